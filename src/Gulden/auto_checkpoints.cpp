@@ -410,7 +410,7 @@ std::string CSyncCheckpoint::strMasterPrivKey = "";
 
 bool CSyncCheckpoint::CheckSignature()
 {
-    CPubKey key(ParseHex(GetBoolArg("-testnet", false) ? CSyncCheckpoint::strMasterPubKeyTestnet : CSyncCheckpoint::strMasterPubKey));
+    CPubKey key(ParseHex(StartupConfig().fTestnet ? CSyncCheckpoint::strMasterPubKeyTestnet : CSyncCheckpoint::strMasterPubKey));
     if (!key.IsValid()) {
         return error("CSyncCheckpoint::CheckSignature() : SetPubKey failed");
     }
@@ -0,0 +1,134 @@
+// Copyright (c) 2016 The Gulden developers
+// Distributed under the GULDEN software license, see the accompanying
+// file COPYING
+
+#ifndef GULDEN_ADDRESSINDEX_H
+#define GULDEN_ADDRESSINDEX_H
+
+#include "amount.h"
+#include "crypto/common.h"
+#include "hash.h"
+#include "script/script.h"
+#include "serialize.h"
+#include "uint256.h"
+
+#include <utility>
+#include <vector>
+
+/** The address index is keyed by the hash160 of the output script, so any script type can be looked up. */
+inline uint160 GetAddressIndexHash(const CScript& script)
+{
+    return Hash160(script.begin(), script.end());
+}
+
+/**
+ * Key of an address history entry: one per output paying the script and one
+ * per input spending such an output. The height is stored big endian so that
+ * entries of a script are ordered by height and a height range is a single
+ * range scan.
+ */
+struct CAddressHistoryKey {
+    uint160 hashScript;
+    int nHeight;
+    uint256 txid;
+    uint32_t nIndex; //!< output index, or input index when spending
+    bool fSpending;
+
+    CAddressHistoryKey() : nHeight(0), nIndex(0), fSpending(false) {}
+    CAddressHistoryKey(const uint160& hashScriptIn, int nHeightIn, const uint256& txidIn = uint256(), uint32_t nIndexIn = 0, bool fSpendingIn = false)
+        : hashScript(hashScriptIn), nHeight(nHeightIn), txid(txidIn), nIndex(nIndexIn), fSpending(fSpendingIn) {}
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        return 20 + 4 + 32 + 4 + 1;
+    }
+
+    template <typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        hashScript.Serialize(s, nType, nVersion);
+        unsigned char buf[4];
+        WriteBE32(buf, nHeight);
+        s.write((const char*)buf, sizeof(buf));
+        txid.Serialize(s, nType, nVersion);
+        WriteBE32(buf, nIndex);
+        s.write((const char*)buf, sizeof(buf));
+        ::Serialize(s, fSpending, nType, nVersion);
+    }
+
+    template <typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        hashScript.Unserialize(s, nType, nVersion);
+        unsigned char buf[4];
+        s.read((char*)buf, sizeof(buf));
+        nHeight = ReadBE32(buf);
+        txid.Unserialize(s, nType, nVersion);
+        s.read((char*)buf, sizeof(buf));
+        nIndex = ReadBE32(buf);
+        ::Unserialize(s, fSpending, nType, nVersion);
+    }
+};
+
+/** Key of an unspent output paying a script. */
+struct CAddressUnspentKey {
+    uint160 hashScript;
+    uint256 txid;
+    uint32_t n;
+
+    CAddressUnspentKey() : n(0) {}
+    CAddressUnspentKey(const uint160& hashScriptIn, const uint256& txidIn = uint256(), uint32_t nIn = 0)
+        : hashScript(hashScriptIn), txid(txidIn), n(nIn) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(hashScript);
+        READWRITE(txid);
+        READWRITE(n);
+    }
+};
+
+struct CAddressUnspentValue {
+    CAmount nValue;
+    CScript script;
+    int nHeight;
+
+    CAddressUnspentValue() { SetNull(); }
+    CAddressUnspentValue(CAmount nValueIn, const CScript& scriptIn, int nHeightIn)
+        : nValue(nValueIn), script(scriptIn), nHeight(nHeightIn) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(nValue);
+        READWRITE(*(CScriptBase*)(&script));
+        READWRITE(nHeight);
+    }
+
+    void SetNull()
+    {
+        nValue = -1;
+        script.clear();
+        nHeight = 0;
+    }
+
+    bool IsNull() const { return nValue == -1; }
+};
+
+/**
+ * Address index changes made by connecting or disconnecting a block, in the
+ * order they were made. When connecting, history entries are added with
+ * their amount (negative when spending); when disconnecting the same entries
+ * are erased. Unspent entries with a null value are erased.
+ */
+struct CAddressIndexUpdate {
+    std::vector<std::pair<CAddressHistoryKey, CAmount> > vHistory;
+    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > vUnspent;
+};
+
+#endif // GULDEN_ADDRESSINDEX_H
@@ -0,0 +1,67 @@
+// Copyright (c) 2016 The Gulden developers
+// Distributed under the GULDEN software license, see the accompanying
+// file COPYING
+
+#include "bench.h"
+#include "amount.h"
+#include "chain.h"
+#include "chainparams.h"
+#include "main.h"
+#include "miner.h"
+#include "primitives/transaction.h"
+#include "script/script.h"
+#include "startupconfig.h"
+#include "txmempool.h"
+
+/* Transactions without unconfirmed parents in the pool, each followed by one child */
+static const int POOL_PACKAGES = 25000;
+
+namespace {
+void FillMempool()
+{
+    LOCK(mempool.cs);
+    const uint256 hashFrom = uint256S("0x1");
+    for (int i = 0; i < POOL_PACKAGES; i++) {
+        // Fees spread over a range so parents and children both lead some packages.
+        const CAmount nFee = 1000 + (i * 7919) % 20000;
+
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout = COutPoint(hashFrom, i);
+        tx.vin[0].scriptSig = CScript() << OP_1;
+        tx.vout.resize(1);
+        tx.vout[0].scriptPubKey = CScript() << OP_1;
+        tx.vout[0].nValue = COIN;
+        CTransactionRef parent = MakeTransactionRef(tx);
+        mempool.addUnchecked(parent->GetHash(), CTxMemPoolEntry(parent, nFee, 0, 0, 1, false, 0, false, 4, LockPoints()), false);
+
+        tx.vin[0].prevout = COutPoint(parent->GetHash(), 0);
+        tx.vout[0].nValue = COIN - CENT;
+        CTransactionRef child = MakeTransactionRef(tx);
+        mempool.addUnchecked(child->GetHash(), CTxMemPoolEntry(child, 21000 - nFee, 0, 0, 1, false, 0, false, 4, LockPoints()), false);
+    }
+}
+}
+
+/* Select the transactions of a block from a pool several blocks deep */
+static void BlockAssembleFullMempool(benchmark::State& state)
+{
+    SelectParams(CBaseChainParams::REGTEST);
+    InitStartupConfig(Params());
+    FillMempool();
+
+    CBlockIndex index;
+    index.nHeight = 1000;
+    index.nVersion = 4;
+    index.nTime = 1475000000;
+
+    BlockAssembler assembler(Params());
+    {
+        LOCK2(cs_main, mempool.cs);
+        while (state.KeepRunning())
+            assembler.SelectTransactions(&index);
+    }
+    mempool.clear();
+}
+
+BENCHMARK(BlockAssembleFullMempool);
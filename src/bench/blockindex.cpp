@@ -0,0 +1,91 @@
+// Copyright (c) 2016 The Gulden developers
+// Distributed under the GULDEN software license, see the accompanying
+// file COPYING
+
+#include "bench.h"
+#include "chain.h"
+#include "chainparams.h"
+#include "startupconfig.h"
+#include "util.h"
+
+#include <vector>
+
+/* Headers accepted per benchmark iteration, on top of a full majority window of history */
+static const int HEADERS_PER_ITERATION = 1000;
+
+namespace {
+/* The supermajority check as it walked the chain before the counts were cached on the index. */
+bool IsSuperMajorityWalk(int minVersion, const CBlockIndex* pstart, unsigned nRequired, const Consensus::Params& params)
+{
+    unsigned int nFound = 0;
+    for (int i = 0; i < params.nMajorityWindow && nFound < nRequired && pstart != NULL; i++) {
+        if (pstart->nVersion >= minVersion)
+            ++nFound;
+        pstart = pstart->pprev;
+    }
+    return (nFound >= nRequired);
+}
+
+void SetupChain(std::vector<CBlockIndex>& vIndex)
+{
+    SelectParams(CBaseChainParams::MAIN);
+    InitStartupConfig(Params());
+    vIndex.resize(Params().GetConsensus().nMajorityWindow + HEADERS_PER_ITERATION);
+    for (size_t i = 0; i < vIndex.size(); i++) {
+        vIndex[i].nHeight = 437000 + i;
+        vIndex[i].nVersion = 4;
+        vIndex[i].nTime = 1475000000 + i * 150;
+        vIndex[i].pprev = i ? &vIndex[i - 1] : NULL;
+        vIndex[i].BuildSkip();
+    }
+}
+
+/* The contextual header checks that depend on ancestors: median time past and the version 2, 3 and 4 supermajorities. */
+template <typename Check>
+int64_t AcceptHeaders(std::vector<CBlockIndex>& vIndex, Check check)
+{
+    const Consensus::Params& params = Params().GetConsensus();
+    int64_t nSum = 0;
+    for (size_t i = vIndex.size() - HEADERS_PER_ITERATION; i < vIndex.size(); i++) {
+        const CBlockIndex* pindexPrev = vIndex[i].pprev;
+        nSum += pindexPrev->GetMedianTimePast(pindexPrev->nHeight);
+        for (int version = 2; version < 5; ++version)
+            nSum += check(version, pindexPrev, params.nMajorityRejectBlockOutdated, params);
+    }
+    return nSum;
+}
+}
+
+static void HeaderAcceptanceWalk(benchmark::State& state)
+{
+    std::vector<CBlockIndex> vIndex;
+    SetupChain(vIndex);
+    int64_t nSum = 0;
+    while (state.KeepRunning())
+        nSum += AcceptHeaders(vIndex, IsSuperMajorityWalk);
+    assert(nSum > 0);
+}
+
+static void HeaderAcceptanceCached(benchmark::State& state)
+{
+    std::vector<CBlockIndex> vIndex;
+    SetupChain(vIndex);
+    const Consensus::Params& params = Params().GetConsensus();
+    for (size_t i = 0; i < vIndex.size() - HEADERS_PER_ITERATION; i++)
+        vIndex[i].BuildContextualFields(params);
+    int64_t nSum = 0;
+    while (state.KeepRunning()) {
+        // Connecting a header computes its cached fields once; include that in the cost.
+        for (size_t i = vIndex.size() - HEADERS_PER_ITERATION; i < vIndex.size(); i++) {
+            vIndex[i].nTimeMedianPast = 0;
+            vIndex[i].BuildContextualFields(params);
+        }
+        nSum += AcceptHeaders(vIndex, [](int minVersion, const CBlockIndex* pstart, unsigned nRequired, const Consensus::Params& params) {
+            return pstart->CountVersionAtLeast(minVersion, params) >= nRequired;
+        });
+    }
+    assert(nSum > 0);
+}
+
+BENCHMARK(HeaderAcceptanceWalk);
+BENCHMARK(HeaderAcceptanceCached);
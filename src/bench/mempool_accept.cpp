@@ -0,0 +1,161 @@
+// Copyright (c) 2016 The Gulden developers
+// Distributed under the GULDEN software license, see the accompanying
+// file COPYING
+
+#include "bench.h"
+#include "chainparams.h"
+#include "coins.h"
+#include "consensus/validation.h"
+#include "key.h"
+#include "main.h"
+#include "random.h"
+#include "script/sigcache.h"
+#include "script/sign.h"
+#include "startupconfig.h"
+#include "txdb.h"
+#include "txmempool.h"
+#include "util.h"
+#include "utiltime.h"
+
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/thread.hpp>
+
+/* Transactions accepted to the mempool per benchmark iteration */
+static const int TXS_PER_ITERATION = 256;
+/* Signed inputs of each transaction */
+static const int INPUTS_PER_TX = 4;
+/* Threads submitting transactions at the same time, as peers, RPC and the wallet do */
+static const int BENCH_THREADS = 4;
+
+namespace {
+/** A regtest node at the genesis block whose chainstate holds the outputs spent by vTx. */
+class BenchNode {
+    boost::filesystem::path pathTemp;
+    boost::thread_group threadGroup;
+    CCoinsViewDB* pcoinsdbview;
+
+public:
+    std::vector<CTransaction> vTx;
+
+    BenchNode(int nThreads)
+    {
+        SelectParams(CBaseChainParams::REGTEST);
+        InitStartupConfig(Params());
+        // The smallest signature cache there is, so every iteration verifies the signatures again.
+        mapArgs["-maxsigcachesize"] = "0";
+        InitSignatureCache();
+
+        ClearDatadirCache();
+        pathTemp = boost::filesystem::temp_directory_path() / strprintf("bench_gulden_%lu_%i", (unsigned long)GetTime(), (int)(GetRand(100000)));
+        boost::filesystem::create_directories(pathTemp);
+        mapArgs["-datadir"] = pathTemp.string();
+        pblocktree = new CBlockTreeDB(1 << 20, true);
+        pcoinsdbview = new CCoinsViewDB(1 << 23, true);
+        pcoinsTip = new CCoinsViewCache(pcoinsdbview);
+        InitBlockIndex(Params());
+        CValidationState state;
+        ActivateBestChain(state, Params());
+
+        nScriptCheckThreads = nThreads > 1 ? nThreads : 0;
+        for (int i = 0; i < nScriptCheckThreads - 1; i++)
+            threadGroup.create_thread(&ThreadMempoolScriptCheck);
+
+        CKey key;
+        key.MakeNewKey(true);
+        const CScript scriptPubKey = CScript() << ToByteVector(key.GetPubKey()) << OP_CHECKSIG;
+        LOCK(cs_main);
+        for (int i = 0; i < TXS_PER_ITERATION; i++) {
+            const uint256 hashFrom = GetRandHash();
+            {
+                CCoinsModifier coins = pcoinsTip->ModifyCoins(hashFrom);
+                coins->fCoinBase = false;
+                coins->nVersion = 1;
+                coins->nHeight = 0;
+                coins->vout.assign(INPUTS_PER_TX, CTxOut(COIN, scriptPubKey));
+            }
+
+            CMutableTransaction tx;
+            tx.vin.resize(INPUTS_PER_TX);
+            for (int j = 0; j < INPUTS_PER_TX; j++)
+                tx.vin[j].prevout = COutPoint(hashFrom, j);
+            tx.vout.resize(1);
+            tx.vout[0].nValue = INPUTS_PER_TX * COIN - CENT;
+            tx.vout[0].scriptPubKey = scriptPubKey;
+            for (int j = 0; j < INPUTS_PER_TX; j++) {
+                std::vector<unsigned char> vchSig;
+                uint256 hash = SignatureHash(scriptPubKey, tx, j, SIGHASH_ALL, COIN, SIGVERSION_BASE);
+                key.Sign(hash, vchSig);
+                vchSig.push_back((unsigned char)SIGHASH_ALL);
+                tx.vin[j].scriptSig = CScript() << vchSig;
+            }
+            vTx.push_back(tx);
+        }
+    }
+
+    ~BenchNode()
+    {
+        threadGroup.interrupt_all();
+        threadGroup.join_all();
+        nScriptCheckThreads = 0;
+        UnloadBlockIndex();
+        delete pcoinsTip;
+        delete pcoinsdbview;
+        delete pblocktree;
+        pcoinsTip = NULL;
+        pblocktree = NULL;
+        boost::filesystem::remove_all(pathTemp);
+        mapArgs.erase("-datadir");
+        mapArgs.erase("-maxsigcachesize");
+        ClearDatadirCache();
+    }
+};
+
+/* Accept every nStride-th transaction starting at nFirst; fHoldMain keeps cs_main for each as callers did before scripts were verified without it. */
+void AcceptTransactions(const std::vector<CTransaction>* pvTx, size_t nFirst, size_t nStride, bool fHoldMain)
+{
+    for (size_t i = nFirst; i < pvTx->size(); i += nStride) {
+        CValidationState state;
+        bool fAccepted;
+        if (fHoldMain) {
+            LOCK(cs_main);
+            fAccepted = AcceptToMemoryPool(mempool, state, (*pvTx)[i], false, NULL);
+        } else {
+            fAccepted = AcceptToMemoryPool(mempool, state, (*pvTx)[i], false, NULL);
+        }
+        assert(fAccepted);
+    }
+}
+
+void RunAccept(benchmark::State& state, int nThreads, bool fHoldMain)
+{
+    BenchNode node(nThreads);
+    while (state.KeepRunning()) {
+        boost::thread_group threads;
+        for (int i = 0; i < nThreads; i++)
+            threads.create_thread(boost::bind(&AcceptTransactions, &node.vTx, i, nThreads, fHoldMain));
+        threads.join_all();
+        mempool.clear();
+    }
+}
+}
+
+static void MempoolAcceptSingleThread(benchmark::State& state)
+{
+    RunAccept(state, 1, false);
+}
+
+static void MempoolAcceptConcurrentHoldingMain(benchmark::State& state)
+{
+    RunAccept(state, BENCH_THREADS, true);
+}
+
+static void MempoolAcceptConcurrent(benchmark::State& state)
+{
+    RunAccept(state, BENCH_THREADS, false);
+}
+
+BENCHMARK(MempoolAcceptSingleThread);
+BENCHMARK(MempoolAcceptConcurrentHoldingMain);
+BENCHMARK(MempoolAcceptConcurrent);
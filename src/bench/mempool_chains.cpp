@@ -0,0 +1,87 @@
+// Copyright (c) 2016 The Gulden developers
+// Distributed under the GULDEN software license, see the accompanying
+// file COPYING
+
+#include "bench.h"
+#include "amount.h"
+#include "primitives/transaction.h"
+#include "script/script.h"
+#include "txmempool.h"
+
+#include <limits>
+#include <list>
+#include <vector>
+
+/* Length of the unconfirmed chain, as built by repeatedly spending change */
+static const int CHAIN_LENGTH = 500;
+/* Transactions of the chain confirmed by each block */
+static const int CHAIN_TXS_PER_BLOCK = 50;
+
+namespace {
+std::vector<CTransactionRef> MakeChain()
+{
+    std::vector<CTransactionRef> vChain;
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].scriptSig = CScript() << OP_1;
+    tx.vin[0].prevout = COutPoint(uint256S("0x1"), 0);
+    tx.vout.resize(1);
+    tx.vout[0].scriptPubKey = CScript() << OP_1;
+    tx.vout[0].nValue = CHAIN_LENGTH * COIN;
+    for (int i = 0; i < CHAIN_LENGTH; i++) {
+        tx.vout[0].nValue -= CENT;
+        vChain.push_back(MakeTransactionRef(tx));
+        tx.vin[0].prevout = COutPoint(vChain.back()->GetHash(), 0);
+    }
+    return vChain;
+}
+
+void AddChain(CTxMemPool& pool, const std::vector<CTransactionRef>& vChain)
+{
+    LOCK(pool.cs);
+    for (const auto& ptx : vChain) {
+        CTxMemPoolEntry entry(*ptx, CENT, 0, 0, 1, pool.HasNoInputsOf(*ptx), 0, false, 4, LockPoints());
+        pool.addUnchecked(ptx->GetHash(), entry, false);
+    }
+}
+}
+
+/* Walk all ancestors of the end of a chain and all descendants of its start */
+static void MempoolChainWalk(benchmark::State& state)
+{
+    CTxMemPool pool(CFeeRate(0));
+    const std::vector<CTransactionRef> vChain = MakeChain();
+    AddChain(pool, vChain);
+
+    const uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
+    std::string dummy;
+    LOCK(pool.cs);
+    CTxMemPool::txiter itFirst = pool.mapTx.find(vChain.front()->GetHash());
+    CTxMemPool::txiter itLast = pool.mapTx.find(vChain.back()->GetHash());
+    while (state.KeepRunning()) {
+        CTxMemPool::setEntries setAncestors, setDescendants;
+        pool.CalculateMemPoolAncestors(*itLast, setAncestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
+        pool.CalculateDescendants(itFirst, setDescendants);
+        assert(setAncestors.size() == vChain.size() - 1);
+        assert(setDescendants.size() == vChain.size());
+    }
+}
+
+/* Accept a chain to the mempool and confirm it again a block at a time */
+static void MempoolChainAddRemove(benchmark::State& state)
+{
+    CTxMemPool pool(CFeeRate(0));
+    const std::vector<CTransactionRef> vChain = MakeChain();
+    while (state.KeepRunning()) {
+        AddChain(pool, vChain);
+        for (size_t i = 0; i < vChain.size(); i += CHAIN_TXS_PER_BLOCK) {
+            std::vector<CTransactionRef> vtx(vChain.begin() + i, vChain.begin() + std::min(vChain.size(), i + CHAIN_TXS_PER_BLOCK));
+            std::list<CTransactionRef> conflicts;
+            pool.removeForBlock(vtx, 1, conflicts, false);
+        }
+        assert(pool.size() == 0);
+    }
+}
+
+BENCHMARK(MempoolChainWalk);
+BENCHMARK(MempoolChainAddRemove);
@@ -0,0 +1,101 @@
+// Copyright (c) 2016 The Gulden developers
+// Distributed under the GULDEN software license, see the accompanying
+// file COPYING
+
+#include "bench.h"
+#include "lockfreecache.h"
+#include "random.h"
+#include "uint256.h"
+
+#include <vector>
+
+#include <boost/thread.hpp>
+#include <boost/unordered_set.hpp>
+
+/* Number of script check style threads hammering the cache concurrently */
+static const int BENCH_THREADS = 4;
+/* Operations performed by each thread per iteration */
+static const int OPS_PER_THREAD = 4096;
+/* Size of the cache under test */
+static const size_t CACHE_BYTES = 4 << 20;
+
+namespace {
+class BenchCacheHasher {
+public:
+    uint64_t operator()(const uint64_t* words) const { return words[0]; }
+    size_t operator()(const uint256& key) const { return key.GetCheapHash(); }
+};
+
+/** The shared_mutex protected set the signature cache used previously, for comparison. */
+class LockedCache {
+    typedef boost::unordered_set<uint256, BenchCacheHasher> map_type;
+    map_type setValid;
+    boost::shared_mutex cs;
+
+public:
+    bool contains(const uint256& e, bool fErase)
+    {
+        if (fErase) {
+            boost::unique_lock<boost::shared_mutex> lock(cs);
+            return setValid.erase(e);
+        }
+        boost::shared_lock<boost::shared_mutex> lock(cs);
+        return setValid.count(e);
+    }
+    void insert(const uint256& e)
+    {
+        boost::unique_lock<boost::shared_mutex> lock(cs);
+        setValid.insert(e);
+    }
+};
+
+std::vector<uint256> MakeEntries(size_t n)
+{
+    std::vector<uint256> entries(n);
+    for (size_t i = 0; i < n; ++i)
+        entries[i] = GetRandHash();
+    return entries;
+}
+
+/* Mimic block validation: every thread looks up (and erases) signatures that were mostly cached on mempool acceptance and inserts the misses. */
+template <typename Cache>
+void Worker(Cache* cache, const std::vector<uint256>* entries, int nThread)
+{
+    const size_t nBase = nThread * OPS_PER_THREAD;
+    for (int i = 0; i < OPS_PER_THREAD; ++i) {
+        const uint256& e = (*entries)[(nBase + i) % entries->size()];
+        if (!cache->contains(e, (i & 1)))
+            cache->insert(e);
+    }
+}
+
+template <typename Cache>
+void RunConcurrent(benchmark::State& state, Cache& cache)
+{
+    const std::vector<uint256> entries = MakeEntries(BENCH_THREADS * OPS_PER_THREAD);
+    for (const uint256& e : entries)
+        cache.insert(e);
+    while (state.KeepRunning()) {
+        boost::thread_group threads;
+        for (int i = 0; i < BENCH_THREADS; ++i)
+            threads.create_thread(boost::bind(&Worker<Cache>, &cache, &entries, i));
+        threads.join_all();
+    }
+}
+}
+
+static void SigCacheLockFreeConcurrent(benchmark::State& state)
+{
+    lockfreecache<uint256, BenchCacheHasher> cache;
+    cache.setup_bytes(CACHE_BYTES);
+    RunConcurrent(state, cache);
+}
+
+static void SigCacheSharedMutexConcurrent(benchmark::State& state)
+{
+    LockedCache cache;
+    RunConcurrent(state, cache);
+}
+
+BENCHMARK(SigCacheLockFreeConcurrent);
+BENCHMARK(SigCacheSharedMutexConcurrent);
@@ -0,0 +1,71 @@
+// Copyright (c) 2016 The Gulden developers
+// Distributed under the GULDEN software license, see the accompanying
+// file COPYING
+
+#include "bench.h"
+#include "chain.h"
+#include "chainparams.h"
+#include "startupconfig.h"
+#include "util.h"
+
+#include <vector>
+
+/* Headers processed per benchmark iteration */
+static const int HEADERS_PER_ITERATION = 1000;
+
+/* Populate mapArgs roughly the way a node configuration does, so lookups search a realistic map. */
+static void SetupArgs()
+{
+    static const char* const args[] = {"-datadir", "-dbcache", "-maxconnections", "-rpcuser", "-rpcpassword", "-rpcallowip",
+                                       "-server", "-listen", "-txindex", "-addnode", "-debug", "-printtoconsole", "-par", "-maxmempool"};
+    for (const char* arg : args)
+        mapArgs[arg] = "1";
+    SelectParams(CBaseChainParams::MAIN);
+    InitStartupConfig(Params());
+}
+
+/* The lookups GetPoWHash and GetMedianTimePast used to do for every header. */
+static void PerHeaderArgLookup(benchmark::State& state)
+{
+    SetupArgs();
+    int64_t nSum = 0;
+    while (state.KeepRunning()) {
+        for (int i = 0; i < HEADERS_PER_ITERATION; i++)
+            nSum += GetBoolArg("-testnetaccel", false) + (GetBoolArg("-testnet", false) ? 446500 : 437500);
+    }
+    assert(nSum > 0);
+}
+
+/* The same settings read from the startup snapshot. */
+static void PerHeaderStartupConfig(benchmark::State& state)
+{
+    SetupArgs();
+    int64_t nSum = 0;
+    while (state.KeepRunning()) {
+        for (int i = 0; i < HEADERS_PER_ITERATION; i++)
+            nSum += StartupConfig().fTestnetAccel + StartupConfig().nShortMedianTimeSpanHeight;
+    }
+    assert(nSum > 0);
+}
+
+/* Median time past of every index in a chain, as versionbits and contextual checks compute it. */
+static void MedianTimePast(benchmark::State& state)
+{
+    SetupArgs();
+    std::vector<CBlockIndex> vIndex(HEADERS_PER_ITERATION);
+    for (int i = 0; i < HEADERS_PER_ITERATION; i++) {
+        vIndex[i].nHeight = 437000 + i;
+        vIndex[i].nTime = 1475000000 + i * 150;
+        vIndex[i].pprev = i ? &vIndex[i - 1] : NULL;
+    }
+    int64_t nSum = 0;
+    while (state.KeepRunning()) {
+        for (const CBlockIndex& index : vIndex)
+            nSum += index.GetMedianTimePast(index.nHeight);
+    }
+    assert(nSum > 0);
+}
+
+BENCHMARK(PerHeaderArgLookup);
+BENCHMARK(PerHeaderStartupConfig);
+BENCHMARK(MedianTimePast);
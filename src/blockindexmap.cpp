@@ -0,0 +1,112 @@
+// Copyright (c) 2016 The Gulden developers
+// Distributed under the GULDEN software license, see the accompanying
+// file COPYING
+
+#include "blockindexmap.h"
+
+#include "memusage.h"
+
+#include <assert.h>
+
+/** Initial number of table slots. */
+static const size_t INITIAL_SLOTS = 1024;
+
+size_t CBlockIndexMap::FindSlot(const uint256& hash) const
+{
+    // Block hashes are uniformly distributed, so their low bits index the table directly.
+    const size_t nMask = vSlots.size() - 1;
+    size_t nSlot = hash.GetCheapHash() & nMask;
+    while (vSlots[nSlot] && *vSlots[nSlot]->phashBlock != hash)
+        nSlot = (nSlot + 1) & nMask;
+    return nSlot;
+}
+
+void CBlockIndexMap::Rehash(size_t nSlotsNew)
+{
+    assert((nSlotsNew & (nSlotsNew - 1)) == 0);
+    std::vector<CBlockIndex*> vOld(nSlotsNew);
+    vSlots.swap(vOld);
+    for (CBlockIndex* pindex : vOld) {
+        if (pindex)
+            vSlots[FindSlot(*pindex->phashBlock)] = pindex;
+    }
+}
+
+CBlockIndexMap::iterator CBlockIndexMap::find(const uint256& hash) const
+{
+    if (vSlots.empty())
+        return end();
+    size_t nSlot = FindSlot(hash);
+    if (!vSlots[nSlot])
+        return end();
+    return iterator(this, nSlot, false);
+}
+
+CBlockIndex* CBlockIndexMap::operator[](const uint256& hash) const
+{
+    if (vSlots.empty())
+        return NULL;
+    return vSlots[FindSlot(hash)];
+}
+
+std::pair<CBlockIndex*, bool> CBlockIndexMap::insert(const uint256& hash, const CBlockIndex& indexIn)
+{
+    // Keep the load factor at or below 3/4.
+    if ((nSize + 1) * 4 > vSlots.size() * 3)
+        Rehash(vSlots.empty() ? INITIAL_SLOTS : vSlots.size() * 2);
+
+    size_t nSlot = FindSlot(hash);
+    if (vSlots[nSlot])
+        return std::make_pair(vSlots[nSlot], false);
+
+    if (nSlabUsed == SLAB_ENTRIES) {
+        vSlabs.emplace_back(new Entry[SLAB_ENTRIES]);
+        nSlabUsed = 0;
+    }
+    Entry& entry = vSlabs.back()[nSlabUsed++];
+    entry.hash = hash;
+    entry.index = indexIn;
+    entry.index.phashBlock = &entry.hash;
+
+    vSlots[nSlot] = &entry.index;
+    nSize++;
+    return std::make_pair(&entry.index, true);
+}
+
+void CBlockIndexMap::reserve(size_t n)
+{
+    size_t nSlotsNew = vSlots.empty() ? INITIAL_SLOTS : vSlots.size();
+    while (n * 4 > nSlotsNew * 3)
+        nSlotsNew *= 2;
+    if (nSlotsNew != vSlots.size())
+        Rehash(nSlotsNew);
+}
+
+void CBlockIndexMap::clear()
+{
+    vSlabs.clear();
+    nSlabUsed = SLAB_ENTRIES;
+    std::vector<CBlockIndex*>().swap(vSlots);
+    nSize = 0;
+}
+
+size_t CBlockIndexMap::ArenaMemoryUsage() const
+{
+    return memusage::MallocUsage(sizeof(Entry) * SLAB_ENTRIES) * vSlabs.size() + memusage::DynamicUsage(vSlabs);
+}
+
+size_t CBlockIndexMap::TableMemoryUsage() const
+{
+    return memusage::DynamicUsage(vSlots);
+}
+
+size_t CBlockIndexMap::DynamicMemoryUsage() const
+{
+    return ArenaMemoryUsage() + TableMemoryUsage();
+}
+
+size_t CBlockIndexMap::NodeMapMemoryUsageEstimate() const
+{
+    // One heap allocated CBlockIndex plus one map node and (at load factor 1) one bucket pointer per entry.
+    return nSize * (memusage::MallocUsage(sizeof(CBlockIndex)) + memusage::MallocUsage(sizeof(memusage::boost_unordered_node<std::pair<const uint256, CBlockIndex*> >)) + sizeof(void*));
+}
@@ -0,0 +1,150 @@
+// Copyright (c) 2016 The Gulden developers
+// Distributed under the GULDEN software license, see the accompanying
+// file COPYING
+
+#ifndef GULDEN_BLOCKINDEXMAP_H
+#define GULDEN_BLOCKINDEXMAP_H
+
+#include "chain.h"
+#include "uint256.h"
+
+#include <iterator>
+#include <memory>
+#include <utility>
+#include <vector>
+
+/**
+ * Hash table of all known block index entries, keyed by block hash.
+ *
+ * Entries are allocated from an arena of fixed size slabs, each entry storing
+ * its hash directly in front of its CBlockIndex so phashBlock points into the
+ * same record. Entries are never freed individually; pointers to them stay
+ * valid until clear(). The table itself is an open addressing (linear
+ * probing) array of entry pointers, so a lookup touches one pointer array
+ * and the entry it finds, with no per node allocations.
+ *
+ * The interface mirrors the subset of std::unordered_map used for
+ * mapBlockIndex; iterators dereference to a (hash, CBlockIndex*) pair.
+ * Unlike a std::map, operator[] never inserts and returns NULL for unknown
+ * hashes.
+ */
+class CBlockIndexMap
+{
+public:
+    typedef std::pair<const uint256&, CBlockIndex*> value_type;
+
+    /** Number of entries per arena slab. */
+    static const size_t SLAB_ENTRIES = 4096;
+
+    class iterator
+    {
+    private:
+        const CBlockIndexMap* map;
+        size_t nSlot;
+
+        void SkipEmpty()
+        {
+            while (nSlot < map->vSlots.size() && !map->vSlots[nSlot])
+                ++nSlot;
+        }
+
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef CBlockIndexMap::value_type value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const value_type* pointer;
+        typedef value_type reference;
+
+        class arrow_proxy
+        {
+        private:
+            value_type value;
+
+        public:
+            arrow_proxy(const value_type& valueIn) : value(valueIn) {}
+            const value_type* operator->() const { return &value; }
+        };
+
+        iterator() : map(NULL), nSlot(0) {}
+        iterator(const CBlockIndexMap* mapIn, size_t nSlotIn, bool fSkip) : map(mapIn), nSlot(nSlotIn)
+        {
+            if (fSkip)
+                SkipEmpty();
+        }
+
+        value_type operator*() const
+        {
+            CBlockIndex* pindex = map->vSlots[nSlot];
+            return value_type(*pindex->phashBlock, pindex);
+        }
+        arrow_proxy operator->() const { return arrow_proxy(**this); }
+
+        iterator& operator++()
+        {
+            ++nSlot;
+            SkipEmpty();
+            return *this;
+        }
+        iterator operator++(int)
+        {
+            iterator ret = *this;
+            ++(*this);
+            return ret;
+        }
+
+        bool operator==(const iterator& other) const { return nSlot == other.nSlot; }
+        bool operator!=(const iterator& other) const { return nSlot != other.nSlot; }
+    };
+    typedef iterator const_iterator;
+
+private:
+    struct Entry {
+        uint256 hash;
+        CBlockIndex index;
+    };
+
+    std::vector<std::unique_ptr<Entry[]> > vSlabs;
+    size_t nSlabUsed;
+    std::vector<CBlockIndex*> vSlots;
+    size_t nSize;
+
+    size_t FindSlot(const uint256& hash) const;
+    void Rehash(size_t nSlotsNew);
+
+public:
+    CBlockIndexMap() : nSlabUsed(SLAB_ENTRIES), nSize(0) {}
+
+    CBlockIndexMap(const CBlockIndexMap&) = delete;
+    CBlockIndexMap& operator=(const CBlockIndexMap&) = delete;
+
+    iterator begin() const { return iterator(this, 0, true); }
+    iterator end() const { return iterator(this, vSlots.size(), false); }
+    size_t size() const { return nSize; }
+    bool empty() const { return nSize == 0; }
+
+    iterator find(const uint256& hash) const;
+    size_t count(const uint256& hash) const { return find(hash) != end(); }
+    CBlockIndex* operator[](const uint256& hash) const;
+
+    /**
+     * Return the entry for hash, creating it as a copy of indexIn (with
+     * phashBlock pointing at the stored hash) if it does not exist yet. The
+     * bool is true if a new entry was created.
+     */
+    std::pair<CBlockIndex*, bool> insert(const uint256& hash, const CBlockIndex& indexIn);
+
+    /** Make room for at least n entries without growing the table. */
+    void reserve(size_t n);
+
+    /** Free all entries. Invalidates every CBlockIndex pointer handed out. */
+    void clear();
+
+    /** Bytes allocated for the arena and the table. */
+    size_t DynamicMemoryUsage() const;
+    size_t ArenaMemoryUsage() const;
+    size_t TableMemoryUsage() const;
+    /** Estimated usage of the same entries held as individually allocated CBlockIndex objects in a boost::unordered_map. */
+    size_t NodeMapMemoryUsageEstimate() const;
+};
+
+#endif // GULDEN_BLOCKINDEXMAP_H
@@ -110,6 +110,44 @@ void CBlockIndex::BuildSkip()
         pskip = pprev->GetAncestor(GetSkipHeight(nHeight));
 }
 
+/** Block versions whose supermajority counts are cached on the index. */
+static const int MIN_COUNTED_VERSION = 2;
+static const int MAX_COUNTED_VERSION = 4;
+
+static unsigned int WalkVersionAtLeast(const CBlockIndex* pindex, int minVersion, int nWindow)
+{
+    unsigned int nFound = 0;
+    for (int i = 0; i < nWindow && pindex != NULL; i++, pindex = pindex->pprev)
+        nFound += pindex->nVersion >= minVersion;
+    return nFound;
+}
+
+void CBlockIndex::BuildContextualFields(const Consensus::Params& params)
+{
+    const bool fIncremental = pprev && pprev->HasContextualFields();
+    const CBlockIndex* pindexLeaving = fIncremental && nHeight >= params.nMajorityWindow ? GetAncestor(nHeight - params.nMajorityWindow) : NULL;
+    for (int v = MIN_COUNTED_VERSION; v <= MAX_COUNTED_VERSION; v++) {
+        unsigned int nCount;
+        if (fIncremental) {
+            // Slide the window: add this block and drop the one that fell out of it.
+            nCount = pprev->nVersionCount[v - MIN_COUNTED_VERSION] + (nVersion >= v);
+            if (pindexLeaving)
+                nCount -= pindexLeaving->nVersion >= v;
+        } else {
+            nCount = WalkVersionAtLeast(this, v, params.nMajorityWindow);
+        }
+        nVersionCount[v - MIN_COUNTED_VERSION] = nCount;
+    }
+    nTimeMedianPast = ComputeMedianTimePast(nHeight);
+}
+
+unsigned int CBlockIndex::CountVersionAtLeast(int minVersion, const Consensus::Params& params) const
+{
+    if (HasContextualFields() && minVersion >= MIN_COUNTED_VERSION && minVersion <= MAX_COUNTED_VERSION)
+        return nVersionCount[minVersion - MIN_COUNTED_VERSION];
+    return WalkVersionAtLeast(this, minVersion, params.nMajorityWindow);
+}
+
 arith_uint256 GetBlockProof(const CBlockIndex& block)
 {
     arith_uint256 bnTarget;
@@ -16,6 +16,7 @@
 #include "arith_uint256.h"
 #include "primitives/block.h"
 #include "pow.h"
+#include "startupconfig.h"
 #include "tinyformat.h"
 #include "uint256.h"
 
@@ -194,6 +195,12 @@ public:
 
     uint32_t nSequenceId;
 
+    //! Contextual values derived from this block and its ancestors, filled in by BuildContextualFields when
+    //! the index is connected into mapBlockIndex. Not stored on disk; zero until built.
+    unsigned int nTimeMedianPast;
+    //! Number of blocks with nVersion of at least 2, 3 and 4 in the majority window ending at this block
+    uint16_t nVersionCount[3];
+
     void SetNull()
     {
         phashBlock = NULL;
@@ -208,6 +215,8 @@ public:
         nChainTx = 0;
         nStatus = 0;
         nSequenceId = 0;
+        nTimeMedianPast = 0;
+        nVersionCount[0] = nVersionCount[1] = nVersionCount[2] = 0;
 
         nVersion = 0;
         hashMerkleRoot = uint256();
@@ -276,9 +285,16 @@ public:
     }
 
     int64_t GetMedianTimePast(int nHeight) const
+    {
+        if (nTimeMedianPast && nHeight == this->nHeight)
+            return nTimeMedianPast;
+        return ComputeMedianTimePast(nHeight);
+    }
+
+    int64_t ComputeMedianTimePast(int nHeight) const
     {
         int nMedianTimeSpan = 11;
-        if (nHeight > (GetBoolArg("-testnet", false) ? 446500 : 437500))
+        if (nHeight > StartupConfig().nShortMedianTimeSpanHeight)
             nMedianTimeSpan = 3;
 
         int64_t pmedian[nMedianTimeSpan];
@@ -323,6 +339,13 @@ public:
 
     void BuildSkip();
 
+    /** Whether BuildContextualFields has been run for this index. */
+    bool HasContextualFields() const { return nTimeMedianPast != 0; }
+    /** Fill in the cached contextual values. The previous block must have them already, if it exists. */
+    void BuildContextualFields(const Consensus::Params& params);
+    /** Number of blocks with nVersion >= minVersion among the nMajorityWindow blocks ending at this one. */
+    unsigned int CountVersionAtLeast(int minVersion, const Consensus::Params& params) const;
+
     CBlockIndex* GetAncestor(int height);
     const CBlockIndex* GetAncestor(int height) const;
 };
@@ -42,6 +42,10 @@ struct Params {
     int nMajorityEnforceBlockUpgrade;
     int nMajorityRejectBlockOutdated;
     int nMajorityWindow;
+    /** Height from which IsSuperMajority version upgrade checks apply */
+    int nSuperMajorityStartHeight;
+    /** Height above which the median time past spans 3 blocks instead of 11 and block times may be at most 60 seconds in the future */
+    int nShortMedianTimeSpanHeight;
     /** Block height and hash at which BIP34 becomes active */
     int BIP34Height;
     uint256 BIP34Hash;
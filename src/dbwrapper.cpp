@@ -6,6 +6,7 @@
 
 #include "util.h"
 #include "random.h"
+#include "sync.h"
 
 #include <boost/filesystem.hpp>
 
@@ -15,14 +16,77 @@
 #include <memenv.h>
 #include <stdint.h>
 
-static leveldb::Options GetOptions(size_t nCacheSize)
+#include <algorithm>
+#include <set>
+
+/** Upper bound of -<name>dbbloombits; more bits per key stop paying off long before this */
+static const int MAX_DB_BLOOM_BITS = 64;
+
+namespace {
+/** Named databases that are open, for getdbstats */
+CCriticalSection cs_openDatabases;
+std::set<const CDBWrapper*> setOpenDatabases;
+}
+
+CDBOptions::CDBOptions(size_t nCacheSize)
+    : nBlockCacheSize(nCacheSize / 2),
+      nWriteBufferSize(nCacheSize / 4), // up to two write buffers may be held in memory simultaneously
+      nBlockSize(4096),
+      nBloomBits(10),
+      nMaxOpenFiles(64),
+      fCompression(false)
+{
+}
+
+CDBOptions GetDBOptions(const std::string& strName, size_t nCacheSize)
+{
+    CDBOptions dbOptions(nCacheSize);
+    dbOptions.strName = strName;
+    if (strName == "blockindex") {
+        // Read in full at startup and written in bulk during sync, so smaller tables are worth the decompression.
+        dbOptions.fCompression = true;
+    } else if (strName == "chainstate") {
+        // Coins are found with iterator seeks, which bloom filters do not serve, and the hot random reads
+        // would pay for decompression of obfuscated values that barely compress.
+        dbOptions.nBloomBits = 0;
+    } else if (strName == "txindex") {
+        // Lookups seek on a truncated txid; entries are mostly written once and read rarely.
+        dbOptions.nBloomBits = 0;
+        dbOptions.fCompression = true;
+    }
+
+    const std::string strPrefix = "-" + strName + "db";
+    dbOptions.fCompression = GetBoolArg(strPrefix + "compression", dbOptions.fCompression);
+    dbOptions.nBloomBits = std::max(0, (int)std::min(GetArg(strPrefix + "bloombits", dbOptions.nBloomBits), (int64_t)MAX_DB_BLOOM_BITS));
+    dbOptions.nMaxOpenFiles = std::max(1, (int)std::min(GetArg(strPrefix + "maxopenfiles", dbOptions.nMaxOpenFiles), (int64_t)50000));
+    if (mapArgs.count(strPrefix + "writebuffer"))
+        dbOptions.nWriteBufferSize = std::max((int64_t)1, GetArg(strPrefix + "writebuffer", 0)) << 20;
+    if (mapArgs.count(strPrefix + "blocksize"))
+        dbOptions.nBlockSize = std::max((int64_t)1, std::min(GetArg(strPrefix + "blocksize", 0), (int64_t)1024)) << 10;
+    return dbOptions;
+}
+
+std::vector<CDBStats> GetDBStats()
+{
+    std::vector<CDBStats> vStats;
+    {
+        LOCK(cs_openDatabases);
+        for (const CDBWrapper* pdbw : setOpenDatabases)
+            vStats.push_back(pdbw->GetStats());
+    }
+    std::sort(vStats.begin(), vStats.end(), [](const CDBStats& a, const CDBStats& b) { return a.options.strName < b.options.strName; });
+    return vStats;
+}
+
+static leveldb::Options GetLevelDBOptions(const CDBOptions& dbOptions)
 {
     leveldb::Options options;
-    options.block_cache = leveldb::NewLRUCache(nCacheSize / 2);
-    options.write_buffer_size = nCacheSize / 4; // up to two write buffers may be held in memory simultaneously
-    options.filter_policy = leveldb::NewBloomFilterPolicy(10);
-    options.compression = leveldb::kNoCompression;
-    options.max_open_files = 64;
+    options.block_cache = leveldb::NewLRUCache(dbOptions.nBlockCacheSize);
+    options.write_buffer_size = dbOptions.nWriteBufferSize;
+    options.block_size = dbOptions.nBlockSize;
+    options.filter_policy = dbOptions.nBloomBits > 0 ? leveldb::NewBloomFilterPolicy(dbOptions.nBloomBits) : NULL;
+    options.compression = dbOptions.fCompression ? leveldb::kSnappyCompression : leveldb::kNoCompression;
+    options.max_open_files = dbOptions.nMaxOpenFiles;
     if (leveldb::kMajorVersion > 1 || (leveldb::kMajorVersion == 1 && leveldb::kMinorVersion >= 16)) {
 
         options.paranoid_checks = true;
@@ -31,13 +95,19 @@ static leveldb::Options GetOptions(size_t nCacheSize)
 }
 
 CDBWrapper::CDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory, bool fWipe, bool obfuscate)
+    : CDBWrapper(path, CDBOptions(nCacheSize), fMemory, fWipe, obfuscate)
+{
+}
+
+CDBWrapper::CDBWrapper(const boost::filesystem::path& path, const CDBOptions& dbOptions, bool fMemory, bool fWipe, bool obfuscate)
+    : dboptions(dbOptions), strPath(path.string())
 {
     penv = NULL;
     readoptions.verify_checksums = true;
     iteroptions.verify_checksums = true;
     iteroptions.fill_cache = false;
     syncoptions.sync = true;
-    options = GetOptions(nCacheSize);
+    options = GetLevelDBOptions(dboptions);
     options.create_if_missing = true;
     if (fMemory) {
         penv = leveldb::NewMemEnv(leveldb::Env::Default());
@@ -70,10 +140,22 @@ CDBWrapper::CDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, b
     }
 
     LogPrintf("Using obfuscation key for %s: %s\n", path.string(), HexStr(obfuscate_key));
+
+    if (!dboptions.strName.empty()) {
+        LogPrint("db", "Database %s: block cache %u, write buffer %u, block size %u, bloom bits %d, max open files %d, compression %s\n",
+            dboptions.strName, dboptions.nBlockCacheSize, dboptions.nWriteBufferSize, dboptions.nBlockSize,
+            dboptions.nBloomBits, dboptions.nMaxOpenFiles, dboptions.fCompression ? "on" : "off");
+        LOCK(cs_openDatabases);
+        setOpenDatabases.insert(this);
+    }
 }
 
 CDBWrapper::~CDBWrapper()
 {
+    {
+        LOCK(cs_openDatabases);
+        setOpenDatabases.erase(this);
+    }
     delete pdb;
     pdb = NULL;
     delete options.filter_policy;
@@ -106,6 +188,29 @@ std::vector<unsigned char> CDBWrapper::CreateObfuscateKey() const
     return std::vector<unsigned char>(&buff[0], &buff[OBFUSCATE_KEY_NUM_BYTES]);
 }
 
+bool CDBWrapper::GetProperty(const std::string& strProperty, std::string& strValue) const
+{
+    return pdb->GetProperty(strProperty, &strValue);
+}
+
+CDBStats CDBWrapper::GetStats() const
+{
+    CDBStats stats;
+    stats.options = dboptions;
+    stats.strPath = strPath;
+    std::string strValue;
+    while (GetProperty(strprintf("leveldb.num-files-at-level%d", stats.vFilesAtLevel.size()), strValue))
+        stats.vFilesAtLevel.push_back(atoi(strValue));
+    // Every key sorts before this one: key prefixes are printable characters or the obfuscation key's 0x00.
+    const std::string strLast(8, '\xff');
+    const leveldb::Range range("", strLast);
+    stats.nApproximateSize = 0;
+    pdb->GetApproximateSizes(&range, 1, &stats.nApproximateSize);
+    stats.nMemoryUsage = GetProperty("leveldb.approximate-memory-usage", strValue) ? atoi64(strValue) : -1;
+    GetProperty("leveldb.stats", stats.strStats);
+    return stats;
+}
+
 bool CDBWrapper::IsEmpty()
 {
     boost::scoped_ptr<CDBIterator> it(NewIterator());
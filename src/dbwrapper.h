@@ -25,6 +25,49 @@ public:
     }
 };
 
+/** LevelDB tuning of a single database. */
+struct CDBOptions {
+    //! Name of the database for its -<name>db... options and getdbstats, empty if unnamed
+    std::string strName;
+    //! LRU cache of uncompressed table blocks
+    size_t nBlockCacheSize;
+    //! Size of the memtable. A full one is written out as a level 0 table, and every few of those trigger a compaction; up to two may be held in memory
+    size_t nWriteBufferSize;
+    //! Approximate uncompressed size of a table block, the unit of reads, caching and compression
+    size_t nBlockSize;
+    //! Bloom filter bits per key, 0 for none. Filters only speed up point reads, not iterator seeks
+    int nBloomBits;
+    int nMaxOpenFiles;
+    //! Compress table blocks with snappy; they are stored as is when leveldb was built without it
+    bool fCompression;
+
+    /** The default profile: half of nCacheSize for the block cache and a quarter for the write buffer. */
+    explicit CDBOptions(size_t nCacheSize = 0);
+};
+
+/**
+ * Profile of a named database: defaults suited to how it is accessed, then
+ * the -<name>db... command line options.
+ */
+CDBOptions GetDBOptions(const std::string& strName, size_t nCacheSize);
+
+/** Statistics of an open database */
+struct CDBStats {
+    CDBOptions options;
+    std::string strPath;
+    //! Number of table files at each level
+    std::vector<int> vFilesAtLevel;
+    //! Estimated size of the tables on disk
+    uint64_t nApproximateSize;
+    //! leveldb.approximate-memory-usage, or -1 when the bundled leveldb does not report it
+    int64_t nMemoryUsage;
+    //! leveldb.stats: per level compaction statistics
+    std::string strStats;
+};
+
+/** Statistics of every open named database, ordered by name. */
+std::vector<CDBStats> GetDBStats();
+
 class CDBWrapper;
 
 /** These should be considered an implementation detail of the specific database.
@@ -84,6 +127,12 @@ public:
 
         batch.Delete(slKey);
     }
+
+    /** Drop all queued changes so the batch can be reused. */
+    void Clear()
+    {
+        batch.Clear();
+    }
 };
 
 class CDBIterator {
@@ -165,6 +214,10 @@ private:
 
     leveldb::Options options;
 
+    CDBOptions dboptions;
+
+    std::string strPath;
+
     leveldb::ReadOptions readoptions;
 
     leveldb::ReadOptions iteroptions;
@@ -186,15 +239,24 @@ private:
 public:
     /**
      * @param[in] path        Location in the filesystem where leveldb data will be stored.
-     * @param[in] nCacheSize  Configures various leveldb cache settings.
+     * @param[in] dbOptions   LevelDB tuning; a named database is reported by getdbstats.
      * @param[in] fMemory     If true, use leveldb's memory environment.
      * @param[in] fWipe       If true, remove all existing data.
      * @param[in] obfuscate   If true, store data obfuscated via simple XOR. If false, XOR
      *                        with a zero'd byte array.
      */
+    CDBWrapper(const boost::filesystem::path& path, const CDBOptions& dbOptions, bool fMemory = false, bool fWipe = false, bool obfuscate = false);
+    /** Open an unnamed database with the default profile for nCacheSize. */
     CDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory = false, bool fWipe = false, bool obfuscate = false);
     ~CDBWrapper();
 
+    const CDBOptions& GetOptions() const { return dboptions; }
+
+    /** Value of a leveldb property such as "leveldb.stats", false if it is not supported. */
+    bool GetProperty(const std::string& strProperty, std::string& strValue) const;
+
+    CDBStats GetStats() const;
+
     template <typename K, typename V>
     bool Read(const K& key, V& value) const
     {
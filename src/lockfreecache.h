@@ -0,0 +1,230 @@
+// Copyright (c) 2016 The Gulden developers
+// Distributed under the GULDEN software license, see the accompanying
+// file COPYING
+
+#ifndef GULDEN_LOCKFREECACHE_H
+#define GULDEN_LOCKFREECACHE_H
+
+#include <atomic>
+#include <memory>
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * Fixed size, lock-free, set-associative cache of fixed size keys.
+ *
+ * The table is split into sets of WAYS slots; a key may only live in the set
+ * selected by its hash. Every slot carries an atomic tag word holding a
+ * valid bit, a busy bit (set while a writer owns the slot), a write sequence
+ * number and the generation in which the slot was last written. Keys are
+ * stored as relaxed atomic 64 bit words, so readers never race with writers
+ * in the C++ memory model sense; a reader re-checks the tag after comparing
+ * the key words and treats any change as a miss (seqlock style).
+ *
+ * Eviction is generation based: the current generation advances every time
+ * roughly 1/GENERATIONS of the capacity has been inserted, and an insert into
+ * a full set replaces the slot with the oldest generation.
+ *
+ * The cache is a best effort structure. An insert that loses a race for a slot
+ * is dropped and a lookup that races with a writer reports a miss; neither
+ * affects correctness of a cache whose hits are only an optimisation. A
+ * false positive is impossible, as a hit requires all key words to match
+ * while the tag is unchanged.
+ *
+ * Element must be trivially copyable, a multiple of 8 bytes in size and
+ * comparable by its bytes. Hash must return a well distributed 64 bit value.
+ */
+template <typename Element, typename Hash>
+class lockfreecache {
+public:
+    static const unsigned int WAYS = 8;
+    static const unsigned int GENERATIONS = 4;
+
+private:
+    static const unsigned int WORDS = sizeof(Element) / sizeof(uint64_t);
+    static_assert(sizeof(Element) % sizeof(uint64_t) == 0, "lockfreecache element size must be a multiple of 8 bytes");
+
+    static const uint32_t TAG_VALID = 0x80000000;
+    static const uint32_t TAG_BUSY = 0x40000000;
+    static const uint32_t TAG_SEQUENCE_MASK = 0x3F000000;
+    static const uint32_t TAG_SEQUENCE_ONE = 0x01000000;
+    static const uint32_t TAG_GENERATION_MASK = 0x00FFFFFF;
+
+    struct Slot {
+        std::atomic<uint32_t> tag;
+        std::atomic<uint64_t> words[WORDS];
+    };
+
+    std::unique_ptr<Slot[]> table;
+    uint64_t nSetMask;
+    uint64_t nSlots;
+    uint64_t nInsertsPerGeneration;
+    std::atomic<uint32_t> nGeneration;
+    std::atomic<uint64_t> nInsertsThisGeneration;
+    const Hash hasher;
+
+    static void ToWords(const Element& e, uint64_t* out)
+    {
+        memcpy(out, &e, sizeof(Element));
+    }
+
+    Slot* SetFor(const uint64_t* words) const
+    {
+        return &table[(hasher(words) & nSetMask) * WAYS];
+    }
+
+    bool MatchSlot(Slot& slot, const uint64_t* words, uint32_t& tagOut) const
+    {
+        uint32_t tag = slot.tag.load(std::memory_order_acquire);
+        if ((tag & (TAG_VALID | TAG_BUSY)) != TAG_VALID)
+            return false;
+        for (unsigned int i = 0; i < WORDS; ++i) {
+            if (slot.words[i].load(std::memory_order_relaxed) != words[i])
+                return false;
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.tag.load(std::memory_order_relaxed) != tag)
+            return false;
+        tagOut = tag;
+        return true;
+    }
+
+    void CountInsert()
+    {
+        if (nInsertsThisGeneration.fetch_add(1, std::memory_order_relaxed) + 1 >= nInsertsPerGeneration) {
+            nInsertsThisGeneration.store(0, std::memory_order_relaxed);
+            nGeneration.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+public:
+    lockfreecache()
+        : nSetMask(0)
+        , nSlots(0)
+        , nInsertsPerGeneration(1)
+        , nGeneration(0)
+        , nInsertsThisGeneration(0)
+        , hasher()
+    {
+    }
+
+    lockfreecache(const lockfreecache&) = delete;
+    lockfreecache& operator=(const lockfreecache&) = delete;
+
+    /**
+     * (Re)allocate the table to use at most nBytes of memory. Not thread
+     * safe; must be called before the cache is shared between threads.
+     * Returns the number of elements the cache can hold (0 if nBytes is too
+     * small to hold a single set, in which case the cache stays disabled).
+     */
+    uint64_t setup_bytes(size_t nBytes)
+    {
+        uint64_t nSets = nBytes / (sizeof(Slot) * WAYS);
+        table.reset();
+        nSetMask = 0;
+        nSlots = 0;
+        if (nSets == 0)
+            return 0;
+        // Round down to a power of two so that set selection is a mask.
+        while (nSets & (nSets - 1))
+            nSets &= nSets - 1;
+        nSlots = nSets * WAYS;
+        nSetMask = nSets - 1;
+        table.reset(new Slot[nSlots]);
+        for (uint64_t i = 0; i < nSlots; ++i) {
+            table[i].tag.store(0, std::memory_order_relaxed);
+            for (unsigned int j = 0; j < WORDS; ++j)
+                table[i].words[j].store(0, std::memory_order_relaxed);
+        }
+        nInsertsPerGeneration = nSlots / GENERATIONS;
+        if (nInsertsPerGeneration == 0)
+            nInsertsPerGeneration = 1;
+        nGeneration.store(0, std::memory_order_relaxed);
+        nInsertsThisGeneration.store(0, std::memory_order_relaxed);
+        return nSlots;
+    }
+
+    /** Number of elements the cache can hold. */
+    uint64_t capacity() const { return nSlots; }
+
+    /** Bytes allocated for the table. */
+    size_t memory_usage() const { return nSlots * sizeof(Slot); }
+
+    /** Insert an element. Best effort: may silently drop the insert under contention. */
+    void insert(const Element& e)
+    {
+        if (!nSlots)
+            return;
+        uint64_t words[WORDS];
+        ToWords(e, words);
+        Slot* set = SetFor(words);
+        const uint32_t nGen = nGeneration.load(std::memory_order_relaxed) & TAG_GENERATION_MASK;
+
+        // Pick a victim: an empty slot if available, else the oldest generation.
+        // All ways are checked for the element first, as an erase can leave a
+        // hole in front of it and filling that would store a second copy.
+        Slot* victim = NULL;
+        uint32_t victimTag = 0;
+        uint32_t victimAge = 0;
+        bool fVictimEmpty = false;
+        for (unsigned int i = 0; i < WAYS; ++i) {
+            uint32_t tag = set[i].tag.load(std::memory_order_relaxed);
+            if (tag & TAG_BUSY)
+                continue;
+            if (!(tag & TAG_VALID)) {
+                if (!fVictimEmpty) {
+                    victim = &set[i];
+                    victimTag = tag;
+                    fVictimEmpty = true;
+                }
+                continue;
+            }
+            uint32_t tmp;
+            if (MatchSlot(set[i], words, tmp))
+                return;
+            if (fVictimEmpty)
+                continue;
+            uint32_t age = (nGen - (tag & TAG_GENERATION_MASK)) & TAG_GENERATION_MASK;
+            if (!victim || age > victimAge) {
+                victim = &set[i];
+                victimTag = tag;
+                victimAge = age;
+            }
+        }
+        if (!victim)
+            return;
+        if (!victim->tag.compare_exchange_strong(victimTag, TAG_BUSY, std::memory_order_acquire, std::memory_order_relaxed))
+            return;
+        std::atomic_thread_fence(std::memory_order_release);
+        for (unsigned int i = 0; i < WORDS; ++i)
+            victim->words[i].store(words[i], std::memory_order_relaxed);
+        // Bump the sequence so a reader that started before this write can never mistake the new tag for the old one.
+        const uint32_t nSequence = (victimTag + TAG_SEQUENCE_ONE) & TAG_SEQUENCE_MASK;
+        victim->tag.store(TAG_VALID | nSequence | nGen, std::memory_order_release);
+        CountInsert();
+    }
+
+    /**
+     * Look up an element. If fErase is set and the element is found it is
+     * removed from the cache, freeing its slot for reuse.
+     */
+    bool contains(const Element& e, bool fErase)
+    {
+        if (!nSlots)
+            return false;
+        uint64_t words[WORDS];
+        ToWords(e, words);
+        Slot* set = SetFor(words);
+        for (unsigned int i = 0; i < WAYS; ++i) {
+            uint32_t tag;
+            if (MatchSlot(set[i], words, tag)) {
+                if (fErase)
+                    set[i].tag.compare_exchange_strong(tag, tag & ~TAG_VALID, std::memory_order_relaxed);
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+#endif // GULDEN_LOCKFREECACHE_H
@@ -12,6 +12,7 @@
 
 #include "main.h"
 
+#include "addressindex.h"
 #include "addrman.h"
 #include "alert.h"
 #include "arith_uint256.h"
@@ -23,8 +24,11 @@
 #include "consensus/consensus.h"
 #include "consensus/merkle.h"
 #include "consensus/validation.h"
+#include "core_memusage.h"
+#include "crypto/common.h"
 #include "hash.h"
 #include "init.h"
+#include "mappedfile.h"
 #include "merkleblock.h"
 #include "net.h"
 #include "policy/fees.h"
@@ -37,8 +41,10 @@
 #include "script/script.h"
 #include "script/sigcache.h"
 #include "script/standard.h"
+#include "startupconfig.h"
 #include "tinyformat.h"
 #include "txdb.h"
+#include "txindex.h"
 #include "txmempool.h"
 #include "ui_interface.h"
 #include "undo.h"
@@ -52,6 +58,8 @@
 #endif
 
 #include <atomic>
+#include <deque>
+#include <list>
 #include <sstream>
 
 #include <boost/algorithm/string/replace.hpp>
@@ -83,6 +91,7 @@ int nScriptCheckThreads = 0;
 bool fImporting = false;
 bool fReindex = false;
 bool fTxIndex = false;
+bool fAddressIndex = false;
 bool fHavePruned = false;
 bool fPruneMode = false;
 bool fIsBareMultisigStd = DEFAULT_PERMIT_BAREMULTISIG;
@@ -94,6 +103,7 @@ uint64_t nPruneTarget = 0;
 bool fAlerts = DEFAULT_ALERTS;
 int64_t nMaxTipAge = DEFAULT_MAX_TIP_AGE;
 bool fEnableReplacement = DEFAULT_ENABLE_REPLACEMENT;
+bool fMapBlockFiles = DEFAULT_MMAP_BLOCK_FILES;
 
 CFeeRate minRelayTxFee = CFeeRate(DEFAULT_MIN_RELAY_TX_FEE);
 CAmount maxTxFee = DEFAULT_TRANSACTION_MAXFEE;
@@ -110,13 +120,24 @@ struct IteratorComparator {
 };
 
 struct COrphanTx {
-    CTransaction tx;
+    CTransactionRef tx;
     NodeId fromPeer;
     int64_t nTimeExpire;
+    size_t nUsage; //!< Memory used by tx, counted against the orphan limits
+};
+/** Orphans kept for a peer, so a peer over its share is found without scanning all orphans */
+struct COrphanPeer {
+    set<uint256> setTx;
+    size_t nUsage;
+
+    COrphanPeer() : nUsage(0) {}
 };
 map<uint256, COrphanTx> mapOrphanTransactions GUARDED_BY(cs_main);
 map<COutPoint, set<map<uint256, COrphanTx>::iterator, IteratorComparator> > mapOrphanTransactionsByPrev GUARDED_BY(cs_main);
+map<NodeId, COrphanPeer> mapOrphanPeers GUARDED_BY(cs_main);
+size_t nOrphanTransactionsUsage GUARDED_BY(cs_main) = 0;
 void EraseOrphansFor(NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
+void ClearOrphans() EXCLUSIVE_LOCKS_REQUIRED(cs_main);
 
 /**
  * Returns true if there are nRequired or more blocks of minVersion or above
@@ -225,6 +246,7 @@ struct QueuedBlock {
     CBlockIndex* pindex; //!< Optional.
     bool fValidatedHeaders; //!< Whether this block has validated headers at the time of request.
     std::unique_ptr<PartiallyDownloadedBlock> partialBlock; //!< Optional, used for CMPCTBLOCK downloads
+    int64_t nTimeRequested; //!< Time in microseconds the block was requested.
 };
 map<uint256, pair<NodeId, list<QueuedBlock>::iterator> > mapBlocksInFlight;
 
@@ -243,8 +265,31 @@ set<int> setDirtyFileInfo;
 /** Number of peers from which we're downloading blocks. */
 int nPeersWithValidatedDownloads = 0;
 
+/** Moving average of the size of downloaded blocks, 0 until the first one arrives. Protected by cs_main. */
+double dAverageBlockSize = 0;
+
+/** A relayed transaction, shared with the mempool, and its network serialization once a peer asked for it. */
+struct CRelayTx {
+    CTransactionRef tx;
+    std::vector<char> vchSerialized[2]; //!< Indexed by whether witness data is included
+
+    explicit CRelayTx(const CTransactionRef& txIn) : tx(txIn) {}
+
+    /** Serialize the transaction on the first request, so every further peer gets the same bytes. */
+    std::vector<char>& GetSerialized(bool fWitness)
+    {
+        std::vector<char>& vch = vchSerialized[fWitness];
+        if (vch.empty()) {
+            CDataStream ss(SER_NETWORK, PROTOCOL_VERSION | (fWitness ? 0 : SERIALIZE_TRANSACTION_NO_WITNESS));
+            ss << *tx;
+            vch.assign(ss.begin(), ss.end());
+        }
+        return vch;
+    }
+};
+
 /** Relay map, protected by cs_main. */
-typedef std::map<uint256, std::shared_ptr<const CTransaction> > MapRelay;
+typedef std::map<uint256, CRelayTx> MapRelay;
 MapRelay mapRelay;
 /** Expiration-time ordered list of (expire time, relay map entry) pairs, protected by cs_main). */
 std::deque<std::pair<int64_t, MapRelay::iterator> > vRelayExpiration;
@@ -296,6 +341,24 @@ struct CNodeState {
     int64_t nDownloadingSince;
     int nBlocksInFlight;
     int nBlocksInFlightValidHeaders;
+    //! Time in microseconds the last requested block arrived.
+    int64_t nLastBlockDelivery;
+    //! Number of blocks and bytes received in response to our requests.
+    uint64_t nBlocksDownloaded;
+    uint64_t nBlockBytesDownloaded;
+    //! Moving averages of the time this peer takes to deliver a block (microseconds) and of its throughput.
+    int64_t nBlockServiceTime;
+    double dBlockBytesPerSecond;
+    //! In-flight limit during block download, recomputed whenever blocks are requested.
+    int nBlocksInFlightLimit;
+    //! Upper bound of the adaptive in-flight limit: halved when the peer stalls, grows back with every delivery.
+    int nBlocksInFlightCap;
+    //! Times this peer's blocks were reassigned for stalling since it last delivered one.
+    int nStallReassigns;
+    //! Blocks taken from this peer for stalling, left to other peers until it delivers one
+    //! or nStallReleasedUntil passes, in case no other peer takes them.
+    std::set<uint256> setStallReleased;
+    int64_t nStallReleasedUntil;
 
     bool fPreferredDownload;
 
@@ -322,6 +385,15 @@ struct CNodeState {
         nDownloadingSince = 0;
         nBlocksInFlight = 0;
         nBlocksInFlightValidHeaders = 0;
+        nLastBlockDelivery = 0;
+        nBlocksDownloaded = 0;
+        nBlockBytesDownloaded = 0;
+        nBlockServiceTime = 0;
+        dBlockBytesPerSecond = 0;
+        nBlocksInFlightLimit = MAX_BLOCKS_IN_TRANSIT_PER_PEER;
+        nBlocksInFlightCap = MAX_ADAPTIVE_BLOCKS_IN_TRANSIT_PER_PEER;
+        nStallReassigns = 0;
+        nStallReleasedUntil = 0;
         fPreferredDownload = false;
         fPreferHeaders = false;
         fPreferHeaderAndIDs = false;
@@ -431,7 +503,7 @@ bool MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const Consensus::Pa
     MarkBlockAsReceived(hash);
 
     list<QueuedBlock>::iterator it = state->vBlocksInFlight.insert(state->vBlocksInFlight.end(),
-                                                                   { hash, pindex, pindex != NULL, std::unique_ptr<PartiallyDownloadedBlock>(pit ? new PartiallyDownloadedBlock(&mempool) : NULL) });
+                                                                   { hash, pindex, pindex != NULL, std::unique_ptr<PartiallyDownloadedBlock>(pit ? new PartiallyDownloadedBlock(&mempool) : NULL), GetTimeMicros() });
     state->nBlocksInFlight++;
     state->nBlocksInFlightValidHeaders += it->fValidatedHeaders;
     if (state->nBlocksInFlight == 1) {
@@ -447,6 +519,77 @@ bool MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const Consensus::Pa
     return true;
 }
 
+/** Weight of a new sample in the block download moving averages. */
+static const double BLOCK_DOWNLOAD_AVERAGE_WEIGHT = 1.0 / 16;
+
+/**
+ * Update the download statistics of a peer that delivered a block we requested
+ * from it. The service time of a block is measured from when the peer could
+ * start sending it: its request, or the delivery of the previous block if
+ * that came later, so pipelined requests do not count the round trip again.
+ */
+void RecordBlockDelivery(NodeId nodeid, const uint256& hash, unsigned int nSize)
+{
+    map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
+    if (itInFlight == mapBlocksInFlight.end() || itInFlight->second.first != nodeid)
+        return;
+    CNodeState* state = State(nodeid);
+    const int64_t nNow = GetTimeMicros();
+    const int64_t nService = std::max<int64_t>(1, nNow - std::max(itInFlight->second.second->nTimeRequested, state->nLastBlockDelivery));
+    const double dBytesPerSecond = nSize * 1000000.0 / nService;
+    if (state->nBlocksDownloaded == 0) {
+        state->nBlockServiceTime = nService;
+        state->dBlockBytesPerSecond = dBytesPerSecond;
+    } else {
+        state->nBlockServiceTime += (nService - state->nBlockServiceTime) * BLOCK_DOWNLOAD_AVERAGE_WEIGHT;
+        state->dBlockBytesPerSecond += (dBytesPerSecond - state->dBlockBytesPerSecond) * BLOCK_DOWNLOAD_AVERAGE_WEIGHT;
+    }
+    state->nLastBlockDelivery = nNow;
+    state->nBlocksDownloaded++;
+    state->nBlockBytesDownloaded += nSize;
+    state->nBlocksInFlightCap = std::min(state->nBlocksInFlightCap + 1, MAX_ADAPTIVE_BLOCKS_IN_TRANSIT_PER_PEER);
+    state->nStallReassigns = 0;
+    state->setStallReleased.clear();
+
+    if (dAverageBlockSize == 0)
+        dAverageBlockSize = nSize;
+    else
+        dAverageBlockSize += (nSize - dAverageBlockSize) * BLOCK_DOWNLOAD_AVERAGE_WEIGHT;
+}
+
+/**
+ * Number of blocks a peer may have in flight during block download: enough to
+ * keep it busy for a round trip at its measured delivery rate, plus headroom
+ * for jitter. Peers that have not delivered anything yet get the fixed limit.
+ */
+int GetBlocksInFlightLimit(const CNodeState& state, int64_t nPingUsecTime)
+{
+    if (state.nBlocksDownloaded == 0)
+        return std::min(MAX_BLOCKS_IN_TRANSIT_PER_PEER, state.nBlocksInFlightCap);
+    const int64_t nRoundTrip = std::max<int64_t>(nPingUsecTime, 0);
+    const int64_t nServiceTime = std::max<int64_t>(state.nBlockServiceTime, 1);
+    int64_t nLimit = (nRoundTrip + nServiceTime - 1) / nServiceTime + 2;
+    nLimit = std::min<int64_t>(nLimit, state.nBlocksInFlightCap);
+    return std::max<int64_t>(MIN_BLOCKS_IN_TRANSIT_PER_PEER, std::min<int64_t>(nLimit, MAX_ADAPTIVE_BLOCKS_IN_TRANSIT_PER_PEER));
+}
+
+/** Time in microseconds a peer may stall the download window before its blocks are reassigned. */
+int64_t GetBlockStallingTimeout(const CNodeState& state)
+{
+    // A few times the peer's own delivery time, so a slow peer is caught quickly without punishing jitter.
+    int64_t nTimeout = state.nBlocksDownloaded ? state.nBlockServiceTime * 4 : 1000000 * BLOCK_STALLING_TIMEOUT;
+    return std::max<int64_t>(1000 * BLOCK_STALLING_TIMEOUT_MIN_MS, std::min<int64_t>(nTimeout, 1000000 * BLOCK_STALLING_TIMEOUT));
+}
+
+/** Size of the block download window in blocks, from the average block size. */
+unsigned int GetBlockDownloadWindow()
+{
+    if (dAverageBlockSize == 0)
+        return BLOCK_DOWNLOAD_WINDOW;
+    const double dWindow = BLOCK_DOWNLOAD_WINDOW_BYTES / dAverageBlockSize;
+    return std::max<double>(MIN_BLOCK_DOWNLOAD_WINDOW, std::min<double>(dWindow, MAX_BLOCK_DOWNLOAD_WINDOW));
+}
+
 /** Check whether the last unknown block a peer advertised is not yet known. */
 void ProcessBlockAvailability(NodeId nodeid)
 {
@@ -463,6 +606,8 @@ void ProcessBlockAvailability(NodeId nodeid)
     }
 }
 
+} // anon namespace
+
 /** Update tracking information about which blocks a peer is assumed to have. */
 void UpdateBlockAvailability(NodeId nodeid, const uint256& hash)
 {
@@ -482,6 +627,8 @@ void UpdateBlockAvailability(NodeId nodeid, const uint256& hash)
     }
 }
 
+namespace {
+
 void MaybeSetPeerAsAnnouncingHeaderAndIDs(const CNodeState* nodestate, CNode* pfrom)
 {
     if (nLocalServices & NODE_WITNESS) {
@@ -568,10 +715,13 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
     if (state->pindexLastCommonBlock == state->pindexBestKnownBlock)
         return;
 
+    if (!state->setStallReleased.empty() && GetTimeMicros() >= state->nStallReleasedUntil)
+        state->setStallReleased.clear();
+
     std::vector<CBlockIndex*> vToFetch;
     CBlockIndex* pindexWalk = state->pindexLastCommonBlock;
 
-    int nWindowEnd = state->pindexLastCommonBlock->nHeight + BLOCK_DOWNLOAD_WINDOW;
+    int nWindowEnd = state->pindexLastCommonBlock->nHeight + GetBlockDownloadWindow();
     int nMaxHeight = std::min<int>(state->pindexBestKnownBlock->nHeight, nWindowEnd + 1);
     NodeId waitingfor = -1;
     while (pindexWalk->nHeight < nMaxHeight) {
@@ -597,6 +747,8 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
                 if (pindex->nChainTx)
                     state->pindexLastCommonBlock = pindex;
             } else if (mapBlocksInFlight.count(pindex->GetBlockHash()) == 0) {
+                if (state->setStallReleased.count(pindex->GetBlockHash()))
+                    continue;
 
                 if (pindex->nHeight > nWindowEnd) {
 
@@ -620,6 +772,26 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
 
 } // anon namespace
 
+/** Hand the blocks a stalling peer has in flight to other peers and ask less of it
+ *  from now on. It is not asked for those blocks again until it delivers one or
+ *  the stalling timeout passes. Returns the number of blocks released. */
+unsigned int ReleaseStalledBlocks(NodeId nodeid)
+{
+    CNodeState* state = State(nodeid);
+    assert(state != NULL);
+    std::vector<uint256> vStalled;
+    BOOST_FOREACH (const QueuedBlock& queuedBlock, state->vBlocksInFlight)
+        vStalled.push_back(queuedBlock.hash);
+    BOOST_FOREACH (const uint256& hash, vStalled) {
+        MarkBlockAsReceived(hash);
+        state->setStallReleased.insert(hash);
+    }
+    state->nStallReleasedUntil = GetTimeMicros() + 1000000 * BLOCK_STALLING_TIMEOUT;
+    state->nBlocksInFlightCap = std::max(state->nBlocksInFlightCap / 2, MIN_BLOCKS_IN_TRANSIT_PER_PEER);
+    state->nStallingSince = 0;
+    return vStalled.size();
+}
+
 bool GetNodeStateStats(NodeId nodeid, CNodeStateStats& stats)
 {
     LOCK(cs_main);
@@ -633,6 +805,11 @@ bool GetNodeStateStats(NodeId nodeid, CNodeStateStats& stats)
         if (queue.pindex)
             stats.vHeightInFlight.push_back(queue.pindex->nHeight);
     }
+    stats.nBlocksInFlightLimit = state->nBlocksInFlightLimit;
+    stats.nBlocksDownloaded = state->nBlocksDownloaded;
+    stats.nBlockBytesDownloaded = state->nBlockBytesDownloaded;
+    stats.nBlockServiceTime = state->nBlockServiceTime;
+    stats.dBlockBytesPerSecond = state->dBlockBytesPerSecond;
     return true;
 }
 
@@ -674,26 +851,31 @@ CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& loc
 CCoinsViewCache* pcoinsTip = NULL;
 CBlockTreeDB* pblocktree = NULL;
 
-bool AddOrphanTx(const CTransaction& tx, NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+bool AddOrphanTx(const CTransactionRef& tx, NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
 {
-    uint256 hash = tx.GetHash();
+    uint256 hash = tx->GetHash();
     if (mapOrphanTransactions.count(hash))
         return false;
 
-    unsigned int sz = GetTransactionWeight(tx);
+    unsigned int sz = GetTransactionWeight(*tx);
     if (sz >= MAX_STANDARD_TX_WEIGHT) {
         LogPrint("mempool", "ignoring large orphan tx (size: %u, hash: %s)\n", sz, hash.ToString());
         return false;
     }
 
-    auto ret = mapOrphanTransactions.emplace(hash, COrphanTx{ tx, peer, GetTime() + ORPHAN_TX_EXPIRE_TIME });
+    const size_t nUsage = RecursiveDynamicUsage(*tx) + memusage::DynamicUsage(tx);
+    auto ret = mapOrphanTransactions.emplace(hash, COrphanTx{ tx, peer, GetTime() + ORPHAN_TX_EXPIRE_TIME, nUsage });
     assert(ret.second);
-    BOOST_FOREACH (const CTxIn& txin, tx.vin) {
+    BOOST_FOREACH (const CTxIn& txin, tx->vin) {
         mapOrphanTransactionsByPrev[txin.prevout].insert(ret.first);
     }
+    COrphanPeer& orphanPeer = mapOrphanPeers[peer];
+    orphanPeer.setTx.insert(hash);
+    orphanPeer.nUsage += nUsage;
+    nOrphanTransactionsUsage += nUsage;
 
-    LogPrint("mempool", "stored orphan tx %s (mapsz %u outsz %u)\n", hash.ToString(),
-             mapOrphanTransactions.size(), mapOrphanTransactionsByPrev.size());
+    LogPrint("mempool", "stored orphan tx %s (mapsz %u outsz %u usage %u)\n", hash.ToString(),
+             mapOrphanTransactions.size(), mapOrphanTransactionsByPrev.size(), nOrphanTransactionsUsage);
     return true;
 }
 
@@ -702,7 +884,7 @@ int static EraseOrphanTx(uint256 hash) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
     map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.find(hash);
     if (it == mapOrphanTransactions.end())
         return 0;
-    BOOST_FOREACH (const CTxIn& txin, it->second.tx.vin) {
+    BOOST_FOREACH (const CTxIn& txin, it->second.tx->vin) {
         auto itPrev = mapOrphanTransactionsByPrev.find(txin.prevout);
         if (itPrev == mapOrphanTransactionsByPrev.end())
             continue;
@@ -710,25 +892,52 @@ int static EraseOrphanTx(uint256 hash) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
         if (itPrev->second.empty())
             mapOrphanTransactionsByPrev.erase(itPrev);
     }
+    auto itPeer = mapOrphanPeers.find(it->second.fromPeer);
+    assert(itPeer != mapOrphanPeers.end());
+    itPeer->second.setTx.erase(hash);
+    itPeer->second.nUsage -= it->second.nUsage;
+    if (itPeer->second.setTx.empty())
+        mapOrphanPeers.erase(itPeer);
+    nOrphanTransactionsUsage -= it->second.nUsage;
     mapOrphanTransactions.erase(it);
     return 1;
 }
 
+/** Erase a random orphan received from peer, which must have some. */
+void static EraseRandomOrphanFor(NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+{
+    const set<uint256>& setTx = mapOrphanPeers[peer].setTx;
+    assert(!setTx.empty());
+    set<uint256>::const_iterator it = setTx.lower_bound(GetRandHash());
+    if (it == setTx.end())
+        it = setTx.begin();
+    EraseOrphanTx(*it);
+}
+
 void EraseOrphansFor(NodeId peer)
 {
+    auto itPeer = mapOrphanPeers.find(peer);
+    if (itPeer == mapOrphanPeers.end())
+        return;
+    // Erasing the last orphan of the peer erases its entry.
+    const set<uint256> setTx = itPeer->second.setTx;
     int nErased = 0;
-    map<uint256, COrphanTx>::iterator iter = mapOrphanTransactions.begin();
-    while (iter != mapOrphanTransactions.end()) {
-        map<uint256, COrphanTx>::iterator maybeErase = iter++; // increment to avoid iterator becoming invalid
-        if (maybeErase->second.fromPeer == peer) {
-            nErased += EraseOrphanTx(maybeErase->second.tx.GetHash());
-        }
+    BOOST_FOREACH (const uint256& hash, setTx) {
+        nErased += EraseOrphanTx(hash);
     }
     if (nErased > 0)
         LogPrint("mempool", "Erased %d orphan tx from peer %d\n", nErased, peer);
 }
 
-unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+void ClearOrphans()
+{
+    mapOrphanTransactions.clear();
+    mapOrphanTransactionsByPrev.clear();
+    mapOrphanPeers.clear();
+    nOrphanTransactionsUsage = 0;
+}
+
+unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans, size_t nMaxUsage, size_t nMaxPeerUsage) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
 {
     unsigned int nEvicted = 0;
     static int64_t nNextSweep;
@@ -741,7 +950,7 @@ unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans) EXCLUSIVE_LOCKS_REQUIRE
         while (iter != mapOrphanTransactions.end()) {
             map<uint256, COrphanTx>::iterator maybeErase = iter++;
             if (maybeErase->second.nTimeExpire <= nNow) {
-                nErased += EraseOrphanTx(maybeErase->second.tx.GetHash());
+                nErased += EraseOrphanTx(maybeErase->second.tx->GetHash());
             } else {
                 nMinExpTime = std::min(maybeErase->second.nTimeExpire, nMinExpTime);
             }
@@ -751,13 +960,26 @@ unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans) EXCLUSIVE_LOCKS_REQUIRE
         if (nErased > 0)
             LogPrint("mempool", "Erased %d orphan tx due to expiration\n", nErased);
     }
-    while (mapOrphanTransactions.size() > nMaxOrphans) {
-
-        uint256 randomhash = GetRandHash();
-        map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.lower_bound(randomhash);
-        if (it == mapOrphanTransactions.end())
-            it = mapOrphanTransactions.begin();
-        EraseOrphanTx(it->first);
+    // A peer over its share loses its own orphans, so a burst from one peer does not push out the others'.
+    vector<NodeId> vPeersOver;
+    for (const auto& orphanPeer : mapOrphanPeers) {
+        if (orphanPeer.second.nUsage > nMaxPeerUsage)
+            vPeersOver.push_back(orphanPeer.first);
+    }
+    BOOST_FOREACH (NodeId peer, vPeersOver) {
+        while (mapOrphanPeers.count(peer) && mapOrphanPeers[peer].nUsage > nMaxPeerUsage) {
+            EraseRandomOrphanFor(peer);
+            ++nEvicted;
+        }
+    }
+    // Beyond that the peer using the most memory gives way.
+    while (mapOrphanTransactions.size() > nMaxOrphans || nOrphanTransactionsUsage > nMaxUsage) {
+        map<NodeId, COrphanPeer>::const_iterator itLargest = mapOrphanPeers.begin();
+        for (auto it = mapOrphanPeers.begin(); it != mapOrphanPeers.end(); ++it) {
+            if (it->second.nUsage > itLargest->second.nUsage)
+                itLargest = it;
+        }
+        EraseRandomOrphanFor(itLargest->first);
         ++nEvicted;
     }
     return nEvicted;
@@ -1022,10 +1244,40 @@ std::string FormatStateMessage(const CValidationState& state)
                      state.GetRejectCode());
 }
 
-bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree,
-                              bool* pfMissingInputs, bool fOverrideMempoolLimit, const CAmount& nAbsurdFee,
-                              std::vector<uint256>& vHashTxnToUncache)
+namespace {
+/** Inputs of a transaction entering the mempool, detached from pcoinsTip and the pool once fetched */
+struct CMempoolInputs {
+    CCoinsView dummy;
+    CCoinsViewCache view;
+
+    CMempoolInputs() : view(&dummy) {}
+};
+
+/** Checks scripts of transactions entering the mempool, so they need not wait for block validation */
+CCheckQueue<CScriptCheck> mempoolcheckqueue(128);
+/** Held by the thread in control of mempoolcheckqueue */
+CCriticalSection cs_mempoolcheckqueue;
+}
+
+void ThreadMempoolScriptCheck()
+{
+    RenameThread("Gulden-mempoolch");
+    mempoolcheckqueue.Thread();
+}
+
+/**
+ * Check a transaction for the mempool with cs_main held. Without fCommit every check but the
+ * scripts is done and the script checks are pushed onto pvChecks, to be run against the inputs
+ * left in the view once the locks are released. With fCommit the scripts must have been verified
+ * that way: the checks are done again, as the chain and the pool may have changed meanwhile,
+ * except for the scripts, which only depend on the outputs spent, and the transaction is added.
+ */
+static bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const CTransactionRef& ptx, bool fLimitFree,
+                                     bool* pfMissingInputs, int64_t nAcceptTime, bool fOverrideMempoolLimit, const CAmount& nAbsurdFee,
+                                     std::vector<uint256>& vHashTxnToUncache, CMempoolInputs& inputs, PrecomputedTransactionData& txdata,
+                                     bool fCommit, std::vector<CScriptCheck>* pvChecks)
 {
+    const CTransaction& tx = *ptx;
     const uint256 hash = tx.GetHash();
     AssertLockHeld(cs_main);
     if (pfMissingInputs)
@@ -1085,8 +1337,7 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
     }
 
     {
-        CCoinsView dummy;
-        CCoinsViewCache view(&dummy);
+        CCoinsViewCache& view = inputs.view;
 
         CAmount nValueIn = 0;
         LockPoints lp;
@@ -1119,7 +1370,7 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
 
             nValueIn = view.GetValueIn(tx);
 
-            view.SetBackend(dummy);
+            view.SetBackend(inputs.dummy);
 
             if (!CheckSequenceLocks(tx, STANDARD_LOCKTIME_VERIFY_FLAGS, &lp))
                 return state.DoS(0, false, REJECT_NONSTANDARD, "non-BIP68-final");
@@ -1149,7 +1400,7 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
             }
         }
 
-        CTxMemPoolEntry entry(tx, nFees, GetTime(), dPriority, chainActive.Height(), pool.HasNoInputsOf(tx), inChainInputValue, fSpendsCoinbase, nSigOpsCost, lp);
+        CTxMemPoolEntry entry(ptx, nFees, nAcceptTime, dPriority, chainActive.Height(), pool.HasNoInputsOf(tx), inChainInputValue, fSpendsCoinbase, nSigOpsCost, lp);
         unsigned int nSize = entry.GetTxSize();
 
         if (nSigOpsCost > MAX_STANDARD_TX_SIGOPS_COST)
@@ -1164,7 +1415,7 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
             return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "insufficient priority");
         }
 
-        if (fLimitFree && nModifiedFees < ::minRelayTxFee.GetFee(nSize)) {
+        if (fCommit && fLimitFree && nModifiedFees < ::minRelayTxFee.GetFee(nSize)) {
             static CCriticalSection csFreeLimiter;
             static double dFreeCount;
             static int64_t nLastTime;
@@ -1295,20 +1546,11 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
             scriptVerifyFlags = GetArg("-promiscuousmempoolflags", scriptVerifyFlags);
         }
 
-        PrecomputedTransactionData txdata(tx);
-        if (!CheckInputs(tx, state, view, true, scriptVerifyFlags, true, txdata)) {
+        if (!fCommit)
+            return CheckInputs(tx, state, view, true, scriptVerifyFlags, true, txdata, pvChecks);
 
-            if (CheckInputs(tx, state, view, true, scriptVerifyFlags & ~(SCRIPT_VERIFY_WITNESS | SCRIPT_VERIFY_CLEANSTACK), true, txdata) && !CheckInputs(tx, state, view, true, scriptVerifyFlags & ~SCRIPT_VERIFY_CLEANSTACK, true, txdata)) {
-
-                state.SetCorruptionPossible();
-            }
+        if (!CheckInputs(tx, state, view, false, scriptVerifyFlags, true, txdata))
             return false;
-        }
-
-        if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true, txdata)) {
-            return error("%s: BUG! PLEASE REPORT THIS! ConnectInputs failed against MANDATORY but not STANDARD flags %s, %s",
-                         __func__, hash.ToString(), FormatStateMessage(state));
-        }
 
         BOOST_FOREACH (const CTxMemPool::txiter it, allConflicting) {
             LogPrint("mempool", "replacing tx %s with %s for %s BTC additional fees, %d delta bytes\n",
@@ -1333,18 +1575,108 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const C
     return true;
 }
 
-bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree,
-                        bool* pfMissingInputs, bool fOverrideMempoolLimit, const CAmount nAbsurdFee)
+/**
+ * Run the script checks of a transaction entering the mempool, spread over the mempool script check
+ * threads when another caller is not using them already. A transaction that passes is checked again
+ * against the consensus flags. On failure the state is filled in by checking again one input at a time.
+ */
+static bool VerifyMempoolScripts(const CTransaction& tx, CValidationState& state, const CCoinsViewCache& view,
+                                 PrecomputedTransactionData& txdata, std::vector<CScriptCheck>& vChecks)
+{
+    bool fValid = true;
+    bool fChecked = false;
+    if (vChecks.size() > 1 && nScriptCheckThreads) {
+        TRY_LOCK(cs_mempoolcheckqueue, lockQueue);
+        if (lockQueue) {
+            CCheckQueueControl<CScriptCheck> control(&mempoolcheckqueue);
+            control.Add(vChecks);
+            fValid = control.Wait();
+            fChecked = true;
+        }
+    }
+    if (!fChecked) {
+        BOOST_FOREACH (CScriptCheck& check, vChecks) {
+            if (!check()) {
+                fValid = false;
+                break;
+            }
+        }
+    }
+    if (fValid) {
+        // Check again against the consensus flags, so that a looser -promiscuousmempoolflags set never lets a
+        // transaction that is invalid in a block into the pool. The signature cache makes this cheap.
+        if (!CheckInputScripts(tx, state, view, MANDATORY_SCRIPT_VERIFY_FLAGS, true, txdata)) {
+            return error("%s: BUG! PLEASE REPORT THIS! ConnectInputs failed against MANDATORY but not STANDARD flags %s, %s",
+                         __func__, tx.GetHash().ToString(), FormatStateMessage(state));
+        }
+        return true;
+    }
+
+    unsigned int scriptVerifyFlags = STANDARD_SCRIPT_VERIFY_FLAGS;
+    if (!Params().RequireStandard()) {
+        scriptVerifyFlags = GetArg("-promiscuousmempoolflags", scriptVerifyFlags);
+    }
+    if (!CheckInputScripts(tx, state, view, scriptVerifyFlags, true, txdata)) {
+
+        if (CheckInputScripts(tx, state, view, scriptVerifyFlags & ~(SCRIPT_VERIFY_WITNESS | SCRIPT_VERIFY_CLEANSTACK), true, txdata) && !CheckInputScripts(tx, state, view, scriptVerifyFlags & ~SCRIPT_VERIFY_CLEANSTACK, true, txdata)) {
+
+            state.SetCorruptionPossible();
+        }
+        return false;
+    }
+    return error("%s: BUG! PLEASE REPORT THIS! script checks of %s failed but not when done again", __func__, tx.GetHash().ToString());
+}
+
+bool AcceptToMemoryPoolWithTime(CTxMemPool& pool, CValidationState& state, const CTransactionRef& ptx, bool fLimitFree,
+                                bool* pfMissingInputs, int64_t nAcceptTime, bool fOverrideMempoolLimit, const CAmount nAbsurdFee)
 {
+    const CTransaction& tx = *ptx;
     std::vector<uint256> vHashTxToUncache;
-    bool res = AcceptToMemoryPoolWorker(pool, state, tx, fLimitFree, pfMissingInputs, fOverrideMempoolLimit, nAbsurdFee, vHashTxToUncache);
+    PrecomputedTransactionData txdata(tx);
+    bool res;
+    {
+        // The scripts, the bulk of the work, are verified without holding cs_main, so blocks and
+        // other transactions are processed meanwhile. Callers already holding it keep it throughout.
+        CMempoolInputs inputs;
+        std::vector<CScriptCheck> vChecks;
+        {
+            LOCK(cs_main);
+            res = AcceptToMemoryPoolWorker(pool, state, ptx, fLimitFree, pfMissingInputs, nAcceptTime, fOverrideMempoolLimit, nAbsurdFee, vHashTxToUncache, inputs, txdata, false, &vChecks);
+        }
+        if (res)
+            res = VerifyMempoolScripts(tx, state, inputs.view, txdata, vChecks);
+        if (res) {
+            CMempoolInputs inputsCommit;
+            LOCK(cs_main);
+            res = AcceptToMemoryPoolWorker(pool, state, ptx, fLimitFree, pfMissingInputs, nAcceptTime, fOverrideMempoolLimit, nAbsurdFee, vHashTxToUncache, inputsCommit, txdata, true, NULL);
+        }
+    }
     if (!res) {
+        LOCK(cs_main);
         BOOST_FOREACH (const uint256& hashTx, vHashTxToUncache)
             pcoinsTip->Uncache(hashTx);
     }
     return res;
 }
 
+bool AcceptToMemoryPoolWithTime(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree,
+                                bool* pfMissingInputs, int64_t nAcceptTime, bool fOverrideMempoolLimit, const CAmount nAbsurdFee)
+{
+    return AcceptToMemoryPoolWithTime(pool, state, MakeTransactionRef(tx), fLimitFree, pfMissingInputs, nAcceptTime, fOverrideMempoolLimit, nAbsurdFee);
+}
+
+bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransactionRef& tx, bool fLimitFree,
+                        bool* pfMissingInputs, bool fOverrideMempoolLimit, const CAmount nAbsurdFee)
+{
+    return AcceptToMemoryPoolWithTime(pool, state, tx, fLimitFree, pfMissingInputs, GetTime(), fOverrideMempoolLimit, nAbsurdFee);
+}
+
+bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree,
+                        bool* pfMissingInputs, bool fOverrideMempoolLimit, const CAmount nAbsurdFee)
+{
+    return AcceptToMemoryPoolWithTime(pool, state, MakeTransactionRef(tx), fLimitFree, pfMissingInputs, GetTime(), fOverrideMempoolLimit, nAbsurdFee);
+}
+
 /** Return transaction in tx, and if it was found inside a block, its hash is placed in hashBlock */
 bool GetTransaction(const uint256& hash, CTransaction& txOut, const Consensus::Params& consensusParams, uint256& hashBlock, bool fAllowSlow)
 {
@@ -1358,27 +1690,8 @@ bool GetTransaction(const uint256& hash, CTransaction& txOut, const Consensus::P
         return true;
     }
 
-    if (fTxIndex) {
-        CDiskTxPos postx;
-        if (pblocktree->ReadTxIndex(hash, postx)) {
-            CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
-            if (file.IsNull())
-                return error("%s: OpenBlockFile failed", __func__);
-            CBlockHeader header;
-            try {
-                file >> header;
-                fseek(file.Get(), postx.nTxOffset, SEEK_CUR);
-                file >> txOut;
-            }
-            catch (const std::exception& e) {
-                return error("%s: Deserialize or I/O error - %s", __func__, e.what());
-            }
-            hashBlock = header.GetHash();
-            if (txOut.GetHash() != hash)
-                return error("%s: txid mismatch", __func__);
-            return true;
-        }
-    }
+    if (ptxindex && ptxindex->FindTx(hash, txOut, hashBlock))
+        return true;
 
     if (fAllowSlow) { // use coin database to locate block that contains transaction, and scan it
         int nHeight = -1;
@@ -1395,7 +1708,8 @@ bool GetTransaction(const uint256& hash, CTransaction& txOut, const Consensus::P
     if (pindexSlow) {
         CBlock block;
         if (ReadBlockFromDisk(block, pindexSlow, consensusParams)) {
-            BOOST_FOREACH (const CTransaction& tx, block.vtx) {
+            for (const auto& ptx : block.vtx) {
+                const CTransaction& tx = *ptx;
                 if (tx.GetHash() == hash) {
                     txOut = tx;
                     hashBlock = pindexSlow->GetBlockHash();
@@ -1427,19 +1741,110 @@ bool WriteBlockToDisk(const CBlock& block, CDiskBlockPos& pos, const CMessageHea
     return true;
 }
 
+namespace {
+/** Mappings of finalized block files, least recently used first. */
+CCriticalSection cs_MappedBlockFiles;
+std::list<std::pair<int, std::shared_ptr<const CMappedFile> > > listMappedBlockFiles;
+
+/** Return a mapping of block file nFile, or null if the file is still being written to or cannot be mapped. */
+std::shared_ptr<const CMappedFile> GetMappedBlockFile(int nFile)
+{
+    if (!fMapBlockFiles)
+        return nullptr;
+    {
+        // The last file is preallocated beyond its contents and still being appended to.
+        LOCK(cs_LastBlockFile);
+        if (nFile >= nLastBlockFile)
+            return nullptr;
+    }
+
+    LOCK(cs_MappedBlockFiles);
+    for (auto it = listMappedBlockFiles.begin(); it != listMappedBlockFiles.end(); ++it) {
+        if (it->first == nFile) {
+            listMappedBlockFiles.splice(listMappedBlockFiles.end(), listMappedBlockFiles, it);
+            return it->second;
+        }
+    }
+    std::shared_ptr<const CMappedFile> mapping = CMappedFile::Open(GetBlockPosFilename(CDiskBlockPos(nFile, 0), "blk"));
+    if (!mapping)
+        return nullptr;
+    listMappedBlockFiles.push_back(std::make_pair(nFile, mapping));
+    if (listMappedBlockFiles.size() > MAX_MAPPED_BLOCK_FILES)
+        listMappedBlockFiles.pop_front();
+    return mapping;
+}
+
+void UnmapBlockFile(int nFile)
+{
+    LOCK(cs_MappedBlockFiles);
+    for (auto it = listMappedBlockFiles.begin(); it != listMappedBlockFiles.end(); ++it) {
+        if (it->first == nFile) {
+            listMappedBlockFiles.erase(it);
+            return;
+        }
+    }
+}
+
+/** Locate the block record at pos (preceded by message start and size) in a mapped block file. */
+bool FindMappedBlock(const CMappedFile& mapping, const CDiskBlockPos& pos, const CMessageHeader::MessageStartChars* messageStart, const char*& pbegin, const char*& pend)
+{
+    if (pos.nPos < 8 || pos.nPos > mapping.size())
+        return false;
+    const char* pheader = mapping.data() + pos.nPos - 8;
+    if (messageStart && memcmp(pheader, *messageStart, MESSAGE_START_SIZE))
+        return false;
+    uint32_t nSize = ReadLE32((const unsigned char*)pheader + MESSAGE_START_SIZE);
+    if (nSize > mapping.size() - pos.nPos)
+        return false;
+    pbegin = mapping.data() + pos.nPos;
+    pend = pbegin + nSize;
+    return true;
+}
+}
+
+void CRawBlock::SetMapped(const std::shared_ptr<const CMappedFile>& mappingIn, const char* pbeginIn, const char* pendIn)
+{
+    std::vector<char>().swap(vchBuffer);
+    mapping = mappingIn;
+    pbegin = pbeginIn;
+    pend = pendIn;
+}
+
+std::vector<char>& CRawBlock::SetBuffer(size_t nSize)
+{
+    mapping.reset();
+    vchBuffer.resize(nSize);
+    pbegin = vchBuffer.data();
+    pend = pbegin + nSize;
+    return vchBuffer;
+}
+
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus::Params& consensusParams)
 {
     block.SetNull();
 
-    CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull())
-        return error("ReadBlockFromDisk: OpenBlockFile failed for %s", pos.ToString());
+    std::shared_ptr<const CMappedFile> mapping = GetMappedBlockFile(pos.nFile);
+    const char* pbegin = NULL;
+    const char* pend = NULL;
+    if (mapping && FindMappedBlock(*mapping, pos, NULL, pbegin, pend)) {
+        try {
+            CSpanReader spanin(pbegin, pend, SER_DISK, CLIENT_VERSION);
+            spanin >> block;
+        }
+        catch (const std::exception& e) {
+            return error("%s: Deserialize error - %s at %s", __func__, e.what(), pos.ToString());
+        }
+    } else {
+        CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
+        if (filein.IsNull())
+            return error("ReadBlockFromDisk: OpenBlockFile failed for %s", pos.ToString());
 
-    try {
-        filein >> block;
-    }
-    catch (const std::exception& e) {
-        return error("%s: Deserialize or I/O error - %s at %s", __func__, e.what(), pos.ToString());
+        try {
+            filein >> block;
+        }
+        catch (const std::exception& e) {
+            return error("%s: Deserialize or I/O error - %s at %s", __func__, e.what(), pos.ToString());
+        }
     }
 
     if (!CheckProofOfWork(block.GetPoWHash(), block.nBits, consensusParams))
@@ -1458,6 +1863,40 @@ bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus
     return true;
 }
 
+bool ReadRawBlockFromDisk(CRawBlock& block, const CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& messageStart)
+{
+    std::shared_ptr<const CMappedFile> mapping = GetMappedBlockFile(pos.nFile);
+    const char* pbegin = NULL;
+    const char* pend = NULL;
+    if (mapping && FindMappedBlock(*mapping, pos, &messageStart, pbegin, pend)) {
+        block.SetMapped(mapping, pbegin, pend);
+        return true;
+    }
+
+    if (pos.nPos < 8)
+        return error("%s: invalid block position %s", __func__, pos.ToString());
+    CAutoFile filein(OpenBlockFile(CDiskBlockPos(pos.nFile, pos.nPos - 8), true), SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull())
+        return error("%s: OpenBlockFile failed for %s", __func__, pos.ToString());
+
+    try {
+        CMessageHeader::MessageStartChars blkMessageStart;
+        unsigned int nSize;
+        filein >> FLATDATA(blkMessageStart) >> nSize;
+        if (memcmp(blkMessageStart, messageStart, MESSAGE_START_SIZE))
+            return error("%s: block magic mismatch at %s", __func__, pos.ToString());
+        if (nSize > MAX_BLOCK_SERIALIZED_SIZE)
+            return error("%s: block size %u too large at %s", __func__, nSize, pos.ToString());
+        std::vector<char>& vch = block.SetBuffer(nSize);
+        filein.read(vch.data(), nSize);
+    }
+    catch (const std::exception& e) {
+        return error("%s: I/O error - %s at %s", __func__, e.what(), pos.ToString());
+    }
+
+    return true;
+}
+
 CAmount GetBlockSubsidy(int nHeight, const Consensus::Params& consensusParams)
 {
     CAmount nSubsidy = 0;
@@ -1721,34 +2160,39 @@ bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsVi
         if (!Consensus::CheckTxInputs(tx, state, inputs, GetSpendHeight(inputs)))
             return false;
 
-        if (pvChecks)
-            pvChecks->reserve(tx.vin.size());
-
-        if (fScriptChecks) {
-            for (unsigned int i = 0; i < tx.vin.size(); i++) {
-                const COutPoint& prevout = tx.vin[i].prevout;
-                const CCoins* coins = inputs.AccessCoins(prevout.hash);
-                assert(coins);
-
-                CScriptCheck check(*coins, tx, i, flags, cacheStore, &txdata);
-                if (pvChecks) {
-                    pvChecks->push_back(CScriptCheck());
-                    check.swap(pvChecks->back());
-                } else if (!check()) {
-                    if (flags & STANDARD_NOT_MANDATORY_VERIFY_FLAGS) {
-
-                        CScriptCheck check2(*coins, tx, i,
-                                            flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheStore, &txdata);
-                        if (check2())
-                            return state.Invalid(false, REJECT_NONSTANDARD, strprintf("non-mandatory-script-verify-flag (%s)", ScriptErrorString(check.GetScriptError())));
-                    }
+        if (fScriptChecks)
+            return CheckInputScripts(tx, state, inputs, flags, cacheStore, txdata, pvChecks);
+    }
 
-                    return state.DoS(100, false, REJECT_INVALID, strprintf("mandatory-script-verify-flag-failed (%s)", ScriptErrorString(check.GetScriptError())));
-                }
+    return true;
+}
+
+bool CheckInputScripts(const CTransaction& tx, CValidationState& state, const CCoinsViewCache& inputs, unsigned int flags, bool cacheStore, PrecomputedTransactionData& txdata, std::vector<CScriptCheck>* pvChecks)
+{
+    if (pvChecks)
+        pvChecks->reserve(tx.vin.size());
+
+    for (unsigned int i = 0; i < tx.vin.size(); i++) {
+        const COutPoint& prevout = tx.vin[i].prevout;
+        const CCoins* coins = inputs.AccessCoins(prevout.hash);
+        assert(coins);
+
+        CScriptCheck check(*coins, tx, i, flags, cacheStore, &txdata);
+        if (pvChecks) {
+            pvChecks->push_back(CScriptCheck());
+            check.swap(pvChecks->back());
+        } else if (!check()) {
+            if (flags & STANDARD_NOT_MANDATORY_VERIFY_FLAGS) {
+
+                CScriptCheck check2(*coins, tx, i,
+                                    flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheStore, &txdata);
+                if (check2())
+                    return state.Invalid(false, REJECT_NONSTANDARD, strprintf("non-mandatory-script-verify-flag (%s)", ScriptErrorString(check.GetScriptError())));
             }
+
+            return state.DoS(100, false, REJECT_INVALID, strprintf("mandatory-script-verify-flag-failed (%s)", ScriptErrorString(check.GetScriptError())));
         }
     }
-
     return true;
 }
 
@@ -1803,6 +2247,45 @@ bool UndoReadFromDisk(CBlockUndo& blockundo, const CDiskBlockPos& pos, const uin
     return true;
 }
 
+/**
+ * Undo data of the most recently connected blocks, so that short reorgs do
+ * not read rev*.dat. The undo data of a block only depends on the block and
+ * its ancestors, so entries stay valid after the block is disconnected.
+ * Protected by cs_main.
+ */
+class CRecentUndoCache {
+private:
+    std::map<uint256, std::shared_ptr<const CBlockUndo> > mapUndo;
+    std::deque<uint256> queueAdded;
+
+public:
+    void Add(const uint256& hashBlock, CBlockUndo&& blockundo, size_t nMaxBlocks)
+    {
+        if (nMaxBlocks == 0)
+            return;
+        if (!mapUndo.insert(std::make_pair(hashBlock, std::make_shared<const CBlockUndo>(std::move(blockundo)))).second)
+            return;
+        queueAdded.push_back(hashBlock);
+        while (queueAdded.size() > nMaxBlocks) {
+            mapUndo.erase(queueAdded.front());
+            queueAdded.pop_front();
+        }
+    }
+
+    std::shared_ptr<const CBlockUndo> Get(const uint256& hashBlock) const
+    {
+        std::map<uint256, std::shared_ptr<const CBlockUndo> >::const_iterator it = mapUndo.find(hashBlock);
+        return it == mapUndo.end() ? std::shared_ptr<const CBlockUndo>() : it->second;
+    }
+
+    void Clear()
+    {
+        mapUndo.clear();
+        queueAdded.clear();
+    }
+};
+CRecentUndoCache recentUndo;
+
 /** Abort with a message */
 bool AbortNode(const std::string& strMessage, const std::string& userMessage = "")
 {
@@ -1824,39 +2307,53 @@ bool AbortNode(CValidationState& state, const std::string& strMessage, const std
 } // anon namespace
 
 /**
- * Apply the undo operation of a CTxInUndo to the given chain state.
+ * Apply the undo operation of a CTxInUndo to the coins of the transaction it spent from.
  * @param undo The undo object.
- * @param view The coins view to which to apply the changes.
- * @param out The out point that corresponds to the tx input.
+ * @param coins The coins of the transaction that created the spent output.
+ * @param n The index of the spent output.
  * @return True on success.
  */
-static bool ApplyTxInUndo(const CTxInUndo& undo, CCoinsViewCache& view, const COutPoint& out)
+static bool ApplyTxInUndo(const CTxInUndo& undo, CCoins& coins, unsigned int n)
 {
     bool fClean = true;
 
-    CCoinsModifier coins = view.ModifyCoins(out.hash);
     if (undo.nHeight != 0) {
 
-        if (!coins->IsPruned())
+        if (!coins.IsPruned())
             fClean = fClean && error("%s: undo data overwriting existing transaction", __func__);
-        coins->Clear();
-        coins->fCoinBase = undo.fCoinBase;
-        coins->nHeight = undo.nHeight;
-        coins->nVersion = undo.nVersion;
+        coins.Clear();
+        coins.fCoinBase = undo.fCoinBase;
+        coins.nHeight = undo.nHeight;
+        coins.nVersion = undo.nVersion;
     } else {
-        if (coins->IsPruned())
+        if (coins.IsPruned())
             fClean = fClean && error("%s: undo data adding output to missing transaction", __func__);
     }
-    if (coins->IsAvailable(out.n))
+    if (coins.IsAvailable(n))
         fClean = fClean && error("%s: undo data overwriting existing output", __func__);
-    if (coins->vout.size() < out.n + 1)
-        coins->vout.resize(out.n + 1);
-    coins->vout[out.n] = undo.txout;
+    if (coins.vout.size() < n + 1)
+        coins.vout.resize(n + 1);
+    coins.vout[n] = undo.txout;
 
     return fClean;
 }
 
-bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockIndex* pindex, CCoinsViewCache& view, bool* pfClean)
+namespace {
+/** A spent output to restore when disconnecting a block. */
+struct CTxInRestore {
+    const COutPoint* pout;
+    const CTxInUndo* pundo;
+    const uint256* phashSpender;
+    unsigned int nIn;
+};
+
+bool CompareRestoreByTxid(const CTxInRestore& a, const CTxInRestore& b)
+{
+    return a.pout->hash < b.pout->hash;
+}
+}
+
+bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockIndex* pindex, CCoinsViewCache& view, bool* pfClean, CAddressIndexUpdate* pAddressIndex)
 {
     assert(pindex->GetBlockHash() == view.GetBestBlock());
 
@@ -1865,19 +2362,39 @@ bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockI
 
     bool fClean = true;
 
-    CBlockUndo blockUndo;
-    CDiskBlockPos pos = pindex->GetUndoPos();
-    if (pos.IsNull())
-        return error("DisconnectBlock(): no undo data available");
-    if (!UndoReadFromDisk(blockUndo, pos, pindex->pprev->GetBlockHash()))
-        return error("DisconnectBlock(): failure reading undo data");
+    std::shared_ptr<const CBlockUndo> pblockUndoCached = recentUndo.Get(pindex->GetBlockHash());
+    CBlockUndo blockUndoDisk;
+    if (!pblockUndoCached) {
+        CDiskBlockPos pos = pindex->GetUndoPos();
+        if (pos.IsNull())
+            return error("DisconnectBlock(): no undo data available");
+        if (!UndoReadFromDisk(blockUndoDisk, pos, pindex->pprev->GetBlockHash()))
+            return error("DisconnectBlock(): failure reading undo data");
+    }
+    const CBlockUndo& blockUndo = pblockUndoCached ? *pblockUndoCached : blockUndoDisk;
 
     if (blockUndo.vtxundo.size() + 1 != block.vtx.size())
         return error("DisconnectBlock(): block and undo data inconsistent");
 
+    // Outputs created earlier in this block are restored as their spenders are disconnected, so the
+    // transaction that created them is seen whole again before it is removed. All other spent outputs
+    // are collected in reverse spend order and restored afterwards, one cache lookup per transaction.
+    std::set<uint256> setBlockTxids;
+    for (const auto& ptx : block.vtx)
+        setBlockTxids.insert(ptx->GetHash());
+    std::vector<CTxInRestore> vRestore;
+
+    auto addSpentToAddressIndex = [&](const CTxInRestore& restore) {
+        const CTxOut& prevout = restore.pundo->txout;
+        const CCoins* coins = view.AccessCoins(restore.pout->hash);
+        const uint160 hashScript = GetAddressIndexHash(prevout.scriptPubKey);
+        pAddressIndex->vHistory.push_back(std::make_pair(CAddressHistoryKey(hashScript, pindex->nHeight, *restore.phashSpender, restore.nIn, true), -prevout.nValue));
+        pAddressIndex->vUnspent.push_back(std::make_pair(CAddressUnspentKey(hashScript, restore.pout->hash, restore.pout->n), CAddressUnspentValue(prevout.nValue, prevout.scriptPubKey, coins ? coins->nHeight : restore.pundo->nHeight)));
+    };
+
     for (int i = block.vtx.size() - 1; i >= 0; i--) {
-        const CTransaction& tx = block.vtx[i];
-        uint256 hash = tx.GetHash();
+        const CTransaction& tx = *(block.vtx[i]);
+        const uint256& hash = tx.GetHash();
 
         {
             CCoinsModifier outs = view.ModifyCoins(hash);
@@ -1893,19 +2410,54 @@ bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockI
             outs->Clear();
         }
 
+        if (pAddressIndex) {
+            for (unsigned int k = tx.vout.size(); k-- > 0;) {
+                const CTxOut& out = tx.vout[k];
+                if (out.scriptPubKey.IsUnspendable())
+                    continue;
+                const uint160 hashScript = GetAddressIndexHash(out.scriptPubKey);
+                pAddressIndex->vHistory.push_back(std::make_pair(CAddressHistoryKey(hashScript, pindex->nHeight, hash, k, false), out.nValue));
+                pAddressIndex->vUnspent.push_back(std::make_pair(CAddressUnspentKey(hashScript, hash, k), CAddressUnspentValue()));
+            }
+        }
+
         if (i > 0) { // not coinbases
             const CTxUndo& txundo = blockUndo.vtxundo[i - 1];
             if (txundo.vprevout.size() != tx.vin.size())
                 return error("DisconnectBlock(): transaction and undo data inconsistent");
             for (unsigned int j = tx.vin.size(); j-- > 0;) {
-                const COutPoint& out = tx.vin[j].prevout;
-                const CTxInUndo& undo = txundo.vprevout[j];
-                if (!ApplyTxInUndo(undo, view, out))
-                    fClean = false;
+                CTxInRestore restore = {&tx.vin[j].prevout, &txundo.vprevout[j], &hash, j};
+                if (!setBlockTxids.count(restore.pout->hash)) {
+                    vRestore.push_back(restore);
+                    continue;
+                }
+                {
+                    CCoinsModifier coins = view.ModifyCoins(restore.pout->hash);
+                    if (!ApplyTxInUndo(*restore.pundo, *coins, restore.pout->n))
+                        fClean = false;
+                }
+                if (pAddressIndex)
+                    addSpentToAddressIndex(restore);
             }
         }
     }
 
+    // A stable sort keeps reverse spend order per transaction, so the output whose spend pruned the
+    // transaction, and which carries its metadata, is restored first.
+    std::stable_sort(vRestore.begin(), vRestore.end(), CompareRestoreByTxid);
+    for (size_t i = 0; i < vRestore.size();) {
+        const uint256& hashPrev = vRestore[i].pout->hash;
+        CCoinsModifier coins = view.ModifyCoins(hashPrev);
+        for (; i < vRestore.size() && vRestore[i].pout->hash == hashPrev; ++i) {
+            if (!ApplyTxInUndo(*vRestore[i].pundo, *coins, vRestore[i].pout->n))
+                fClean = false;
+        }
+    }
+    if (pAddressIndex) {
+        BOOST_FOREACH (const CTxInRestore& restore, vRestore)
+            addSpentToAddressIndex(restore);
+    }
+
     view.SetBestBlock(pindex->pprev->GetBlockHash());
 
     if (pfClean) {
@@ -2001,7 +2553,7 @@ static int64_t nTimeCallbacks = 0;
 static int64_t nTimeTotal = 0;
 
 bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex,
-                  CCoinsViewCache& view, const CChainParams& chainparams, bool fJustCheck)
+                  CCoinsViewCache& view, const CChainParams& chainparams, bool fJustCheck, CAddressIndexUpdate* pAddressIndex)
 {
     AssertLockHeld(cs_main);
 
@@ -2039,7 +2591,8 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     fEnforceBIP30 = fEnforceBIP30 && (!pindexBIP34height || !(pindexBIP34height->GetBlockHash() == chainparams.GetConsensus().BIP34Hash));
 
     if (fEnforceBIP30) {
-        BOOST_FOREACH (const CTransaction& tx, block.vtx) {
+        for (const auto& ptx : block.vtx) {
+            const CTransaction& tx = *ptx;
             const CCoins* coins = view.AccessCoins(tx.GetHash());
             if (coins && !coins->IsPruned())
                 return state.DoS(100, error("ConnectBlock(): tried to overwrite transaction"),
@@ -2083,14 +2636,11 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     CAmount nFees = 0;
     int nInputs = 0;
     int64_t nSigOpsCost = 0;
-    CDiskTxPos pos(pindex->GetBlockPos(), GetSizeOfCompactSize(block.vtx.size()));
-    std::vector<std::pair<uint256, CDiskTxPos> > vPos;
-    vPos.reserve(block.vtx.size());
     blockundo.vtxundo.reserve(block.vtx.size() - 1);
     std::vector<PrecomputedTransactionData> txdata;
     txdata.reserve(block.vtx.size()); // Required so that pointers to individual PrecomputedTransactionData don't get invalidated
     for (unsigned int i = 0; i < block.vtx.size(); i++) {
-        const CTransaction& tx = block.vtx[i];
+        const CTransaction& tx = *(block.vtx[i]);
 
         nInputs += tx.vin.size();
 
@@ -2109,7 +2659,7 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
                 if (itByPrev == mapOrphanTransactionsByPrev.end())
                     continue;
                 for (auto mi = itByPrev->second.begin(); mi != itByPrev->second.end(); ++mi) {
-                    const CTransaction& orphanTx = (*mi)->second.tx;
+                    const CTransaction& orphanTx = *(*mi)->second.tx;
                     const uint256& orphanHash = orphanTx.GetHash();
                     vOrphanErase.push_back(orphanHash);
                 }
@@ -2138,24 +2688,43 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
             control.Add(vChecks);
         }
 
+        if (pAddressIndex) {
+            const uint256& hash = tx.GetHash();
+            if (!tx.IsCoinBase()) {
+                for (unsigned int j = 0; j < tx.vin.size(); j++) {
+                    const COutPoint& prevout = tx.vin[j].prevout;
+                    const CCoins* coins = view.AccessCoins(prevout.hash);
+                    const CTxOut& out = coins->vout[prevout.n];
+                    const uint160 hashScript = GetAddressIndexHash(out.scriptPubKey);
+                    pAddressIndex->vHistory.push_back(std::make_pair(CAddressHistoryKey(hashScript, pindex->nHeight, hash, j, true), -out.nValue));
+                    pAddressIndex->vUnspent.push_back(std::make_pair(CAddressUnspentKey(hashScript, prevout.hash, prevout.n), CAddressUnspentValue()));
+                }
+            }
+            for (unsigned int k = 0; k < tx.vout.size(); k++) {
+                const CTxOut& out = tx.vout[k];
+                if (out.scriptPubKey.IsUnspendable())
+                    continue;
+                const uint160 hashScript = GetAddressIndexHash(out.scriptPubKey);
+                pAddressIndex->vHistory.push_back(std::make_pair(CAddressHistoryKey(hashScript, pindex->nHeight, hash, k, false), out.nValue));
+                pAddressIndex->vUnspent.push_back(std::make_pair(CAddressUnspentKey(hashScript, hash, k), CAddressUnspentValue(out.nValue, out.scriptPubKey, pindex->nHeight)));
+            }
+        }
+
         CTxUndo undoDummy;
         if (i > 0) {
             blockundo.vtxundo.push_back(CTxUndo());
         }
         UpdateCoins(tx, view, i == 0 ? undoDummy : blockundo.vtxundo.back(), pindex->nHeight);
-
-        vPos.push_back(std::make_pair(tx.GetHash(), pos));
-        pos.nTxOffset += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
     }
     int64_t nTime3 = GetTimeMicros();
     nTimeConnect += nTime3 - nTime2;
     LogPrint("bench", "      - Connect %u transactions: %.2fms (%.3fms/tx, %.3fms/txin) [%.2fs]\n", (unsigned)block.vtx.size(), 0.001 * (nTime3 - nTime2), 0.001 * (nTime3 - nTime2) / block.vtx.size(), nInputs <= 1 ? 0 : 0.001 * (nTime3 - nTime2) / (nInputs - 1), nTimeConnect * 0.000001);
 
     CAmount blockReward = nFees + GetBlockSubsidy(pindex->nHeight, chainparams.GetConsensus());
-    if (block.vtx[0].GetValueOut() > blockReward)
+    if (block.vtx[0]->GetValueOut() > blockReward)
         return state.DoS(100,
                          error("ConnectBlock(): coinbase pays too much (actual=%d vs limit=%d)",
-                               block.vtx[0].GetValueOut(), blockReward),
+                               block.vtx[0]->GetValueOut(), blockReward),
                          REJECT_INVALID, "bad-cb-amount");
 
     if (!control.Wait())
@@ -2182,10 +2751,7 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         pindex->RaiseValidity(BLOCK_VALID_SCRIPTS);
         setDirtyBlockIndex.insert(pindex);
     }
-
-    if (fTxIndex)
-        if (!pblocktree->WriteTxIndex(vPos))
-            return AbortNode(state, "Failed to write transaction index");
+    recentUndo.Add(pindex->GetBlockHash(), std::move(blockundo), StartupConfig().nUndoCacheBlocks);
 
     view.SetBestBlock(pindex->GetBlockHash());
 
@@ -2195,7 +2761,7 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 
     static uint256 hashPrevBestCoinBase;
     GetMainSignals().UpdatedTransaction(hashPrevBestCoinBase);
-    hashPrevBestCoinBase = block.vtx[0].GetHash();
+    hashPrevBestCoinBase = block.vtx[0]->GetHash();
 
     if (vOrphanErase.size()) {
         int nErased = 0;
@@ -2404,8 +2970,11 @@ bool static DisconnectTip(CValidationState& state, const CChainParams& chainpara
     int64_t nStart = GetTimeMicros();
     {
         CCoinsViewCache view(pcoinsTip);
-        if (!DisconnectBlock(block, state, pindexDelete, view))
+        CAddressIndexUpdate addressIndex;
+        if (!DisconnectBlock(block, state, pindexDelete, view, NULL, fAddressIndex ? &addressIndex : NULL))
             return error("DisconnectTip(): DisconnectBlock %s failed", pindexDelete->GetBlockHash().ToString());
+        if (fAddressIndex && !pblocktree->UpdateAddressIndex(addressIndex, true))
+            return AbortNode(state, "Failed to write address index");
         assert(view.Flush());
     }
     LogPrint("bench", "- Disconnect block: %.2fms\n", (GetTimeMicros() - nStart) * 0.001);
@@ -2416,11 +2985,11 @@ bool static DisconnectTip(CValidationState& state, const CChainParams& chainpara
     if (!fBare) {
 
         std::vector<uint256> vHashUpdate;
-        BOOST_FOREACH (const CTransaction& tx, block.vtx) {
-
-            list<CTransaction> removed;
+        for (const auto& ptx : block.vtx) {
+            const CTransaction& tx = *ptx;
+            list<CTransactionRef> removed;
             CValidationState stateDummy;
-            if (tx.IsCoinBase() || !AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL, true)) {
+            if (tx.IsCoinBase() || !AcceptToMemoryPool(mempool, stateDummy, ptx, false, NULL, true)) {
                 mempool.removeRecursive(tx, removed);
             } else if (mempool.exists(tx.GetHash())) {
                 vHashUpdate.push_back(tx.GetHash());
@@ -2432,8 +3001,9 @@ bool static DisconnectTip(CValidationState& state, const CChainParams& chainpara
 
     UpdateTip(pindexDelete->pprev, chainparams);
 
-    BOOST_FOREACH (const CTransaction& tx, block.vtx) {
-        SyncWithWallets(tx, pindexDelete->pprev, NULL);
+    GetMainSignals().BlockDisconnected(block, pindexDelete);
+    for (const auto& tx : block.vtx) {
+        SyncWithWallets(*tx, pindexDelete->pprev, NULL);
     }
     return true;
 }
@@ -2466,13 +3036,16 @@ bool static ConnectTip(CValidationState& state, const CChainParams& chainparams,
     LogPrint("bench", "  - Load block from disk: %.2fms [%.2fs]\n", (nTime2 - nTime1) * 0.001, nTimeReadFromDisk * 0.000001);
     {
         CCoinsViewCache view(pcoinsTip);
-        bool rv = ConnectBlock(*pblock, state, pindexNew, view, chainparams);
+        CAddressIndexUpdate addressIndex;
+        bool rv = ConnectBlock(*pblock, state, pindexNew, view, chainparams, false, fAddressIndex ? &addressIndex : NULL);
         GetMainSignals().BlockChecked(*pblock, state);
         if (!rv) {
             if (state.IsInvalid())
                 InvalidBlockFound(pindexNew, state);
             return error("ConnectTip(): ConnectBlock %s failed", pindexNew->GetBlockHash().ToString());
         }
+        if (fAddressIndex && !pblocktree->UpdateAddressIndex(addressIndex, false))
+            return AbortNode(state, "Failed to write address index");
         mapBlockSource.erase(pindexNew->GetBlockHash());
         nTime3 = GetTimeMicros();
         nTimeConnectTotal += nTime3 - nTime2;
@@ -2489,17 +3062,18 @@ bool static ConnectTip(CValidationState& state, const CChainParams& chainparams,
     nTimeChainState += nTime5 - nTime4;
     LogPrint("bench", "  - Writing chainstate: %.2fms [%.2fs]\n", (nTime5 - nTime4) * 0.001, nTimeChainState * 0.000001);
 
-    list<CTransaction> txConflicted;
+    list<CTransactionRef> txConflicted;
     mempool.removeForBlock(pblock->vtx, pindexNew->nHeight, txConflicted, !IsInitialBlockDownload());
 
     UpdateTip(pindexNew, chainparams);
 
-    BOOST_FOREACH (const CTransaction& tx, txConflicted) {
-        SyncWithWallets(tx, pindexNew, NULL);
+    GetMainSignals().BlockConnected(*pblock, pindexNew);
+    for (const auto& ptx : txConflicted) {
+        SyncWithWallets(*ptx, pindexNew, NULL);
     }
 
-    BOOST_FOREACH (const CTransaction& tx, pblock->vtx) {
-        SyncWithWallets(tx, pindexNew, pblock);
+    for (const auto& tx : pblock->vtx) {
+        SyncWithWallets(*tx, pindexNew, pblock);
     }
 
     int64_t nTime6 = GetTimeMicros();
@@ -2821,26 +3395,22 @@ bool ResetBlockFailureFlags(CBlockIndex* pindex)
     return true;
 }
 
-CBlockIndex* AddToBlockIndex(const CBlockHeader& block)
+CBlockIndex* AddToBlockIndex(const CBlockHeader& block, const uint256& hash)
 {
-
-    uint256 hash = block.GetHash();
     BlockMap::iterator it = mapBlockIndex.find(hash);
     if (it != mapBlockIndex.end())
         return it->second;
 
-    CBlockIndex* pindexNew = new CBlockIndex(block);
-    assert(pindexNew);
+    CBlockIndex* pindexNew = mapBlockIndex.insert(hash, CBlockIndex(block)).first;
 
     pindexNew->nSequenceId = 0;
-    BlockMap::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
-    pindexNew->phashBlock = &((*mi).first);
     BlockMap::iterator miPrev = mapBlockIndex.find(block.hashPrevBlock);
     if (miPrev != mapBlockIndex.end()) {
         pindexNew->pprev = (*miPrev).second;
         pindexNew->nHeight = pindexNew->pprev->nHeight + 1;
         pindexNew->BuildSkip();
     }
+    pindexNew->BuildContextualFields(Params().GetConsensus());
     pindexNew->nChainWork = (pindexNew->pprev ? pindexNew->pprev->nChainWork : 0) + GetBlockProof(*pindexNew);
     pindexNew->RaiseValidity(BLOCK_VALID_TREE);
     if (pindexBestHeader == NULL || pindexBestHeader->nChainWork < pindexNew->nChainWork)
@@ -2985,7 +3555,12 @@ bool FindUndoPos(CValidationState& state, int nFile, CDiskBlockPos& pos, unsigne
     return true;
 }
 
-bool CheckBlockHeader(const CBlock& block, CValidationState& state, const Consensus::Params& consensusParams, bool fCheckPOW)
+CBlockIndex* AddToBlockIndex(const CBlockHeader& block)
+{
+    return AddToBlockIndex(block, block.GetHash());
+}
+
+bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, const Consensus::Params& consensusParams, bool fCheckPOW)
 {
 
     if (fCheckPOW && !CheckProofOfWork(block.GetPoWHash(), block.nBits, consensusParams))
@@ -3016,19 +3591,20 @@ bool CheckBlock(const CBlock& block, CValidationState& state, const Consensus::P
     if (block.vtx.empty() || block.vtx.size() > MAX_BLOCK_BASE_SIZE || ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION | SERIALIZE_TRANSACTION_NO_WITNESS) > MAX_BLOCK_BASE_SIZE)
         return state.DoS(100, false, REJECT_INVALID, "bad-blk-length", false, "size limits failed");
 
-    if (block.vtx.empty() || !block.vtx[0].IsCoinBase())
+    if (block.vtx.empty() || !block.vtx[0]->IsCoinBase())
         return state.DoS(100, false, REJECT_INVALID, "bad-cb-missing", false, "first tx is not coinbase");
     for (unsigned int i = 1; i < block.vtx.size(); i++)
-        if (block.vtx[i].IsCoinBase())
+        if (block.vtx[i]->IsCoinBase())
             return state.DoS(100, false, REJECT_INVALID, "bad-cb-multiple", false, "more than one coinbase");
 
-    BOOST_FOREACH (const CTransaction& tx, block.vtx)
-        if (!CheckTransaction(tx, state))
+    for (const auto& tx : block.vtx)
+        if (!CheckTransaction(*tx, state))
             return state.Invalid(false, state.GetRejectCode(), state.GetRejectReason(),
-                                 strprintf("Transaction check failed (tx hash %s) %s", tx.GetHash().ToString(), state.GetDebugMessage()));
+                                 strprintf("Transaction check failed (tx hash %s) %s", tx->GetHash().ToString(), state.GetDebugMessage()));
 
     unsigned int nSigOps = 0;
-    BOOST_FOREACH (const CTransaction& tx, block.vtx) {
+    for (const auto& ptx : block.vtx) {
+        const CTransaction& tx = *ptx;
         nSigOps += GetLegacySigOpCount(tx);
     }
     if (nSigOps * WITNESS_SCALE_FACTOR > MAX_BLOCK_SIGOPS_COST)
@@ -3066,8 +3642,8 @@ bool IsWitnessEnabled(const CBlockIndex* pindexPrev, const Consensus::Params& pa
 static int GetWitnessCommitmentIndex(const CBlock& block)
 {
     int commitpos = -1;
-    for (size_t o = 0; o < block.vtx[0].vout.size(); o++) {
-        if (block.vtx[0].vout[o].scriptPubKey.size() >= 38 && block.vtx[0].vout[o].scriptPubKey[0] == OP_RETURN && block.vtx[0].vout[o].scriptPubKey[1] == 0x24 && block.vtx[0].vout[o].scriptPubKey[2] == 0xaa && block.vtx[0].vout[o].scriptPubKey[3] == 0x21 && block.vtx[0].vout[o].scriptPubKey[4] == 0xa9 && block.vtx[0].vout[o].scriptPubKey[5] == 0xed) {
+    for (size_t o = 0; o < block.vtx[0]->vout.size(); o++) {
+        if (block.vtx[0]->vout[o].scriptPubKey.size() >= 38 && block.vtx[0]->vout[o].scriptPubKey[0] == OP_RETURN && block.vtx[0]->vout[o].scriptPubKey[1] == 0x24 && block.vtx[0]->vout[o].scriptPubKey[2] == 0xaa && block.vtx[0]->vout[o].scriptPubKey[3] == 0x21 && block.vtx[0]->vout[o].scriptPubKey[4] == 0xa9 && block.vtx[0]->vout[o].scriptPubKey[5] == 0xed) {
             commitpos = o;
         }
     }
@@ -3078,10 +3654,12 @@ void UpdateUncommittedBlockStructures(CBlock& block, const CBlockIndex* pindexPr
 {
     int commitpos = GetWitnessCommitmentIndex(block);
     static const std::vector<unsigned char> nonce(32, 0x00);
-    if (commitpos != -1 && IsWitnessEnabled(pindexPrev, consensusParams) && block.vtx[0].wit.IsEmpty()) {
-        block.vtx[0].wit.vtxinwit.resize(1);
-        block.vtx[0].wit.vtxinwit[0].scriptWitness.stack.resize(1);
-        block.vtx[0].wit.vtxinwit[0].scriptWitness.stack[0] = nonce;
+    if (commitpos != -1 && IsWitnessEnabled(pindexPrev, consensusParams) && block.vtx[0]->wit.IsEmpty()) {
+        CMutableTransaction tx(*block.vtx[0]);
+        tx.wit.vtxinwit.resize(1);
+        tx.wit.vtxinwit[0].scriptWitness.stack.resize(1);
+        tx.wit.vtxinwit[0].scriptWitness.stack[0] = nonce;
+        block.vtx[0] = MakeTransactionRef(std::move(tx));
     }
 }
 
@@ -3091,7 +3669,7 @@ std::vector<unsigned char> GenerateCoinbaseCommitment(CBlock& block, const CBloc
     int commitpos = GetWitnessCommitmentIndex(block);
     bool fHaveWitness = false;
     for (size_t t = 1; t < block.vtx.size(); t++) {
-        if (!block.vtx[t].wit.IsNull()) {
+        if (!block.vtx[t]->wit.IsNull()) {
             fHaveWitness = true;
             break;
         }
@@ -3112,8 +3690,9 @@ std::vector<unsigned char> GenerateCoinbaseCommitment(CBlock& block, const CBloc
             out.scriptPubKey[5] = 0xed;
             memcpy(&out.scriptPubKey[6], witnessroot.begin(), 32);
             commitment = std::vector<unsigned char>(out.scriptPubKey.begin(), out.scriptPubKey.end());
-            const_cast<std::vector<CTxOut>*>(&block.vtx[0].vout)->push_back(out);
-            block.vtx[0].UpdateHash();
+            CMutableTransaction tx(*block.vtx[0]);
+            tx.vout.push_back(out);
+            block.vtx[0] = MakeTransactionRef(std::move(tx));
         }
     }
     UpdateUncommittedBlockStructures(block, pindexPrev, consensusParams);
@@ -3129,7 +3708,7 @@ bool ContextualCheckBlockHeader(const CBlockHeader& block, CValidationState& sta
     if (block.GetBlockTime() <= pindexPrev->GetMedianTimePast(pindexPrev->nHeight))
         return state.Invalid(false, REJECT_INVALID, "time-too-old", "block's timestamp is too early");
 
-    if (pindexPrev->nHeight > (GetBoolArg("-testnet", false) ? 446500 : 437500)) {
+    if (pindexPrev->nHeight > consensusParams.nShortMedianTimeSpanHeight) {
         if (block.GetBlockTime() > nAdjustedTime + 60)
             return state.Invalid(false, REJECT_INVALID, "time-too-new", strprintf("block timestamp too far in the future block:%u adjusted:%u system:%u offset:%u", block.GetBlockTime(), nAdjustedTime, GetTime(), GetTimeOffset()));
     } else {
@@ -3159,15 +3738,15 @@ bool ContextualCheckBlock(const CBlock& block, CValidationState& state, CBlockIn
                                   ? pindexPrev->GetMedianTimePast(pindexPrev->nHeight)
                                   : block.GetBlockTime();
 
-    BOOST_FOREACH (const CTransaction& tx, block.vtx) {
-        if (!IsFinalTx(tx, nHeight, nLockTimeCutoff)) {
+    for (const auto& tx : block.vtx) {
+        if (!IsFinalTx(*tx, nHeight, nLockTimeCutoff)) {
             return state.DoS(10, false, REJECT_INVALID, "bad-txns-nonfinal", false, "non-final transaction");
         }
     }
 
     if (block.nVersion >= 2 && IsSuperMajority(2, pindexPrev, consensusParams.nMajorityEnforceBlockUpgrade, consensusParams)) {
         CScript expect = CScript() << nHeight;
-        if (block.vtx[0].vin[0].scriptSig.size() < expect.size() || !std::equal(expect.begin(), expect.end(), block.vtx[0].vin[0].scriptSig.begin())) {
+        if (block.vtx[0]->vin[0].scriptSig.size() < expect.size() || !std::equal(expect.begin(), expect.end(), block.vtx[0]->vin[0].scriptSig.begin())) {
             return state.DoS(100, false, REJECT_INVALID, "bad-cb-height", false, "block height mismatch in coinbase");
         }
     }
@@ -3179,11 +3758,11 @@ bool ContextualCheckBlock(const CBlock& block, CValidationState& state, CBlockIn
             bool malleated = false;
             uint256 hashWitness = BlockWitnessMerkleRoot(block, &malleated);
 
-            if (block.vtx[0].wit.vtxinwit.size() != 1 || block.vtx[0].wit.vtxinwit[0].scriptWitness.stack.size() != 1 || block.vtx[0].wit.vtxinwit[0].scriptWitness.stack[0].size() != 32) {
+            if (block.vtx[0]->wit.vtxinwit.size() != 1 || block.vtx[0]->wit.vtxinwit[0].scriptWitness.stack.size() != 1 || block.vtx[0]->wit.vtxinwit[0].scriptWitness.stack[0].size() != 32) {
                 return state.DoS(100, error("%s : invalid witness nonce size", __func__), REJECT_INVALID, "bad-witness-nonce-size", true);
             }
-            CHash256().Write(hashWitness.begin(), 32).Write(&block.vtx[0].wit.vtxinwit[0].scriptWitness.stack[0][0], 32).Finalize(hashWitness.begin());
-            if (memcmp(hashWitness.begin(), &block.vtx[0].vout[commitpos].scriptPubKey[6], 32)) {
+            CHash256().Write(hashWitness.begin(), 32).Write(&block.vtx[0]->wit.vtxinwit[0].scriptWitness.stack[0][0], 32).Finalize(hashWitness.begin());
+            if (memcmp(hashWitness.begin(), &block.vtx[0]->vout[commitpos].scriptPubKey[6], 32)) {
                 return state.DoS(100, error("%s : witness merkle commitment mismatch", __func__), REJECT_INVALID, "bad-witness-merkle-match", true);
             }
             fHaveWitness = true;
@@ -3192,7 +3771,7 @@ bool ContextualCheckBlock(const CBlock& block, CValidationState& state, CBlockIn
 
     if (!fHaveWitness) {
         for (size_t i = 0; i < block.vtx.size(); i++) {
-            if (!block.vtx[i].wit.IsNull()) {
+            if (!block.vtx[i]->wit.IsNull()) {
                 return state.DoS(100, error("%s : unexpected witness data found", __func__), REJECT_INVALID, "unexpected-witness", true);
             }
         }
@@ -3205,11 +3784,14 @@ bool ContextualCheckBlock(const CBlock& block, CValidationState& state, CBlockIn
     return true;
 }
 
-static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex = NULL)
+/**
+ * Add a header to the block index. hash is the header's hash; when fCheckPOW is
+ * false the caller has already checked the proof of work.
+ */
+static bool AcceptBlockHeader(const CBlockHeader& block, const uint256& hash, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex, bool fCheckPOW)
 {
     AssertLockHeld(cs_main);
 
-    uint256 hash = block.GetHash();
     BlockMap::iterator miSelf = mapBlockIndex.find(hash);
     CBlockIndex* pindex = NULL;
     if (hash != chainparams.GetConsensus().hashGenesisBlock) {
@@ -3224,7 +3806,7 @@ static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state
             return true;
         }
 
-        if (!CheckBlockHeader(block, state, chainparams.GetConsensus()))
+        if (!CheckBlockHeader(block, state, chainparams.GetConsensus(), fCheckPOW))
             return error("%s: Consensus::CheckBlockHeader: %s, %s", __func__, hash.ToString(), FormatStateMessage(state));
 
         CBlockIndex* pindexPrev = NULL;
@@ -3243,7 +3825,7 @@ static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state
             return error("%s: Consensus::ContextualCheckBlockHeader: %s, %s", __func__, hash.ToString(), FormatStateMessage(state));
     }
     if (pindex == NULL)
-        pindex = AddToBlockIndex(block);
+        pindex = AddToBlockIndex(block, hash);
 
     if (ppindex)
         *ppindex = pindex;
@@ -3251,10 +3833,52 @@ static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state
     return true;
 }
 
-/** Store block on disk. If dbp is non-NULL, the file is known to already reside on disk */
-static bool AcceptBlock(const CBlock& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex, bool fRequested, const CDiskBlockPos* dbp, bool* fNewBlock)
+static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex = NULL)
 {
-    if (fNewBlock)
+    return AcceptBlockHeader(block, block.GetHash(), state, chainparams, ppindex, true);
+}
+
+bool ProcessNewBlockHeaders(const std::vector<CBlockHeader>& headers, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex)
+{
+    std::vector<uint256> vHashes;
+    vHashes.reserve(headers.size());
+    for (size_t i = 0; i < headers.size(); i++) {
+        if (i > 0 && headers[i].hashPrevBlock != vHashes.back())
+            return state.DoS(20, error("%s: non-continuous headers sequence", __func__), 0, "bad-headers-sequence");
+        vHashes.push_back(headers[i].GetHash());
+    }
+
+    // Peers commonly resend headers we have; only the ones after those need their proof of work checked.
+    size_t nFirstNew = 0;
+    {
+        LOCK(cs_main);
+        while (nFirstNew < vHashes.size() && mapBlockIndex.count(vHashes[nFirstNew]))
+            nFirstNew++;
+    }
+
+    // The scrypt proof of work dominates header validation; check it without holding cs_main.
+    size_t nChecked = nFirstNew;
+    for (; nChecked < headers.size(); nChecked++) {
+        if (vHashes[nChecked] == chainparams.GetConsensus().hashGenesisBlock)
+            continue;
+        if (!CheckBlockHeader(headers[nChecked], state, chainparams.GetConsensus(), true)) {
+            error("%s: Consensus::CheckBlockHeader: %s, %s", __func__, vHashes[nChecked].ToString(), FormatStateMessage(state));
+            break;
+        }
+    }
+
+    LOCK(cs_main);
+    for (size_t i = 0; i < nChecked; i++) {
+        if (!AcceptBlockHeader(headers[i], vHashes[i], state, chainparams, ppindex, false))
+            return false;
+    }
+    return nChecked == headers.size();
+}
+
+/** Store block on disk. If dbp is non-NULL, the file is known to already reside on disk */
+static bool AcceptBlock(const CBlock& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex, bool fRequested, const CDiskBlockPos* dbp, bool* fNewBlock)
+{
+    if (fNewBlock)
         *fNewBlock = false;
     AssertLockHeld(cs_main);
 
@@ -3317,16 +3941,10 @@ static bool AcceptBlock(const CBlock& block, CValidationState& state, const CCha
 
 static bool IsSuperMajority(int minVersion, const CBlockIndex* pstart, unsigned nRequired, const Consensus::Params& consensusParams)
 {
-    if (pstart->nHeight < (GetBoolArg("-testnet", false) ? 446500 : 434500))
+    if (pstart->nHeight < consensusParams.nSuperMajorityStartHeight)
         return false;
 
-    unsigned int nFound = 0;
-    for (int i = 0; i < consensusParams.nMajorityWindow && nFound < nRequired && pstart != NULL; i++) {
-        if (pstart->nVersion >= minVersion)
-            ++nFound;
-        pstart = pstart->pprev;
-    }
-    return (nFound >= nRequired);
+    return pstart->CountVersionAtLeast(minVersion, consensusParams) >= nRequired;
 }
 
 bool ProcessNewBlock(CValidationState& state, const CChainParams& chainparams, CNode* pfrom, const CBlock* pblock, bool fForceProcessing, const CDiskBlockPos* dbp)
@@ -3436,6 +4054,7 @@ void UnlinkPrunedFiles(std::set<int>& setFilesToPrune)
 {
     for (set<int>::iterator it = setFilesToPrune.begin(); it != setFilesToPrune.end(); ++it) {
         CDiskBlockPos pos(*it, 0);
+        UnmapBlockFile(*it);
         boost::filesystem::remove(GetBlockPosFilename(pos, "blk"));
         boost::filesystem::remove(GetBlockPosFilename(pos, "rev"));
         LogPrintf("Prune: %s deleted blk/rev (%05u)\n", __func__, *it);
@@ -3540,30 +4159,23 @@ CBlockIndex* InsertBlockIndex(uint256 hash)
     if (hash.IsNull())
         return NULL;
 
-    BlockMap::iterator mi = mapBlockIndex.find(hash);
-    if (mi != mapBlockIndex.end())
-        return (*mi).second;
-
-    CBlockIndex* pindexNew = new CBlockIndex();
-    if (!pindexNew)
-        throw runtime_error(std::string(__func__) + ": new CBlockIndex failed");
-    mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
-    pindexNew->phashBlock = &((*mi).first);
-
-    return pindexNew;
+    return mapBlockIndex.insert(hash, CBlockIndex()).first;
 }
 
 bool static LoadBlockIndexDB()
 {
     const CChainParams& chainparams = Params();
+    int64_t nStart = GetTimeMillis();
     if (!pblocktree->LoadBlockIndexGuts(InsertBlockIndex))
         return false;
+    LogPrintf("%s: loaded %u block index entries in %dms, using %u KiB (%u KiB as individually allocated nodes)\n", __func__,
+              mapBlockIndex.size(), GetTimeMillis() - nStart, mapBlockIndex.DynamicMemoryUsage() >> 10, mapBlockIndex.NodeMapMemoryUsageEstimate() >> 10);
 
     boost::this_thread::interruption_point();
 
     vector<pair<int, CBlockIndex*> > vSortedByHeight;
     vSortedByHeight.reserve(mapBlockIndex.size());
-    BOOST_FOREACH (const PAIRTYPE(uint256, CBlockIndex*)&item, mapBlockIndex) {
+    for (const BlockMap::value_type& item : mapBlockIndex) {
         CBlockIndex* pindex = item.second;
         vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
     }
@@ -3590,6 +4202,7 @@ bool static LoadBlockIndexDB()
             pindexBestInvalid = pindex;
         if (pindex->pprev)
             pindex->BuildSkip();
+        pindex->BuildContextualFields(chainparams.GetConsensus());
         if (pindex->IsValid(BLOCK_VALID_TREE) && (pindexBestHeader == NULL || CBlockIndexWorkComparator()(pindexBestHeader, pindex)))
             pindexBestHeader = pindex;
     }
@@ -3612,7 +4225,7 @@ bool static LoadBlockIndexDB()
 
     LogPrintf("Checking all blk files are present...\n");
     set<int> setBlkDataFiles;
-    BOOST_FOREACH (const PAIRTYPE(uint256, CBlockIndex*)&item, mapBlockIndex) {
+    for (const BlockMap::value_type& item : mapBlockIndex) {
         CBlockIndex* pindex = item.second;
         if (pindex->nStatus & BLOCK_HAVE_DATA) {
             setBlkDataFiles.insert(pindex->nFile);
@@ -3633,8 +4246,12 @@ bool static LoadBlockIndexDB()
     pblocktree->ReadReindexing(fReindexing);
     fReindex |= fReindexing;
 
-    pblocktree->ReadFlag("txindex", fTxIndex);
-    LogPrintf("%s: transaction index %s\n", __func__, fTxIndex ? "enabled" : "disabled");
+    pblocktree->ReadFlag("addressindex", fAddressIndex);
+    LogPrintf("%s: address index %s\n", __func__, fAddressIndex ? "enabled" : "disabled");
+
+    bool fLegacyTxIndex = false;
+    if (!fTxIndex && pblocktree->ReadFlag("txindex", fLegacyTxIndex) && fLegacyTxIndex)
+        LogPrintf("%s: block index database still holds old transaction index entries, they are removed the next time -txindex is enabled\n", __func__);
 
     BlockMap::iterator it = mapBlockIndex.find(pcoinsTip->GetBestBlock());
     if (it == mapBlockIndex.end())
@@ -3668,6 +4285,103 @@ CVerifyDB::~CVerifyDB()
     uiInterface.ShowProgress("", 100);
 }
 
+namespace {
+/** Work shared between the threads checking block and undo data (levels 0 to 2) in VerifyDB. */
+struct CVerifyDBJob {
+    const Consensus::Params& consensusParams;
+    const std::vector<CBlockIndex*>& vIndex;
+    const int nCheckLevel;
+    std::vector<std::string> vError;
+    std::atomic<size_t> nNext;
+    std::atomic<size_t> nDone;
+    //! Position in vIndex of the failure closest to the tip so far; vIndex.size() if none
+    std::atomic<size_t> nFirstFailure;
+    std::atomic<int> nRunning;
+    std::atomic<bool> fStop;
+
+    CVerifyDBJob(const Consensus::Params& consensusParamsIn, const std::vector<CBlockIndex*>& vIndexIn, int nCheckLevelIn)
+        : consensusParams(consensusParamsIn), vIndex(vIndexIn), nCheckLevel(nCheckLevelIn), vError(vIndexIn.size()),
+          nNext(0), nDone(0), nFirstFailure(vIndexIn.size()), nRunning(0), fStop(false) {}
+
+    void Fail(size_t n, const std::string& strError)
+    {
+        vError[n] = strError;
+        size_t nFirst = nFirstFailure.load();
+        while (n < nFirst && !nFirstFailure.compare_exchange_weak(nFirst, n)) {}
+    }
+};
+
+bool VerifyBlockData(CVerifyDBJob& job, const CBlockIndex* pindex, std::string& strError)
+{
+    CBlock block;
+    if (!ReadBlockFromDisk(block, pindex, job.consensusParams)) {
+        strError = strprintf("ReadBlockFromDisk failed at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
+        return false;
+    }
+
+    CValidationState state;
+    if (job.nCheckLevel >= 1 && !CheckBlock(block, state, job.consensusParams)) {
+        strError = strprintf("found bad block at %d, hash=%s (%s)", pindex->nHeight, pindex->GetBlockHash().ToString(), FormatStateMessage(state));
+        return false;
+    }
+
+    if (job.nCheckLevel >= 2) {
+        CBlockUndo undo;
+        CDiskBlockPos pos = pindex->GetUndoPos();
+        if (!pos.IsNull() && !UndoReadFromDisk(undo, pos, pindex->pprev->GetBlockHash())) {
+            strError = strprintf("found bad undo data at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
+            return false;
+        }
+    }
+    return true;
+}
+
+void ThreadVerifyDB(CVerifyDBJob* job)
+{
+    RenameThread("Gulden-verifydb");
+    while (!job->fStop) {
+        // Blocks are handed out tip first; once a failure is known nothing further from the tip matters.
+        size_t n = job->nNext++;
+        if (n >= job->vIndex.size() || n > job->nFirstFailure)
+            break;
+        std::string strError;
+        try {
+            if (!VerifyBlockData(*job, job->vIndex[n], strError))
+                job->Fail(n, strError);
+        } catch (const std::exception& e) {
+            job->Fail(n, strprintf("exception verifying block at %d: %s", job->vIndex[n]->nHeight, e.what()));
+        }
+        job->nDone++;
+    }
+    job->nRunning--;
+}
+
+/** Read a block whose proof of work VerifyDB already checked, without hashing it with scrypt again. */
+bool ReadVerifiedBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const CChainParams& chainparams)
+{
+    CRawBlock raw;
+    if (!ReadRawBlockFromDisk(raw, pindex->GetBlockPos(), chainparams.MessageStart()))
+        return false;
+    try {
+        CSpanReader spanin(raw.begin(), raw.end(), SER_DISK, CLIENT_VERSION);
+        spanin >> block;
+    } catch (const std::exception& e) {
+        return error("%s: Deserialize error - %s at %s", __func__, e.what(), pindex->GetBlockPos().ToString());
+    }
+    return block.GetHash() == pindex->GetBlockHash();
+}
+
+void ReportVerifyProgress(int nPercentage, int& nReportDone)
+{
+    nPercentage = std::max(1, std::min(99, nPercentage));
+    if (nReportDone < nPercentage / 10) {
+        LogPrintf("[%d%%]...", nPercentage);
+        nReportDone = nPercentage / 10;
+    }
+    uiInterface.ShowProgress(_("Verifying blocks..."), nPercentage);
+}
+}
+
 bool CVerifyDB::VerifyDB(const CChainParams& chainparams, CCoinsView* coinsview, int nCheckLevel, int nCheckDepth)
 {
     LOCK(cs_main);
@@ -3680,48 +4394,73 @@ bool CVerifyDB::VerifyDB(const CChainParams& chainparams, CCoinsView* coinsview,
         nCheckDepth = chainActive.Height();
     nCheckLevel = std::max(0, std::min(4, nCheckLevel));
     LogPrintf("Verifying last %i blocks at level %i\n", nCheckDepth, nCheckLevel);
-    CCoinsViewCache coins(coinsview);
-    CBlockIndex* pindexState = chainActive.Tip();
-    CBlockIndex* pindexFailure = NULL;
-    int nGoodTransactions = 0;
-    CValidationState state;
-    int reportDone = 0;
-    LogPrintf("[0%]...");
-    for (CBlockIndex* pindex = chainActive.Tip(); pindex && pindex->pprev; pindex = pindex->pprev) {
-        boost::this_thread::interruption_point();
-        int percentageDone = std::max(1, std::min(99, (int)(((double)(chainActive.Height() - pindex->nHeight)) / (double)nCheckDepth * (nCheckLevel >= 4 ? 50 : 100))));
-        if (reportDone < percentageDone / 10) {
 
-            LogPrintf("[%d%%]...", percentageDone);
-            reportDone = percentageDone / 10;
-        }
-        uiInterface.ShowProgress(_("Verifying blocks..."), percentageDone);
+    std::vector<CBlockIndex*> vIndex;
+    for (CBlockIndex* pindex = chainActive.Tip(); pindex && pindex->pprev; pindex = pindex->pprev) {
         if (pindex->nHeight < chainActive.Height() - nCheckDepth)
             break;
         if (fPruneMode && !(pindex->nStatus & BLOCK_HAVE_DATA)) {
-
             LogPrintf("VerifyDB(): block verification stopping at height %d (pruning, no data)\n", pindex->nHeight);
             break;
         }
-        CBlock block;
-
-        if (!ReadBlockFromDisk(block, pindex, chainparams.GetConsensus()))
-            return error("VerifyDB(): *** ReadBlockFromDisk failed at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
+        vIndex.push_back(pindex);
+    }
+    if (vIndex.empty())
+        return true;
 
-        if (nCheckLevel >= 1 && !CheckBlock(block, state, chainparams.GetConsensus()))
-            return error("%s: *** found bad block at %d, hash=%s (%s)\n", __func__,
-                         pindex->nHeight, pindex->GetBlockHash().ToString(), FormatStateMessage(state));
+    // Share of the progress bar taken by each phase: the parallel block and undo checks, the serial
+    // disconnect (level 3) and the serial reconnect (level 4).
+    const int nParallelShare = nCheckLevel >= 4 ? 40 : nCheckLevel >= 3 ? 60 : 100;
+    const int nDisconnectShare = nCheckLevel >= 4 ? 30 : 100 - nParallelShare;
+    int reportDone = 0;
+    LogPrintf("[0%]...");
 
-        if (nCheckLevel >= 2 && pindex) {
-            CBlockUndo undo;
-            CDiskBlockPos pos = pindex->GetUndoPos();
-            if (!pos.IsNull()) {
-                if (!UndoReadFromDisk(undo, pos, pindex->pprev->GetBlockHash()))
-                    return error("VerifyDB(): *** found bad undo data at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
+    // Levels 0 to 2 only look at a single block and its undo data, so they are spread across a thread
+    // pool. Workers never touch chain state; cs_main stays held here so the index cannot change under them.
+    {
+        int64_t nStart = GetTimeMicros();
+        const int nThreads = std::max(1, std::min(GetNumCores(), (int)vIndex.size()));
+        CVerifyDBJob job(chainparams.GetConsensus(), vIndex, nCheckLevel);
+        boost::thread_group threads;
+        job.nRunning = nThreads;
+        for (int i = 0; i < nThreads; ++i)
+            threads.create_thread(boost::bind(&ThreadVerifyDB, &job));
+        try {
+            while (job.nRunning > 0) {
+                boost::this_thread::interruption_point();
+                if (ShutdownRequested())
+                    job.fStop = true;
+                ReportVerifyProgress(job.nDone * nParallelShare / vIndex.size(), reportDone);
+                MilliSleep(50);
             }
+        } catch (...) {
+            job.fStop = true;
+            threads.join_all();
+            throw;
         }
+        threads.join_all();
+        if (ShutdownRequested())
+            return true;
+        if (job.nFirstFailure < vIndex.size())
+            return error("VerifyDB(): *** %s", job.vError[job.nFirstFailure]);
+        LogPrint("bench", "VerifyDB(): checked %u blocks at level %d on %d threads in %.2fms\n", vIndex.size(), std::min(2, nCheckLevel), nThreads, (GetTimeMicros() - nStart) * 0.001);
+    }
 
-        if (nCheckLevel >= 3 && pindex == pindexState && (coins.DynamicMemoryUsage() + pcoinsTip->DynamicMemoryUsage()) <= nCoinCacheUsage) {
+    CCoinsViewCache coins(coinsview);
+    CBlockIndex* pindexState = chainActive.Tip();
+    CBlockIndex* pindexFailure = NULL;
+    int nGoodTransactions = 0;
+    CValidationState state;
+    if (nCheckLevel >= 3) {
+        for (size_t n = 0; n < vIndex.size(); ++n) {
+            boost::this_thread::interruption_point();
+            CBlockIndex* pindex = vIndex[n];
+            if ((coins.DynamicMemoryUsage() + pcoinsTip->DynamicMemoryUsage()) > nCoinCacheUsage)
+                break;
+            ReportVerifyProgress(nParallelShare + n * nDisconnectShare / vIndex.size(), reportDone);
+            CBlock block;
+            if (!ReadVerifiedBlockFromDisk(block, pindex, chainparams))
+                return error("VerifyDB(): *** ReadBlockFromDisk failed at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
             bool fClean = true;
             if (!DisconnectBlock(block, state, pindex, coins, &fClean))
                 return error("VerifyDB(): *** irrecoverable inconsistency in block data at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
@@ -3731,21 +4470,22 @@ bool CVerifyDB::VerifyDB(const CChainParams& chainparams, CCoinsView* coinsview,
                 pindexFailure = pindex;
             } else
                 nGoodTransactions += block.vtx.size();
+            if (ShutdownRequested())
+                return true;
         }
-        if (ShutdownRequested())
-            return true;
     }
     if (pindexFailure)
         return error("VerifyDB(): *** coin database inconsistencies found (last %i blocks, %i good transactions before that)\n", chainActive.Height() - pindexFailure->nHeight + 1, nGoodTransactions);
 
     if (nCheckLevel >= 4) {
         CBlockIndex* pindex = pindexState;
+        const int nDisconnected = chainActive.Height() - pindexState->nHeight;
         while (pindex != chainActive.Tip()) {
             boost::this_thread::interruption_point();
-            uiInterface.ShowProgress(_("Verifying blocks..."), std::max(1, std::min(99, 100 - (int)(((double)(chainActive.Height() - pindex->nHeight)) / (double)nCheckDepth * 50))));
+            ReportVerifyProgress(nParallelShare + nDisconnectShare + (nDisconnected - (chainActive.Height() - pindex->nHeight)) * (100 - nParallelShare - nDisconnectShare) / std::max(1, nDisconnected), reportDone);
             pindex = chainActive.Next(pindex);
             CBlock block;
-            if (!ReadBlockFromDisk(block, pindex, chainparams.GetConsensus()))
+            if (!ReadVerifiedBlockFromDisk(block, pindex, chainparams))
                 return error("VerifyDB(): *** ReadBlockFromDisk failed at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
             if (!ConnectBlock(block, state, pindex, coins, chainparams))
                 return error("VerifyDB(): *** found unconnectable block at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
@@ -3837,8 +4577,7 @@ void UnloadBlockIndex()
     pindexBestInvalid = NULL;
     pindexBestHeader = NULL;
     mempool.clear();
-    mapOrphanTransactions.clear();
-    mapOrphanTransactionsByPrev.clear();
+    ClearOrphans();
     nSyncStarted = 0;
     mapBlocksUnlinked.clear();
     vinfoBlockFile.clear();
@@ -3847,6 +4586,8 @@ void UnloadBlockIndex()
     mapBlockSource.clear();
     mapBlocksInFlight.clear();
     nPreferredDownload = 0;
+    dAverageBlockSize = 0;
+    recentUndo.Clear();
     setDirtyBlockIndex.clear();
     setDirtyFileInfo.clear();
     mapNodeState.clear();
@@ -3856,9 +4597,6 @@ void UnloadBlockIndex()
         warningcache[b].clear();
     }
 
-    BOOST_FOREACH (BlockMap::value_type& entry, mapBlockIndex) {
-        delete entry.second;
-    }
     mapBlockIndex.clear();
     fHavePruned = false;
 }
@@ -3882,8 +4620,8 @@ bool InitBlockIndex(const CChainParams& chainparams)
 
     LogPrintf("Wrote sync checkpoint...\n");
 
-    fTxIndex = GetBoolArg("-txindex", DEFAULT_TXINDEX);
-    pblocktree->WriteFlag("txindex", fTxIndex);
+    fAddressIndex = GetBoolArg("-addressindex", DEFAULT_ADDRESSINDEX);
+    pblocktree->WriteFlag("addressindex", fAddressIndex);
     LogPrintf("Initializing databases...\n");
 
     if (!fReindex) {
@@ -3923,6 +4661,348 @@ bool InitBlockIndex(const CChainParams& chainparams)
     return true;
 }
 
+/** Maximum number of blocks read ahead of the connect stage during import. */
+static const unsigned int IMPORT_MAX_BLOCKS_IN_FLIGHT_PER_WORKER = 16;
+/** Maximum number of raw bytes read ahead of the connect stage during import. */
+static const uint64_t IMPORT_MAX_BYTES_IN_FLIGHT = 128 * 1024 * 1024;
+/** Number of blocks an import worker takes from the queue at once. */
+static const unsigned int IMPORT_CHECK_BATCH_SIZE = 8;
+
+namespace {
+
+/** A block read from an external block file, travelling through the import pipeline. */
+struct CImportedBlock {
+    uint64_t nPos;
+    unsigned int nSize;
+    std::vector<char> vchRaw;
+    CBlock block;
+    uint256 hash;
+    bool fDeserialized;
+    bool fDone;
+    std::string strError;
+
+    CImportedBlock(uint64_t nPosIn, unsigned int nSizeIn) : nPos(nPosIn), nSize(nSizeIn), vchRaw(nSizeIn), fDeserialized(false), fDone(false) {}
+};
+typedef std::shared_ptr<CImportedBlock> CImportedBlockRef;
+
+/**
+ * Staged pipeline used by LoadExternalBlockFile.
+ *
+ * A scanner thread locates block records in the file and copies out their raw
+ * bytes. A pool of worker threads takes batches of records and, for each,
+ * deserializes the block, computes the block hash and runs the context free
+ * checks (scrypt proof of work, merkle root, transaction sanity). Blocks that
+ * pass are marked fChecked so AcceptBlock does not repeat the work. The
+ * caller pulls blocks back out strictly in file order and connects them, so
+ * import order and the handling of out of order blocks are unchanged.
+ *
+ * The scanner skips over each record it finds. When a record turns out not to
+ * deserialize, everything found after it is dropped and scanning starts over
+ * one byte after its magic, as the size it claimed may span valid blocks.
+ */
+class CBlockImportPipeline
+{
+private:
+    const CChainParams& chainparams;
+    const int nWorkers;
+
+    boost::mutex cs;
+    boost::condition_variable condScanner;
+    boost::condition_variable condWorkers;
+    boost::condition_variable condConnect;
+    std::deque<CImportedBlockRef> queueOrdered; //! all in flight blocks, in file order
+    std::deque<CImportedBlockRef> queueWork; //! blocks not yet picked up by a worker
+    uint64_t nBytesInFlight;
+    bool fScanDone;
+    bool fStop;
+    std::string strAbort;
+    //! Bumped whenever scanning has to start over from nRescanPos
+    unsigned int nGeneration;
+    uint64_t nRescanPos;
+
+    boost::thread_group threads;
+
+    // Per stage statistics; worker stage times are summed over all workers.
+    std::atomic<uint64_t> nScanned;
+    std::atomic<uint64_t> nScannedBytes;
+    std::atomic<int64_t> nTimeScan;
+    int64_t nTimeScanBlocked; //! time the scanner waited for room in the pipeline, guarded by cs
+    std::atomic<int64_t> nTimeDeserialize;
+    std::atomic<int64_t> nTimeHash;
+    std::atomic<int64_t> nTimePoW;
+    std::atomic<int64_t> nTimeCheck;
+    int64_t nTimeStall;
+    int64_t nTimeConnect;
+    uint64_t nConnected;
+    int64_t nTimeStart;
+    int64_t nTimeReturned;
+
+    /** Queue a record found by scan generation nGen; records of an abandoned scan are dropped. */
+    void Push(const CImportedBlockRef& item, unsigned int nGen)
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        int64_t nTimeBegin = GetTimeMicros();
+        while (!fStop && nGen == nGeneration && !queueOrdered.empty() && (queueOrdered.size() >= IMPORT_MAX_BLOCKS_IN_FLIGHT_PER_WORKER * nWorkers || nBytesInFlight + item->nSize > IMPORT_MAX_BYTES_IN_FLIGHT))
+            condScanner.wait(lock);
+        nTimeScanBlocked += GetTimeMicros() - nTimeBegin;
+        if (fStop || nGen != nGeneration)
+            return;
+        nBytesInFlight += item->nSize;
+        queueOrdered.push_back(item);
+        queueWork.push_back(item);
+        condWorkers.notify_one();
+    }
+
+    /** Position to scan from if a rescan was asked for since generation nGen, updating nGen. */
+    bool CheckRescan(unsigned int& nGen, uint64_t& nPos)
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        if (nGen == nGeneration)
+            return false;
+        nGen = nGeneration;
+        nPos = nRescanPos;
+        return true;
+    }
+
+    /** Report the end of the file and wait for a rescan, returning false if the pipeline stops instead. */
+    bool WaitForRescan(unsigned int& nGen, uint64_t& nPos)
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        int64_t nTimeBegin = GetTimeMicros();
+        if (nGen == nGeneration) {
+            fScanDone = true;
+            condWorkers.notify_all();
+            condConnect.notify_all();
+        }
+        while (!fStop && nGen == nGeneration)
+            condScanner.wait(lock);
+        nTimeScanBlocked += GetTimeMicros() - nTimeBegin;
+        if (fStop)
+            return false;
+        nGen = nGeneration;
+        nPos = nRescanPos;
+        return true;
+    }
+
+    void ThreadScan(FILE* fileIn)
+    {
+        int64_t nTimeBegin = GetTimeMicros();
+        try {
+            CBufferedFile blkdat(fileIn, 2 * MAX_BLOCK_SERIALIZED_SIZE, MAX_BLOCK_SERIALIZED_SIZE + 8, SER_DISK, CLIENT_VERSION);
+            uint64_t nRewind = blkdat.GetPos();
+            unsigned int nGen = 0;
+            while (true) {
+                boost::this_thread::interruption_point();
+
+                bool fSeek = CheckRescan(nGen, nRewind);
+                if (!fSeek && blkdat.eof()) {
+                    if (!WaitForRescan(nGen, nRewind))
+                        break;
+                    fSeek = true;
+                }
+                if (fSeek && !blkdat.Seek(nRewind))
+                    throw std::runtime_error("unable to seek back in block file");
+
+                blkdat.SetPos(nRewind);
+                nRewind++; // start one byte further next time, in case of failure
+                blkdat.SetLimit(); // remove former limit
+                unsigned int nSize = 0;
+                try {
+                    unsigned char buf[MESSAGE_START_SIZE];
+                    blkdat.FindByte(chainparams.MessageStart()[0]);
+                    nRewind = blkdat.GetPos() + 1;
+                    blkdat >> FLATDATA(buf);
+                    if (memcmp(buf, chainparams.MessageStart(), MESSAGE_START_SIZE))
+                        continue;
+
+                    blkdat >> nSize;
+                    if (nSize < 80 || nSize > MAX_BLOCK_SERIALIZED_SIZE)
+                        continue;
+                }
+                catch (const std::exception&) {
+                    // End of file; nothing more to find unless a rescan is asked for.
+                    if (!WaitForRescan(nGen, nRewind))
+                        break;
+                    if (!blkdat.Seek(nRewind))
+                        throw std::runtime_error("unable to seek back in block file");
+                    continue;
+                }
+                try {
+                    uint64_t nBlockPos = blkdat.GetPos();
+                    blkdat.SetLimit(nBlockPos + nSize);
+                    CImportedBlockRef item = std::make_shared<CImportedBlock>(nBlockPos, nSize);
+                    blkdat.read(&item->vchRaw[0], nSize);
+                    nRewind = blkdat.GetPos();
+                    nScanned++;
+                    nScannedBytes += nSize;
+                    Push(item, nGen);
+                }
+                catch (const std::exception& e) {
+                    LogPrintf("%s: I/O error - %s\n", __func__, e.what());
+                }
+            }
+        }
+        catch (const boost::thread_interrupted&) {
+        }
+        catch (const std::runtime_error& e) {
+            boost::unique_lock<boost::mutex> lock(cs);
+            strAbort = e.what();
+        }
+        boost::unique_lock<boost::mutex> lock(cs);
+        nTimeScan = GetTimeMicros() - nTimeBegin - nTimeScanBlocked;
+        fScanDone = true;
+        condWorkers.notify_all();
+        condConnect.notify_all();
+    }
+
+    void Process(CImportedBlock& item)
+    {
+        int64_t nTime1 = GetTimeMicros();
+        try {
+            CDataStream ss(item.vchRaw, SER_DISK, CLIENT_VERSION);
+            ss >> item.block;
+            item.fDeserialized = true;
+        }
+        catch (const std::exception& e) {
+            item.strError = e.what();
+        }
+        std::vector<char>().swap(item.vchRaw);
+        int64_t nTime2 = GetTimeMicros();
+        nTimeDeserialize += nTime2 - nTime1;
+        if (!item.fDeserialized)
+            return;
+
+        item.hash = item.block.GetHash();
+        int64_t nTime3 = GetTimeMicros();
+        nTimeHash += nTime3 - nTime2;
+
+        // Failures are not acted on here; the block is left unchecked so that
+        // AcceptBlock repeats the check and records the failure as usual.
+        CValidationState state;
+        bool fPoW = CheckBlockHeader(item.block, state, chainparams.GetConsensus(), true);
+        int64_t nTime4 = GetTimeMicros();
+        nTimePoW += nTime4 - nTime3;
+        if (fPoW && CheckBlock(item.block, state, chainparams.GetConsensus(), false, true))
+            item.block.fChecked = true;
+        nTimeCheck += GetTimeMicros() - nTime4;
+    }
+
+    void ThreadWork()
+    {
+        std::vector<CImportedBlockRef> vBatch;
+        vBatch.reserve(IMPORT_CHECK_BATCH_SIZE);
+        try {
+            while (true) {
+                {
+                    boost::unique_lock<boost::mutex> lock(cs);
+                    while (!fStop && queueWork.empty() && !fScanDone)
+                        condWorkers.wait(lock);
+                    if (fStop || (queueWork.empty() && fScanDone))
+                        return;
+                    // Leave work for the other workers while the queue is short.
+                    size_t nBatch = std::min<size_t>(IMPORT_CHECK_BATCH_SIZE, std::max<size_t>(1, queueWork.size() / nWorkers));
+                    while (vBatch.size() < nBatch) {
+                        vBatch.push_back(queueWork.front());
+                        queueWork.pop_front();
+                    }
+                }
+                for (const CImportedBlockRef& item : vBatch)
+                    Process(*item);
+                {
+                    boost::unique_lock<boost::mutex> lock(cs);
+                    for (const CImportedBlockRef& item : vBatch)
+                        item->fDone = true;
+                    condConnect.notify_all();
+                }
+                vBatch.clear();
+            }
+        }
+        catch (const boost::thread_interrupted&) {
+        }
+    }
+
+public:
+    CBlockImportPipeline(const CChainParams& chainparamsIn, FILE* fileIn, int nWorkersIn)
+        : chainparams(chainparamsIn), nWorkers(std::max(nWorkersIn, 1)), nBytesInFlight(0), fScanDone(false), fStop(false),
+          nGeneration(0), nRescanPos(0), nScanned(0), nScannedBytes(0), nTimeScan(0), nTimeScanBlocked(0), nTimeDeserialize(0), nTimeHash(0), nTimePoW(0), nTimeCheck(0),
+          nTimeStall(0), nTimeConnect(0), nConnected(0), nTimeStart(GetTimeMicros()), nTimeReturned(nTimeStart)
+    {
+        threads.create_thread(boost::bind(&CBlockImportPipeline::ThreadScan, this, fileIn));
+        for (int i = 0; i < nWorkers; i++)
+            threads.create_thread(boost::bind(&CBlockImportPipeline::ThreadWork, this));
+    }
+
+    ~CBlockImportPipeline()
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(cs);
+            fStop = true;
+            condScanner.notify_all();
+            condWorkers.notify_all();
+        }
+        threads.interrupt_all();
+        threads.join_all();
+    }
+
+    /** Wait for the next block in file order. Returns false once the file is exhausted. */
+    bool Next(CImportedBlockRef& item)
+    {
+        int64_t nTimeBegin = GetTimeMicros();
+        if (item) {
+            // Everything since the previous block was handed out was spent connecting it.
+            nTimeConnect += nTimeBegin - nTimeReturned;
+            nConnected++;
+        }
+        boost::unique_lock<boost::mutex> lock(cs);
+        while (!(queueOrdered.empty() ? fScanDone : queueOrdered.front()->fDone))
+            condConnect.wait(lock);
+        nTimeReturned = GetTimeMicros();
+        nTimeStall += nTimeReturned - nTimeBegin;
+        if (queueOrdered.empty())
+            return false;
+        item = queueOrdered.front();
+        queueOrdered.pop_front();
+        nBytesInFlight -= item->nSize;
+        if (!item->fDeserialized) {
+            // The size of a bad record may span valid blocks; look for them as the old loader did.
+            nRescanPos = item->nPos - MESSAGE_START_SIZE - sizeof(unsigned int) + 1;
+            nGeneration++;
+            queueOrdered.clear();
+            queueWork.clear();
+            nBytesInFlight = 0;
+            fScanDone = false;
+            condScanner.notify_all();
+        } else {
+            condScanner.notify_one();
+        }
+        return true;
+    }
+
+    /** Error that stopped the scanner, if any. */
+    std::string GetAbortReason()
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        return strAbort;
+    }
+
+    void LogStats()
+    {
+        const int64_t nTimeTotal = std::max<int64_t>(GetTimeMicros() - nTimeStart, 1);
+        const uint64_t nBlocks = nScanned;
+        if (nBlocks == 0)
+            return;
+        // Worker stage times are summed over all workers, so scale by the pool size for wall clock throughput.
+        LogPrintf("Import pipeline: %u blocks (%.1f MiB) in %.2fs using %d workers\n", nBlocks, nScannedBytes / 1048576.0, nTimeTotal * 0.000001, nWorkers);
+        LogPrintf("  scan:        %.2fs, %.1f blk/s, %.2fs waiting for room\n", nTimeScan * 0.000001, nBlocks * 1000000.0 / std::max<int64_t>(nTimeScan, 1), nTimeScanBlocked * 0.000001);
+        LogPrintf("  deserialize: %.2fs cpu, %.1f blk/s\n", nTimeDeserialize * 0.000001, nBlocks * 1000000.0 * nWorkers / std::max<int64_t>(nTimeDeserialize, 1));
+        LogPrintf("  hash:        %.2fs cpu, %.1f blk/s\n", nTimeHash * 0.000001, nBlocks * 1000000.0 * nWorkers / std::max<int64_t>(nTimeHash, 1));
+        LogPrintf("  pow:         %.2fs cpu, %.1f blk/s\n", nTimePoW * 0.000001, nBlocks * 1000000.0 * nWorkers / std::max<int64_t>(nTimePoW, 1));
+        LogPrintf("  check:       %.2fs cpu, %.1f blk/s\n", nTimeCheck * 0.000001, nBlocks * 1000000.0 * nWorkers / std::max<int64_t>(nTimeCheck, 1));
+        LogPrintf("  connect:     %.2fs, %.1f blk/s, %.2fs waiting on workers\n", nTimeConnect * 0.000001, nConnected * 1000000.0 / std::max<int64_t>(nTimeConnect, 1), nTimeStall * 0.000001);
+    }
+};
+}
+
 bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskBlockPos* dbp)
 {
 
@@ -3932,44 +5012,21 @@ bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskB
     int nLoaded = 0;
     try {
 
-        CBufferedFile blkdat(fileIn, 2 * MAX_BLOCK_SERIALIZED_SIZE, MAX_BLOCK_SERIALIZED_SIZE + 8, SER_DISK, CLIENT_VERSION);
-        uint64_t nRewind = blkdat.GetPos();
-        while (!blkdat.eof()) {
+        CBlockImportPipeline pipeline(chainparams, fileIn, GetNumCores());
+        CImportedBlockRef item;
+        while (pipeline.Next(item)) {
             boost::this_thread::interruption_point();
 
-            blkdat.SetPos(nRewind);
-            nRewind++; // start one byte further next time, in case of failure
-            blkdat.SetLimit(); // remove former limit
-            unsigned int nSize = 0;
-            try {
-
-                unsigned char buf[MESSAGE_START_SIZE];
-                blkdat.FindByte(chainparams.MessageStart()[0]);
-                nRewind = blkdat.GetPos() + 1;
-                blkdat >> FLATDATA(buf);
-                if (memcmp(buf, chainparams.MessageStart(), MESSAGE_START_SIZE))
-                    continue;
-
-                blkdat >> nSize;
-                if (nSize < 80 || nSize > MAX_BLOCK_SERIALIZED_SIZE)
-                    continue;
-            }
-            catch (const std::exception&) {
-
-                break;
+            if (dbp)
+                dbp->nPos = item->nPos;
+            if (!item->fDeserialized) {
+                LogPrintf("%s: Deserialize or I/O error - %s\n", __func__, item->strError);
+                continue;
             }
+            CBlock& block = item->block;
+            const uint256& hash = item->hash;
             try {
 
-                uint64_t nBlockPos = blkdat.GetPos();
-                if (dbp)
-                    dbp->nPos = nBlockPos;
-                blkdat.SetLimit(nBlockPos + nSize);
-                blkdat.SetPos(nBlockPos);
-                CBlock block;
-                blkdat >> block;
-                nRewind = blkdat.GetPos();
-
-                uint256 hash = block.GetHash();
                 if (hash != chainparams.GetConsensus().hashGenesisBlock && mapBlockIndex.find(block.hashPrevBlock) == mapBlockIndex.end()) {
                     LogPrint("reindex", "%s: Out of order block %s, parent %s not known\n", __func__, hash.ToString(),
                              block.hashPrevBlock.ToString());
@@ -4006,14 +5063,15 @@ bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskB
                     std::pair<std::multimap<uint256, CDiskBlockPos>::iterator, std::multimap<uint256, CDiskBlockPos>::iterator> range = mapBlocksUnknownParent.equal_range(head);
                     while (range.first != range.second) {
                         std::multimap<uint256, CDiskBlockPos>::iterator it = range.first;
-                        if (ReadBlockFromDisk(block, it->second, chainparams.GetConsensus())) {
-                            LogPrint("reindex", "%s: Processing out of order child %s of %s\n", __func__, block.GetHash().ToString(),
+                        CBlock child;
+                        if (ReadBlockFromDisk(child, it->second, chainparams.GetConsensus())) {
+                            LogPrint("reindex", "%s: Processing out of order child %s of %s\n", __func__, child.GetHash().ToString(),
                                      head.ToString());
                             LOCK(cs_main);
                             CValidationState dummy;
-                            if (AcceptBlock(block, dummy, chainparams, NULL, true, &it->second, NULL)) {
+                            if (AcceptBlock(child, dummy, chainparams, NULL, true, &it->second, NULL)) {
                                 nLoaded++;
-                                queue.push_back(block.GetHash());
+                                queue.push_back(child.GetHash());
                             }
                         }
                         range.first++;
@@ -4026,6 +5084,10 @@ bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskB
                 LogPrintf("%s: Deserialize or I/O error - %s\n", __func__, e.what());
             }
         }
+        std::string strAbort = pipeline.GetAbortReason();
+        if (!strAbort.empty())
+            throw std::runtime_error(strAbort);
+        pipeline.LogStats();
     }
     catch (const std::runtime_error& e) {
         AbortNode(std::string("System error: ") + e.what());
@@ -4345,10 +5407,21 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
 
                 if (send && (mi->second->nStatus & BLOCK_HAVE_DATA)) {
 
+                    // Full blocks go out straight from the block file when the requested
+                    // serialization matches the one on disk: always for witness requests,
+                    // and for plain requests before segwit activation (such blocks cannot
+                    // carry witness data).
+                    CRawBlock rawBlock;
+                    bool fRaw = (inv.type == MSG_WITNESS_BLOCK || (inv.type == MSG_BLOCK && !IsWitnessEnabled(mi->second->pprev, consensusParams)));
+                    if (fRaw && !ReadRawBlockFromDisk(rawBlock, mi->second->GetBlockPos(), Params().MessageStart()))
+                        fRaw = false;
+
                     CBlock block;
-                    if (!ReadBlockFromDisk(block, (*mi).second, consensusParams))
+                    if (!fRaw && !ReadBlockFromDisk(block, (*mi).second, consensusParams))
                         assert(!"cannot load block from disk");
-                    if (inv.type == MSG_BLOCK)
+                    if (fRaw)
+                        pfrom->PushMessage(NetMsgType::BLOCK, rawBlock);
+                    else if (inv.type == MSG_BLOCK)
                         pfrom->PushMessageWithFlag(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::BLOCK, block);
                     else if (inv.type == MSG_WITNESS_BLOCK)
                         pfrom->PushMessage(NetMsgType::BLOCK, block);
@@ -4367,7 +5440,7 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
 
                             typedef std::pair<unsigned int, uint256> PairType;
                             BOOST_FOREACH (PairType& pair, merkleBlock.vMatchedTxn)
-                                pfrom->PushMessageWithFlag(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::TX, block.vtx[pair.first]);
+                                pfrom->PushMessageWithFlag(SERIALIZE_TRANSACTION_NO_WITNESS, NetMsgType::TX, *block.vtx[pair.first]);
                         }
 
                     } else if (inv.type == MSG_CMPCT_BLOCK) {
@@ -4392,7 +5465,7 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
                 bool push = false;
                 auto mi = mapRelay.find(inv.hash);
                 if (mi != mapRelay.end()) {
-                    pfrom->PushMessageWithFlag(inv.type == MSG_TX ? SERIALIZE_TRANSACTION_NO_WITNESS : 0, NetMsgType::TX, *mi->second);
+                    pfrom->PushMessage(NetMsgType::TX, CFlatData(mi->second.GetSerialized(inv.type != MSG_TX)));
                     push = true;
                 } else if (pfrom->timeLastMempoolReq) {
                     auto txinfo = mempool.info(inv.hash);
@@ -4431,6 +5504,95 @@ uint32_t GetFetchFlags(CNode* pfrom, CBlockIndex* pprev, const Consensus::Params
     return nFetchFlags;
 }
 
+/**
+ * Try the orphans spending outputs of hashParent, which just entered the
+ * mempool, then those spending outputs of the orphans accepted, and so on.
+ * Each round looks up the inputs of all its orphans in one view over the
+ * chain and the mempool, so orphans still waiting for another parent stay
+ * without going through AcceptToMemoryPool.
+ */
+void static ProcessOrphansFor(const uint256& hashParent) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+{
+    vector<uint256> vParents(1, hashParent);
+    vector<uint256> vEraseQueue;
+    set<uint256> setDone;
+    set<NodeId> setMisbehaving;
+    while (!vParents.empty()) {
+        vector<map<uint256, COrphanTx>::iterator> vBatch;
+        set<uint256> setBatch;
+        BOOST_FOREACH (const uint256& hash, vParents) {
+            for (auto itByPrev = mapOrphanTransactionsByPrev.lower_bound(COutPoint(hash, 0));
+                 itByPrev != mapOrphanTransactionsByPrev.end() && itByPrev->first.hash == hash;
+                 ++itByPrev) {
+                BOOST_FOREACH (const auto& mi, itByPrev->second) {
+                    if (!setDone.count(mi->first) && setBatch.insert(mi->first).second)
+                        vBatch.push_back(mi);
+                }
+            }
+        }
+        vParents.clear();
+
+        vector<map<uint256, COrphanTx>::iterator> vReady;
+        vector<uint256> vHashTxToUncache;
+        {
+            CCoinsViewMemPool viewMemPool(pcoinsTip, mempool);
+            CCoinsViewCache view(&viewMemPool);
+            BOOST_FOREACH (const auto& mi, vBatch) {
+                vector<uint256> vHashTxNotCached;
+                BOOST_FOREACH (const CTxIn& txin, mi->second.tx->vin) {
+                    if (!pcoinsTip->HaveCoinsInCache(txin.prevout.hash))
+                        vHashTxNotCached.push_back(txin.prevout.hash);
+                }
+                if (view.HaveInputs(*mi->second.tx))
+                    vReady.push_back(mi);
+                else
+                    vHashTxToUncache.insert(vHashTxToUncache.end(), vHashTxNotCached.begin(), vHashTxNotCached.end());
+            }
+        }
+        // As in AcceptToMemoryPool, lookups for orphans left waiting do not grow the coins cache.
+        BOOST_FOREACH (const uint256& hashTx, vHashTxToUncache)
+            pcoinsTip->Uncache(hashTx);
+
+        BOOST_FOREACH (const auto& mi, vReady) {
+            const CTransactionRef orphanTx = mi->second.tx;
+            const uint256& orphanHash = orphanTx->GetHash();
+            NodeId fromPeer = mi->second.fromPeer;
+            bool fMissingInputs = false;
+            CValidationState stateOrphan;
+
+            if (setMisbehaving.count(fromPeer))
+                continue;
+            if (AcceptToMemoryPool(mempool, stateOrphan, orphanTx, true, &fMissingInputs)) {
+                LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
+                RelayTransaction(*orphanTx);
+                vParents.push_back(orphanHash);
+                vEraseQueue.push_back(orphanHash);
+                setDone.insert(orphanHash);
+            } else if (!fMissingInputs) {
+                int nDos = 0;
+                if (stateOrphan.IsInvalid(nDos) && nDos > 0 && (!stateOrphan.CorruptionPossible() || State(fromPeer)->fHaveWitness)) {
+
+                    Misbehaving(fromPeer, nDos);
+                    setMisbehaving.insert(fromPeer);
+                    LogPrint("mempool", "   invalid orphan tx %s\n", orphanHash.ToString());
+                }
+
+                LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
+                vEraseQueue.push_back(orphanHash);
+                setDone.insert(orphanHash);
+                if (!stateOrphan.CorruptionPossible()) {
+                    assert(recentRejects);
+                    recentRejects->insert(orphanHash);
+                }
+            }
+            mempool.check(pcoinsTip);
+        }
+    }
+
+    BOOST_FOREACH (const uint256& hash, vEraseQueue)
+        EraseOrphanTx(hash);
+}
+
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived, const CChainParams& chainparams)
 {
     LogPrint("net", "received: %s (%u bytes) peer=%d\n", SanitizeString(strCommand), vRecv.size(), pfrom->id);
@@ -4868,7 +6030,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 pindex = chainActive.Next(pindex);
         }
 
-        vector<CBlock> vHeaders;
+        vector<CBlockHeader> vHeaders;
         int nLimit = MAX_HEADERS_RESULTS;
         LogPrint("net", "getheaders %d to %s from peer=%d\n", (pindex ? pindex->nHeight : -1), hashStop.ToString(), pfrom->id);
         for (; pindex; pindex = chainActive.Next(pindex)) {
@@ -4878,7 +6040,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         }
 
         nodestate->pindexBestHeaderSent = pindex ? pindex : chainActive.Tip();
-        pfrom->PushMessage(NetMsgType::HEADERS, vHeaders);
+        pfrom->PushMessage(NetMsgType::HEADERS, CHeadersMessage(vHeaders));
     }
 
     else if (strCommand == NetMsgType::TX) {
@@ -4888,28 +6050,32 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             return true;
         }
 
-        deque<COutPoint> vWorkQueue;
-        vector<uint256> vEraseQueue;
-        CTransaction tx;
-        vRecv >> tx;
+        // Deserialized once into the object the mempool, relay map or orphan pool keep.
+        CTransactionRef ptx;
+        vRecv >> ptx;
+        const CTransaction& tx = *ptx;
 
         CInv inv(MSG_TX, tx.GetHash());
         pfrom->AddInventoryKnown(inv);
 
-        LOCK(cs_main);
-
         bool fMissingInputs = false;
         CValidationState state;
 
-        pfrom->setAskFor.erase(inv.hash);
-        mapAlreadyAskedFor.erase(inv.hash);
+        bool fAlreadyHave;
+        {
+            LOCK(cs_main);
+            pfrom->setAskFor.erase(inv.hash);
+            mapAlreadyAskedFor.erase(inv.hash);
+            fAlreadyHave = AlreadyHave(inv);
+        }
+        // cs_main is released while the scripts are verified, other threads can use it meanwhile.
+        const bool fAccepted = !fAlreadyHave && AcceptToMemoryPool(mempool, state, ptx, true, &fMissingInputs);
+
+        LOCK(cs_main);
 
-        if (!AlreadyHave(inv) && AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs)) {
+        if (fAccepted) {
             mempool.check(pcoinsTip);
             RelayTransaction(tx);
-            for (unsigned int i = 0; i < tx.vout.size(); i++) {
-                vWorkQueue.emplace_back(inv.hash, i);
-            }
 
             pfrom->nLastTXTime = GetTime();
 
@@ -4918,53 +6084,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                      tx.GetHash().ToString(),
                      mempool.size(), mempool.DynamicMemoryUsage() / 1000);
 
-            set<NodeId> setMisbehaving;
-            while (!vWorkQueue.empty()) {
-                auto itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue.front());
-                vWorkQueue.pop_front();
-                if (itByPrev == mapOrphanTransactionsByPrev.end())
-                    continue;
-                for (auto mi = itByPrev->second.begin();
-                     mi != itByPrev->second.end();
-                     ++mi) {
-                    const CTransaction& orphanTx = (*mi)->second.tx;
-                    const uint256& orphanHash = orphanTx.GetHash();
-                    NodeId fromPeer = (*mi)->second.fromPeer;
-                    bool fMissingInputs2 = false;
-
-                    CValidationState stateDummy;
-
-                    if (setMisbehaving.count(fromPeer))
-                        continue;
-                    if (AcceptToMemoryPool(mempool, stateDummy, orphanTx, true, &fMissingInputs2)) {
-                        LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
-                        RelayTransaction(orphanTx);
-                        for (unsigned int i = 0; i < orphanTx.vout.size(); i++) {
-                            vWorkQueue.emplace_back(orphanHash, i);
-                        }
-                        vEraseQueue.push_back(orphanHash);
-                    } else if (!fMissingInputs2) {
-                        int nDos = 0;
-                        if (stateDummy.IsInvalid(nDos) && nDos > 0 && (!state.CorruptionPossible() || State(fromPeer)->fHaveWitness)) {
-
-                            Misbehaving(fromPeer, nDos);
-                            setMisbehaving.insert(fromPeer);
-                            LogPrint("mempool", "   invalid orphan tx %s\n", orphanHash.ToString());
-                        }
-
-                        LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
-                        vEraseQueue.push_back(orphanHash);
-                        if (!stateDummy.CorruptionPossible()) {
-                            assert(recentRejects);
-                            recentRejects->insert(orphanHash);
-                        }
-                    }
-                    mempool.check(pcoinsTip);
-                }
-            }
-
-            BOOST_FOREACH (uint256 hash, vEraseQueue)
-                EraseOrphanTx(hash);
+            ProcessOrphansFor(inv.hash);
         } else if (fMissingInputs) {
             bool fRejectedParents = false; // It may be the case that the orphans parents have all been rejected
             BOOST_FOREACH (const CTxIn& txin, tx.vin) {
@@ -4980,17 +6100,20 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                     if (!AlreadyHave(inv))
                         pfrom->AskFor(inv);
                 }
-                AddOrphanTx(tx, pfrom->GetId());
+                AddOrphanTx(ptx, pfrom->GetId());
 
                 unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
-                unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx);
+                size_t nMaxOrphanUsage = std::max((int64_t)0, GetArg("-maxorphansize", DEFAULT_MAX_ORPHAN_TRANSACTIONS_SIZE)) * 1000000;
+                size_t nMaxOrphanPeerUsage = std::max((int64_t)0, GetArg("-maxorphanpeersize", DEFAULT_MAX_ORPHAN_PEER_SIZE)) * 1000;
+                unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx, nMaxOrphanUsage, nMaxOrphanPeerUsage);
                 if (nEvicted > 0)
                     LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
             } else {
                 LogPrint("mempool", "not keeping orphan with rejected parents %s\n", tx.GetHash().ToString());
             }
         } else {
-            if (!state.CorruptionPossible()) {
+            // Another thread may have added it while cs_main was not held.
+            if (!state.CorruptionPossible() && !mempool.exists(tx.GetHash())) {
                 assert(recentRejects);
                 recentRejects->insert(tx.GetHash());
             }
@@ -5027,115 +6150,124 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         CBlockHeaderAndShortTxIDs cmpctblock;
         vRecv >> cmpctblock;
 
-        LOCK(cs_main);
+        // Fallbacks to other messages are handled once cs_main is released, as they may
+        // connect blocks and ProcessNewBlockHeaders must not be called with it held.
+        bool fProcessBLOCKTXN = false;
+        bool fRevertToHeaderProcessing = false;
+        CDataStream vFallbackMsg(SER_NETWORK, PROTOCOL_VERSION);
+        {
+            LOCK(cs_main);
 
-        if (mapBlockIndex.find(cmpctblock.header.hashPrevBlock) == mapBlockIndex.end()) {
+            if (mapBlockIndex.find(cmpctblock.header.hashPrevBlock) == mapBlockIndex.end()) {
 
-            if (!IsInitialBlockDownload())
-                pfrom->PushMessage(NetMsgType::GETHEADERS, chainActive.GetLocator(pindexBestHeader), uint256());
-            return true;
-        }
-
-        CBlockIndex* pindex = NULL;
-        CValidationState state;
-        if (!AcceptBlockHeader(cmpctblock.header, state, chainparams, &pindex)) {
-            int nDoS;
-            if (state.IsInvalid(nDoS)) {
-                if (nDoS > 0)
-                    Misbehaving(pfrom->GetId(), nDoS);
-                LogPrintf("Peer %d sent us invalid header via cmpctblock\n", pfrom->id);
+                if (!IsInitialBlockDownload())
+                    pfrom->PushMessage(NetMsgType::GETHEADERS, chainActive.GetLocator(pindexBestHeader), uint256());
                 return true;
             }
-        }
 
-        assert(pindex);
-        UpdateBlockAvailability(pfrom->GetId(), pindex->GetBlockHash());
+            CBlockIndex* pindex = NULL;
+            CValidationState state;
+            if (!AcceptBlockHeader(cmpctblock.header, state, chainparams, &pindex)) {
+                int nDoS;
+                if (state.IsInvalid(nDoS)) {
+                    if (nDoS > 0)
+                        Misbehaving(pfrom->GetId(), nDoS);
+                    LogPrintf("Peer %d sent us invalid header via cmpctblock\n", pfrom->id);
+                    return true;
+                }
+            }
 
-        std::map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator blockInFlightIt = mapBlocksInFlight.find(pindex->GetBlockHash());
-        bool fAlreadyInFlight = blockInFlightIt != mapBlocksInFlight.end();
+            assert(pindex);
+            UpdateBlockAvailability(pfrom->GetId(), pindex->GetBlockHash());
 
-        if (pindex->nStatus & BLOCK_HAVE_DATA) // Nothing to do here
-            return true;
+            std::map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator blockInFlightIt = mapBlocksInFlight.find(pindex->GetBlockHash());
+            bool fAlreadyInFlight = blockInFlightIt != mapBlocksInFlight.end();
 
-        if (pindex->nChainWork <= chainActive.Tip()->nChainWork || // We know something better
-            pindex->nTx != 0) { // We had this block at some point, but pruned it
-            if (fAlreadyInFlight) {
+            if (pindex->nStatus & BLOCK_HAVE_DATA) // Nothing to do here
+                return true;
+
+            if (pindex->nChainWork <= chainActive.Tip()->nChainWork || // We know something better
+                pindex->nTx != 0) { // We had this block at some point, but pruned it
+                if (fAlreadyInFlight) {
 
-                std::vector<CInv> vInv(1);
-                vInv[0] = CInv(MSG_BLOCK, cmpctblock.header.GetHash());
-                pfrom->PushMessage(NetMsgType::GETDATA, vInv);
+                    std::vector<CInv> vInv(1);
+                    vInv[0] = CInv(MSG_BLOCK, cmpctblock.header.GetHash());
+                    pfrom->PushMessage(NetMsgType::GETDATA, vInv);
+                }
+                return true;
             }
-            return true;
-        }
 
-        if (!fAlreadyInFlight && !CanDirectFetch(chainparams.GetConsensus()))
-            return true;
+            if (!fAlreadyInFlight && !CanDirectFetch(chainparams.GetConsensus()))
+                return true;
 
-        CNodeState* nodestate = State(pfrom->GetId());
+            CNodeState* nodestate = State(pfrom->GetId());
+
+            if (pindex->nHeight <= chainActive.Height() + 2) {
+                if ((!fAlreadyInFlight && nodestate->nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) || (fAlreadyInFlight && blockInFlightIt->second.first == pfrom->GetId())) {
+                    list<QueuedBlock>::iterator* queuedBlockIt = NULL;
+                    if (!MarkBlockAsInFlight(pfrom->GetId(), pindex->GetBlockHash(), chainparams.GetConsensus(), pindex, &queuedBlockIt)) {
+                        if (!(*queuedBlockIt)->partialBlock)
+                            (*queuedBlockIt)->partialBlock.reset(new PartiallyDownloadedBlock(&mempool));
+                        else {
+
+                            LogPrint("net", "Peer sent us compact block we were already syncing!\n");
+                            return true;
+                        }
+                    }
 
-        if (pindex->nHeight <= chainActive.Height() + 2) {
-            if ((!fAlreadyInFlight && nodestate->nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) || (fAlreadyInFlight && blockInFlightIt->second.first == pfrom->GetId())) {
-                list<QueuedBlock>::iterator* queuedBlockIt = NULL;
-                if (!MarkBlockAsInFlight(pfrom->GetId(), pindex->GetBlockHash(), chainparams.GetConsensus(), pindex, &queuedBlockIt)) {
-                    if (!(*queuedBlockIt)->partialBlock)
-                        (*queuedBlockIt)->partialBlock.reset(new PartiallyDownloadedBlock(&mempool));
-                    else {
+                    PartiallyDownloadedBlock& partialBlock = *(*queuedBlockIt)->partialBlock;
+                    ReadStatus status = partialBlock.InitData(cmpctblock);
+                    if (status == READ_STATUS_INVALID) {
+                        MarkBlockAsReceived(pindex->GetBlockHash()); // Reset in-flight state in case of whitelist
+                        Misbehaving(pfrom->GetId(), 100);
+                        LogPrintf("Peer %d sent us invalid compact block\n", pfrom->id);
+                        return true;
+                    } else if (status == READ_STATUS_FAILED) {
 
-                        LogPrint("net", "Peer sent us compact block we were already syncing!\n");
+                        std::vector<CInv> vInv(1);
+                        vInv[0] = CInv(MSG_BLOCK, cmpctblock.header.GetHash());
+                        pfrom->PushMessage(NetMsgType::GETDATA, vInv);
                         return true;
                     }
-                }
 
-                PartiallyDownloadedBlock& partialBlock = *(*queuedBlockIt)->partialBlock;
-                ReadStatus status = partialBlock.InitData(cmpctblock);
-                if (status == READ_STATUS_INVALID) {
-                    MarkBlockAsReceived(pindex->GetBlockHash()); // Reset in-flight state in case of whitelist
-                    Misbehaving(pfrom->GetId(), 100);
-                    LogPrintf("Peer %d sent us invalid compact block\n", pfrom->id);
-                    return true;
-                } else if (status == READ_STATUS_FAILED) {
+                    BlockTransactionsRequest req;
+                    for (size_t i = 0; i < cmpctblock.BlockTxCount(); i++) {
+                        if (!partialBlock.IsTxAvailable(i))
+                            req.indexes.push_back(i);
+                    }
+                    if (req.indexes.empty()) {
+
+                        BlockTransactions txn;
+                        txn.blockhash = cmpctblock.header.GetHash();
+                        vFallbackMsg << txn;
+                        fProcessBLOCKTXN = true;
+                    } else {
+                        req.blockhash = pindex->GetBlockHash();
+                        pfrom->PushMessage(NetMsgType::GETBLOCKTXN, req);
+                    }
+                }
+            } else {
+                if (fAlreadyInFlight) {
 
                     std::vector<CInv> vInv(1);
                     vInv[0] = CInv(MSG_BLOCK, cmpctblock.header.GetHash());
                     pfrom->PushMessage(NetMsgType::GETDATA, vInv);
                     return true;
-                }
-
-                BlockTransactionsRequest req;
-                for (size_t i = 0; i < cmpctblock.BlockTxCount(); i++) {
-                    if (!partialBlock.IsTxAvailable(i))
-                        req.indexes.push_back(i);
-                }
-                if (req.indexes.empty()) {
-
-                    BlockTransactions txn;
-                    txn.blockhash = cmpctblock.header.GetHash();
-                    CDataStream blockTxnMsg(SER_NETWORK, PROTOCOL_VERSION);
-                    blockTxnMsg << txn;
-                    return ProcessMessage(pfrom, NetMsgType::BLOCKTXN, blockTxnMsg, nTimeReceived, chainparams);
                 } else {
-                    req.blockhash = pindex->GetBlockHash();
-                    pfrom->PushMessage(NetMsgType::GETBLOCKTXN, req);
+
+                    std::vector<CBlockHeader> headers(1, cmpctblock.header);
+                    vFallbackMsg << CHeadersMessage(headers);
+                    fRevertToHeaderProcessing = true;
                 }
             }
-        } else {
-            if (fAlreadyInFlight) {
-
-                std::vector<CInv> vInv(1);
-                vInv[0] = CInv(MSG_BLOCK, cmpctblock.header.GetHash());
-                pfrom->PushMessage(NetMsgType::GETDATA, vInv);
-                return true;
-            } else {
 
-                std::vector<CBlock> headers;
-                headers.push_back(cmpctblock.header);
-                CDataStream vHeadersMsg(SER_NETWORK, PROTOCOL_VERSION);
-                vHeadersMsg << headers;
-                return ProcessMessage(pfrom, NetMsgType::HEADERS, vHeadersMsg, nTimeReceived, chainparams);
-            }
+            CheckBlockIndex(chainparams.GetConsensus());
         }
 
-        CheckBlockIndex(chainparams.GetConsensus());
+        if (fProcessBLOCKTXN)
+            return ProcessMessage(pfrom, NetMsgType::BLOCKTXN, vFallbackMsg, nTimeReceived, chainparams);
+        if (fRevertToHeaderProcessing)
+            return ProcessMessage(pfrom, NetMsgType::HEADERS, vFallbackMsg, nTimeReceived, chainparams);
     }
 
     else if (strCommand == NetMsgType::BLOCKTXN && !fImporting && !fReindex) // Ignore blocks received while importing
@@ -5222,24 +6354,25 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 }
                 return true;
             }
+        }
 
-            CBlockIndex* pindexLast = NULL;
-            BOOST_FOREACH (const CBlockHeader& header, headers) {
-                CValidationState state;
-                if (pindexLast != NULL && header.hashPrevBlock != pindexLast->GetBlockHash()) {
-                    Misbehaving(pfrom->GetId(), 20);
-                    return error("non-continuous headers sequence");
-                }
-                if (!AcceptBlockHeader(header, state, chainparams, &pindexLast)) {
-                    int nDoS;
-                    if (state.IsInvalid(nDoS)) {
-                        if (nDoS > 0)
-                            Misbehaving(pfrom->GetId(), nDoS);
-                        return error("invalid header received");
-                    }
+        CBlockIndex* pindexLast = NULL;
+        {
+            CValidationState state;
+            if (!ProcessNewBlockHeaders(headers, state, chainparams, &pindexLast)) {
+                int nDoS;
+                if (state.IsInvalid(nDoS) && nDoS > 0) {
+                    LOCK(cs_main);
+                    Misbehaving(pfrom->GetId(), nDoS);
                 }
+                return error("invalid header received");
             }
+        }
+
+        {
+            LOCK(cs_main);
 
+            CNodeState* nodestate = State(pfrom->GetId());
             if (nodestate->nUnconnectingHeaders > 0) {
                 LogPrint("net", "peer=%d: resetting nUnconnectingHeaders (%d -> 0)\n", pfrom->id, nodestate->nUnconnectingHeaders);
             }
@@ -5311,11 +6444,17 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
     else if (strCommand == NetMsgType::BLOCK && !fImporting && !fReindex) // Ignore blocks received while importing
     {
+        const unsigned int nSize = vRecv.size();
         CBlock block;
         vRecv >> block;
 
         LogPrint("net", "received block %s peer=%d\n", block.GetHash().ToString(), pfrom->id);
 
+        {
+            LOCK(cs_main);
+            RecordBlockDelivery(pfrom->GetId(), block.GetHash(), nSize);
+        }
+
         CValidationState state;
 
         bool forceProcessing = pfrom->fWhitelisted && !IsInitialBlockDownload();
@@ -5786,7 +6925,7 @@ bool SendMessages(CNode* pto)
         {
 
             LOCK(pto->cs_inventory);
-            vector<CBlock> vHeaders;
+            vector<CBlockHeader> vHeaders;
             bool fRevertToInv = ((!state.fPreferHeaders && (!state.fPreferHeaderAndIDs || pto->vBlockHashesToAnnounce.size() > 1)) || pto->vBlockHashesToAnnounce.size() > MAX_BLOCKS_TO_ANNOUNCE);
             CBlockIndex* pBestIndex = NULL; // last header queued for delivery
             ProcessBlockAvailability(pto->id); // ensure pindexBestKnownBlock is up-to-date
@@ -5846,7 +6985,7 @@ bool SendMessages(CNode* pto)
                         LogPrint("net", "%s: sending header %s to peer=%d\n", __func__,
                                  vHeaders.front().GetHash().ToString(), pto->id);
                     }
-                    pto->PushMessage(NetMsgType::HEADERS, vHeaders);
+                    pto->PushMessage(NetMsgType::HEADERS, CHeadersMessage(vHeaders));
                     state.pindexBestHeaderSent = pBestIndex;
                 } else
                     fRevertToInv = true;
@@ -5984,7 +7123,7 @@ bool SendMessages(CNode* pto)
                             vRelayExpiration.pop_front();
                         }
 
-                        auto ret = mapRelay.insert(std::make_pair(hash, std::move(txinfo.tx)));
+                        auto ret = mapRelay.insert(std::make_pair(hash, CRelayTx(txinfo.tx)));
                         if (ret.second) {
                             vRelayExpiration.push_back(std::make_pair(nNow + 15 * 60 * 1000000, ret.first));
                         }
@@ -6001,10 +7140,16 @@ bool SendMessages(CNode* pto)
             pto->PushMessage(NetMsgType::INV, vInv);
 
         nNow = GetTimeMicros();
-        if (!pto->fDisconnect && state.nStallingSince && state.nStallingSince < nNow - 1000000 * BLOCK_STALLING_TIMEOUT) {
-
-            LogPrintf("Peer=%d is stalling block download, disconnecting\n", pto->id);
-            pto->fDisconnect = true;
+        if (!pto->fDisconnect && state.nStallingSince && state.nStallingSince < nNow - GetBlockStallingTimeout(state)) {
+            if (++state.nStallReassigns > MAX_BLOCK_STALL_REASSIGNS) {
+                LogPrintf("Peer=%d is stalling block download, disconnecting\n", pto->id);
+                pto->fDisconnect = true;
+            } else {
+                // The released blocks are the earliest not in flight now, so without the
+                // exclusion FindNextBlocksToDownload would give them straight back to this peer.
+                unsigned int nReleased = ReleaseStalledBlocks(pto->GetId());
+                LogPrint("net", "Peer=%d is stalling block download, reassigned %u blocks\n", pto->id, nReleased);
+            }
         }
 
         if (!pto->fDisconnect && state.vBlocksInFlight.size() > 0) {
@@ -6017,10 +7162,11 @@ bool SendMessages(CNode* pto)
         }
 
         vector<CInv> vGetData;
-        if (!pto->fDisconnect && !pto->fClient && (fFetch || !IsInitialBlockDownload()) && state.nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+        state.nBlocksInFlightLimit = GetBlocksInFlightLimit(state, pto->nPingUsecTime);
+        if (!pto->fDisconnect && !pto->fClient && (fFetch || !IsInitialBlockDownload()) && state.nBlocksInFlight < state.nBlocksInFlightLimit) {
             vector<CBlockIndex*> vToDownload;
             NodeId staller = -1;
-            FindNextBlocksToDownload(pto->GetId(), MAX_BLOCKS_IN_TRANSIT_PER_PEER - state.nBlocksInFlight, vToDownload, staller, consensusParams);
+            FindNextBlocksToDownload(pto->GetId(), state.nBlocksInFlightLimit - state.nBlocksInFlight, vToDownload, staller, consensusParams);
             BOOST_FOREACH (CBlockIndex* pindex, vToDownload) {
                 uint32_t nFetchFlags = GetFetchFlags(pto, pindex->pprev, consensusParams);
                 vGetData.push_back(CInv(MSG_BLOCK | nFetchFlags, pindex->GetBlockHash()));
@@ -6086,18 +7232,225 @@ ThresholdState VersionBitsTipState(const Consensus::Params& params, Consensus::D
     return VersionBitsState(chainActive.Tip(), params, pos, versionbitscache);
 }
 
+static const uint64_t MEMPOOL_DUMP_VERSION = 1;
+/** Transactions read from mempool.dat whose inputs are fetched and scripts checked together */
+static const size_t MEMPOOL_LOAD_BATCH_SIZE = 1000;
+
+/** Set once mempool.dat has been read, so that a dump cannot replace it with a partially loaded pool */
+static std::atomic<bool> fMempoolLoaded(false);
+
+namespace {
+/** A transaction in mempool.dat */
+struct CMempoolDumpEntry {
+    CTransactionRef tx;
+    int64_t nTime;
+    double dPriorityDelta;
+    CAmount nFeeDelta;
+
+    CMempoolDumpEntry() : nTime(0), dPriorityDelta(0), nFeeDelta(0) {}
+    CMempoolDumpEntry(const CTransactionRef& txIn, int64_t nTimeIn, double dPriorityDeltaIn, CAmount nFeeDeltaIn)
+        : tx(txIn), nTime(nTimeIn), dPriorityDelta(dPriorityDeltaIn), nFeeDelta(nFeeDeltaIn) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(tx);
+        READWRITE(nTime);
+        READWRITE(dPriorityDelta);
+        READWRITE(nFeeDelta);
+    }
+};
+
+/**
+ * Prepare a batch of mempool.dat transactions for acceptance. The inputs of
+ * the whole batch are fetched into the coins cache in txid order rather than
+ * one transaction at a time, and the scripts of transactions spending
+ * confirmed outputs are verified on the script check threads. Successful
+ * checks land in the signature cache, so the full acceptance that follows
+ * finds them there instead of verifying every signature serially. The txids
+ * this brought into the coins cache are appended to vHashTxnToUncache.
+ */
+void PrepareMempoolBatch(const std::vector<CMempoolDumpEntry>& vBatch, std::vector<uint256>& vHashTxnToUncache)
+{
+    std::vector<uint256> vPrevHashes;
+    for (const CMempoolDumpEntry& entry : vBatch)
+        for (const CTxIn& txin : entry.tx->vin)
+            vPrevHashes.push_back(txin.prevout.hash);
+    std::sort(vPrevHashes.begin(), vPrevHashes.end());
+    vPrevHashes.erase(std::unique(vPrevHashes.begin(), vPrevHashes.end()), vPrevHashes.end());
+
+    LOCK(cs_main);
+    for (const uint256& hash : vPrevHashes) {
+        if (!pcoinsTip->HaveCoinsInCache(hash) && pcoinsTip->HaveCoins(hash))
+            vHashTxnToUncache.push_back(hash);
+    }
+    if (!nScriptCheckThreads)
+        return;
+
+    CCoinsViewCache view(pcoinsTip);
+    std::vector<PrecomputedTransactionData> vTxData;
+    vTxData.reserve(vBatch.size());
+    CCheckQueueControl<CScriptCheck> control(&scriptcheckqueue);
+    for (const CMempoolDumpEntry& entry : vBatch) {
+        const CTransaction& tx = *entry.tx;
+        // Transactions spending other mempool transactions are checked on acceptance.
+        if (tx.IsCoinBase() || !view.HaveInputs(tx))
+            continue;
+        vTxData.emplace_back(tx);
+        std::vector<CScriptCheck> vChecks;
+        CValidationState state;
+        if (CheckInputs(tx, state, view, true, STANDARD_SCRIPT_VERIFY_FLAGS, true, vTxData.back(), &vChecks))
+            control.Add(vChecks);
+    }
+    control.Wait();
+}
+
+/** Drop prefetched coins that no transaction in the pool spends, as ATMP does for rejected transactions. */
+void UncacheMempoolBatch(const std::vector<uint256>& vHashTxnToUncache)
+{
+    LOCK2(cs_main, mempool.cs);
+    for (const uint256& hash : vHashTxnToUncache) {
+        auto it = mempool.mapNextTx.lower_bound(COutPoint(hash, 0));
+        if (it == mempool.mapNextTx.end() || it->first->hash != hash)
+            pcoinsTip->Uncache(hash);
+    }
+}
+}
+
+bool LoadMempool()
+{
+    const int64_t nExpiryTimeout = GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60;
+    FILE* filestr = fopen((GetDataDir() / "mempool.dat").string().c_str(), "rb");
+    CAutoFile file(filestr, SER_DISK, CLIENT_VERSION);
+    if (file.IsNull()) {
+        LogPrintf("Failed to open mempool file from disk. Continuing anyway.\n");
+        fMempoolLoaded = true;
+        return false;
+    }
+
+    const int64_t nStart = GetTimeMillis();
+    const int64_t nNow = GetTime();
+    int64_t nAccepted = 0, nFailed = 0, nExpired = 0, nAlreadyHave = 0;
+    try {
+        uint64_t nVersion;
+        file >> nVersion;
+        if (nVersion != MEMPOOL_DUMP_VERSION) {
+            LogPrintf("%s: unknown mempool file version %u, ignoring it\n", __func__, nVersion);
+            fMempoolLoaded = true;
+            return false;
+        }
+        uint64_t nCount;
+        file >> nCount;
+
+        std::vector<CMempoolDumpEntry> vBatch;
+        std::vector<uint256> vHashTxnToUncache;
+        while (nCount > 0) {
+            vBatch.clear();
+            vHashTxnToUncache.clear();
+            while (nCount > 0 && vBatch.size() < MEMPOOL_LOAD_BATCH_SIZE) {
+                CMempoolDumpEntry entry;
+                file >> entry;
+                nCount--;
+                if (entry.nTime + nExpiryTimeout <= nNow)
+                    nExpired++;
+                else
+                    vBatch.push_back(entry);
+            }
+            PrepareMempoolBatch(vBatch, vHashTxnToUncache);
+
+            for (const CMempoolDumpEntry& entry : vBatch) {
+                const uint256& hash = entry.tx->GetHash();
+                if (entry.dPriorityDelta != 0 || entry.nFeeDelta != 0)
+                    mempool.PrioritiseTransaction(hash, hash.ToString(), entry.dPriorityDelta, entry.nFeeDelta);
+                CValidationState state;
+                LOCK(cs_main);
+                if (AcceptToMemoryPoolWithTime(mempool, state, entry.tx, false, NULL, entry.nTime))
+                    nAccepted++;
+                else if (state.GetRejectCode() == REJECT_ALREADY_KNOWN)
+                    nAlreadyHave++;
+                else
+                    nFailed++;
+            }
+            UncacheMempoolBatch(vHashTxnToUncache);
+            if (ShutdownRequested())
+                return false;
+        }
+
+        // Fee deltas of transactions that were not in the pool
+        std::map<uint256, std::pair<double, CAmount> > mapDeltas;
+        file >> mapDeltas;
+        for (const auto& delta : mapDeltas)
+            mempool.PrioritiseTransaction(delta.first, delta.first.ToString(), delta.second.first, delta.second.second);
+    } catch (const std::exception& e) {
+        LogPrintf("Failed to deserialize mempool data on disk: %s. Continuing anyway.\n", e.what());
+        fMempoolLoaded = true;
+        return false;
+    }
+
+    LogPrintf("Loaded %i mempool transactions from disk in %dms: %i failed, %i expired, %i already present\n",
+        nAccepted, GetTimeMillis() - nStart, nFailed, nExpired, nAlreadyHave);
+    fMempoolLoaded = true;
+    return true;
+}
+
+bool DumpMempool()
+{
+    if (!fMempoolLoaded)
+        return false;
+
+    const int64_t nStart = GetTimeMicros();
+    std::map<uint256, std::pair<double, CAmount> > mapDeltas;
+    std::vector<TxMempoolInfo> vInfo;
+    {
+        LOCK(mempool.cs);
+        mapDeltas = mempool.mapDeltas;
+        vInfo = mempool.infoAll();
+    }
+    const int64_t nCopied = GetTimeMicros();
+
+    const boost::filesystem::path pathTmp = GetDataDir() / "mempool.dat.new";
+    try {
+        FILE* filestr = fopen(pathTmp.string().c_str(), "wb");
+        if (!filestr)
+            return error("%s: failed to open %s", __func__, pathTmp.string());
+        CAutoFile file(filestr, SER_DISK, CLIENT_VERSION);
+
+        // Entries are written parents first, so the loader can accept them in file order.
+        file << MEMPOOL_DUMP_VERSION;
+        file << (uint64_t)vInfo.size();
+        for (const TxMempoolInfo& info : vInfo) {
+            std::pair<double, CAmount> delta(0, 0);
+            auto it = mapDeltas.find(info.tx->GetHash());
+            if (it != mapDeltas.end()) {
+                delta = it->second;
+                mapDeltas.erase(it);
+            }
+            file << CMempoolDumpEntry(info.tx, info.nTime, delta.first, delta.second);
+        }
+        file << mapDeltas;
+        FileCommit(file.Get());
+        file.fclose();
+        if (!RenameOver(pathTmp, GetDataDir() / "mempool.dat"))
+            return error("%s: failed to rename %s", __func__, pathTmp.string());
+    } catch (const std::exception& e) {
+        LogPrintf("Failed to dump mempool: %s. Continuing anyway.\n", e.what());
+        return false;
+    }
+    LogPrint("mempool", "Dumped %u mempool transactions: %.3fms to copy, %.3fms to write\n",
+        vInfo.size(), (nCopied - nStart) * 0.001, (GetTimeMicros() - nCopied) * 0.001);
+    return true;
+}
+
 class CMainCleanup {
 public:
     CMainCleanup() {}
     ~CMainCleanup()
     {
 
-        BlockMap::iterator it1 = mapBlockIndex.begin();
-        for (; it1 != mapBlockIndex.end(); it1++)
-            delete (*it1).second;
         mapBlockIndex.clear();
 
-        mapOrphanTransactions.clear();
-        mapOrphanTransactionsByPrev.clear();
+        ClearOrphans();
     }
 } instance_of_cmaincleanup;
@@ -18,6 +18,7 @@
 #endif
 
 #include "amount.h"
+#include "blockindexmap.h"
 #include "chain.h"
 #include "coins.h"
 #include "net.h"
@@ -28,6 +29,7 @@
 #include <algorithm>
 #include <exception>
 #include <map>
+#include <memory>
 #include <set>
 #include <stdint.h>
 #include <string>
@@ -36,11 +38,13 @@
 
 #include <boost/unordered_map.hpp>
 
+struct CAddressIndexUpdate;
 class CBlockIndex;
 class CBlockTreeDB;
 class CBloomFilter;
 class CChainParams;
 class CInv;
+class CMappedFile;
 class CScriptCheck;
 class CTxMemPool;
 class CValidationInterface;
@@ -65,7 +69,11 @@ static const CAmount HIGH_TX_FEE_PER_KB = 0.01 * COIN;
 
 static const CAmount HIGH_MAX_TX_FEE = 100 * HIGH_TX_FEE_PER_KB;
 /** Default for -maxorphantx, maximum number of orphan transactions kept in memory */
-static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS = 100;
+static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS = 10000;
+/** Default for -maxorphansize, maximum megabytes of memory used by orphan transactions */
+static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS_SIZE = 10;
+/** Default for -maxorphanpeersize, maximum kilobytes of memory used by orphan transactions from one peer */
+static const unsigned int DEFAULT_MAX_ORPHAN_PEER_SIZE = 1000;
 /** Expiration time for orphan transactions in seconds */
 static const int64_t ORPHAN_TX_EXPIRE_TIME = 20 * 60;
 /** Minimum time between orphan transactions expire time checks in seconds */
@@ -80,6 +88,10 @@ static const unsigned int DEFAULT_DESCENDANT_LIMIT = 25;
 static const unsigned int DEFAULT_DESCENDANT_SIZE_LIMIT = 101;
 /** Default for -mempoolexpiry, expiration time for mempool transactions in hours */
 static const unsigned int DEFAULT_MEMPOOL_EXPIRY = 72;
+/** Default for -persistmempool */
+static const bool DEFAULT_PERSIST_MEMPOOL = true;
+/** Time in seconds between writes of mempool.dat while running */
+static const int64_t MEMPOOL_DUMP_INTERVAL = 15 * 60;
 /** The maximum size of a blk?????.dat file (since 0.8) */
 static const unsigned int MAX_BLOCKFILE_SIZE = 0x8000000; // 128 MiB
 /** The pre-allocation chunk size for blk?????.dat files (since 0.8) */
@@ -94,18 +106,30 @@ static const int64_t DUST_HARD_LIMIT = 1000; // 0.00001 NLG mininput
 static const int MAX_SCRIPTCHECK_THREADS = 16;
 /** -par default (number of script-checking threads, 0 = auto) */
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
-/** Number of blocks that can be requested at any given time from a single peer. */
+/** Number of blocks that can be requested at any given time from a single peer, until its delivery rate is known,
+ *  and when fetching blocks near the tip. */
 static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
+/** Bounds of the adaptive per-peer in-flight limit used during block download. */
+static const int MIN_BLOCKS_IN_TRANSIT_PER_PEER = 2;
+static const int MAX_ADAPTIVE_BLOCKS_IN_TRANSIT_PER_PEER = 128;
 /** Timeout in seconds during which a peer must stall block download progress before being disconnected. */
 static const unsigned int BLOCK_STALLING_TIMEOUT = 2;
+/** Lower bound in milliseconds of the adaptive stall timeout, after which a stalling peer's blocks are reassigned. */
+static const unsigned int BLOCK_STALLING_TIMEOUT_MIN_MS = 500;
+/** Number of times a peer's blocks are reassigned for stalling, without any delivery in between, before it is disconnected. */
+static const int MAX_BLOCK_STALL_REASSIGNS = 3;
 /** Number of headers sent in one getheaders result. We rely on the assumption that if a peer sends
  *  less than this number, we reached its tip. Changing this value is a protocol upgrade. */
 static const unsigned int MAX_HEADERS_RESULTS = 2000;
 /** Size of the "block download window": how far ahead of our current height do we fetch?
  *  Larger windows tolerate larger download speed differences between peer, but increase the potential
  *  degree of disordering of blocks on disk (which make reindexing and in the future perhaps pruning
- *  harder). We'll probably want to make this a per-peer adaptive value at some point. */
+ *  harder). This is the window used until the average block size is known. */
 static const unsigned int BLOCK_DOWNLOAD_WINDOW = 1024;
+/** The window is sized in bytes using the average size of downloaded blocks, and kept between these bounds in blocks. */
+static const uint64_t BLOCK_DOWNLOAD_WINDOW_BYTES = 64 * 1024 * 1024;
+static const unsigned int MIN_BLOCK_DOWNLOAD_WINDOW = 256;
+static const unsigned int MAX_BLOCK_DOWNLOAD_WINDOW = 16384;
 /** Time to wait (in seconds) between writing blocks/block index to disk. */
 static const unsigned int DATABASE_WRITE_INTERVAL = 60 * 60;
 /** Time to wait (in seconds) between flushing chainstate to disk. */
@@ -139,6 +163,7 @@ static const int64_t DEFAULT_MAX_TIP_AGE = 24 * 60 * 60;
 static const bool DEFAULT_PERMIT_BAREMULTISIG = true;
 static const bool DEFAULT_CHECKPOINTS_ENABLED = true;
 static const bool DEFAULT_TXINDEX = false;
+static const bool DEFAULT_ADDRESSINDEX = false;
 static const unsigned int DEFAULT_BANSCORE_THRESHOLD = 100;
 
 static const bool DEFAULT_TESTSAFEMODE = false;
@@ -155,6 +180,11 @@ static const int MAX_UNCONNECTING_HEADERS = 10;
 
 static const bool DEFAULT_PEERBLOOMFILTERS = true;
 
+/** Default for -mmapblocks, read finalized block files through memory mappings */
+static const bool DEFAULT_MMAP_BLOCK_FILES = true;
+/** Maximum number of block files kept mapped at once */
+static const unsigned int MAX_MAPPED_BLOCK_FILES = 64;
+
 struct BlockHasher {
     size_t operator()(const uint256& hash) const { return hash.GetCheapHash(); }
 };
@@ -162,7 +192,7 @@ struct BlockHasher {
 extern CScript COINBASE_FLAGS;
 extern CCriticalSection cs_main;
 extern CTxMemPool mempool;
-typedef boost::unordered_map<uint256, CBlockIndex*, BlockHasher> BlockMap;
+typedef CBlockIndexMap BlockMap;
 extern BlockMap mapBlockIndex;
 extern uint64_t nLastBlockTx;
 extern uint64_t nLastBlockSize;
@@ -174,6 +204,7 @@ extern bool fImporting;
 extern bool fReindex;
 extern int nScriptCheckThreads;
 extern bool fTxIndex;
+extern bool fAddressIndex;
 extern bool fIsBareMultisigStd;
 extern bool fRequireStandard;
 extern bool fCheckBlockIndex;
@@ -187,6 +218,7 @@ extern bool fAlerts;
 /** If the tip is older than this (in seconds), the node is considered to be in initial block download. */
 extern int64_t nMaxTipAge;
 extern bool fEnableReplacement;
+extern bool fMapBlockFiles;
 
 /** Best header we've seen so far (used for getheaders queries' starting points). */
 extern CBlockIndex* pindexBestHeader;
@@ -229,6 +261,18 @@ void UnregisterNodeSignals(CNodeSignals& nodeSignals);
  * @return True if state.IsValid()
  */
 bool ProcessNewBlock(CValidationState& state, const CChainParams& chainparams, CNode* pfrom, const CBlock* pblock, bool fForceProcessing, const CDiskBlockPos* dbp);
+/**
+ * Process a contiguous run of block headers, each building on the previous one.
+ * Hashes and proof of work of headers not yet known are checked without holding
+ * cs_main, which must not be held by the caller; the headers are then added to
+ * the block index in order.
+ *
+ * @param[in]   headers The headers, in chain order.
+ * @param[out]  state   Details of the first header that failed, if any.
+ * @param[out]  ppindex If set, the index entry of the last header accepted.
+ * @return True if all headers were accepted
+ */
+bool ProcessNewBlockHeaders(const std::vector<CBlockHeader>& headers, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex = NULL);
 /** Check whether enough disk space is available for an incoming block */
 bool CheckDiskSpace(uint64_t nAdditionalBytes = 0);
 /** Open a block file (blk?????.dat) */
@@ -255,6 +299,8 @@ bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto);
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Run an instance of the thread checking scripts of transactions entering the mempool */
+void ThreadMempoolScriptCheck();
 /** Check whether we are doing an initial block download (synchronizing from disk or network) */
 bool IsInitialBlockDownload();
 /** Format a string that describes several potential problems detected by the core.
@@ -304,10 +350,24 @@ void FlushStateToDisk();
 /** Prune block files and flush state to disk. */
 void PruneAndFlush();
 
-/** (try to) add transaction to memory pool **/
+/** (try to) add transaction to memory pool; the pool keeps tx itself rather than a copy **/
+bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransactionRef& tx, bool fLimitFree,
+                        bool* pfMissingInputs, bool fOverrideMempoolLimit = false, const CAmount nAbsurdFee = 0);
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree,
                         bool* pfMissingInputs, bool fOverrideMempoolLimit = false, const CAmount nAbsurdFee = 0);
 
+/** (try to) add transaction to memory pool, recording nAcceptTime as the time it entered the pool **/
+bool AcceptToMemoryPoolWithTime(CTxMemPool& pool, CValidationState& state, const CTransactionRef& tx, bool fLimitFree,
+                                bool* pfMissingInputs, int64_t nAcceptTime, bool fOverrideMempoolLimit = false, const CAmount nAbsurdFee = 0);
+bool AcceptToMemoryPoolWithTime(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree,
+                                bool* pfMissingInputs, int64_t nAcceptTime, bool fOverrideMempoolLimit = false, const CAmount nAbsurdFee = 0);
+
+/** Write the mempool, with entry times and fee deltas, to mempool.dat. Does nothing until LoadMempool has finished. */
+bool DumpMempool();
+
+/** Reload mempool.dat into the mempool; call once the chain is activated. */
+bool LoadMempool();
+
 /** Convert CValidationState to a human-readable message for logging */
 std::string FormatStateMessage(const CValidationState& state);
 
@@ -319,6 +379,11 @@ struct CNodeStateStats {
     int nSyncHeight;
     int nCommonHeight;
     std::vector<int> vHeightInFlight;
+    int nBlocksInFlightLimit;
+    uint64_t nBlocksDownloaded;
+    uint64_t nBlockBytesDownloaded;
+    int64_t nBlockServiceTime; //!< Average time in microseconds the peer takes to deliver a block
+    double dBlockBytesPerSecond; //!< Average block download throughput
 };
 
 /** 
@@ -354,6 +419,13 @@ int64_t GetTransactionSigOpCost(const CTransaction& tx, const CCoinsViewCache& i
 bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsViewCache& view, bool fScriptChecks,
                  unsigned int flags, bool cacheStore, PrecomputedTransactionData& txdata, std::vector<CScriptCheck>* pvChecks = NULL);
 
+/**
+ * Check the scripts of all inputs of this transaction, or push the checks onto pvChecks if it is not
+ * NULL. Only the scripts are checked, CheckInputs does the rest. Needs no locks.
+ */
+bool CheckInputScripts(const CTransaction& tx, CValidationState& state, const CCoinsViewCache& view, unsigned int flags,
+                       bool cacheStore, PrecomputedTransactionData& txdata, std::vector<CScriptCheck>* pvChecks = NULL);
+
 /** Apply the effects of this transaction on the UTXO set represented by view */
 void UpdateCoins(const CTransaction& tx, CCoinsViewCache& inputs, int nHeight);
 
@@ -458,10 +530,47 @@ bool WriteBlockToDisk(const CBlock& block, CDiskBlockPos& pos, const CMessageHea
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus::Params& consensusParams);
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus::Params& consensusParams);
 
+/**
+ * Serialized bytes of a block exactly as stored on disk. The bytes are either
+ * borrowed from a memory mapped block file (kept alive by mapping) or read
+ * into a private buffer. Serializing a CRawBlock writes the bytes unchanged,
+ * which is the network serialization of the block including witness data.
+ */
+class CRawBlock
+{
+private:
+    std::shared_ptr<const CMappedFile> mapping;
+    std::vector<char> vchBuffer;
+    const char* pbegin;
+    const char* pend;
+
+public:
+    CRawBlock() : pbegin(NULL), pend(NULL) {}
+
+    void SetMapped(const std::shared_ptr<const CMappedFile>& mappingIn, const char* pbeginIn, const char* pendIn);
+    std::vector<char>& SetBuffer(size_t nSize);
+
+    const char* begin() const { return pbegin; }
+    const char* end() const { return pend; }
+    size_t size() const { return pend - pbegin; }
+    bool IsMapped() const { return mapping != nullptr; }
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const { return size(); }
+
+    template <typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        s.write(pbegin, size());
+    }
+};
+
+/** Read the serialized bytes of a block without deserializing it. Checks the record header only, not proof of work. */
+bool ReadRawBlockFromDisk(CRawBlock& block, const CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& messageStart);
+
 /** Functions for validating blocks and updating the block tree */
 
 /** Context-independent validity checks */
-bool CheckBlockHeader(const CBlock& block, CValidationState& state, const Consensus::Params& consensusParams, bool fCheckPOW = true);
+bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, const Consensus::Params& consensusParams, bool fCheckPOW = true);
 bool CheckBlock(const CBlock& block, CValidationState& state, const Consensus::Params& consensusParams, bool fCheckPOW = true, bool fCheckMerkleRoot = true);
 
 /** Context-dependent validity checks.
@@ -472,15 +581,17 @@ bool ContextualCheckBlock(const CBlock& block, CValidationState& state, CBlockIn
 
 /** Apply the effects of this block (with given index) on the UTXO set represented by coins.
  *  Validity checks that depend on the UTXO set are also done; ConnectBlock()
- *  can fail if those validity checks fail (among other reasons). */
+ *  can fail if those validity checks fail (among other reasons).
+ *  If pAddressIndex is provided, the address index entries for the block are collected in it. */
 bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& coins,
-                  const CChainParams& chainparams, bool fJustCheck = false);
+                  const CChainParams& chainparams, bool fJustCheck = false, CAddressIndexUpdate* pAddressIndex = NULL);
 
 /** Undo the effects of this block (with given index) on the UTXO set represented by coins.
  *  In case pfClean is provided, operation will try to be tolerant about errors, and *pfClean
  *  will be true if no problems were found. Otherwise, the return value will be false in case
- *  of problems. Note that in any case, coins may be modified. */
-bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockIndex* pindex, CCoinsViewCache& coins, bool* pfClean = NULL);
+ *  of problems. Note that in any case, coins may be modified.
+ *  If pAddressIndex is provided, the address index entries to remove are collected in it. */
+bool DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockIndex* pindex, CCoinsViewCache& coins, bool* pfClean = NULL, CAddressIndexUpdate* pAddressIndex = NULL);
 
 /** Check a block is completely valid from start to finish (only works on top of our current best block, with cs_main held) */
 bool TestBlockValidity(CValidationState& state, const CChainParams& chainparams, const CBlock& block, CBlockIndex* pindexPrev, bool fCheckPOW = true, bool fCheckMerkleRoot = true);
@@ -0,0 +1,41 @@
+// Copyright (c) 2016 The Gulden developers
+// Distributed under the GULDEN software license, see the accompanying
+// file COPYING
+
+#ifndef GULDEN_MAPPEDFILE_H
+#define GULDEN_MAPPEDFILE_H
+
+#include <memory>
+#include <stddef.h>
+
+#include <boost/filesystem/path.hpp>
+
+/**
+ * Read only memory mapping of a whole file.
+ *
+ * Intended for files that no longer change, such as finalized block files;
+ * the mapping covers the file as it was when opened. Instances are shared
+ * between readers so a mapping stays valid for as long as anyone still holds
+ * a pointer into it.
+ */
+class CMappedFile
+{
+private:
+    const char* pdata;
+    size_t nSize;
+
+    CMappedFile(const char* pdataIn, size_t nSizeIn) : pdata(pdataIn), nSize(nSizeIn) {}
+    CMappedFile(const CMappedFile&);
+    CMappedFile& operator=(const CMappedFile&);
+
+public:
+    ~CMappedFile();
+
+    /** Map the file at path. Returns null if the file cannot be mapped, in which case callers fall back to regular reads. */
+    static std::shared_ptr<const CMappedFile> Open(const boost::filesystem::path& path);
+
+    const char* data() const { return pdata; }
+    size_t size() const { return nSize; }
+};
+
+#endif // GULDEN_MAPPEDFILE_H
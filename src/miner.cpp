@@ -34,6 +34,7 @@
 #include "validationinterface.h"
 
 #include <algorithm>
+#include <boost/bind.hpp>
 #include <boost/thread.hpp>
 #include <boost/tuple/tuple.hpp>
 #include <queue>
@@ -48,6 +49,9 @@ uint64_t nLastBlockTx = 0;
 uint64_t nLastBlockSize = 0;
 uint64_t nLastBlockWeight = 0;
 
+/** Mempool transactions each thread preparing a package selection takes at least */
+static const size_t MIN_PACKAGE_TXS_PER_THREAD = 5000;
+
 class ScoreCompare {
 public:
     ScoreCompare() {}
@@ -73,7 +77,8 @@ int64_t UpdateTime(CBlockHeader* pblock, const Consensus::Params& consensusParam
 }
 
 BlockAssembler::BlockAssembler(const CChainParams& _chainparams)
-    : chainparams(_chainparams)
+    : pindexPrev(NULL)
+    , chainparams(_chainparams)
 {
 
     nBlockMaxWeight = DEFAULT_BLOCK_MAX_WEIGHT;
@@ -112,24 +117,46 @@ void BlockAssembler::resetBlock()
 
     lastFewTxs = 0;
     blockFinished = false;
+
+    feeRateLowestPackage = CFeeRate();
+    fHavePackages = false;
 }
 
 CBlockTemplate* BlockAssembler::CreateNewBlock(const CScript& scriptPubKeyIn)
 {
+    LOCK2(cs_main, mempool.cs);
+    SelectTransactions(chainActive.Tip());
+
+    if (!pblocktemplate.get())
+        return NULL;
+    FinishBlock(*pblocktemplate, scriptPubKeyIn);
+
+    CValidationState state;
+    if (!TestBlockValidity(state, chainparams, pblocktemplate->block, pindexPrev, false, false)) {
+        throw std::runtime_error(strprintf("%s: TestBlockValidity failed: %s", __func__, FormatStateMessage(state)));
+    }
+
+    return pblocktemplate.release();
+}
+
+void BlockAssembler::SelectTransactions(CBlockIndex* pindexPrevIn)
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(mempool.cs);
+
     resetBlock();
 
     pblocktemplate.reset(new CBlockTemplate());
 
     if (!pblocktemplate.get())
-        return NULL;
+        return;
     pblock = &pblocktemplate->block; // pointer for convenience
 
-    pblock->vtx.push_back(CTransaction());
+    pblock->vtx.emplace_back();
     pblocktemplate->vTxFees.push_back(-1); // updated at end
     pblocktemplate->vTxSigOpsCost.push_back(-1); // updated at end
 
-    LOCK2(cs_main, mempool.cs);
-    CBlockIndex* pindexPrev = chainActive.Tip();
+    pindexPrev = pindexPrevIn;
     nHeight = pindexPrev->nHeight + 1;
 
     pblock->nVersion = ComputeBlockVersion(pindexPrev, chainparams.GetConsensus());
@@ -148,6 +175,73 @@ CBlockTemplate* BlockAssembler::CreateNewBlock(const CScript& scriptPubKeyIn)
 
     addPriorityTxs();
     addPackageTxs();
+}
+
+bool BlockAssembler::AddNewTransactions(std::vector<CTxMemPool::txiter>& vNew)
+{
+    AssertLockHeld(mempool.cs);
+    assert(pblocktemplate.get());
+
+    // Best packages first, as addPackageTxs would take them.
+    std::sort(vNew.begin(), vNew.end(), [](const CTxMemPool::txiter& a, const CTxMemPool::txiter& b) {
+        return CompareTxMemPoolEntryByAncestorFee()(*a, *b);
+    });
+
+    BOOST_FOREACH (CTxMemPool::txiter iter, vNew) {
+        // Already taken along as the ancestor of an earlier one.
+        if (inBlock.count(iter))
+            continue;
+
+        CTxMemPool::setEntries ancestors;
+        mempool.CalculateAncestorsUntil(iter, ancestors, inBlock);
+        ancestors.insert(iter);
+
+        // The mempool's ancestor state counts selected ancestors too, so sum the package itself.
+        uint64_t packageSize = 0;
+        CAmount packageFees = 0;
+        int64_t packageSigOpsCost = 0;
+        BOOST_FOREACH (const CTxMemPool::txiter it, ancestors) {
+            packageSize += it->GetTxSize();
+            packageFees += it->GetModifiedFee();
+            packageSigOpsCost += it->GetSigOpCost();
+        }
+
+        if (packageFees < ::minRelayTxFee.GetFee(packageSize))
+            continue;
+
+        if (!TestPackage(packageSize, packageSigOpsCost) || !TestPackageTransactions(ancestors)) {
+            // A new selection could make room for it by leaving out packages paying less.
+            if (!fHavePackages || feeRateLowestPackage < CFeeRate(packageFees, packageSize))
+                return false;
+            continue;
+        }
+
+        vector<CTxMemPool::txiter> sortedEntries;
+        SortForBlock(ancestors, iter, sortedEntries);
+        for (size_t i = 0; i < sortedEntries.size(); ++i)
+            AddToBlock(sortedEntries[i]);
+
+        const CFeeRate feeRatePackage(packageFees, packageSize);
+        if (!fHavePackages || feeRatePackage < feeRateLowestPackage)
+            feeRateLowestPackage = feeRatePackage;
+        fHavePackages = true;
+    }
+    return true;
+}
+
+CBlockTemplate* BlockAssembler::GetBlockTemplate(const CScript& scriptPubKeyIn)
+{
+    AssertLockHeld(cs_main);
+    assert(pblocktemplate.get());
+
+    CBlockTemplate* pblocktemplateNew = new CBlockTemplate(*pblocktemplate);
+    FinishBlock(*pblocktemplateNew, scriptPubKeyIn);
+    return pblocktemplateNew;
+}
+
+void BlockAssembler::FinishBlock(CBlockTemplate& blocktemplate, const CScript& scriptPubKeyIn)
+{
+    CBlock* pblockFinish = &blocktemplate.block;
 
     nLastBlockTx = nBlockTx;
     nLastBlockSize = nBlockSize;
@@ -162,22 +256,15 @@ CBlockTemplate* BlockAssembler::CreateNewBlock(const CScript& scriptPubKeyIn)
     coinbaseTx.vout[0].nValue = nFees + GetBlockSubsidy(nHeight, chainparams.GetConsensus());
     std::string coinbaseSignature = GetArg("-coinbasesignature", "");
     coinbaseTx.vin[0].scriptSig = CScript() << nHeight << OP_0 << std::vector<unsigned char>(coinbaseSignature.begin(), coinbaseSignature.end());
-    pblock->vtx[0] = coinbaseTx;
-    pblocktemplate->vchCoinbaseCommitment = GenerateCoinbaseCommitment(*pblock, pindexPrev, chainparams.GetConsensus());
-    pblocktemplate->vTxFees[0] = -nFees;
-
-    pblock->hashPrevBlock = pindexPrev->GetBlockHash();
-    UpdateTime(pblock, chainparams.GetConsensus(), pindexPrev);
-    pblock->nBits = GetNextWorkRequired(pindexPrev, pblock, chainparams.GetConsensus());
-    pblock->nNonce = 0;
-    pblocktemplate->vTxSigOpsCost[0] = WITNESS_SCALE_FACTOR * GetLegacySigOpCount(pblock->vtx[0]);
-
-    CValidationState state;
-    if (!TestBlockValidity(state, chainparams, *pblock, pindexPrev, false, false)) {
-        throw std::runtime_error(strprintf("%s: TestBlockValidity failed: %s", __func__, FormatStateMessage(state)));
-    }
-
-    return pblocktemplate.release();
+    pblockFinish->vtx[0] = MakeTransactionRef(std::move(coinbaseTx));
+    blocktemplate.vchCoinbaseCommitment = GenerateCoinbaseCommitment(*pblockFinish, pindexPrev, chainparams.GetConsensus());
+    blocktemplate.vTxFees[0] = -nFees;
+
+    pblockFinish->hashPrevBlock = pindexPrev->GetBlockHash();
+    UpdateTime(pblockFinish, chainparams.GetConsensus(), pindexPrev);
+    pblockFinish->nBits = GetNextWorkRequired(pindexPrev, pblockFinish, chainparams.GetConsensus());
+    pblockFinish->nNonce = 0;
+    blocktemplate.vTxSigOpsCost[0] = WITNESS_SCALE_FACTOR * GetLegacySigOpCount(*pblockFinish->vtx[0]);
 }
 
 bool BlockAssembler::isStillDependent(CTxMemPool::txiter iter)
@@ -190,18 +277,6 @@ bool BlockAssembler::isStillDependent(CTxMemPool::txiter iter)
     return false;
 }
 
-void BlockAssembler::onlyUnconfirmed(CTxMemPool::setEntries& testSet)
-{
-    for (CTxMemPool::setEntries::iterator iit = testSet.begin(); iit != testSet.end();) {
-
-        if (inBlock.count(*iit)) {
-            testSet.erase(iit++);
-        } else {
-            iit++;
-        }
-    }
-}
-
 bool BlockAssembler::TestPackage(uint64_t packageSize, int64_t packageSigOpsCost)
 {
 
@@ -231,6 +306,51 @@ bool BlockAssembler::TestPackageTransactions(const CTxMemPool::setEntries& packa
     return true;
 }
 
+bool BlockAssembler::TestPackageTransactions(const CTxMemPool::setEntries& package, const std::vector<CPackageTxInfo>& vInfo)
+{
+    uint64_t nPotentialBlockSize = nBlockSize; // only used with fNeedSizeAccounting
+    BOOST_FOREACH (const CTxMemPool::txiter it, package) {
+        const CPackageTxInfo& info = vInfo[it->vTxHashesIdx];
+        if (!info.fIncludable)
+            return false;
+        if (fNeedSizeAccounting) {
+            if (nPotentialBlockSize + info.nSerializedSize >= nBlockMaxSize)
+                return false;
+            nPotentialBlockSize += info.nSerializedSize;
+        }
+    }
+    return true;
+}
+
+void BlockAssembler::PreparePackageTxInfoRange(std::vector<CPackageTxInfo>* pvInfo, size_t nBegin, size_t nEnd)
+{
+    for (size_t i = nBegin; i < nEnd; ++i) {
+        const CTransaction& tx = mempool.vTxHashes[i].second->GetTx();
+        CPackageTxInfo& info = (*pvInfo)[i];
+        info.nSerializedSize = fNeedSizeAccounting ? ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION) : 0;
+        info.fIncludable = IsFinalTx(tx, nHeight, nLockTimeCutoff) && (fIncludeWitness || tx.wit.IsNull());
+        info.nState = CPackageTxInfo::CANDIDATE;
+    }
+}
+
+void BlockAssembler::PreparePackageTxInfo(std::vector<CPackageTxInfo>& vInfo)
+{
+    const size_t nTxs = mempool.vTxHashes.size();
+    vInfo.resize(nTxs);
+
+    // The workers only read the pool, which this thread keeps locked until they are joined.
+    const int nThreads = std::max(1, std::min(GetNumCores(), (int)(nTxs / MIN_PACKAGE_TXS_PER_THREAD)));
+    const size_t nPerThread = (nTxs + nThreads - 1) / nThreads;
+    boost::thread_group threads;
+    for (int i = 1; i < nThreads; ++i)
+        threads.create_thread(boost::bind(&BlockAssembler::PreparePackageTxInfoRange, this, &vInfo, std::min(nTxs, i * nPerThread), std::min(nTxs, (i + 1) * nPerThread)));
+    PreparePackageTxInfoRange(&vInfo, 0, std::min(nTxs, nPerThread));
+    threads.join_all();
+
+    BOOST_FOREACH (const CTxMemPool::txiter it, inBlock)
+        vInfo[it->vTxHashesIdx].nState = CPackageTxInfo::IN_BLOCK;
+}
+
 bool BlockAssembler::TestForBlock(CTxMemPool::txiter iter)
 {
     if (nBlockWeight + iter->GetTxWeight() >= nBlockMaxWeight) {
@@ -277,7 +397,7 @@ bool BlockAssembler::TestForBlock(CTxMemPool::txiter iter)
 
 void BlockAssembler::AddToBlock(CTxMemPool::txiter iter)
 {
-    pblock->vtx.push_back(iter->GetTx());
+    pblock->vtx.push_back(iter->GetSharedTx());
     pblocktemplate->vTxFees.push_back(iter->GetFee());
     pblocktemplate->vTxSigOpsCost.push_back(iter->GetSigOpCost());
     if (fNeedSizeAccounting) {
@@ -302,7 +422,8 @@ void BlockAssembler::AddToBlock(CTxMemPool::txiter iter)
 }
 
 void BlockAssembler::UpdatePackagesForAdded(const CTxMemPool::setEntries& alreadyAdded,
-                                            indexed_modified_transaction_set& mapModifiedTx)
+                                            indexed_modified_transaction_set& mapModifiedTx,
+                                            std::vector<CPackageTxInfo>& vInfo)
 {
     BOOST_FOREACH (const CTxMemPool::txiter it, alreadyAdded) {
         CTxMemPool::setEntries descendants;
@@ -318,6 +439,7 @@ void BlockAssembler::UpdatePackagesForAdded(const CTxMemPool::setEntries& alread
                 modEntry.nModFeesWithAncestors -= it->GetModifiedFee();
                 modEntry.nSigOpCostWithAncestors -= it->GetSigOpCost();
                 mapModifiedTx.insert(modEntry);
+                vInfo[desc->vTxHashesIdx].nState = CPackageTxInfo::MODIFIED;
             } else {
                 mapModifiedTx.modify(mit, update_for_parent_inclusion(it));
             }
@@ -325,12 +447,10 @@ void BlockAssembler::UpdatePackagesForAdded(const CTxMemPool::setEntries& alread
     }
 }
 
-bool BlockAssembler::SkipMapTxEntry(CTxMemPool::txiter it, indexed_modified_transaction_set& mapModifiedTx, CTxMemPool::setEntries& failedTx)
+bool BlockAssembler::SkipMapTxEntry(CTxMemPool::txiter it, const std::vector<CPackageTxInfo>& vInfo)
 {
     assert(it != mempool.mapTx.end());
-    if (mapModifiedTx.count(it) || inBlock.count(it) || failedTx.count(it))
-        return true;
-    return false;
+    return vInfo[it->vTxHashesIdx].nState != CPackageTxInfo::CANDIDATE;
 }
 
 void BlockAssembler::SortForBlock(const CTxMemPool::setEntries& package, CTxMemPool::txiter entry, std::vector<CTxMemPool::txiter>& sortedEntries)
@@ -343,18 +463,20 @@ void BlockAssembler::SortForBlock(const CTxMemPool::setEntries& package, CTxMemP
 
 void BlockAssembler::addPackageTxs()
 {
+    // What is checked of each transaction does not depend on the selection, so it is
+    // done for the whole pool up front and the loop below only looks it up.
+    std::vector<CPackageTxInfo> vInfo;
+    PreparePackageTxInfo(vInfo);
 
     indexed_modified_transaction_set mapModifiedTx;
 
-    CTxMemPool::setEntries failedTx;
-
-    UpdatePackagesForAdded(inBlock, mapModifiedTx);
+    UpdatePackagesForAdded(inBlock, mapModifiedTx, vInfo);
 
     CTxMemPool::indexed_transaction_set::index<ancestor_score>::type::iterator mi = mempool.mapTx.get<ancestor_score>().begin();
     CTxMemPool::txiter iter;
     while (mi != mempool.mapTx.get<ancestor_score>().end() || !mapModifiedTx.empty()) {
 
-        if (mi != mempool.mapTx.get<ancestor_score>().end() && SkipMapTxEntry(mempool.mapTx.project<0>(mi), mapModifiedTx, failedTx)) {
+        if (mi != mempool.mapTx.get<ancestor_score>().end() && SkipMapTxEntry(mempool.mapTx.project<0>(mi), vInfo)) {
             ++mi;
             continue;
         }
@@ -399,23 +521,20 @@ void BlockAssembler::addPackageTxs()
             if (fUsingModified) {
 
                 mapModifiedTx.get<ancestor_score>().erase(modit);
-                failedTx.insert(iter);
+                vInfo[iter->vTxHashesIdx].nState = CPackageTxInfo::FAILED;
             }
             continue;
         }
 
+        // Ancestors already in the block have theirs in it too, so the walk stops at them.
         CTxMemPool::setEntries ancestors;
-        uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
-        std::string dummy;
-        mempool.CalculateMemPoolAncestors(*iter, ancestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
-
-        onlyUnconfirmed(ancestors);
+        mempool.CalculateAncestorsUntil(iter, ancestors, inBlock);
         ancestors.insert(iter);
 
-        if (!TestPackageTransactions(ancestors)) {
+        if (!TestPackageTransactions(ancestors, vInfo)) {
             if (fUsingModified) {
                 mapModifiedTx.get<ancestor_score>().erase(modit);
-                failedTx.insert(iter);
+                vInfo[iter->vTxHashesIdx].nState = CPackageTxInfo::FAILED;
             }
             continue;
         }
@@ -427,9 +546,15 @@ void BlockAssembler::addPackageTxs()
             AddToBlock(sortedEntries[i]);
 
             mapModifiedTx.erase(sortedEntries[i]);
+            vInfo[sortedEntries[i]->vTxHashesIdx].nState = CPackageTxInfo::IN_BLOCK;
         }
 
-        UpdatePackagesForAdded(ancestors, mapModifiedTx);
+        const CFeeRate feeRatePackage(packageFees, packageSize);
+        if (!fHavePackages || feeRatePackage < feeRateLowestPackage)
+            feeRateLowestPackage = feeRatePackage;
+        fHavePackages = true;
+
+        UpdatePackagesForAdded(ancestors, mapModifiedTx, vInfo);
     }
 }
 
@@ -502,6 +627,108 @@ void BlockAssembler::addPriorityTxs()
     fNeedSizeAccounting = fSizeAccounting;
 }
 
+/** Mempool additions kept for the template cache before it gives up and selects again */
+static const size_t MAX_TEMPLATE_PENDING_TXS = 10000;
+
+CBlockTemplateCache* pblocktemplatecache = NULL;
+
+CBlockTemplateCache::CBlockTemplateCache(const CChainParams& chainparamsIn)
+    : chainparams(chainparamsIn)
+    , assembler(chainparamsIn)
+    , pindexPrev(NULL)
+    , nTransactionsUpdated(0)
+    , fStale(false)
+{
+    connAdded = mempool.NotifyEntryAdded.connect(boost::bind(&CBlockTemplateCache::TransactionAddedToMempool, this, _1));
+    connRemoved = mempool.NotifyEntryRemoved.connect(boost::bind(&CBlockTemplateCache::TransactionRemovedFromMempool, this, _1));
+}
+
+bool CBlockTemplateCache::CheckUpdated()
+{
+    if (!pindexPrev || fStale)
+        return false;
+    // Each notification follows one increment of the mempool's counter; any other change to
+    // the pool (prioritisation, clearing, a new tip) shows up as a difference.
+    if (++nTransactionsUpdated != mempool.GetTransactionsUpdated() || vAdded.size() >= MAX_TEMPLATE_PENDING_TXS) {
+        fStale = true;
+        std::vector<uint256>().swap(vAdded);
+        return false;
+    }
+    return true;
+}
+
+void CBlockTemplateCache::TransactionAddedToMempool(const CTransaction& tx)
+{
+    if (CheckUpdated())
+        vAdded.push_back(tx.GetHash());
+    // Not under csBestBlock: its waiters take mempool.cs, which is held here.
+    cvBlockChange.notify_all();
+}
+
+void CBlockTemplateCache::TransactionRemovedFromMempool(const CTransaction& tx)
+{
+    // Sent before the entry is erased, so it can still be looked up.
+    if (CheckUpdated()) {
+        CTxMemPool::txiter it = mempool.mapTx.find(tx.GetHash());
+        if (it != mempool.mapTx.end() && assembler.IsSelected(it)) {
+            fStale = true;
+            std::vector<uint256>().swap(vAdded);
+        }
+    }
+    cvBlockChange.notify_all();
+}
+
+void CBlockTemplateCache::Select()
+{
+    pindexPrev = NULL;
+    assembler.SelectTransactions(chainActive.Tip());
+    pindexPrev = chainActive.Tip();
+    nTransactionsUpdated = mempool.GetTransactionsUpdated();
+    fStale = false;
+    vAdded.clear();
+}
+
+CBlockTemplate* CBlockTemplateCache::CreateNewBlock(const CScript& scriptPubKeyIn)
+{
+    LOCK2(cs_main, mempool.cs);
+
+    bool fSelected = false;
+    if (pindexPrev != chainActive.Tip() || fStale || nTransactionsUpdated != mempool.GetTransactionsUpdated()) {
+        Select();
+        fSelected = true;
+    } else if (!vAdded.empty()) {
+        std::vector<CTxMemPool::txiter> vNew;
+        vNew.reserve(vAdded.size());
+        BOOST_FOREACH (const uint256& hash, vAdded) {
+            CTxMemPool::txiter it = mempool.mapTx.find(hash);
+            if (it != mempool.mapTx.end())
+                vNew.push_back(it);
+        }
+        vAdded.clear();
+        if (!assembler.AddNewTransactions(vNew)) {
+            Select();
+            fSelected = true;
+        }
+    }
+
+    std::unique_ptr<CBlockTemplate> pblocktemplate(assembler.GetBlockTemplate(scriptPubKeyIn));
+    if (fSelected) {
+        CValidationState state;
+        if (!TestBlockValidity(state, chainparams, pblocktemplate->block, pindexPrev, false, false)) {
+            pindexPrev = NULL;
+            throw std::runtime_error(strprintf("%s: TestBlockValidity failed: %s", __func__, FormatStateMessage(state)));
+        }
+    }
+    return pblocktemplate.release();
+}
+
+CBlockTemplate* CreateBlockTemplate(const CChainParams& chainparams, const CScript& scriptPubKeyIn)
+{
+    if (pblocktemplatecache)
+        return pblocktemplatecache->CreateNewBlock(scriptPubKeyIn);
+    return BlockAssembler(chainparams).CreateNewBlock(scriptPubKeyIn);
+}
+
 void IncrementExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned int& nExtraNonce)
 {
 
@@ -512,12 +739,12 @@ void IncrementExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned
     }
     ++nExtraNonce;
     unsigned int nHeight = pindexPrev->nHeight + 1; // Height first in coinbase required for block.version=2
-    CMutableTransaction txCoinbase(pblock->vtx[0]);
+    CMutableTransaction txCoinbase(*pblock->vtx[0]);
     std::string coinbaseSignature = GetArg("-coinbasesignature", "");
     txCoinbase.vin[0].scriptSig = (CScript() << nHeight << CScriptNum(nExtraNonce) << std::vector<unsigned char>(coinbaseSignature.begin(), coinbaseSignature.end())) + COINBASE_FLAGS;
     assert(txCoinbase.vin[0].scriptSig.size() <= 100);
 
-    pblock->vtx[0] = txCoinbase;
+    pblock->vtx[0] = MakeTransactionRef(std::move(txCoinbase));
     pblock->hashMerkleRoot = BlockMerkleRoot(*pblock);
 }
 
@@ -597,7 +824,7 @@ void FormatHashBuffers(CBlock* pblock, char* pmidstate, char* pdata, char* phash
 bool ProcessBlockFound(const CBlock* pblock, const CChainParams& chainparams)
 {
     LogPrintf("%s\n", pblock->ToString());
-    LogPrintf("generated %s\n", FormatMoney(pblock->vtx[0].vout[0].nValue));
+    LogPrintf("generated %s\n", FormatMoney(pblock->vtx[0]->vout[0].nValue));
 
     {
         LOCK(cs_main);
@@ -663,7 +890,7 @@ void static BitcoinMiner(const CChainParams& chainparams)
             unsigned int nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
             CBlockIndex* pindexPrev = chainActive.Tip();
 
-            std::unique_ptr<CBlockTemplate> pblocktemplate(BlockAssembler(chainparams).CreateNewBlock(coinbaseScript->reserveScript));
+            std::unique_ptr<CBlockTemplate> pblocktemplate(CreateBlockTemplate(chainparams, coinbaseScript->reserveScript));
             if (!pblocktemplate.get()) {
                 LogPrintf("Error in GuldenMiner: Keypool ran out, please call keypoolrefill before restarting the mining thread\n");
                 return;
@@ -20,6 +20,7 @@
 #include <memory>
 #include "boost/multi_index_container.hpp"
 #include "boost/multi_index/ordered_index.hpp"
+#include <boost/signals2/connection.hpp>
 
 #include <Gulden/Common/scrypt.h>
 
@@ -139,6 +140,22 @@ struct update_for_parent_inclusion {
     CTxMemPool::txiter iter;
 };
 
+/** What addPackageTxs needs of a mempool entry besides its package state, worked
+ *  out for the whole pool before the selection starts. Kept in a vector indexed by
+ *  the entry's vTxHashesIdx, so the selection looks it up without a set or map. */
+struct CPackageTxInfo {
+    enum State : uint8_t {
+        CANDIDATE,
+        MODIFIED, //!< in mapModifiedTx
+        IN_BLOCK,
+        FAILED,
+    };
+
+    uint32_t nSerializedSize; //!< only set when the block size is accounted for
+    bool fIncludable; //!< final for the block and without witness unless it is enabled
+    State nState;
+};
+
 /** Run the miner threads */
 void GenerateBitcoins(bool fGenerate, int nThreads, const CChainParams& chainparams);
 
@@ -159,7 +176,11 @@ private:
     uint64_t nBlockSigOpsCost;
     CAmount nFees;
     CTxMemPool::setEntries inBlock;
+    //! Lowest feerate of the packages added by addPackageTxs/AddNewTransactions
+    CFeeRate feeRateLowestPackage;
+    bool fHavePackages;
 
+    CBlockIndex* pindexPrev;
     int nHeight;
     int64_t nLockTimeCutoff;
     const CChainParams& chainparams;
@@ -172,11 +193,24 @@ public:
     /** Construct a new block template with coinbase to scriptPubKeyIn */
     CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn);
 
+    /** Select the transactions of a block on top of pindexPrevIn and keep them until the next selection. */
+    void SelectTransactions(CBlockIndex* pindexPrevIn);
+    /** Add the packages of transactions that entered the mempool since the selection was made.
+     *  Returns false if a package did not fit but would have displaced selected packages, in
+     *  which case only a new selection gives the block SelectTransactions would make. */
+    bool AddNewTransactions(std::vector<CTxMemPool::txiter>& vNew);
+    /** Copy of the selected block with a coinbase paying scriptPubKeyIn */
+    CBlockTemplate* GetBlockTemplate(const CScript& scriptPubKeyIn);
+    /** Whether a transaction is part of the selection */
+    bool IsSelected(CTxMemPool::txiter iter) const { return inBlock.count(iter) != 0; }
+
 private:
     /** Clear the block's state and prepare for assembling a new block */
     void resetBlock();
     /** Add a tx to the block */
     void AddToBlock(CTxMemPool::txiter iter);
+    /** Fill in the coinbase and header of a block template of the selection */
+    void FinishBlock(CBlockTemplate& blocktemplate, const CScript& scriptPubKeyIn);
 
     /** Add transactions based on tx "priority" */
     void addPriorityTxs();
@@ -188,8 +222,6 @@ private:
     /** Test if tx still has unconfirmed parents not yet in block */
     bool isStillDependent(CTxMemPool::txiter iter);
 
-    /** Remove confirmed (inBlock) entries from given set */
-    void onlyUnconfirmed(CTxMemPool::setEntries& testSet);
     /** Test if a new package would "fit" in the block */
     bool TestPackage(uint64_t packageSize, int64_t packageSigOpsCost);
     /** Perform checks on each transaction in a package:
@@ -197,16 +229,80 @@ private:
       * These checks should always succeed, and they're here
       * only as an extra check in case of suboptimal node configuration */
     bool TestPackageTransactions(const CTxMemPool::setEntries& package);
+    /** As above, with the checks of each transaction looked up in vInfo */
+    bool TestPackageTransactions(const CTxMemPool::setEntries& package, const std::vector<CPackageTxInfo>& vInfo);
+    /** Fill vInfo for every mempool entry, spread over threads for a large pool */
+    void PreparePackageTxInfo(std::vector<CPackageTxInfo>& vInfo);
+    /** Fill vInfo for the entries of vTxHashes from nBegin up to nEnd */
+    void PreparePackageTxInfoRange(std::vector<CPackageTxInfo>* pvInfo, size_t nBegin, size_t nEnd);
     /** Return true if given transaction from mapTx has already been evaluated,
       * or if the transaction's cached data in mapTx is incorrect. */
-    bool SkipMapTxEntry(CTxMemPool::txiter it, indexed_modified_transaction_set& mapModifiedTx, CTxMemPool::setEntries& failedTx);
+    bool SkipMapTxEntry(CTxMemPool::txiter it, const std::vector<CPackageTxInfo>& vInfo);
     /** Sort the package in an order that is valid to appear in a block */
     void SortForBlock(const CTxMemPool::setEntries& package, CTxMemPool::txiter entry, std::vector<CTxMemPool::txiter>& sortedEntries);
     /** Add descendants of given transactions to mapModifiedTx with ancestor
       * state updated assuming given transactions are inBlock. */
-    void UpdatePackagesForAdded(const CTxMemPool::setEntries& alreadyAdded, indexed_modified_transaction_set& mapModifiedTx);
+    void UpdatePackagesForAdded(const CTxMemPool::setEntries& alreadyAdded, indexed_modified_transaction_set& mapModifiedTx, std::vector<CPackageTxInfo>& vInfo);
 };
 
+/**
+ * Block template kept up to date with the mempool.
+ *
+ * The transactions selected for the next block are kept between calls and
+ * transactions entering the pool are added to them as their packages fit, so
+ * a template costs work proportional to the changes since the previous one
+ * rather than a walk over the whole mempool. The selection is made again
+ * when the tip changes, when a selected transaction leaves the pool, when
+ * the pool changes in a way not reported to the cache (prioritisation,
+ * clearing) or when a new package would displace selected ones.
+ *
+ * Transactions added incrementally are chosen by package feerate only, so
+ * until the next selection a new high priority free transaction is not
+ * picked up. Templates from a new selection are checked with
+ * TestBlockValidity, templates extended from an existing one are not.
+ *
+ * State is protected by mempool.cs; notifications arrive with it held.
+ * Every notification also wakes long polling getblocktemplate calls through
+ * cvBlockChange, as the template they would be handed has changed.
+ */
+class CBlockTemplateCache {
+private:
+    const CChainParams& chainparams;
+    BlockAssembler assembler;
+    //! Tip the selection builds on, NULL if there is none
+    CBlockIndex* pindexPrev;
+    //! Mempool update counter accounted for by the selection and the notifications since
+    unsigned int nTransactionsUpdated;
+    //! The selection must be made again, e.g. because a selected transaction left the pool
+    bool fStale;
+    //! Transactions that entered the pool since the selection was last extended
+    std::vector<uint256> vAdded;
+
+    boost::signals2::scoped_connection connAdded;
+    boost::signals2::scoped_connection connRemoved;
+
+    CBlockTemplateCache(const CBlockTemplateCache&);
+    CBlockTemplateCache& operator=(const CBlockTemplateCache&);
+
+    /** Account for a notification; false if the selection is (now) stale */
+    bool CheckUpdated();
+    void TransactionAddedToMempool(const CTransaction& tx);
+    void TransactionRemovedFromMempool(const CTransaction& tx);
+    void Select();
+
+public:
+    CBlockTemplateCache(const CChainParams& chainparams);
+
+    /** Construct a new block template with coinbase to scriptPubKeyIn */
+    CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn);
+};
+
+/** The block template cache, NULL until the node is started */
+extern CBlockTemplateCache* pblocktemplatecache;
+
+/** Construct a new block template from the cache if there is one, otherwise with a BlockAssembler */
+CBlockTemplate* CreateBlockTemplate(const CChainParams& chainparams, const CScript& scriptPubKeyIn);
+
 /** Modify the extranonce in a block */
 void IncrementExtraNonce(CBlock* pblock, const CBlockIndex* pindexPrev, unsigned int& nExtraNonce);
 int64_t UpdateTime(CBlockHeader* pblock, const Consensus::Params& consensusParams, const CBlockIndex* pindexPrev);
@@ -13,64 +13,78 @@
 #include "txmempool.h"
 #include "util.h"
 
+#include <algorithm>
+
+/** Below this the stored moving averages are rescaled, long before dividing by it could overflow */
+static const double MIN_SCALE = 1e-100;
+
 void TxConfirmStats::Initialize(std::vector<double>& defaultBuckets,
                                 unsigned int maxConfirms, double _decay, std::string _dataTypeString)
 {
     decay = _decay;
+    scale = 1;
     dataTypeString = _dataTypeString;
-    for (unsigned int i = 0; i < defaultBuckets.size(); i++) {
-        buckets.push_back(defaultBuckets[i]);
-        bucketMap[defaultBuckets[i]] = i;
-    }
+    buckets = defaultBuckets;
     confAvg.resize(maxConfirms);
-    curBlockConf.resize(maxConfirms);
     unconfTxs.resize(maxConfirms);
     for (unsigned int i = 0; i < maxConfirms; i++) {
         confAvg[i].resize(buckets.size());
-        curBlockConf[i].resize(buckets.size());
         unconfTxs[i].resize(buckets.size());
     }
 
     oldUnconfTxs.resize(buckets.size());
-    curBlockTxCt.resize(buckets.size());
     txCtAvg.resize(buckets.size());
-    curBlockVal.resize(buckets.size());
     avg.resize(buckets.size());
 }
 
 void TxConfirmStats::ClearCurrent(unsigned int nBlockHeight)
 {
+    std::vector<int>& unconfTxsOut = unconfTxs[nBlockHeight % unconfTxs.size()];
     for (unsigned int j = 0; j < buckets.size(); j++) {
-        oldUnconfTxs[j] += unconfTxs[nBlockHeight % unconfTxs.size()][j];
-        unconfTxs[nBlockHeight % unconfTxs.size()][j] = 0;
-        for (unsigned int i = 0; i < curBlockConf.size(); i++)
-            curBlockConf[i][j] = 0;
-        curBlockTxCt[j] = 0;
-        curBlockVal[j] = 0;
+        oldUnconfTxs[j] += unconfTxsOut[j];
+        unconfTxsOut[j] = 0;
     }
 }
 
+unsigned int TxConfirmStats::FindBucketIndex(double val) const
+{
+    // The last bucket is unbounded in practice, so everything above the others lands in it.
+    std::vector<double>::const_iterator it = std::lower_bound(buckets.begin(), buckets.end(), val);
+    if (it == buckets.end())
+        --it;
+    return it - buckets.begin();
+}
+
 void TxConfirmStats::Record(int blocksToConfirm, double val)
 {
 
     if (blocksToConfirm < 1)
         return;
-    unsigned int bucketindex = bucketMap.lower_bound(val)->second;
-    for (size_t i = blocksToConfirm; i <= curBlockConf.size(); i++) {
-        curBlockConf[i - 1][bucketindex]++;
+    unsigned int bucketindex = FindBucketIndex(val);
+    const double weight = 1 / scale;
+    for (size_t i = blocksToConfirm; i <= confAvg.size(); i++) {
+        confAvg[i - 1][bucketindex] += weight;
     }
-    curBlockTxCt[bucketindex]++;
-    curBlockVal[bucketindex] += val;
+    txCtAvg[bucketindex] += weight;
+    avg[bucketindex] += val * weight;
 }
 
 void TxConfirmStats::UpdateMovingAverages()
+{
+    scale *= decay;
+    if (scale < MIN_SCALE)
+        Normalize();
+}
+
+void TxConfirmStats::Normalize()
 {
     for (unsigned int j = 0; j < buckets.size(); j++) {
         for (unsigned int i = 0; i < confAvg.size(); i++)
-            confAvg[i][j] = confAvg[i][j] * decay + curBlockConf[i][j];
-        avg[j] = avg[j] * decay + curBlockVal[j];
-        txCtAvg[j] = txCtAvg[j] * decay + curBlockTxCt[j];
+            confAvg[i][j] *= scale;
+        avg[j] *= scale;
+        txCtAvg[j] *= scale;
     }
+    scale = 1;
 }
 
 double TxConfirmStats::EstimateMedianVal(int confTarget, double sufficientTxVal,
@@ -97,8 +111,8 @@ double TxConfirmStats::EstimateMedianVal(int confTarget, double sufficientTxVal,
 
     for (int bucket = startbucket; bucket >= 0 && bucket <= maxbucketindex; bucket += step) {
         curFarBucket = bucket;
-        nConf += confAvg[confTarget - 1][bucket];
-        totalNum += txCtAvg[bucket];
+        nConf += confAvg[confTarget - 1][bucket] * scale;
+        totalNum += txCtAvg[bucket] * scale;
         for (unsigned int confct = confTarget; confct < GetMaxConfirms(); confct++)
             extraNum += unconfTxs[(nBlockHeight - confct) % bins][bucket];
         extraNum += oldUnconfTxs[bucket];
@@ -123,6 +137,7 @@ double TxConfirmStats::EstimateMedianVal(int confTarget, double sufficientTxVal,
         }
     }
 
+    // The median only compares and divides averages, so it can use them as stored.
     double median = -1;
     double txSum = 0;
 
@@ -153,6 +168,7 @@ double TxConfirmStats::EstimateMedianVal(int confTarget, double sufficientTxVal,
 
 void TxConfirmStats::Write(CAutoFile& fileout)
 {
+    Normalize();
     fileout << decay;
     fileout << buckets;
     fileout << avg;
@@ -193,19 +209,17 @@ void TxConfirmStats::Read(CAutoFile& filein)
             throw std::runtime_error("Corrupt estimates file. Mismatch in fee/pri conf average bucket count");
     }
 
+    for (unsigned int i = 1; i < numBuckets; i++) {
+        if (fileBuckets[i] <= fileBuckets[i - 1])
+            throw std::runtime_error("Corrupt estimates file. Fee/pri buckets must be ascending");
+    }
+
     decay = fileDecay;
+    scale = 1;
     buckets = fileBuckets;
     avg = fileAvg;
     confAvg = fileConfAvg;
     txCtAvg = fileTxCtAvg;
-    bucketMap.clear();
-
-    curBlockConf.resize(maxConfirms);
-    for (unsigned int i = 0; i < maxConfirms; i++) {
-        curBlockConf[i].resize(buckets.size());
-    }
-    curBlockTxCt.resize(buckets.size());
-    curBlockVal.resize(buckets.size());
 
     unconfTxs.resize(maxConfirms);
     for (unsigned int i = 0; i < maxConfirms; i++) {
@@ -213,16 +227,13 @@ void TxConfirmStats::Read(CAutoFile& filein)
     }
     oldUnconfTxs.resize(buckets.size());
 
-    for (unsigned int i = 0; i < buckets.size(); i++)
-        bucketMap[buckets[i]] = i;
-
     LogPrint("estimatefee", "Reading estimates: %u %s buckets counting confirms up to %u blocks\n",
              numBuckets, dataTypeString, maxConfirms);
 }
 
 unsigned int TxConfirmStats::NewTx(unsigned int nBlockHeight, double val)
 {
-    unsigned int bucketindex = bucketMap.lower_bound(val)->second;
+    unsigned int bucketindex = FindBucketIndex(val);
     unsigned int blockIndex = nBlockHeight % unconfTxs.size();
     unconfTxs[blockIndex][bucketindex]++;
     LogPrint("estimatefee", "adding to %s", dataTypeString);
@@ -268,9 +279,13 @@ void CBlockPolicyEstimator::removeTx(uint256 hash)
     unsigned int entryHeight = pos->second.blockHeight;
     unsigned int bucketIndex = pos->second.bucketIndex;
 
-    if (stats != NULL)
+    if (stats != NULL) {
         stats->removeTx(entryHeight, nBestSeenHeight, bucketIndex);
-    mapMemPoolTxs.erase(hash);
+        // Transactions that entered before the last block count towards the estimates.
+        if (entryHeight != nBestSeenHeight)
+            InvalidateEstimates();
+    }
+    mapMemPoolTxs.erase(pos);
 }
 
 CBlockPolicyEstimator::CBlockPolicyEstimator(const CFeeRate& _minRelayFee)
@@ -318,7 +333,8 @@ void CBlockPolicyEstimator::processTransaction(const CTxMemPoolEntry& entry, boo
 {
     unsigned int txHeight = entry.GetHeight();
     uint256 hash = entry.GetTx().GetHash();
-    if (mapMemPoolTxs[hash].stats != NULL) {
+    TxStatsInfo& info = mapMemPoolTxs[hash];
+    if (info.stats != NULL) {
         LogPrint("estimatefee", "Blockpolicy error mempool tx %s already being tracked\n",
                  hash.ToString().c_str());
         return;
@@ -337,21 +353,25 @@ void CBlockPolicyEstimator::processTransaction(const CTxMemPoolEntry& entry, boo
         return;
     }
 
+    // Estimates only read unconfirmed counts from before the last block seen.
+    if (txHeight != nBestSeenHeight)
+        InvalidateEstimates();
+
     CFeeRate feeRate(entry.GetFee(), entry.GetTxSize());
 
     double curPri = entry.GetPriority(txHeight);
-    mapMemPoolTxs[hash].blockHeight = txHeight;
+    info.blockHeight = txHeight;
 
     LogPrint("estimatefee", "Blockpolicy mempool tx %s ", hash.ToString().substr(0, 10));
 
     if (entry.GetFee() == 0 || isPriDataPoint(feeRate, curPri)) {
-        mapMemPoolTxs[hash].stats = &priStats;
-        mapMemPoolTxs[hash].bucketIndex = priStats.NewTx(txHeight, curPri);
+        info.stats = &priStats;
+        info.bucketIndex = priStats.NewTx(txHeight, curPri);
     }
 
     else if (isFeeDataPoint(feeRate, curPri)) {
-        mapMemPoolTxs[hash].stats = &feeStats;
-        mapMemPoolTxs[hash].bucketIndex = feeStats.NewTx(txHeight, (double)feeRate.GetFeePerK());
+        info.stats = &feeStats;
+        info.bucketIndex = feeStats.NewTx(txHeight, (double)feeRate.GetFeePerK());
     } else {
         LogPrint("estimatefee", "not adding");
     }
@@ -393,6 +413,7 @@ void CBlockPolicyEstimator::processBlock(unsigned int nBlockHeight,
         return;
     }
     nBestSeenHeight = nBlockHeight;
+    InvalidateEstimates();
 
     if (!fCurrentEstimate)
         return;
@@ -421,12 +442,13 @@ void CBlockPolicyEstimator::processBlock(unsigned int nBlockHeight,
     feeStats.ClearCurrent(nBlockHeight);
     priStats.ClearCurrent(nBlockHeight);
 
-    for (unsigned int i = 0; i < entries.size(); i++)
-        processBlockTx(nBlockHeight, entries[i]);
-
+    // Decay the history first, the transactions of this block are recorded at full weight.
     feeStats.UpdateMovingAverages();
     priStats.UpdateMovingAverages();
 
+    for (unsigned int i = 0; i < entries.size(); i++)
+        processBlockTx(nBlockHeight, entries[i]);
+
     LogPrint("estimatefee", "Blockpolicy after updating estimates for %u confirmed entries, new mempool map size %u\n",
              entries.size(), mapMemPoolTxs.size());
 }
@@ -437,7 +459,7 @@ CFeeRate CBlockPolicyEstimator::estimateFee(int confTarget)
     if (confTarget <= 0 || (unsigned int)confTarget > feeStats.GetMaxConfirms())
         return CFeeRate(0);
 
-    double median = feeStats.EstimateMedianVal(confTarget, SUFFICIENT_FEETXS, MIN_SUCCESS_PCT, true, nBestSeenHeight);
+    double median = GetEstimate(feeStats, vFeeEstimates, SUFFICIENT_FEETXS, confTarget);
 
     if (median < 0)
         return CFeeRate(0);
@@ -455,7 +477,7 @@ CFeeRate CBlockPolicyEstimator::estimateSmartFee(int confTarget, int* answerFoun
 
     double median = -1;
     while (median < 0 && (unsigned int)confTarget <= feeStats.GetMaxConfirms()) {
-        median = feeStats.EstimateMedianVal(confTarget++, SUFFICIENT_FEETXS, MIN_SUCCESS_PCT, true, nBestSeenHeight);
+        median = GetEstimate(feeStats, vFeeEstimates, SUFFICIENT_FEETXS, confTarget++);
     }
 
     if (answerFoundAtTarget)
@@ -477,7 +499,7 @@ double CBlockPolicyEstimator::estimatePriority(int confTarget)
     if (confTarget <= 0 || (unsigned int)confTarget > priStats.GetMaxConfirms())
         return -1;
 
-    return priStats.EstimateMedianVal(confTarget, SUFFICIENT_PRITXS, MIN_SUCCESS_PCT, true, nBestSeenHeight);
+    return GetEstimate(priStats, vPriEstimates, SUFFICIENT_PRITXS, confTarget);
 }
 
 double CBlockPolicyEstimator::estimateSmartPriority(int confTarget, int* answerFoundAtTarget, const CTxMemPool& pool)
@@ -494,7 +516,7 @@ double CBlockPolicyEstimator::estimateSmartPriority(int confTarget, int* answerF
 
     double median = -1;
     while (median < 0 && (unsigned int)confTarget <= priStats.GetMaxConfirms()) {
-        median = priStats.EstimateMedianVal(confTarget++, SUFFICIENT_PRITXS, MIN_SUCCESS_PCT, true, nBestSeenHeight);
+        median = GetEstimate(priStats, vPriEstimates, SUFFICIENT_PRITXS, confTarget++);
     }
 
     if (answerFoundAtTarget)
@@ -503,11 +525,28 @@ double CBlockPolicyEstimator::estimateSmartPriority(int confTarget, int* answerF
     return median;
 }
 
+double CBlockPolicyEstimator::GetEstimate(TxConfirmStats& stats, std::vector<double>& vEstimates, double sufficientTxVal, int confTarget)
+{
+    if (vEstimates.empty()) {
+        for (unsigned int i = 1; i <= stats.GetMaxConfirms(); i++)
+            vEstimates.push_back(stats.EstimateMedianVal(i, sufficientTxVal, MIN_SUCCESS_PCT, true, nBestSeenHeight));
+    }
+    return vEstimates[confTarget - 1];
+}
+
+void CBlockPolicyEstimator::InvalidateEstimates()
+{
+    vFeeEstimates.clear();
+    vPriEstimates.clear();
+}
+
 void CBlockPolicyEstimator::Write(CAutoFile& fileout)
 {
     fileout << nBestSeenHeight;
     feeStats.Write(fileout);
     priStats.Write(fileout);
+    fileout << FEE_ESTIMATOR_VERSION;
+    fileout << feeLikely << feeUnlikely << priLikely << priUnlikely;
 }
 
 void CBlockPolicyEstimator::Read(CAutoFile& filein)
@@ -517,6 +556,25 @@ void CBlockPolicyEstimator::Read(CAutoFile& filein)
     feeStats.Read(filein);
     priStats.Read(filein);
     nBestSeenHeight = nFileBestSeenHeight;
+    InvalidateEstimates();
+
+    int nFileVersion = 0;
+    try {
+        filein >> nFileVersion;
+    }
+    catch (const std::ios_base::failure&) {
+        // Written before the estimator data was versioned; the cutoffs follow with the next block.
+    }
+    if (nFileVersion >= 1) {
+        CFeeRate fileFeeLikely, fileFeeUnlikely;
+        double filePriLikely, filePriUnlikely;
+        filein >> fileFeeLikely >> fileFeeUnlikely >> filePriLikely >> filePriUnlikely;
+        feeLikely = fileFeeLikely;
+        feeUnlikely = fileFeeUnlikely;
+        priLikely = filePriLikely;
+        priUnlikely = filePriUnlikely;
+    }
+    LogPrint("estimatefee", "Reading estimator data version %d\n", nFileVersion);
 }
 
 FeeFilterRounder::FeeFilterRounder(const CFeeRate& minIncrementalFee)
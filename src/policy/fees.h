@@ -78,20 +78,18 @@ class CTxMemPool;
  */
 class TxConfirmStats {
 private:
-    std::vector<double> buckets; // The upper-bound of the range for the bucket (inclusive)
-    std::map<double, unsigned int> bucketMap; // Map of bucket upper-bound to index into all vectors by bucket
+    std::vector<double> buckets; // The upper-bound of the range for the bucket (inclusive), ascending
 
-    std::vector<double> txCtAvg;
+    // The moving averages below are stored divided by scale, so decaying all
+    // of them for a new block only multiplies scale by decay.
 
-    std::vector<int> curBlockTxCt;
+    std::vector<double> txCtAvg;
 
     std::vector<std::vector<double> > confAvg; // confAvg[Y][X]
 
-    std::vector<std::vector<int> > curBlockConf; // curBlockConf[Y][X]
-
     std::vector<double> avg;
 
-    std::vector<double> curBlockVal;
+    double scale;
 
     std::string dataTypeString;
     double decay;
@@ -111,11 +109,15 @@ public:
      */
     void Initialize(std::vector<double>& defaultBuckets, unsigned int maxConfirms, double decay, std::string dataTypeString);
 
-    /** Clear the state of the curBlock variables to start counting for the new block */
+    /** Move the unconfirmed transactions that entered a max confirms ago to oldUnconfTxs */
     void ClearCurrent(unsigned int nBlockHeight);
 
+    /** Index of the bucket holding val */
+    unsigned int FindBucketIndex(double val) const;
+
     /**
-     * Record a new transaction data point in the current block stats
+     * Record a new transaction data point in the moving averages, after they
+     * were decayed for the block that confirmed it
      * @param blocksToConfirm the number of blocks it took this transaction to confirm
      * @param val either the fee or the priority when entered of the transaction
      * @warning blocksToConfirm is 1-based and has to be >= 1
@@ -129,10 +131,12 @@ public:
     void removeTx(unsigned int entryHeight, unsigned int nBestSeenHeight,
                   unsigned int bucketIndex);
 
-    /** Update our estimates by decaying our historical moving average and updating
-        with the data gathered from the current block */
+    /** Decay our historical moving averages for a new block */
     void UpdateMovingAverages();
 
+    /** Apply scale to the stored moving averages and reset it to 1 */
+    void Normalize();
+
     /**
      * Calculate a fee or priority estimate.  Find the lowest value bucket (or range of buckets
      * to make sure we have enough data points) whose transactions still have sufficient likelihood
@@ -189,6 +193,13 @@ static const double FEE_SPACING = 1.1;
 /** Spacing of Priority buckets */
 static const double PRI_SPACING = 2;
 
+/**
+ * Version of the estimator data following the stats in the estimates file.
+ * Files written before it was added are read as version 0, and every version
+ * only appends to the previous one so older versions can still read it.
+ */
+static const int FEE_ESTIMATOR_VERSION = 1;
+
 /**
  *  We want to be able to estimate fees or priorities that are needed on tx's to be included in
  * a certain number of blocks.  Every time a block is added to the best chain, this class records
@@ -266,6 +277,17 @@ private:
     /** Breakpoints to help determine whether a transaction was confirmed by priority or Fee */
     CFeeRate feeLikely, feeUnlikely;
     double priLikely, priUnlikely;
+
+    /**
+     * Estimates at MIN_SUCCESS_PCT for every target, indexed by target - 1.
+     * They only change with a block or when a transaction that entered before
+     * the last block leaves the mempool; empty until asked for after that.
+     */
+    std::vector<double> vFeeEstimates, vPriEstimates;
+
+    /** Return the cached estimate of stats for confTarget, recalculating all targets when stale */
+    double GetEstimate(TxConfirmStats& stats, std::vector<double>& vEstimates, double sufficientTxVal, int confTarget);
+    void InvalidateEstimates();
 };
 
 class FeeFilterRounder {
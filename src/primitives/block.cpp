@@ -13,6 +13,7 @@
 #include "primitives/block.h"
 
 #include "hash.h"
+#include "startupconfig.h"
 #include "tinyformat.h"
 #include "utilstrencodings.h"
 #include "crypto/common.h"
@@ -38,17 +39,17 @@ std::string CBlock::ToString() const
                    nTime, nBits, nNonce,
                    vtx.size());
     for (unsigned int i = 0; i < vtx.size(); i++) {
-        s << "  " << vtx[i].ToString() << "\n";
+        s << "  " << vtx[i]->ToString() << "\n";
     }
     return s.str();
 }
 
-uint256 CBlock::GetPoWHash() const
+uint256 CBlockHeader::GetPoWHash() const
 {
 
     arith_uint256 thash;
 
-    if (GetBoolArg("-testnetaccel", false)) {
+    if (StartupConfig().fTestnetAccel) {
         hash_city(BEGIN(nVersion), thash);
     } else {
         char scratchpad[SCRYPT_SCRATCHPAD_SIZE];
@@ -72,6 +72,9 @@ public:
 
     uint256 GetHash() const;
 
+    /** Scrypt hash of the header that is checked against the target. */
+    uint256 GetPoWHash() const;
+
     int64_t GetBlockTime() const
     {
         return (int64_t)nTime;
@@ -80,7 +83,7 @@ public:
 
 class CBlock : public CBlockHeader {
 public:
-    std::vector<CTransaction> vtx;
+    std::vector<CTransactionRef> vtx;
 
     mutable bool fChecked;
 
@@ -89,7 +92,7 @@ public:
         SetNull();
     }
 
-    CBlock(const CBlockHeader& header)
+    explicit CBlock(const CBlockHeader& header)
     {
         SetNull();
         *((CBlockHeader*)this) = header;
@@ -111,8 +114,6 @@ public:
         fChecked = false;
     }
 
-    uint256 GetPoWHash() const;
-
     CBlockHeader GetBlockHeader() const
     {
         CBlockHeader block;
@@ -128,6 +129,33 @@ public:
     std::string ToString() const;
 };
 
+/**
+ * Payload of a headers message: every header is followed by a transaction
+ * count, which is always zero. Serializes a vector of headers in that format
+ * without building an empty CBlock for each.
+ */
+class CHeadersMessage {
+    const std::vector<CBlockHeader>& headers;
+
+public:
+    explicit CHeadersMessage(const std::vector<CBlockHeader>& headersIn) : headers(headersIn) {}
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        return GetSizeOfCompactSize(headers.size()) + headers.size() * (::GetSerializeSize(CBlockHeader(), nType, nVersion) + GetSizeOfCompactSize(0));
+    }
+
+    template <typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        WriteCompactSize(s, headers.size());
+        for (const CBlockHeader& header : headers) {
+            header.Serialize(s, nType, nVersion);
+            WriteCompactSize(s, 0);
+        }
+    }
+};
+
 /** Describes a place in the block chain to another node such that if the
  * other node doesn't have the same branch, it can find a recent common trunk.
  * The further back it is, the further before the fork it may be.
@@ -447,6 +447,13 @@ struct CMutableTransaction {
     uint256 GetHash() const;
 };
 
+/** Shared reference to an immutable transaction, so blocks, the mempool and
+ * notifications can all hold the same object without copying it. */
+typedef std::shared_ptr<const CTransaction> CTransactionRef;
+static inline CTransactionRef MakeTransactionRef() { return std::make_shared<const CTransaction>(); }
+template <typename Tx>
+static inline CTransactionRef MakeTransactionRef(Tx&& txIn) { return std::make_shared<const CTransaction>(std::forward<Tx>(txIn)); }
+
 /** Compute the weight of a transaction, as defined by BIP 141 */
 int64_t GetTransactionWeight(const CTransaction& tx);
 
@@ -211,7 +211,11 @@ static bool rest_block(HTTPRequest* req,
     if (!ParseHashStr(hashStr, hash))
         return RESTERR(req, HTTP_BAD_REQUEST, "Invalid hash: " + hashStr);
 
+    // Binary and hex replies are the serialized block, which is what is on
+    // disk; only JSON needs the block deserialized.
+    const bool fRaw = (rf == RF_BINARY || rf == RF_HEX);
     CBlock block;
+    CRawBlock rawBlock;
     CBlockIndex* pblockindex = NULL;
     {
         LOCK(cs_main);
@@ -222,23 +226,23 @@ static bool rest_block(HTTPRequest* req,
         if (fHavePruned && !(pblockindex->nStatus & BLOCK_HAVE_DATA) && pblockindex->nTx > 0)
             return RESTERR(req, HTTP_NOT_FOUND, hashStr + " not available (pruned data)");
 
-        if (!ReadBlockFromDisk(block, pblockindex, Params().GetConsensus()))
+        if (fRaw) {
+            if (!ReadRawBlockFromDisk(rawBlock, pblockindex->GetBlockPos(), Params().MessageStart()))
+                return RESTERR(req, HTTP_NOT_FOUND, hashStr + " not found");
+        } else if (!ReadBlockFromDisk(block, pblockindex, Params().GetConsensus()))
             return RESTERR(req, HTTP_NOT_FOUND, hashStr + " not found");
     }
 
-    CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
-    ssBlock << block;
-
     switch (rf) {
     case RF_BINARY: {
-        string binaryBlock = ssBlock.str();
+        string binaryBlock(rawBlock.begin(), rawBlock.end());
         req->WriteHeader("Content-Type", "application/octet-stream");
         req->WriteReply(HTTP_OK, binaryBlock);
         return true;
     }
 
     case RF_HEX: {
-        string strHex = HexStr(ssBlock.begin(), ssBlock.end()) + "\n";
+        string strHex = HexStr(rawBlock.begin(), rawBlock.end()) + "\n";
         req->WriteHeader("Content-Type", "text/plain");
         req->WriteReply(HTTP_OK, strHex);
         return true;
@@ -395,6 +399,57 @@ static bool rest_tx(HTTPRequest* req, const std::string& strURIPart)
     return true; // continue to process further HTTP reqs on this cxn
 }
 
+UniValue getaddresstxids(const UniValue& params, bool fHelp);
+UniValue getaddressutxos(const UniValue& params, bool fHelp);
+UniValue getaddressbalance(const UniValue& params, bool fHelp);
+
+/** Serve an address index query for the address in the URI through the matching RPC call. */
+static bool rest_address(HTTPRequest* req, const std::string& strURIPart, rpcfn_type actor)
+{
+    if (!CheckWarmup(req))
+        return false;
+    std::string strAddress;
+    const RetFormat rf = ParseDataFormat(strAddress, strURIPart);
+
+    switch (rf) {
+    case RF_JSON: {
+        UniValue rpcParams(UniValue::VARR);
+        rpcParams.push_back(strAddress);
+        UniValue result;
+        try {
+            result = actor(rpcParams, false);
+        }
+        catch (const UniValue& objError) {
+            return RESTERR(req, HTTP_BAD_REQUEST, find_value(objError, "message").get_str());
+        }
+        string strJSON = result.write() + "\n";
+        req->WriteHeader("Content-Type", "application/json");
+        req->WriteReply(HTTP_OK, strJSON);
+        return true;
+    }
+    default: {
+        return RESTERR(req, HTTP_NOT_FOUND, "output format not found (available: json)");
+    }
+    }
+
+    return true; // continue to process further HTTP reqs on this cxn
+}
+
+static bool rest_address_txids(HTTPRequest* req, const std::string& strURIPart)
+{
+    return rest_address(req, strURIPart, &getaddresstxids);
+}
+
+static bool rest_address_utxos(HTTPRequest* req, const std::string& strURIPart)
+{
+    return rest_address(req, strURIPart, &getaddressutxos);
+}
+
+static bool rest_address_balance(HTTPRequest* req, const std::string& strURIPart)
+{
+    return rest_address(req, strURIPart, &getaddressbalance);
+}
+
 static bool rest_getutxos(HTTPRequest* req, const std::string& strURIPart)
 {
     if (!CheckWarmup(req))
@@ -586,6 +641,9 @@ static const struct {
       { "/rest/mempool/contents", rest_mempool_contents },
       { "/rest/headers/", rest_headers },
       { "/rest/getutxos", rest_getutxos },
+      { "/rest/address/txids/", rest_address_txids },
+      { "/rest/address/utxos/", rest_address_utxos },
+      { "/rest/address/balance/", rest_address_balance },
   };
 
 bool StartREST()
@@ -14,8 +14,10 @@
 #include "chain.h"
 #include "chainparams.h"
 #include "checkpoints.h"
+#include "clientversion.h"
 #include "coins.h"
 #include "consensus/validation.h"
+#include "dbwrapper.h"
 #include "main.h"
 #include "policy/policy.h"
 #include "primitives/transaction.h"
@@ -33,6 +35,10 @@
 
 #include <boost/thread/thread.hpp> // boost::thread::interrupt
 
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
 using namespace std;
 
 extern void TxToJSON(const CTransaction& tx, const uint256 hashBlock, UniValue& entry);
@@ -109,13 +115,13 @@ UniValue blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool tx
     result.push_back(Pair("versionHex", strprintf("%08x", block.nVersion)));
     result.push_back(Pair("merkleroot", block.hashMerkleRoot.GetHex()));
     UniValue txs(UniValue::VARR);
-    BOOST_FOREACH (const CTransaction& tx, block.vtx) {
+    for (const auto& tx : block.vtx) {
         if (txDetails) {
             UniValue objTx(UniValue::VOBJ);
-            TxToJSON(tx, uint256(), objTx);
+            TxToJSON(*tx, uint256(), objTx);
             txs.push_back(objTx);
         } else
-            txs.push_back(tx.GetHash().GetHex());
+            txs.push_back(tx->GetHash().GetHex());
     }
     result.push_back(Pair("tx", txs));
     result.push_back(Pair("time", block.GetBlockTime()));
@@ -603,6 +609,7 @@ struct CCoinsStats {
     uint64_t nTransactions;
     uint64_t nTransactionOutputs;
     uint64_t nSerializedSize;
+    uint64_t nSerializedSizePerTx;
     uint256 hashSerialized;
     CAmount nTotalAmount;
 
@@ -611,6 +618,7 @@ struct CCoinsStats {
         , nTransactions(0)
         , nTransactionOutputs(0)
         , nSerializedSize(0)
+        , nSerializedSizePerTx(0)
         , nTotalAmount(0)
     {
     }
@@ -645,6 +653,7 @@ static bool GetUTXOStats(CCoinsView* view, CCoinsStats& stats)
                 }
             }
             stats.nSerializedSize += 32 + pcursor->GetValueSize();
+            stats.nSerializedSizePerTx += 1 + 32 + ::GetSerializeSize(coins, SER_DISK, CLIENT_VERSION);
             ss << VARINT(0);
         } else {
             return error("%s: unable to read value", __func__);
@@ -669,7 +678,8 @@ UniValue gettxoutsetinfo(const UniValue& params, bool fHelp)
             "  \"bestblock\": \"hex\",   (string) the best block hash hex\n"
             "  \"transactions\": n,      (numeric) The number of transactions\n"
             "  \"txouts\": n,            (numeric) The number of output transactions\n"
-            "  \"bytes_serialized\": n,  (numeric) The serialized size\n"
+            "  \"bytes_serialized\": n,  (numeric) The serialized size of the per output records, keys included\n"
+            "  \"bytes_serialized_pertx\": n,  (numeric) The size the same set would take as per transaction records\n"
             "  \"hash_serialized\": \"hash\",   (string) The serialized hash\n"
             "  \"total_amount\": x.xxx          (numeric) The total amount\n"
             "}\n"
@@ -687,6 +697,7 @@ UniValue gettxoutsetinfo(const UniValue& params, bool fHelp)
         ret.push_back(Pair("transactions", (int64_t)stats.nTransactions));
         ret.push_back(Pair("txouts", (int64_t)stats.nTransactionOutputs));
         ret.push_back(Pair("bytes_serialized", (int64_t)stats.nSerializedSize));
+        ret.push_back(Pair("bytes_serialized_pertx", (int64_t)stats.nSerializedSizePerTx));
         ret.push_back(Pair("hash_serialized", stats.hashSerialized.GetHex()));
         ret.push_back(Pair("total_amount", ValueFromAmount(stats.nTotalAmount)));
     }
@@ -1000,7 +1011,7 @@ UniValue getchaintips(const UniValue& params, bool fHelp)
     std::set<const CBlockIndex*> setOrphans;
     std::set<const CBlockIndex*> setPrevs;
 
-    BOOST_FOREACH (const PAIRTYPE(const uint256, CBlockIndex*)&item, mapBlockIndex) {
+    for (const BlockMap::value_type& item : mapBlockIndex) {
         if (!chainActive.Contains(item.second)) {
             setOrphans.insert(item.second);
             setPrevs.insert(item.second->pprev);
@@ -1087,6 +1098,101 @@ UniValue getmempoolinfo(const UniValue& params, bool fHelp)
     return mempoolInfoToJSON();
 }
 
+UniValue getmempoolmemory(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getmempoolmemory\n"
+            "\nReturns the memory used by the TX memory pool, split by index and component.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"size\": xxxxx,               (numeric) Current tx count\n"
+            "  \"usage\": xxxxx,              (numeric) Total memory usage for the mempool, as limited by -maxmempool\n"
+            "  \"transactions\": xxxxx,       (numeric) The transactions themselves\n"
+            "  \"entries\": xxxxx,            (numeric) The entries, with the nodes of the txid, descendant score, entry time, mining score and ancestor score indexes\n"
+            "  \"entrysize\": xxxxx,          (numeric) Size of a single entry, without its index nodes\n"
+            "  \"links\": xxxxx,              (numeric) The in-mempool parents and children of every transaction\n"
+            "  \"spentoutputs\": xxxxx,       (numeric) The index of the outputs spent by the transactions\n"
+            "  \"deltas\": xxxxx,             (numeric) The fee and priority deltas set with prioritisetransaction\n"
+            "  \"txhashes\": xxxxx,           (numeric) The list of transactions used to reconstruct compact blocks\n"
+            "  \"allocated\": xxxxx           (numeric, optional) Bytes the allocator reports in use by the whole process, to check the estimates against\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getmempoolmemory", "")
+            + HelpExampleRpc("getmempoolmemory", ""));
+
+    const CTxMemPool::MemoryUsage usage = mempool.GetMemoryUsage();
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("size", (int64_t)mempool.size()));
+    ret.push_back(Pair("usage", (int64_t)mempool.DynamicMemoryUsage()));
+    ret.push_back(Pair("transactions", (int64_t)usage.nTransactions));
+    ret.push_back(Pair("entries", (int64_t)usage.nEntries));
+    ret.push_back(Pair("entrysize", (int64_t)sizeof(CTxMemPoolEntry)));
+    ret.push_back(Pair("links", (int64_t)usage.nLinks));
+    ret.push_back(Pair("spentoutputs", (int64_t)usage.nNextTx));
+    ret.push_back(Pair("deltas", (int64_t)usage.nDeltas));
+    ret.push_back(Pair("txhashes", (int64_t)usage.nTxHashes));
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    struct mallinfo2 mi = mallinfo2();
+    ret.push_back(Pair("allocated", (int64_t)(mi.uordblks + mi.hblkhd)));
+#elif defined(__GLIBC__)
+    // The counters of mallinfo are ints, read them back as unsigned so they last up to 4GB.
+    struct mallinfo mi = mallinfo();
+    ret.push_back(Pair("allocated", (int64_t)(unsigned int)mi.uordblks + (int64_t)(unsigned int)mi.hblkhd));
+#endif
+    return ret;
+}
+
+UniValue getdbstats(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getdbstats\n"
+            "\nReturns the LevelDB profile and statistics of every open database.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"name\": {                     (object) one entry per database (blockindex, chainstate, txindex)\n"
+            "    \"path\": \"path\",              (string) location of the database\n"
+            "    \"blockcache\": xxxxx,          (numeric) block cache size in bytes\n"
+            "    \"writebuffer\": xxxxx,         (numeric) write buffer size in bytes\n"
+            "    \"blocksize\": xxxxx,           (numeric) table block size in bytes\n"
+            "    \"bloombits\": xxxxx,           (numeric) bloom filter bits per key, 0 if disabled\n"
+            "    \"maxopenfiles\": xxxxx,        (numeric) table files kept open\n"
+            "    \"compression\": true|false,    (boolean) whether table blocks are compressed\n"
+            "    \"approximate-size\": xxxxx,    (numeric) estimated size on disk in bytes\n"
+            "    \"approximate-memory-usage\": xxxxx, (numeric, optional) memory used by the memtables and block cache, if leveldb reports it\n"
+            "    \"files-per-level\": [n,...],   (array) number of table files at each level\n"
+            "    \"stats\": \"...\"               (string) leveldb.stats compaction statistics\n"
+            "  },\n"
+            "  ...\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getdbstats", "")
+            + HelpExampleRpc("getdbstats", ""));
+
+    UniValue ret(UniValue::VOBJ);
+    for (const CDBStats& stats : GetDBStats()) {
+        UniValue entry(UniValue::VOBJ);
+        entry.push_back(Pair("path", stats.strPath));
+        entry.push_back(Pair("blockcache", (uint64_t)stats.options.nBlockCacheSize));
+        entry.push_back(Pair("writebuffer", (uint64_t)stats.options.nWriteBufferSize));
+        entry.push_back(Pair("blocksize", (uint64_t)stats.options.nBlockSize));
+        entry.push_back(Pair("bloombits", stats.options.nBloomBits));
+        entry.push_back(Pair("maxopenfiles", stats.options.nMaxOpenFiles));
+        entry.push_back(Pair("compression", stats.options.fCompression));
+        entry.push_back(Pair("approximate-size", stats.nApproximateSize));
+        if (stats.nMemoryUsage >= 0)
+            entry.push_back(Pair("approximate-memory-usage", stats.nMemoryUsage));
+        UniValue levels(UniValue::VARR);
+        for (int nFiles : stats.vFilesAtLevel)
+            levels.push_back(nFiles);
+        entry.push_back(Pair("files-per-level", levels));
+        entry.push_back(Pair("stats", stats.strStats));
+        ret.push_back(Pair(stats.options.strName, entry));
+    }
+    return ret;
+}
+
 UniValue invalidateblock(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
@@ -1169,11 +1275,13 @@ static const CRPCCommand commands[] = { //  category              name
     { "blockchain", "getblockhash", &getblockhash, true },
     { "blockchain", "getblockheader", &getblockheader, true },
     { "blockchain", "getchaintips", &getchaintips, true },
+    { "blockchain", "getdbstats", &getdbstats, true },
     { "blockchain", "getdifficulty", &getdifficulty, true },
     { "blockchain", "getmempoolancestors", &getmempoolancestors, true },
     { "blockchain", "getmempooldescendants", &getmempooldescendants, true },
     { "blockchain", "getmempoolentry", &getmempoolentry, true },
     { "blockchain", "getmempoolinfo", &getmempoolinfo, true },
+    { "blockchain", "getmempoolmemory", &getmempoolmemory, true },
     { "blockchain", "getrawmempool", &getrawmempool, true },
     { "blockchain", "gettxout", &gettxout, true },
     { "blockchain", "gettxoutsetinfo", &gettxoutsetinfo, true },
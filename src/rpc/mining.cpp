@@ -122,7 +122,7 @@ UniValue generateBlocks(boost::shared_ptr<CReserveScript> coinbaseScript, int nG
     unsigned int nExtraNonce = 0;
     UniValue blockHashes(UniValue::VARR);
     while (nHeight < nHeightEnd) {
-        std::unique_ptr<CBlockTemplate> pblocktemplate(BlockAssembler(Params()).CreateNewBlock(coinbaseScript->reserveScript));
+        std::unique_ptr<CBlockTemplate> pblocktemplate(CreateBlockTemplate(Params(), coinbaseScript->reserveScript));
         if (!pblocktemplate.get())
             throw JSONRPCError(RPC_INTERNAL_ERROR, "Couldn't create new block");
         CBlock* pblock = &pblocktemplate->block;
@@ -572,16 +572,17 @@ UniValue getblocktemplate(const UniValue& params, bool fHelp)
 
         LEAVE_CRITICAL_SECTION(cs_main);
         {
-            checktxtime = boost::get_system_time() + boost::posix_time::minutes(1);
+            // The template cache wakes us on every mempool change; the timeout only catches a
+            // change that slipped in between the check and the wait, and a new nBits.
+            checktxtime = boost::get_system_time() + boost::posix_time::seconds(10);
 
             boost::unique_lock<boost::mutex> lock(csBestBlock);
             while (chainActive.Tip()->GetBlockHash() == hashWatchedChain && IsRPCRunning()) {
+                if (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLastLP) {
+                    forceBlockUpdate = true;
+                    break;
+                }
                 if (!cvBlockChange.timed_wait(lock, checktxtime)) {
-
-                    if (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLastLP) {
-                        forceBlockUpdate = true;
-                        break;
-                    }
                     UpdateTime(&blockUpdatedLastLP, Params().GetConsensus(), chainActive.Tip());
                     if (GetNextWorkRequired(chainActive.Tip(), &blockUpdatedLastLP, Params().GetConsensus()) != blockUpdatedLastLP.nBits) {
                         forceBlockUpdate = true;
@@ -605,7 +606,8 @@ UniValue getblocktemplate(const UniValue& params, bool fHelp)
     static CBlockIndex* pindexPrev;
     static CBlockTemplate* pblocktemplate;
 
-    if (forceBlockUpdate || pindexPrev != chainActive.Tip() || (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast && GetTime() - nStart > 5)) {
+    // The template cache makes a new template cheap, so every mempool change is picked up at once.
+    if (forceBlockUpdate || pindexPrev != chainActive.Tip() || mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast) {
 
         pindexPrev = NULL;
 
@@ -618,7 +620,7 @@ UniValue getblocktemplate(const UniValue& params, bool fHelp)
             pblocktemplate = NULL;
         }
         CScript scriptDummy = CScript() << OP_TRUE;
-        pblocktemplate = BlockAssembler(Params()).CreateNewBlock(scriptDummy);
+        pblocktemplate = CreateBlockTemplate(Params(), scriptDummy);
         if (!pblocktemplate)
             throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
 
@@ -638,7 +640,8 @@ UniValue getblocktemplate(const UniValue& params, bool fHelp)
     UniValue transactions(UniValue::VARR);
     map<uint256, int64_t> setTxIndex;
     int i = 0;
-    BOOST_FOREACH (CTransaction& tx, pblock->vtx) {
+    for (const auto& it : pblock->vtx) {
+        const CTransaction& tx = *it;
         uint256 txHash = tx.GetHash();
         setTxIndex[txHash] = i++;
 
@@ -737,7 +740,7 @@ UniValue getblocktemplate(const UniValue& params, bool fHelp)
     result.push_back(Pair("previousblockhash", pblock->hashPrevBlock.GetHex()));
     result.push_back(Pair("transactions", transactions));
     result.push_back(Pair("coinbaseaux", aux));
-    result.push_back(Pair("coinbasevalue", (int64_t)pblock->vtx[0].vout[0].nValue));
+    result.push_back(Pair("coinbasevalue", (int64_t)pblock->vtx[0]->vout[0].nValue));
     result.push_back(Pair("longpollid", chainActive.Tip()->GetBlockHash().GetHex() + i64tostr(nTransactionsUpdatedLast)));
     result.push_back(Pair("target", hashTarget.GetHex()));
     result.push_back(Pair("mintime", (int64_t)std::max(pindexPrev->GetMedianTimePast(pindexPrev->nHeight) + 1, GetTime())));
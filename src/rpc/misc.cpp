@@ -10,6 +10,7 @@
 // Distributed under the GULDEN software license, see the accompanying
 // file COPYING
 
+#include "addressindex.h"
 #include "base58.h"
 #include "clientversion.h"
 #include "init.h"
@@ -17,7 +18,9 @@
 #include "net.h"
 #include "netbase.h"
 #include "rpc/server.h"
+#include "script/standard.h"
 #include "timedata.h"
+#include "txdb.h"
 #include "util.h"
 #include "utilstrencodings.h"
 #ifdef ENABLE_WALLET
@@ -445,6 +448,249 @@ UniValue signmessagewithprivkey(const UniValue& params, bool fHelp)
     return EncodeBase64(&vchSig[0], vchSig.size());
 }
 
+UniValue getmemoryinfo(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getmemoryinfo\n"
+            "\nReturns an object containing information about memory usage.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"blockindex\": {                (json object) the in-memory block index\n"
+            "    \"entries\": xxxxx,            (numeric) number of block index entries\n"
+            "    \"arena\": xxxxx,              (numeric) bytes allocated for the entries\n"
+            "    \"table\": xxxxx,              (numeric) bytes allocated for the hash table\n"
+            "    \"usage\": xxxxx,              (numeric) total bytes used by the block index\n"
+            "    \"bytesperentry\": xxxxx,      (numeric) average bytes used per entry\n"
+            "    \"nodemapestimate\": xxxxx,    (numeric) estimated bytes the same entries would use as individually allocated map nodes\n"
+            "    \"saved\": xxxxx               (numeric) difference between the estimate and the actual usage\n"
+            "  }\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getmemoryinfo", "")
+            + HelpExampleRpc("getmemoryinfo", ""));
+
+    LOCK(cs_main);
+
+    const size_t nUsage = mapBlockIndex.DynamicMemoryUsage();
+    const size_t nEstimate = mapBlockIndex.NodeMapMemoryUsageEstimate();
+    UniValue blockindex(UniValue::VOBJ);
+    blockindex.push_back(Pair("entries", (uint64_t)mapBlockIndex.size()));
+    blockindex.push_back(Pair("arena", (uint64_t)mapBlockIndex.ArenaMemoryUsage()));
+    blockindex.push_back(Pair("table", (uint64_t)mapBlockIndex.TableMemoryUsage()));
+    blockindex.push_back(Pair("usage", (uint64_t)nUsage));
+    blockindex.push_back(Pair("bytesperentry", mapBlockIndex.empty() ? 0 : (uint64_t)(nUsage / mapBlockIndex.size())));
+    blockindex.push_back(Pair("nodemapestimate", (uint64_t)nEstimate));
+    blockindex.push_back(Pair("saved", (int64_t)nEstimate - (int64_t)nUsage));
+
+    UniValue obj(UniValue::VOBJ);
+    obj.push_back(Pair("blockindex", blockindex));
+    return obj;
+}
+
+/**
+ * The address argument of the address index calls arrives as a plain string from the command line,
+ * so a JSON object is recognised by its leading brace and parsed here instead of in the client.
+ */
+static UniValue GetAddressIndexParam(const UniValue& param)
+{
+    if (!param.isStr() || param.get_str().empty() || param.get_str()[0] != '{')
+        return param;
+    UniValue obj;
+    if (!obj.read(param.get_str()) || !obj.isObject())
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Error parsing JSON: " + param.get_str());
+    return obj;
+}
+
+/** Parse the address argument of the address index calls: a single address or {"addresses": [...]}. */
+static std::vector<std::pair<uint160, std::string> > ParseAddressIndexAddresses(const UniValue& param)
+{
+    if (!fAddressIndex)
+        throw JSONRPCError(RPC_MISC_ERROR, "Address index not enabled, restart with -addressindex and -reindex-chainstate");
+
+    std::vector<std::string> vStrAddresses;
+    if (param.isStr()) {
+        vStrAddresses.push_back(param.get_str());
+    } else if (param.isObject()) {
+        const UniValue& addresses = find_value(param.get_obj(), "addresses");
+        if (!addresses.isArray())
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Addresses is expected to be an array");
+        for (unsigned int i = 0; i < addresses.size(); i++)
+            vStrAddresses.push_back(addresses[i].get_str());
+    } else {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Expected an address or an object with an addresses array");
+    }
+
+    std::vector<std::pair<uint160, std::string> > vAddresses;
+    BOOST_FOREACH (const std::string& strAddress, vStrAddresses) {
+        CBitcoinAddress address(strAddress);
+        if (!address.IsValid())
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid Gulden address: " + strAddress);
+        vAddresses.push_back(std::make_pair(GetAddressIndexHash(GetScriptForDestination(address.Get())), strAddress));
+    }
+    return vAddresses;
+}
+
+static int GetAddressIndexHeightParam(const UniValue& param, const std::string& strKey, int nDefault)
+{
+    if (!param.isObject())
+        return nDefault;
+    const UniValue& value = find_value(param.get_obj(), strKey);
+    return value.isNull() ? nDefault : value.get_int();
+}
+
+UniValue getaddresstxids(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getaddresstxids \"address\"|{\"addresses\":[\"address\",...],\"start\":n,\"end\":n}\n"
+            "\nReturns the txids of all transactions paying to or spending from the given addresses (requires -addressindex).\n"
+            "\nArguments:\n"
+            "1. \"address\"        (string) The address, or an object with:\n"
+            "   \"addresses\"      (array, required) The addresses\n"
+            "   \"start\"          (numeric, optional) First block height to include\n"
+            "   \"end\"            (numeric, optional) Last block height to include\n"
+            "\nResult:\n"
+            "[\n"
+            "  \"txid\"            (string) The transaction id, ordered by block height\n"
+            "  ,...\n"
+            "]\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getaddresstxids", "\"GPSSGeFHDnKNxiEyFrD1wcEaHr9hrQDDWc\"")
+            + HelpExampleCli("getaddresstxids", "'{\"addresses\": [\"GPSSGeFHDnKNxiEyFrD1wcEaHr9hrQDDWc\"]}'")
+            + HelpExampleRpc("getaddresstxids", "{\"addresses\": [\"GPSSGeFHDnKNxiEyFrD1wcEaHr9hrQDDWc\"], \"start\": 1000}"));
+
+    const UniValue param = GetAddressIndexParam(params[0]);
+    const std::vector<std::pair<uint160, std::string> > vAddresses = ParseAddressIndexAddresses(param);
+    const int nStart = GetAddressIndexHeightParam(param, "start", 0);
+    const int nEnd = GetAddressIndexHeightParam(param, "end", -1);
+
+    std::vector<std::pair<CAddressHistoryKey, CAmount> > vHistory;
+    {
+        LOCK(cs_main);
+        for (const auto& address : vAddresses) {
+            if (!pblocktree->ReadAddressHistory(address.first, nStart, nEnd, vHistory))
+                throw JSONRPCError(RPC_INTERNAL_ERROR, "Unable to read the address index");
+        }
+    }
+
+    // Entries of a single address are already in height order; several addresses have to be merged.
+    std::vector<std::pair<int, uint256> > vTxids;
+    vTxids.reserve(vHistory.size());
+    for (const auto& entry : vHistory)
+        vTxids.push_back(std::make_pair(entry.first.nHeight, entry.first.txid));
+    if (vAddresses.size() > 1)
+        std::stable_sort(vTxids.begin(), vTxids.end(), [](const std::pair<int, uint256>& a, const std::pair<int, uint256>& b) { return a.first < b.first; });
+
+    UniValue result(UniValue::VARR);
+    std::set<uint256> setSeen;
+    for (const auto& txid : vTxids) {
+        if (setSeen.insert(txid.second).second)
+            result.push_back(txid.second.GetHex());
+    }
+    return result;
+}
+
+UniValue getaddressutxos(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getaddressutxos \"address\"|{\"addresses\":[\"address\",...]}\n"
+            "\nReturns the unspent outputs paying to the given addresses (requires -addressindex).\n"
+            "\nArguments:\n"
+            "1. \"address\"        (string) The address, or an object with:\n"
+            "   \"addresses\"      (array, required) The addresses\n"
+            "\nResult:\n"
+            "[\n"
+            "  {\n"
+            "    \"address\": \"address\",  (string) The address\n"
+            "    \"txid\": \"hash\",        (string) The transaction id\n"
+            "    \"outputIndex\": n,       (numeric) The output index\n"
+            "    \"script\": \"hex\",       (string) The output script\n"
+            "    \"amount\": x.xxx,        (numeric) The output value in " + CURRENCY_UNIT + "\n"
+            "    \"height\": n             (numeric) The height of the block containing the output\n"
+            "  }\n"
+            "  ,...\n"
+            "]\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getaddressutxos", "\"GPSSGeFHDnKNxiEyFrD1wcEaHr9hrQDDWc\"")
+            + HelpExampleCli("getaddressutxos", "'{\"addresses\": [\"GPSSGeFHDnKNxiEyFrD1wcEaHr9hrQDDWc\"]}'")
+            + HelpExampleRpc("getaddressutxos", "{\"addresses\": [\"GPSSGeFHDnKNxiEyFrD1wcEaHr9hrQDDWc\"]}"));
+
+    const std::vector<std::pair<uint160, std::string> > vAddresses = ParseAddressIndexAddresses(GetAddressIndexParam(params[0]));
+
+    std::vector<std::pair<const std::string*, std::pair<CAddressUnspentKey, CAddressUnspentValue> > > vUnspent;
+    {
+        LOCK(cs_main);
+        for (const auto& address : vAddresses) {
+            std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > vAddressUnspent;
+            if (!pblocktree->ReadAddressUnspent(address.first, vAddressUnspent))
+                throw JSONRPCError(RPC_INTERNAL_ERROR, "Unable to read the address index");
+            for (const auto& entry : vAddressUnspent)
+                vUnspent.push_back(std::make_pair(&address.second, entry));
+        }
+    }
+    std::stable_sort(vUnspent.begin(), vUnspent.end(), [](const std::pair<const std::string*, std::pair<CAddressUnspentKey, CAddressUnspentValue> >& a, const std::pair<const std::string*, std::pair<CAddressUnspentKey, CAddressUnspentValue> >& b) {
+        return a.second.second.nHeight < b.second.second.nHeight;
+    });
+
+    UniValue result(UniValue::VARR);
+    for (const auto& entry : vUnspent) {
+        UniValue output(UniValue::VOBJ);
+        output.push_back(Pair("address", *entry.first));
+        output.push_back(Pair("txid", entry.second.first.txid.GetHex()));
+        output.push_back(Pair("outputIndex", (int)entry.second.first.n));
+        output.push_back(Pair("script", HexStr(entry.second.second.script.begin(), entry.second.second.script.end())));
+        output.push_back(Pair("amount", ValueFromAmount(entry.second.second.nValue)));
+        output.push_back(Pair("height", entry.second.second.nHeight));
+        result.push_back(output);
+    }
+    return result;
+}
+
+UniValue getaddressbalance(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getaddressbalance \"address\"|{\"addresses\":[\"address\",...]}\n"
+            "\nReturns the balance of the given addresses (requires -addressindex).\n"
+            "\nArguments:\n"
+            "1. \"address\"        (string) The address, or an object with:\n"
+            "   \"addresses\"      (array, required) The addresses\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"balance\": x.xxx,      (numeric) The current balance in " + CURRENCY_UNIT + "\n"
+            "  \"received\": x.xxx      (numeric) The total amount received in " + CURRENCY_UNIT + ", including change\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getaddressbalance", "\"GPSSGeFHDnKNxiEyFrD1wcEaHr9hrQDDWc\"")
+            + HelpExampleCli("getaddressbalance", "'{\"addresses\": [\"GPSSGeFHDnKNxiEyFrD1wcEaHr9hrQDDWc\"]}'")
+            + HelpExampleRpc("getaddressbalance", "{\"addresses\": [\"GPSSGeFHDnKNxiEyFrD1wcEaHr9hrQDDWc\"]}"));
+
+    const std::vector<std::pair<uint160, std::string> > vAddresses = ParseAddressIndexAddresses(GetAddressIndexParam(params[0]));
+
+    CAmount nBalance = 0;
+    CAmount nReceived = 0;
+    {
+        LOCK(cs_main);
+        for (const auto& address : vAddresses) {
+            std::vector<std::pair<CAddressHistoryKey, CAmount> > vHistory;
+            if (!pblocktree->ReadAddressHistory(address.first, 0, -1, vHistory))
+                throw JSONRPCError(RPC_INTERNAL_ERROR, "Unable to read the address index");
+            for (const auto& entry : vHistory) {
+                nBalance += entry.second;
+                if (entry.second > 0)
+                    nReceived += entry.second;
+            }
+        }
+    }
+
+    UniValue result(UniValue::VOBJ);
+    result.push_back(Pair("balance", ValueFromAmount(nBalance)));
+    result.push_back(Pair("received", ValueFromAmount(nReceived)));
+    return result;
+}
+
 UniValue setmocktime(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
@@ -474,11 +720,15 @@ UniValue setmocktime(const UniValue& params, bool fHelp)
 static const CRPCCommand commands[] = { //  category              name                      actor (function)         okSafeMode
 
     { "control", "getinfo", &getinfo, true }, /* uses wallet if enabled */
+    { "control", "getmemoryinfo", &getmemoryinfo, true },
     { "util", "validateaddress", &validateaddress, true }, /* uses wallet if enabled */
     { "util", "createmultisig", &createmultisig, true },
     { "util", "createwitnessaddress", &createwitnessaddress, true },
     { "util", "verifymessage", &verifymessage, true },
     { "util", "signmessagewithprivkey", &signmessagewithprivkey, true },
+    { "addressindex", "getaddresstxids", &getaddresstxids, false },
+    { "addressindex", "getaddressutxos", &getaddressutxos, false },
+    { "addressindex", "getaddressbalance", &getaddressbalance, false },
 
     /* Not shown in help */
     { "hidden", "setmocktime", &setmocktime, true },
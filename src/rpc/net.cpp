@@ -117,6 +117,11 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
             "       n,                        (numeric) The heights of blocks we're currently asking from this peer\n"
             "       ...\n"
             "    ]\n"
+            "    \"inflightlimit\": n,        (numeric) The number of blocks we allow in flight from this peer during block download\n"
+            "    \"blocksdownloaded\": n,     (numeric) The number of requested blocks received from this peer\n"
+            "    \"blockbytesdownloaded\": n, (numeric) The total size of those blocks in bytes\n"
+            "    \"blockservicetime\": n,     (numeric) The average time in seconds this peer takes to deliver a block\n"
+            "    \"blockthroughput\": n,      (numeric) The average block download throughput from this peer in bytes per second\n"
             "    \"bytessent_per_msg\": {\n"
             "       \"addr\": n,             (numeric) The total bytes sent aggregated by message type\n"
             "       ...\n"
@@ -175,6 +180,11 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
                 heights.push_back(height);
             }
             obj.push_back(Pair("inflight", heights));
+            obj.push_back(Pair("inflightlimit", statestats.nBlocksInFlightLimit));
+            obj.push_back(Pair("blocksdownloaded", statestats.nBlocksDownloaded));
+            obj.push_back(Pair("blockbytesdownloaded", statestats.nBlockBytesDownloaded));
+            obj.push_back(Pair("blockservicetime", ((double)statestats.nBlockServiceTime) / 1e6));
+            obj.push_back(Pair("blockthroughput", statestats.dBlockBytesPerSecond));
         }
         obj.push_back(Pair("whitelisted", stats.fWhitelisted));
 
@@ -27,6 +27,7 @@
 #include "script/script_error.h"
 #include "script/sign.h"
 #include "script/standard.h"
+#include "txindex.h"
 #include "txmempool.h"
 #include "uint256.h"
 #include "utilstrencodings.h"
@@ -140,6 +141,8 @@ UniValue getrawtransaction(const UniValue& params, bool fHelp)
             "\nNOTE: By default this function only works sometimes. This is when the tx is in the mempool\n"
             "or there is an unspent output in the utxo for this transaction. To make it always work,\n"
             "you need to maintain a transaction index, using the -txindex command line option.\n"
+            "The index is built in the background; until it has caught up, transactions in blocks it\n"
+            "has not reached yet are only found as described above.\n"
             "\nReturn the raw transaction data.\n"
             "\nIf verbose=0, returns a string that is serialized, hex-encoded data for 'txid'.\n"
             "If verbose is non-zero, returns an Object with information about 'txid'.\n"
@@ -211,8 +214,13 @@ UniValue getrawtransaction(const UniValue& params, bool fHelp)
 
     CTransaction tx;
     uint256 hashBlock;
-    if (!GetTransaction(hash, tx, Params().GetConsensus(), hashBlock, true))
+    if (!GetTransaction(hash, tx, Params().GetConsensus(), hashBlock, true)) {
+        if (ptxindex && ptxindex->IsFailed())
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, strprintf("No information available about transaction, transaction index failed to update at height %d (see debug.log)", ptxindex->GetBestHeight()));
+        if (ptxindex && !ptxindex->IsSynced())
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, strprintf("No information available about transaction, transaction index is still being built (at height %d)", ptxindex->GetBestHeight()));
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available about transaction");
+    }
 
     string strHex = EncodeHexTx(tx);
 
@@ -292,8 +300,8 @@ UniValue gettxoutproof(const UniValue& params, bool fHelp)
         throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
 
     unsigned int ntxFound = 0;
-    BOOST_FOREACH (const CTransaction& tx, block.vtx)
-        if (setTxids.count(tx.GetHash()))
+    for (const auto& tx : block.vtx)
+        if (setTxids.count(tx->GetHash()))
             ntxFound++;
     if (ntxFound != setTxids.size())
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "(Not all) transactions not found in specified block");
@@ -832,7 +840,6 @@ UniValue sendrawtransaction(const UniValue& params, bool fHelp)
             + HelpExampleCli("sendrawtransaction", "\"signedhex\"") + "\nAs a json rpc call\n"
             + HelpExampleRpc("sendrawtransaction", "\"signedhex\""));
 
-    LOCK(cs_main);
     RPCTypeCheck(params, boost::assign::list_of(UniValue::VSTR)(UniValue::VBOOL));
 
     CTransaction tx;
@@ -844,12 +851,16 @@ UniValue sendrawtransaction(const UniValue& params, bool fHelp)
     if (params.size() > 1 && params[1].get_bool())
         nMaxRawTxFee = 0;
 
-    CCoinsViewCache& view = *pcoinsTip;
-    const CCoins* existingCoins = view.AccessCoins(hashTx);
-    bool fHaveMempool = mempool.exists(hashTx);
-    bool fHaveChain = existingCoins && existingCoins->nHeight < 1000000000;
+    bool fHaveMempool;
+    bool fHaveChain;
+    {
+        LOCK(cs_main);
+        const CCoins* existingCoins = pcoinsTip->AccessCoins(hashTx);
+        fHaveMempool = mempool.exists(hashTx);
+        fHaveChain = existingCoins && existingCoins->nHeight < 1000000000;
+    }
     if (!fHaveMempool && !fHaveChain) {
-
+        // Not holding cs_main here lets the scripts be verified without it.
         CValidationState state;
         bool fMissingInputs;
         if (!AcceptToMemoryPool(mempool, state, tx, false, &fMissingInputs, false, nMaxRawTxFee)) {
@@ -0,0 +1,39 @@
+// Copyright (c) 2016 The Gulden developers
+// Distributed under the GULDEN software license, see the accompanying
+// file COPYING
+
+#include "startupconfig.h"
+
+#include "chainparams.h"
+#include "util.h"
+
+#include <algorithm>
+
+static CStartupConfig startupConfig;
+
+CStartupConfig::CStartupConfig()
+    : fTestnet(false)
+    , fTestnetAccel(false)
+    , nShortMedianTimeSpanHeight(437500)
+    , nAccountPool(DEFAULT_ACCOUNTPOOL_SIZE)
+    , nKeyPool(-1)
+    , nUndoCacheBlocks(DEFAULT_UNDO_CACHE_BLOCKS)
+{
+}
+
+const CStartupConfig& StartupConfig()
+{
+    return startupConfig;
+}
+
+void InitStartupConfig(const CChainParams& chainparams)
+{
+    CStartupConfig config;
+    config.fTestnet = GetBoolArg("-testnet", false);
+    config.fTestnetAccel = GetBoolArg("-testnetaccel", false);
+    config.nShortMedianTimeSpanHeight = chainparams.GetConsensus().nShortMedianTimeSpanHeight;
+    config.nAccountPool = GetArg("-accountpool", DEFAULT_ACCOUNTPOOL_SIZE);
+    config.nKeyPool = GetArg("-keypool", -1);
+    config.nUndoCacheBlocks = std::max<int64_t>(0, GetArg("-undocache", DEFAULT_UNDO_CACHE_BLOCKS));
+    startupConfig = config;
+}
@@ -0,0 +1,51 @@
+// Copyright (c) 2016 The Gulden developers
+// Distributed under the GULDEN software license, see the accompanying
+// file COPYING
+
+#ifndef GULDEN_STARTUPCONFIG_H
+#define GULDEN_STARTUPCONFIG_H
+
+#include <stdint.h>
+
+class CChainParams;
+
+/** Default for -accountpool */
+static const int64_t DEFAULT_ACCOUNTPOOL_SIZE = 10;
+/** Default for -undocache */
+static const unsigned int DEFAULT_UNDO_CACHE_BLOCKS = 20;
+
+/**
+ * Typed snapshot of the settings that are read on hot paths (per header,
+ * per block or in wallet loops). Resolved once by InitStartupConfig() after
+ * the chain has been selected and never changed afterwards, so readers pay
+ * a plain field access instead of a mapArgs lookup.
+ *
+ * Until InitStartupConfig() runs the snapshot holds the defaults of the
+ * main chain.
+ */
+class CStartupConfig
+{
+public:
+    //! -testnet
+    bool fTestnet;
+    //! -testnetaccel: hash proof of work with CityHash instead of scrypt
+    bool fTestnetAccel;
+    //! Height above which the median time past spans 3 blocks instead of 11 (Consensus::Params::nShortMedianTimeSpanHeight)
+    int nShortMedianTimeSpanHeight;
+    //! -accountpool
+    int64_t nAccountPool;
+    //! -keypool, or -1 when not given so callers can apply their own default
+    int64_t nKeyPool;
+    //! -undocache: number of recently connected blocks whose undo data is kept in memory
+    unsigned int nUndoCacheBlocks;
+
+    CStartupConfig();
+};
+
+/** The current snapshot. */
+const CStartupConfig& StartupConfig();
+
+/** Resolve the snapshot from the command line, the config file and the selected chain. Call before starting any threads. */
+void InitStartupConfig(const CChainParams& chainparams);
+
+#endif // GULDEN_STARTUPCONFIG_H
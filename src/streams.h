@@ -344,6 +344,61 @@ public:
     }
 };
 
+/** Read only stream over a borrowed range of memory.
+ *
+ * Deserializes straight out of the range without copying it into a buffer
+ * first, e.g. from a memory mapped block file. The memory must outlive the
+ * stream.
+ */
+class CSpanReader {
+private:
+    const int nType;
+    const int nVersion;
+    const char* pbegin;
+    const char* pend;
+
+public:
+    CSpanReader(const char* pbeginIn, const char* pendIn, int nTypeIn, int nVersionIn)
+        : nType(nTypeIn)
+        , nVersion(nVersionIn)
+        , pbegin(pbeginIn)
+        , pend(pendIn)
+    {
+        assert(pbegin <= pend);
+    }
+
+    int GetType() const { return nType; }
+    int GetVersion() const { return nVersion; }
+    const char* begin() const { return pbegin; }
+    const char* end() const { return pend; }
+    size_t size() const { return pend - pbegin; }
+    bool empty() const { return pbegin == pend; }
+
+    CSpanReader& read(char* pch, size_t nSize)
+    {
+        if (nSize > size())
+            throw std::ios_base::failure("CSpanReader::read(): end of data");
+        memcpy(pch, pbegin, nSize);
+        pbegin += nSize;
+        return (*this);
+    }
+
+    CSpanReader& ignore(size_t nSize)
+    {
+        if (nSize > size())
+            throw std::ios_base::failure("CSpanReader::ignore(): end of data");
+        pbegin += nSize;
+        return (*this);
+    }
+
+    template <typename T>
+    CSpanReader& operator>>(T& obj)
+    {
+        ::Unserialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+};
+
 /** Non-refcounted RAII wrapper for FILE*
  *
  * Will automatically close the file when it goes out of scope if not null.
@@ -12,6 +12,7 @@
 // Unit tests for denial-of-service detection/prevention code
 
 #include "chainparams.h"
+#include "consensus/validation.h"
 #include "keystore.h"
 #include "main.h"
 #include "net.h"
@@ -29,15 +30,20 @@
 #include <boost/foreach.hpp>
 #include <boost/test/unit_test.hpp>
 
-extern bool AddOrphanTx(const CTransaction& tx, NodeId peer);
+extern bool AddOrphanTx(const CTransactionRef& tx, NodeId peer);
 extern void EraseOrphansFor(NodeId peer);
-extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans);
+extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans, size_t nMaxUsage, size_t nMaxPeerUsage);
 struct COrphanTx {
-    CTransaction tx;
+    CTransactionRef tx;
     NodeId fromPeer;
+    int64_t nTimeExpire;
+    size_t nUsage;
 };
 extern std::map<uint256, COrphanTx> mapOrphanTransactions;
 extern std::map<uint256, std::set<uint256> > mapOrphanTransactionsByPrev;
+extern size_t nOrphanTransactionsUsage;
+extern void UpdateBlockAvailability(NodeId nodeid, const uint256& hash);
+extern unsigned int ReleaseStalledBlocks(NodeId nodeid);
 
 CService ip(uint32_t i)
 {
@@ -111,7 +117,7 @@ BOOST_AUTO_TEST_CASE(DoS_bantime)
     BOOST_CHECK(!CNode::IsBanned(addr));
 }
 
-CTransaction RandomOrphan()
+CTransactionRef RandomOrphan()
 {
     std::map<uint256, COrphanTx>::iterator it;
     it = mapOrphanTransactions.lower_bound(GetRandHash());
@@ -137,28 +143,28 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         tx.vout[0].nValue = 1 * CENT;
         tx.vout[0].scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
 
-        AddOrphanTx(tx, i);
+        AddOrphanTx(MakeTransactionRef(tx), i);
     }
 
     /*    for (int i = 0; i < 50; i++)
     {
-        CTransaction txPrev = RandomOrphan();
+        CTransactionRef txPrev = RandomOrphan();
 
         CMutableTransaction tx;
         tx.vin.resize(1);
         tx.vin[0].prevout.n = 0;
-        tx.vin[0].prevout.hash = txPrev.GetHash();
+        tx.vin[0].prevout.hash = txPrev->GetHash();
         tx.vout.resize(1);
         tx.vout[0].nValue = 1*CENT;
         tx.vout[0].scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
-        SignSignature(keystore, txPrev, tx, 0, SIGHASH_ALL);
+        SignSignature(keystore, *txPrev, tx, 0, SIGHASH_ALL);
 
-        AddOrphanTx(tx, i);
+        AddOrphanTx(MakeTransactionRef(tx), i);
     }*/
 
     /*    for (int i = 0; i < 10; i++)
     {
-        CTransaction txPrev = RandomOrphan();
+        CTransactionRef txPrev = RandomOrphan();
 
         CMutableTransaction tx;
         tx.vout.resize(1);
@@ -168,15 +174,15 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         for (unsigned int j = 0; j < tx.vin.size(); j++)
         {
             tx.vin[j].prevout.n = j;
-            tx.vin[j].prevout.hash = txPrev.GetHash();
+            tx.vin[j].prevout.hash = txPrev->GetHash();
         }
-        SignSignature(keystore, txPrev, tx, 0, SIGHASH_ALL);
+        SignSignature(keystore, *txPrev, tx, 0, SIGHASH_ALL);
 
 
         for (unsigned int j = 1; j < tx.vin.size(); j++)
             tx.vin[j].scriptSig = tx.vin[0].scriptSig;
 
-        BOOST_CHECK(!AddOrphanTx(tx, i));
+        BOOST_CHECK(!AddOrphanTx(MakeTransactionRef(tx), i));
     }*/
 
     for (NodeId i = 0; i < 3; i++) {
@@ -185,13 +191,104 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         BOOST_CHECK(mapOrphanTransactions.size() < sizeBefore);
     }
 
-    LimitOrphanTxSize(40);
+    const size_t nNoLimit = std::numeric_limits<size_t>::max();
+    LimitOrphanTxSize(40, nNoLimit, nNoLimit);
     BOOST_CHECK(mapOrphanTransactions.size() <= 40);
-    LimitOrphanTxSize(10);
+    LimitOrphanTxSize(10, nNoLimit, nNoLimit);
     BOOST_CHECK(mapOrphanTransactions.size() <= 10);
-    LimitOrphanTxSize(0);
+    LimitOrphanTxSize(0, nNoLimit, nNoLimit);
     BOOST_CHECK(mapOrphanTransactions.empty());
     BOOST_CHECK(mapOrphanTransactionsByPrev.empty());
+    BOOST_CHECK_EQUAL(nOrphanTransactionsUsage, 0U);
+}
+
+BOOST_AUTO_TEST_CASE(DoS_mapOrphansUsage)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    const size_t nNoLimit = std::numeric_limits<size_t>::max();
+
+    // Peer 0 sends a burst of 40 orphans, peer 1 sends 5.
+    size_t nUsagePerOrphan = 0;
+    for (int i = 0; i < 45; i++) {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout.n = 0;
+        tx.vin[0].prevout.hash = GetRandHash();
+        tx.vin[0].scriptSig << OP_1;
+        tx.vout.resize(1);
+        tx.vout[0].nValue = 1 * CENT;
+        tx.vout[0].scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
+
+        size_t nUsageBefore = nOrphanTransactionsUsage;
+        BOOST_CHECK(AddOrphanTx(MakeTransactionRef(tx), i < 40 ? 0 : 1));
+        nUsagePerOrphan = nOrphanTransactionsUsage - nUsageBefore;
+        BOOST_CHECK(nUsagePerOrphan > 0);
+    }
+    BOOST_CHECK_EQUAL(nOrphanTransactionsUsage, 45 * nUsagePerOrphan);
+
+    // Only the peer over its share loses orphans.
+    LimitOrphanTxSize(nNoLimit, nNoLimit, 10 * nUsagePerOrphan);
+    BOOST_CHECK_EQUAL(mapOrphanTransactions.size(), 15U);
+    int nFromPeer1 = 0;
+    for (const auto& orphan : mapOrphanTransactions)
+        nFromPeer1 += orphan.second.fromPeer == 1;
+    BOOST_CHECK_EQUAL(nFromPeer1, 5);
+
+    // Over the total, the peer using the most gives way first.
+    LimitOrphanTxSize(nNoLimit, 10 * nUsagePerOrphan, nNoLimit);
+    BOOST_CHECK_EQUAL(mapOrphanTransactions.size(), 10U);
+    BOOST_CHECK_EQUAL(nOrphanTransactionsUsage, 10 * nUsagePerOrphan);
+
+    EraseOrphansFor(0);
+    EraseOrphansFor(1);
+    BOOST_CHECK(mapOrphanTransactions.empty());
+    BOOST_CHECK_EQUAL(nOrphanTransactionsUsage, 0U);
+}
+
+BOOST_FIXTURE_TEST_CASE(DoS_stalled_blocks_reassigned, TestChain100Setup)
+{
+    // Drop the last blocks from the chain and forget their data, so they are downloaded again.
+    CBlockIndex* pindexTip = chainActive.Tip();
+    CBlockIndex* pindexFork = chainActive[chainActive.Height() - 4];
+    {
+        LOCK(cs_main);
+        CValidationState state;
+        BOOST_CHECK(InvalidateBlock(state, Params(), pindexFork));
+        BOOST_CHECK(ResetBlockFailureFlags(pindexFork));
+        for (CBlockIndex* pindex = pindexTip; pindex != pindexFork->pprev; pindex = pindex->pprev)
+            pindex->nStatus &= ~BLOCK_HAVE_DATA;
+    }
+    BOOST_CHECK(chainActive.Tip() == pindexFork->pprev);
+
+    CNode node1(INVALID_SOCKET, CAddress(ip(0xa0b0c010), NODE_NETWORK), "", true);
+    CNode node2(INVALID_SOCKET, CAddress(ip(0xa0b0c011), NODE_NETWORK), "", true);
+    node1.nVersion = node2.nVersion = PROTOCOL_VERSION;
+    CNodeStateStats stats;
+    {
+        LOCK(cs_main);
+        UpdateBlockAvailability(node1.GetId(), pindexTip->GetBlockHash());
+    }
+    SendMessages(&node1);
+    BOOST_CHECK(GetNodeStateStats(node1.GetId(), stats));
+    BOOST_CHECK_EQUAL(stats.vHeightInFlight.size(), 5U);
+
+    // Once released, the blocks are left to other peers instead of going straight back.
+    {
+        LOCK(cs_main);
+        BOOST_CHECK_EQUAL(ReleaseStalledBlocks(node1.GetId()), 5U);
+    }
+    SendMessages(&node1);
+    BOOST_CHECK(GetNodeStateStats(node1.GetId(), stats));
+    BOOST_CHECK(stats.vHeightInFlight.empty());
+
+    {
+        LOCK(cs_main);
+        UpdateBlockAvailability(node2.GetId(), pindexTip->GetBlockHash());
+    }
+    SendMessages(&node2);
+    BOOST_CHECK(GetNodeStateStats(node2.GetId(), stats));
+    BOOST_CHECK_EQUAL(stats.vHeightInFlight.size(), 5U);
 }
 
 BOOST_AUTO_TEST_SUITE_END()
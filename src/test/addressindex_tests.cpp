@@ -0,0 +1,105 @@
+// Copyright (c) 2016 The Gulden developers
+// Distributed under the GULDEN software license, see the accompanying
+// file COPYING
+
+#include "addressindex.h"
+#include "chainparams.h"
+#include "consensus/validation.h"
+#include "key.h"
+#include "main.h"
+#include "script/standard.h"
+#include "streams.h"
+#include "txdb.h"
+
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+/** Enables the address index for the duration of a test, also when the test bails out early. */
+struct AddressIndexSetup : public TestChain100Setup {
+    AddressIndexSetup() { fAddressIndex = true; }
+    ~AddressIndexSetup() { fAddressIndex = false; }
+};
+
+BOOST_AUTO_TEST_SUITE(addressindex_tests)
+
+BOOST_AUTO_TEST_CASE(addressindex_key_order)
+{
+    // Keys of one script must sort by height so a height range is one range scan.
+    uint160 hashScript = GetAddressIndexHash(CScript() << OP_TRUE);
+    CDataStream ssLow(SER_DISK, CLIENT_VERSION);
+    CDataStream ssHigh(SER_DISK, CLIENT_VERSION);
+    ssLow << CAddressHistoryKey(hashScript, 255, uint256S("ff"), 7, true);
+    ssHigh << CAddressHistoryKey(hashScript, 256, uint256(), 0, false);
+    BOOST_CHECK_EQUAL(ssLow.size(), CAddressHistoryKey().GetSerializeSize(SER_DISK, CLIENT_VERSION));
+    BOOST_CHECK(ssLow.str() < ssHigh.str());
+
+    CAddressHistoryKey key;
+    ssLow >> key;
+    BOOST_CHECK(key.hashScript == hashScript);
+    BOOST_CHECK_EQUAL(key.nHeight, 255);
+    BOOST_CHECK(key.txid == uint256S("ff"));
+    BOOST_CHECK_EQUAL(key.nIndex, 7U);
+    BOOST_CHECK(key.fSpending);
+}
+
+BOOST_FIXTURE_TEST_CASE(addressindex_connect_disconnect, AddressIndexSetup)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    CScript scriptDest = GetScriptForDestination(key.GetPubKey().GetID());
+    CScript scriptCoinbase = CScript() << ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+    const uint160 hashDest = GetAddressIndexHash(scriptDest);
+    const uint160 hashCoinbase = GetAddressIndexHash(scriptCoinbase);
+
+    CMutableTransaction spend = SpendOutput(coinbaseTxns[0], 0, 11 * CENT, scriptDest);
+    std::vector<CMutableTransaction> spends(1, spend);
+    CBlock block = CreateAndProcessBlock(spends, scriptCoinbase);
+    BOOST_REQUIRE(chainActive.Tip()->GetBlockHash() == block.GetHash());
+    const int nHeight = chainActive.Height();
+
+    std::vector<std::pair<CAddressHistoryKey, CAmount> > vHistory;
+    BOOST_CHECK(pblocktree->ReadAddressHistory(hashDest, 0, -1, vHistory));
+    BOOST_REQUIRE_EQUAL(vHistory.size(), 1U);
+    BOOST_CHECK(vHistory[0].first.txid == spend.GetHash());
+    BOOST_CHECK_EQUAL(vHistory[0].first.nHeight, nHeight);
+    BOOST_CHECK(!vHistory[0].first.fSpending);
+    BOOST_CHECK_EQUAL(vHistory[0].second, 11 * CENT);
+
+    // Only the spend and the new coinbase of the coinbase script were indexed while the index was on.
+    vHistory.clear();
+    BOOST_CHECK(pblocktree->ReadAddressHistory(hashCoinbase, nHeight, nHeight, vHistory));
+    BOOST_CHECK_EQUAL(vHistory.size(), 2U);
+    vHistory.clear();
+    BOOST_CHECK(pblocktree->ReadAddressHistory(hashCoinbase, 0, nHeight - 1, vHistory));
+    BOOST_CHECK(vHistory.empty());
+
+    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > vUnspent;
+    BOOST_CHECK(pblocktree->ReadAddressUnspent(hashDest, vUnspent));
+    BOOST_REQUIRE_EQUAL(vUnspent.size(), 1U);
+    BOOST_CHECK(vUnspent[0].first.txid == spend.GetHash());
+    BOOST_CHECK(vUnspent[0].second.script == scriptDest);
+    BOOST_CHECK_EQUAL(vUnspent[0].second.nHeight, nHeight);
+
+    // Disconnecting the block removes everything it added.
+    {
+        LOCK(cs_main);
+        CValidationState state;
+        BOOST_CHECK(InvalidateBlock(state, Params(), chainActive.Tip()));
+    }
+    vHistory.clear();
+    vUnspent.clear();
+    BOOST_CHECK(pblocktree->ReadAddressHistory(hashDest, 0, -1, vHistory));
+    BOOST_CHECK(pblocktree->ReadAddressUnspent(hashDest, vUnspent));
+    BOOST_CHECK(vHistory.empty());
+    BOOST_CHECK(vUnspent.empty());
+
+    // The spent coinbase output is unspent again.
+    vUnspent.clear();
+    BOOST_CHECK(pblocktree->ReadAddressUnspent(hashCoinbase, vUnspent));
+    BOOST_REQUIRE_EQUAL(vUnspent.size(), 1U);
+    BOOST_CHECK(vUnspent[0].first.txid == coinbaseTxns[0].GetHash());
+    BOOST_CHECK_EQUAL(vUnspent[0].second.nHeight, 1);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,83 @@
+// Copyright (c) 2016 The Gulden developers
+// Distributed under the GULDEN software license, see the accompanying
+// file COPYING
+
+#include "blockindexmap.h"
+#include "random.h"
+
+#include "test/test_bitcoin.h"
+
+#include <map>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(blockindexmap_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(blockindexmap_insert_find)
+{
+    CBlockIndexMap map;
+    BOOST_CHECK(map.empty());
+    BOOST_CHECK(map.begin() == map.end());
+    BOOST_CHECK(map.find(GetRandHash()) == map.end());
+    BOOST_CHECK(map[GetRandHash()] == NULL);
+
+    // Insert enough entries to span several slabs and table resizes.
+    const size_t nEntries = CBlockIndexMap::SLAB_ENTRIES * 3 + 17;
+    std::map<uint256, CBlockIndex*> expected;
+    for (size_t i = 0; i < nEntries; i++) {
+        uint256 hash = GetRandHash();
+        CBlockIndex index;
+        index.nHeight = i;
+        std::pair<CBlockIndex*, bool> ret = map.insert(hash, index);
+        BOOST_CHECK(ret.second);
+        BOOST_CHECK(*ret.first->phashBlock == hash);
+        BOOST_CHECK_EQUAL(ret.first->nHeight, (int)i);
+        expected[hash] = ret.first;
+    }
+    BOOST_CHECK_EQUAL(map.size(), nEntries);
+
+    // Entry pointers survive growth and every entry is found again.
+    for (const auto& item : expected) {
+        CBlockIndexMap::iterator it = map.find(item.first);
+        BOOST_REQUIRE(it != map.end());
+        BOOST_CHECK(it->first == item.first);
+        BOOST_CHECK(it->second == item.second);
+        BOOST_CHECK(map[item.first] == item.second);
+        BOOST_CHECK_EQUAL(map.count(item.first), 1U);
+    }
+
+    // Inserting an existing hash returns the existing entry untouched.
+    CBlockIndex other;
+    other.nHeight = -1;
+    std::pair<CBlockIndex*, bool> ret = map.insert(expected.begin()->first, other);
+    BOOST_CHECK(!ret.second);
+    BOOST_CHECK(ret.first == expected.begin()->second);
+    BOOST_CHECK(ret.first->nHeight != -1);
+    BOOST_CHECK_EQUAL(map.size(), nEntries);
+
+    // Iteration visits every entry exactly once.
+    std::map<uint256, CBlockIndex*> visited;
+    for (const CBlockIndexMap::value_type& item : map)
+        BOOST_CHECK(visited.insert(std::make_pair(item.first, item.second)).second);
+    BOOST_CHECK(visited == expected);
+
+    BOOST_CHECK(map.DynamicMemoryUsage() > 0);
+    BOOST_CHECK(map.DynamicMemoryUsage() < map.NodeMapMemoryUsageEstimate());
+
+    map.clear();
+    BOOST_CHECK(map.empty());
+    BOOST_CHECK(map.find(expected.begin()->first) == map.end());
+    BOOST_CHECK_EQUAL(map.DynamicMemoryUsage(), 0U);
+}
+
+BOOST_AUTO_TEST_CASE(blockindexmap_reserve)
+{
+    CBlockIndexMap map;
+    map.reserve(10000);
+    size_t nTable = map.TableMemoryUsage();
+    for (int i = 0; i < 10000; i++)
+        map.insert(GetRandHash(), CBlockIndex());
+    BOOST_CHECK_EQUAL(map.TableMemoryUsage(), nTable);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,88 @@
+// Copyright (c) 2016 The Gulden developers
+// Distributed under the GULDEN software license, see the accompanying
+// file COPYING
+
+#include "chainparams.h"
+#include "consensus/validation.h"
+#include "key.h"
+#include "main.h"
+#include "miner.h"
+#include "script/standard.h"
+#include "txmempool.h"
+
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+namespace {
+CAmount TotalFees(const CBlockTemplate& blocktemplate)
+{
+    CAmount nFees = 0;
+    for (size_t i = 1; i < blocktemplate.vTxFees.size(); ++i)
+        nFees += blocktemplate.vTxFees[i];
+    return nFees;
+}
+}
+
+BOOST_FIXTURE_TEST_SUITE(blocktemplatecache_tests, TestChain100Setup)
+
+BOOST_AUTO_TEST_CASE(blocktemplatecache_follows_mempool)
+{
+    CBlockTemplateCache cache(Params());
+    CScript scriptPubKey = CScript() << ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+
+    std::unique_ptr<CBlockTemplate> pblocktemplate(cache.CreateNewBlock(scriptPubKey));
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 1U);
+
+    // Transactions entering the pool are added to the kept selection, parents first.
+    CMutableTransaction parent = SpendOutput(coinbaseTxns[0], 0, 11 * CENT, scriptPubKey);
+    CMutableTransaction child = SpendOutput(parent, 0, 10 * CENT, scriptPubKey);
+    BOOST_CHECK(AddToMempool(parent));
+    pblocktemplate.reset(cache.CreateNewBlock(scriptPubKey));
+    BOOST_REQUIRE_EQUAL(pblocktemplate->block.vtx.size(), 2U);
+    BOOST_CHECK(pblocktemplate->block.vtx[1]->GetHash() == parent.GetHash());
+
+    BOOST_CHECK(AddToMempool(child));
+    pblocktemplate.reset(cache.CreateNewBlock(scriptPubKey));
+    BOOST_REQUIRE_EQUAL(pblocktemplate->block.vtx.size(), 3U);
+    BOOST_CHECK(pblocktemplate->block.vtx[1]->GetHash() == parent.GetHash());
+    BOOST_CHECK(pblocktemplate->block.vtx[2]->GetHash() == child.GetHash());
+    BOOST_CHECK_EQUAL(pblocktemplate->vTxFees[0], -TotalFees(*pblocktemplate));
+    BOOST_CHECK_EQUAL(pblocktemplate->vTxFees[2], 1 * CENT);
+
+    // Unchanged pool, same selection; the template is a copy the caller may modify.
+    pblocktemplate->block.vtx.pop_back();
+    pblocktemplate.reset(cache.CreateNewBlock(scriptPubKey));
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 3U);
+
+    // A selected transaction leaving the pool makes the cache select again.
+    std::list<CTransactionRef> removed;
+    mempool.removeRecursive(child, removed);
+    BOOST_CHECK_EQUAL(removed.size(), 1U);
+    pblocktemplate.reset(cache.CreateNewBlock(scriptPubKey));
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 2U);
+    BOOST_CHECK_EQUAL(pblocktemplate->vTxFees[0], -TotalFees(*pblocktemplate));
+
+    // Prioritisation is not reported per transaction but still picked up.
+    BOOST_CHECK(AddToMempool(child));
+    mempool.PrioritiseTransaction(child.GetHash(), child.GetHash().ToString(), 0, 5 * CENT);
+    pblocktemplate.reset(cache.CreateNewBlock(scriptPubKey));
+    BOOST_REQUIRE_EQUAL(pblocktemplate->block.vtx.size(), 3U);
+    BOOST_CHECK_EQUAL(pblocktemplate->vTxFees[2], 1 * CENT);
+
+    // A new tip starts a selection on top of it.
+    std::vector<CMutableTransaction> vtx;
+    vtx.push_back(parent);
+    CreateAndProcessBlock(vtx, scriptPubKey);
+    pblocktemplate.reset(cache.CreateNewBlock(scriptPubKey));
+    BOOST_CHECK(pblocktemplate->block.hashPrevBlock == chainActive.Tip()->GetBlockHash());
+    BOOST_REQUIRE_EQUAL(pblocktemplate->block.vtx.size(), 2U);
+    BOOST_CHECK(pblocktemplate->block.vtx[1]->GetHash() == child.GetHash());
+
+    mempool.clear();
+    mempool.mapDeltas.clear();
+    pblocktemplate.reset(cache.CreateNewBlock(scriptPubKey));
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 1U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -5,6 +5,7 @@
 #include "coins.h"
 #include "random.h"
 #include "script/standard.h"
+#include "txdb.h"
 #include "uint256.h"
 #include "utilstrencodings.h"
 #include "test/test_bitcoin.h"
@@ -63,6 +64,28 @@ public:
     }
 };
 
+/** In-memory coin database that exposes the raw records, to check the stored layout. */
+class CCoinsViewDBTest : public CCoinsViewDB {
+public:
+    CCoinsViewDBTest() : CCoinsViewDB(1 << 20, true) {}
+
+    CDBWrapper& GetDB() { return db; }
+    size_t GetLastWritten() const { return nLastWritten; }
+    size_t GetLastErased() const { return nLastErased; }
+
+    size_t CountRecords()
+    {
+        size_t nRecords = 0;
+        boost::scoped_ptr<CDBIterator> pcursor(db.NewIterator());
+        for (pcursor->SeekToFirst(); pcursor->Valid(); pcursor->Next()) {
+            std::pair<char, uint256> key;
+            if (pcursor->GetKey(key) && key.first == 'C')
+                nRecords++;
+        }
+        return nRecords;
+    }
+};
+
 class CCoinsViewCacheTest : public CCoinsViewCache {
 public:
     CCoinsViewCacheTest(CCoinsView* base)
@@ -375,4 +398,137 @@ BOOST_AUTO_TEST_CASE(ccoins_serialization)
     }
 }
 
+BOOST_FIXTURE_TEST_CASE(ccoins_db_per_output, TestingSetup)
+{
+    CCoinsViewDBTest db;
+    const uint256 txid = GetRandHash();
+    CCoinsViewCache cache(&db);
+    {
+        CCoinsModifier coins = cache.ModifyNewCoins(txid, false);
+        coins->nHeight = 10;
+        coins->nVersion = 1;
+        coins->vout.resize(300);
+        for (unsigned int i = 0; i < coins->vout.size(); i++) {
+            coins->vout[i].nValue = 1000 + i;
+            coins->vout[i].scriptPubKey = CScript() << OP_TRUE;
+        }
+    }
+    cache.SetBestBlock(GetRandHash());
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK_EQUAL(db.CountRecords(), 300U);
+
+    BOOST_CHECK_EQUAL(db.GetLastWritten(), 300U);
+
+    // Spending an output erases its record only, including the last one that trims the vout vector.
+    BOOST_CHECK(cache.ModifyCoins(txid)->Spend(5));
+    cache.SetBestBlock(GetRandHash());
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK_EQUAL(db.GetLastWritten(), 0U);
+    BOOST_CHECK_EQUAL(db.GetLastErased(), 1U);
+    BOOST_CHECK(cache.ModifyCoins(txid)->Spend(299));
+    cache.SetBestBlock(GetRandHash());
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK_EQUAL(db.GetLastWritten(), 0U);
+    BOOST_CHECK_EQUAL(db.GetLastErased(), 1U);
+    BOOST_CHECK_EQUAL(db.CountRecords(), 298U);
+
+    CCoins coins;
+    BOOST_CHECK(db.GetCoins(txid, coins));
+    BOOST_CHECK_EQUAL(coins.vout.size(), 299U);
+    BOOST_CHECK(!coins.IsAvailable(5));
+    BOOST_CHECK(coins.IsAvailable(6));
+    BOOST_CHECK_EQUAL(coins.vout[6].nValue, 1006);
+    BOOST_CHECK_EQUAL(coins.nHeight, 10);
+    BOOST_CHECK(!coins.fCoinBase);
+
+    // A fully spent transaction leaves nothing behind.
+    {
+        CCoinsModifier modifier = cache.ModifyCoins(txid);
+        for (unsigned int i = 0; i < 300; i++)
+            modifier->Spend(i);
+    }
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK_EQUAL(db.CountRecords(), 0U);
+    BOOST_CHECK(!db.HaveCoins(txid));
+}
+
+BOOST_FIXTURE_TEST_CASE(ccoins_db_reorg_flush, TestingSetup)
+{
+    const uint256 txid = GetRandHash();
+    {
+        CCoinsViewDB db(1 << 20, false, true);
+        CCoinsViewCache cache(&db);
+        {
+            CCoinsModifier coins = cache.ModifyNewCoins(txid, false);
+            coins->nHeight = 10;
+            coins->nVersion = 1;
+            coins->vout.resize(2);
+            for (unsigned int i = 0; i < coins->vout.size(); i++) {
+                coins->vout[i].nValue = 1000 + i;
+                coins->vout[i].scriptPubKey = CScript() << OP_TRUE;
+            }
+        }
+        cache.SetBestBlock(GetRandHash());
+        BOOST_CHECK(cache.Flush());
+        BOOST_CHECK(db.HaveCoins(txid));
+
+        // Disconnected and mined again at another height before the next flush.
+        CCoins coinsMined;
+        BOOST_CHECK(cache.GetCoins(txid, coinsMined));
+        cache.ModifyCoins(txid)->Clear();
+        {
+            CCoinsModifier coins = cache.ModifyCoins(txid);
+            *coins = coinsMined;
+            coins->nHeight = 20;
+        }
+        cache.SetBestBlock(GetRandHash());
+        BOOST_CHECK(cache.Flush());
+    }
+
+    CCoinsViewDB db(1 << 20, false);
+    CCoins coins;
+    BOOST_CHECK(db.GetCoins(txid, coins));
+    BOOST_CHECK_EQUAL(coins.nHeight, 20);
+    BOOST_CHECK_EQUAL(coins.vout.size(), 2U);
+    BOOST_CHECK_EQUAL(coins.vout[1].nValue, 1001);
+}
+
+BOOST_FIXTURE_TEST_CASE(ccoins_db_upgrade, TestingSetup)
+{
+    CCoinsViewDBTest db;
+    const uint256 txid = GetRandHash();
+    CCoins legacy;
+    legacy.fCoinBase = true;
+    legacy.nHeight = 5;
+    legacy.nVersion = 1;
+    legacy.vout.resize(3);
+    for (unsigned int i = 1; i < legacy.vout.size(); i++) {
+        legacy.vout[i].nValue = 7 + i;
+        legacy.vout[i].scriptPubKey = CScript() << OP_TRUE;
+    }
+    BOOST_CHECK(db.GetDB().Write(std::make_pair('c', txid), legacy));
+
+    BOOST_CHECK(db.Upgrade());
+    BOOST_CHECK(!db.GetDB().Exists(std::make_pair('c', txid)));
+    int nVersion = 0;
+    BOOST_CHECK(db.GetDB().Read('V', nVersion));
+    BOOST_CHECK_EQUAL(nVersion, 1);
+    BOOST_CHECK_EQUAL(db.CountRecords(), 2U);
+    CCoins coins;
+    BOOST_CHECK(db.GetCoins(txid, coins));
+    BOOST_CHECK(coins == legacy);
+
+    boost::scoped_ptr<CCoinsViewCursor> pcursor(db.Cursor());
+    BOOST_CHECK(pcursor->Valid());
+    uint256 key;
+    BOOST_CHECK(pcursor->GetKey(key) && key == txid);
+    pcursor->Next();
+    BOOST_CHECK(!pcursor->Valid());
+
+    // A layout this version does not know is refused rather than read as an empty set.
+    BOOST_CHECK(db.Upgrade());
+    BOOST_CHECK(db.GetDB().Write('V', 2));
+    BOOST_CHECK(!db.Upgrade());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -309,4 +309,70 @@ BOOST_AUTO_TEST_CASE(iterator_string_ordering)
     }
 }
 
+BOOST_AUTO_TEST_CASE(dbwrapper_profiles)
+{
+    // Per-database defaults
+    CDBOptions chainstate = GetDBOptions("chainstate", 8 << 20);
+    BOOST_CHECK_EQUAL(chainstate.nBlockCacheSize, 4U << 20);
+    BOOST_CHECK_EQUAL(chainstate.nWriteBufferSize, 2U << 20);
+    BOOST_CHECK_EQUAL(chainstate.nBloomBits, 0);
+    BOOST_CHECK(!chainstate.fCompression);
+    BOOST_CHECK(GetDBOptions("blockindex", 8 << 20).fCompression);
+    BOOST_CHECK_EQUAL(GetDBOptions("blockindex", 8 << 20).nBloomBits, 10);
+
+    // Command line overrides apply to the named database only
+    mapArgs["-txindexdbcompression"] = "0";
+    mapArgs["-txindexdbbloombits"] = "1000";
+    mapArgs["-txindexdbmaxopenfiles"] = "200";
+    mapArgs["-txindexdbwritebuffer"] = "3";
+    mapArgs["-txindexdbblocksize"] = "16";
+    CDBOptions txindex = GetDBOptions("txindex", 8 << 20);
+    BOOST_CHECK(!txindex.fCompression);
+    BOOST_CHECK_EQUAL(txindex.nBloomBits, 64);
+    BOOST_CHECK_EQUAL(txindex.nMaxOpenFiles, 200);
+    BOOST_CHECK_EQUAL(txindex.nWriteBufferSize, 3U << 20);
+    BOOST_CHECK_EQUAL(txindex.nBlockSize, 16U << 10);
+    BOOST_CHECK(GetDBOptions("blockindex", 8 << 20).fCompression);
+    mapArgs.erase("-txindexdbcompression");
+    mapArgs.erase("-txindexdbbloombits");
+    mapArgs.erase("-txindexdbmaxopenfiles");
+    mapArgs.erase("-txindexdbwritebuffer");
+    mapArgs.erase("-txindexdbblocksize");
+}
+
+BOOST_AUTO_TEST_CASE(dbwrapper_stats)
+{
+    path ph = temp_directory_path() / unique_path();
+    CDBOptions dbOptions(1 << 20);
+    dbOptions.strName = "dbwrapper_stats";
+    dbOptions.fCompression = true;
+    {
+        CDBWrapper dbw(ph, dbOptions, false, false, false);
+        BOOST_CHECK(dbw.GetOptions().fCompression);
+        // Compressed and uncompressed tables read back the same
+        for (int i = 0; i < 1000; i++)
+            BOOST_CHECK(dbw.Write(make_pair('k', i), std::string(100, 'a' + i % 26)));
+        std::string strValue;
+        BOOST_CHECK(dbw.Read(make_pair('k', 500), strValue));
+        BOOST_CHECK_EQUAL(strValue, std::string(100, 'a' + 500 % 26));
+        BOOST_CHECK(dbw.GetProperty("leveldb.stats", strValue));
+        BOOST_CHECK(!dbw.GetProperty("leveldb.nonexistent", strValue));
+
+        bool fFound = false;
+        for (const CDBStats& stats : GetDBStats()) {
+            if (stats.options.strName != dbOptions.strName)
+                continue;
+            fFound = true;
+            BOOST_CHECK_EQUAL(stats.strPath, ph.string());
+            BOOST_CHECK(stats.vFilesAtLevel.size() > 0);
+            BOOST_CHECK(!stats.strStats.empty());
+        }
+        BOOST_CHECK(fFound);
+    }
+    // Closed databases are no longer reported
+    for (const CDBStats& stats : GetDBStats())
+        BOOST_CHECK(stats.options.strName != dbOptions.strName);
+    remove_all(ph);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
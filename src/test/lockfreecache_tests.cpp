@@ -0,0 +1,146 @@
+// Copyright (c) 2016 The Gulden developers
+// Distributed under the GULDEN software license, see the accompanying
+// file COPYING
+
+#include "lockfreecache.h"
+#include "random.h"
+#include "uint256.h"
+
+#include "test/test_bitcoin.h"
+
+#include <vector>
+
+#include <boost/thread.hpp>
+#include <boost/test/unit_test.hpp>
+
+namespace {
+class TestCacheHasher {
+public:
+    uint64_t operator()(const uint64_t* words) const { return words[0]; }
+};
+
+typedef lockfreecache<uint256, TestCacheHasher> test_cache;
+
+std::vector<uint256> MakeEntries(size_t n)
+{
+    std::vector<uint256> entries(n);
+    for (size_t i = 0; i < n; ++i)
+        entries[i] = GetRandHash();
+    return entries;
+}
+
+void InsertRange(test_cache* cache, const std::vector<uint256>* entries, size_t nBegin, size_t nEnd)
+{
+    for (size_t i = nBegin; i < nEnd; ++i)
+        cache->insert((*entries)[i]);
+}
+}
+
+BOOST_FIXTURE_TEST_SUITE(lockfreecache_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(lockfreecache_disabled)
+{
+    test_cache cache;
+    BOOST_CHECK_EQUAL(cache.setup_bytes(0), 0U);
+    uint256 e = GetRandHash();
+    cache.insert(e);
+    BOOST_CHECK(!cache.contains(e, false));
+}
+
+BOOST_AUTO_TEST_CASE(lockfreecache_insert_contains_erase)
+{
+    test_cache cache;
+    uint64_t nCapacity = cache.setup_bytes(1 << 20);
+    BOOST_CHECK(nCapacity > 0);
+    BOOST_CHECK(cache.memory_usage() <= (1 << 20));
+    BOOST_CHECK_EQUAL(nCapacity % test_cache::WAYS, 0U);
+
+    // Well below capacity every insert should stick.
+    std::vector<uint256> entries = MakeEntries(nCapacity / 8);
+    for (const uint256& e : entries)
+        cache.insert(e);
+    for (const uint256& e : entries)
+        BOOST_CHECK(cache.contains(e, false));
+
+    // Never inserted entries are never reported.
+    std::vector<uint256> absent = MakeEntries(1000);
+    for (const uint256& e : absent)
+        BOOST_CHECK(!cache.contains(e, false));
+
+    // Erase on hit removes the entry.
+    BOOST_CHECK(cache.contains(entries[0], true));
+    BOOST_CHECK(!cache.contains(entries[0], false));
+}
+
+BOOST_AUTO_TEST_CASE(lockfreecache_no_duplicates)
+{
+    // A single set, so every element competes for the same ways.
+    test_cache cache;
+    uint64_t nCapacity = cache.setup_bytes(1 << 16);
+    BOOST_REQUIRE_EQUAL(cache.setup_bytes(cache.memory_usage() / nCapacity * test_cache::WAYS), test_cache::WAYS);
+
+    uint256 a = GetRandHash();
+    uint256 b = GetRandHash();
+    cache.insert(a);
+    cache.insert(b);
+    BOOST_CHECK(cache.contains(a, true));
+
+    // Re-inserting an element behind the freed way must not store it twice.
+    cache.insert(b);
+    BOOST_CHECK(cache.contains(b, true));
+    BOOST_CHECK(!cache.contains(b, false));
+}
+
+BOOST_AUTO_TEST_CASE(lockfreecache_generation_eviction)
+{
+    test_cache cache;
+    uint64_t nCapacity = cache.setup_bytes(1 << 16);
+
+    // Fill the cache several times over; the most recent generation should
+    // be mostly resident while the oldest entries are evicted first.
+    std::vector<uint256> old = MakeEntries(nCapacity);
+    std::vector<uint256> recent = MakeEntries(nCapacity / test_cache::GENERATIONS);
+    for (const uint256& e : old)
+        cache.insert(e);
+    for (int i = 0; i < 4; ++i) {
+        std::vector<uint256> filler = MakeEntries(nCapacity);
+        for (const uint256& e : filler)
+            cache.insert(e);
+    }
+    for (const uint256& e : recent)
+        cache.insert(e);
+
+    size_t nOld = 0, nRecent = 0;
+    for (const uint256& e : old)
+        nOld += cache.contains(e, false);
+    for (const uint256& e : recent)
+        nRecent += cache.contains(e, false);
+    BOOST_CHECK(nRecent * 10 >= recent.size() * 9);
+    BOOST_CHECK(nOld * 10 < old.size());
+}
+
+BOOST_AUTO_TEST_CASE(lockfreecache_concurrent)
+{
+    test_cache cache;
+    uint64_t nCapacity = cache.setup_bytes(1 << 20);
+    const int nThreads = 4;
+    std::vector<uint256> entries = MakeEntries(nCapacity / 8);
+    size_t nPerThread = entries.size() / nThreads;
+
+    boost::thread_group threads;
+    for (int i = 0; i < nThreads; ++i)
+        threads.create_thread(boost::bind(&InsertRange, &cache, &entries, i * nPerThread, (i + 1) * nPerThread));
+    threads.join_all();
+
+    // Inserts may be dropped under contention, but only rarely at this load.
+    size_t nFound = 0;
+    for (size_t i = 0; i < nThreads * nPerThread; ++i)
+        nFound += cache.contains(entries[i], false);
+    BOOST_CHECK(nFound * 100 >= nThreads * nPerThread * 99);
+
+    std::vector<uint256> absent = MakeEntries(1000);
+    for (const uint256& e : absent)
+        BOOST_CHECK(!cache.contains(e, false));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
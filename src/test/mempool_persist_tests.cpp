@@ -0,0 +1,74 @@
+// Copyright (c) 2016 The Gulden developers
+// Distributed under the GULDEN software license, see the accompanying
+// file COPYING
+
+#include "consensus/validation.h"
+#include "key.h"
+#include "main.h"
+#include "random.h"
+#include "script/standard.h"
+#include "txmempool.h"
+#include "util.h"
+#include "utiltime.h"
+
+#include "test/test_bitcoin.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(mempool_persist_tests, TestChain100Setup)
+
+BOOST_AUTO_TEST_CASE(mempool_dump_and_load)
+{
+    const boost::filesystem::path pathDump = GetDataDir() / "mempool.dat";
+    boost::filesystem::remove(pathDump);
+
+    // Nothing is written before the pool was loaded, so a partial pool never replaces the file.
+    BOOST_CHECK(!DumpMempool());
+    BOOST_CHECK(!LoadMempool());
+    BOOST_CHECK(!boost::filesystem::exists(pathDump));
+
+    CScript scriptPubKey = CScript() << ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+    CMutableTransaction parent = SpendOutput(coinbaseTxns[0], 0, 11 * CENT, scriptPubKey);
+    CMutableTransaction child = SpendOutput(parent, 0, 10 * CENT, scriptPubKey);
+    const int64_t nTime = GetTime() - 600;
+    BOOST_CHECK(AddToMempool(parent, nTime));
+    BOOST_CHECK(AddToMempool(child, nTime + 1));
+    mempool.PrioritiseTransaction(child.GetHash(), child.GetHash().ToString(), 0, 5 * CENT);
+    // A delta of a transaction that is not in the pool is kept as well.
+    const uint256 hashOther = GetRandHash();
+    mempool.PrioritiseTransaction(hashOther, hashOther.ToString(), 0, CENT);
+
+    BOOST_CHECK(DumpMempool());
+    BOOST_CHECK(boost::filesystem::exists(pathDump));
+
+    mempool.clear();
+    mempool.mapDeltas.clear();
+    BOOST_CHECK_EQUAL(mempool.size(), 0U);
+
+    BOOST_CHECK(LoadMempool());
+    BOOST_CHECK_EQUAL(mempool.size(), 2U);
+    {
+        LOCK(mempool.cs);
+        CTxMemPool::txiter itParent = mempool.mapTx.find(parent.GetHash());
+        CTxMemPool::txiter itChild = mempool.mapTx.find(child.GetHash());
+        BOOST_REQUIRE(itParent != mempool.mapTx.end());
+        BOOST_REQUIRE(itChild != mempool.mapTx.end());
+        BOOST_CHECK_EQUAL(itParent->GetTime(), nTime);
+        BOOST_CHECK_EQUAL(itChild->GetTime(), nTime + 1);
+        BOOST_CHECK_EQUAL(itChild->GetModifiedFee(), itChild->GetFee() + 5 * CENT);
+        BOOST_CHECK_EQUAL(mempool.mapDeltas[hashOther].second, CENT);
+    }
+
+    // Expired transactions are dropped on load.
+    mempool.clear();
+    mapArgs["-mempoolexpiry"] = "0";
+    BOOST_CHECK(LoadMempool());
+    BOOST_CHECK_EQUAL(mempool.size(), 0U);
+    mapArgs.erase("-mempoolexpiry");
+
+    mempool.clear();
+    mempool.mapDeltas.clear();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
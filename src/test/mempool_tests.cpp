@@ -12,6 +12,10 @@
 #include <list>
 #include <vector>
 
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
 BOOST_FIXTURE_TEST_SUITE(mempool_tests, TestingSetup)
 
 BOOST_AUTO_TEST_CASE(MempoolRemoveTest)
@@ -51,14 +55,17 @@ BOOST_AUTO_TEST_CASE(MempoolRemoveTest)
     }
 
     CTxMemPool testPool(CFeeRate(0));
-    std::list<CTransaction> removed;
+    std::list<CTransactionRef> removed;
 
     testPool.removeRecursive(txParent, removed);
     BOOST_CHECK_EQUAL(removed.size(), 0);
 
     testPool.addUnchecked(txParent.GetHash(), entry.FromTx(txParent));
+    CTransactionRef ptxParent = testPool.get(txParent.GetHash());
     testPool.removeRecursive(txParent, removed);
     BOOST_CHECK_EQUAL(removed.size(), 1);
+    // The removed transaction is the object the pool held, not a copy.
+    BOOST_CHECK(removed.front() == ptxParent);
     removed.clear();
 
     testPool.addUnchecked(txParent.GetHash(), entry.FromTx(txParent));
@@ -265,7 +272,7 @@ BOOST_AUTO_TEST_CASE(MempoolIndexingTest)
 
     BOOST_CHECK_EQUAL(pool.size(), 10);
 
-    std::list<CTransaction> removed;
+    std::list<CTransactionRef> removed;
     pool.removeRecursive(pool.mapTx.find(tx10.GetHash())->GetTx(), removed);
     CheckSort<descendant_score>(pool, snapshotOrder);
 
@@ -392,9 +399,9 @@ BOOST_AUTO_TEST_CASE(MempoolAncestorIndexingTest)
     CheckSort<ancestor_score>(pool, sortedOrder);
 
     /* after tx6 is mined, tx7 should move up in the sort */
-    std::vector<CTransaction> vtx;
-    vtx.push_back(tx6);
-    std::list<CTransaction> dummy;
+    std::vector<CTransactionRef> vtx;
+    vtx.push_back(MakeTransactionRef(tx6));
+    std::list<CTransactionRef> dummy;
     pool.removeForBlock(vtx, 1, dummy, false);
 
     sortedOrder.erase(sortedOrder.begin() + 1);
@@ -403,6 +410,283 @@ BOOST_AUTO_TEST_CASE(MempoolAncestorIndexingTest)
     CheckSort<ancestor_score>(pool, sortedOrder);
 }
 
+BOOST_AUTO_TEST_CASE(MempoolAncestorWalkTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+    LOCK(pool.cs);
+
+    /* tx1 -> tx2, tx3 -> tx4: a diamond, so tx1 is reached twice from tx4 */
+    CMutableTransaction tx1 = CMutableTransaction();
+    tx1.vout.resize(2);
+    tx1.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx1.vout[0].nValue = 10 * COIN;
+    tx1.vout[1] = tx1.vout[0];
+    pool.addUnchecked(tx1.GetHash(), entry.FromTx(tx1));
+
+    CMutableTransaction tx2 = CMutableTransaction();
+    tx2.vin.resize(1);
+    tx2.vin[0].prevout = COutPoint(tx1.GetHash(), 0);
+    tx2.vin[0].scriptSig = CScript() << OP_11;
+    tx2.vout.resize(1);
+    tx2.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx2.vout[0].nValue = 10 * COIN;
+    pool.addUnchecked(tx2.GetHash(), entry.FromTx(tx2));
+
+    CMutableTransaction tx3 = tx2;
+    tx3.vin[0].prevout = COutPoint(tx1.GetHash(), 1);
+    pool.addUnchecked(tx3.GetHash(), entry.FromTx(tx3));
+
+    CMutableTransaction tx4 = CMutableTransaction();
+    tx4.vin.resize(2);
+    tx4.vin[0].prevout = COutPoint(tx2.GetHash(), 0);
+    tx4.vin[0].scriptSig = CScript() << OP_11;
+    tx4.vin[1].prevout = COutPoint(tx3.GetHash(), 0);
+    tx4.vin[1].scriptSig = CScript() << OP_11;
+    tx4.vout.resize(1);
+    tx4.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx4.vout[0].nValue = 20 * COIN;
+    pool.addUnchecked(tx4.GetHash(), entry.FromTx(tx4));
+
+    CTxMemPool::txiter it1 = pool.mapTx.find(tx1.GetHash());
+    CTxMemPool::txiter it2 = pool.mapTx.find(tx2.GetHash());
+    CTxMemPool::txiter it3 = pool.mapTx.find(tx3.GetHash());
+    CTxMemPool::txiter it4 = pool.mapTx.find(tx4.GetHash());
+    BOOST_CHECK_EQUAL(it1->GetCountWithDescendants(), 4U);
+    BOOST_CHECK_EQUAL(it4->GetCountWithAncestors(), 4U);
+
+    const uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
+    std::string dummy;
+    CTxMemPool::setEntries setAncestors;
+    BOOST_CHECK(pool.CalculateMemPoolAncestors(*it4, setAncestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false));
+    BOOST_CHECK_EQUAL(setAncestors.size(), 3U);
+    BOOST_CHECK(setAncestors.count(it1) && setAncestors.count(it2) && setAncestors.count(it3));
+
+    CTxMemPool::setEntries setDescendants;
+    pool.CalculateDescendants(it1, setDescendants);
+    BOOST_CHECK_EQUAL(setDescendants.size(), 4U);
+    // Entries already in the set are not walked again.
+    setDescendants.clear();
+    setDescendants.insert(it2);
+    pool.CalculateDescendants(it2, setDescendants);
+    BOOST_CHECK_EQUAL(setDescendants.size(), 1U);
+
+    // The walk stops at entries already taken, as the miner's transactions in the block.
+    CTxMemPool::setEntries setStop, setUnconfirmed;
+    setStop.insert(it1);
+    setStop.insert(it2);
+    pool.CalculateAncestorsUntil(it4, setUnconfirmed, setStop);
+    BOOST_CHECK_EQUAL(setUnconfirmed.size(), 1U);
+    BOOST_CHECK(setUnconfirmed.count(it3));
+
+    // A child of tx4 is refused from the ancestor state of tx4 alone.
+    CMutableTransaction tx5 = CMutableTransaction();
+    tx5.vin.resize(1);
+    tx5.vin[0].prevout = COutPoint(tx4.GetHash(), 0);
+    tx5.vin[0].scriptSig = CScript() << OP_11;
+    tx5.vout.resize(1);
+    tx5.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx5.vout[0].nValue = 20 * COIN;
+    std::string errString;
+    setAncestors.clear();
+    BOOST_CHECK(!pool.CalculateMemPoolAncestors(entry.FromTx(tx5), setAncestors, 4, nNoLimit, nNoLimit, nNoLimit, errString));
+    BOOST_CHECK(setAncestors.empty());
+    BOOST_CHECK(pool.CalculateMemPoolAncestors(entry.FromTx(tx5), setAncestors, 5, nNoLimit, nNoLimit, nNoLimit, errString));
+    BOOST_CHECK_EQUAL(setAncestors.size(), 4U);
+
+    // Confirming the top of the diamond leaves the ancestor state of the rest consistent.
+    std::vector<CTransactionRef> vtx;
+    vtx.push_back(MakeTransactionRef(tx1));
+    std::list<CTransactionRef> conflicts;
+    pool.removeForBlock(vtx, 1, conflicts, false);
+    BOOST_CHECK_EQUAL(pool.size(), 3U);
+    BOOST_CHECK_EQUAL(pool.mapTx.find(tx4.GetHash())->GetCountWithAncestors(), 3U);
+    BOOST_CHECK_EQUAL(pool.mapTx.find(tx2.GetHash())->GetCountWithDescendants(), 2U);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolMemoryUsageTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+
+    /* tx1 with two children, tx2 and tx3 */
+    CMutableTransaction tx1 = CMutableTransaction();
+    tx1.vout.resize(2);
+    tx1.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx1.vout[0].nValue = 10 * COIN;
+    tx1.vout[1] = tx1.vout[0];
+    pool.addUnchecked(tx1.GetHash(), entry.FromTx(tx1));
+
+    CMutableTransaction tx2 = CMutableTransaction();
+    tx2.vin.resize(1);
+    tx2.vin[0].prevout = COutPoint(tx1.GetHash(), 0);
+    tx2.vin[0].scriptSig = CScript() << OP_11;
+    tx2.vout.resize(1);
+    tx2.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx2.vout[0].nValue = 10 * COIN;
+    pool.addUnchecked(tx2.GetHash(), entry.FromTx(tx2));
+
+    CMutableTransaction tx3 = tx2;
+    tx3.vin[0].prevout = COutPoint(tx1.GetHash(), 1);
+    pool.addUnchecked(tx3.GetHash(), entry.FromTx(tx3));
+
+    {
+        LOCK(pool.cs);
+        CTxMemPool::txiter it1 = pool.mapTx.find(tx1.GetHash());
+        CTxMemPool::txiter it2 = pool.mapTx.find(tx2.GetHash());
+        BOOST_CHECK_EQUAL(pool.GetMemPoolChildren(it1).size(), 2U);
+        BOOST_CHECK(pool.GetMemPoolParents(it1).empty());
+        BOOST_REQUIRE_EQUAL(pool.GetMemPoolParents(it2).size(), 1U);
+        BOOST_CHECK(pool.GetMemPoolParents(it2)[0] == it1);
+    }
+
+    // The parts add up to the usage the pool is limited by. The links are counted from the
+    // lists, so this holds only if the pool's running count of them is right.
+    CTxMemPool::MemoryUsage usage = pool.GetMemoryUsage();
+    size_t nTransactions = 0;
+    size_t nLists = 0;
+    {
+        LOCK(pool.cs);
+        for (CTxMemPool::txiter it = pool.mapTx.begin(); it != pool.mapTx.end(); it++) {
+            nTransactions += it->DynamicMemoryUsage();
+            nLists += memusage::DynamicUsage(pool.GetMemPoolParents(it)) + memusage::DynamicUsage(pool.GetMemPoolChildren(it));
+        }
+    }
+    BOOST_CHECK_EQUAL(usage.nTransactions, nTransactions);
+    BOOST_CHECK(usage.nEntries > 3 * sizeof(CTxMemPoolEntry));
+    BOOST_CHECK(nLists > 0);
+    BOOST_CHECK(usage.nLinks > nLists);
+    BOOST_CHECK(usage.nNextTx > 0);
+    BOOST_CHECK_EQUAL(usage.nTransactions + usage.nEntries + usage.nLinks + usage.nNextTx + usage.nDeltas + usage.nTxHashes,
+                      pool.DynamicMemoryUsage());
+
+    // Removing a child releases its link from the parent's list.
+    std::list<CTransactionRef> removed;
+    pool.removeRecursive(tx3, removed);
+    {
+        LOCK(pool.cs);
+        BOOST_CHECK_EQUAL(pool.GetMemPoolChildren(pool.mapTx.find(tx1.GetHash())).size(), 1U);
+    }
+    usage = pool.GetMemoryUsage();
+    BOOST_CHECK_EQUAL(usage.nTransactions + usage.nEntries + usage.nLinks + usage.nNextTx + usage.nDeltas + usage.nTxHashes,
+                      pool.DynamicMemoryUsage());
+
+    pool.removeRecursive(tx1, removed);
+    BOOST_CHECK_EQUAL(pool.size(), 0U);
+    BOOST_CHECK_EQUAL(pool.GetMemoryUsage().nLinks, 0U);
+}
+
+#if defined(__GLIBC__)
+namespace {
+/** Bytes the allocator reports in use by the process, as getmempoolmemory shows them. */
+int64_t GetAllocatedBytes()
+{
+#if __GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33)
+    struct mallinfo2 mi = mallinfo2();
+    return mi.uordblks + mi.hblkhd;
+#else
+    struct mallinfo mi = mallinfo();
+    return (int64_t)(unsigned int)mi.uordblks + (int64_t)(unsigned int)mi.hblkhd;
+#endif
+}
+}
+
+BOOST_AUTO_TEST_CASE(MempoolMemoryUsageAllocatorTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+
+    // Chains of transactions with two outputs, so the pool holds links and spent outputs too.
+    // They are built up front, so the allocations while the pool is filled are its own.
+    const int nTxs = 4000;
+    std::vector<CMutableTransaction> vtx(nTxs);
+    for (int i = 0; i < nTxs; i++) {
+        CMutableTransaction& tx = vtx[i];
+        tx.vin.resize(1);
+        if (i % 10)
+            tx.vin[0].prevout = COutPoint(vtx[i - 1].GetHash(), 0);
+        tx.vin[0].scriptSig = CScript() << i << OP_11;
+        tx.vout.resize(2);
+        tx.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        tx.vout[0].nValue = 10 * COIN;
+        tx.vout[1] = tx.vout[0];
+    }
+
+    const int64_t nAllocatedBefore = GetAllocatedBytes();
+    const int64_t nUsageBefore = pool.DynamicMemoryUsage();
+    for (int i = 0; i < nTxs; i++)
+        pool.addUnchecked(vtx[i].GetHash(), entry.FromTx(vtx[i], &pool));
+    int64_t nAllocated = GetAllocatedBytes() - nAllocatedBefore;
+    const int64_t nUsage = pool.DynamicMemoryUsage() - nUsageBefore;
+
+    // The fee estimator keeps a map node per transaction that the pool does not count.
+    std::map<uint256, std::pair<void*, uint64_t> > mapEstimator;
+    nAllocated -= memusage::DynamicUsage(mapEstimator) + nTxs * memusage::IncrementalDynamicUsage(mapEstimator);
+
+    // The estimate must not fall below what the allocator handed out, and may exceed it by at most 15%.
+    // Most of the excess is the shared_ptr control block, which memusage counts as its own allocation
+    // while MakeTransactionRef places it next to the transaction (about 64 bytes per transaction here).
+    BOOST_CHECK_MESSAGE(nUsage >= nAllocated && nUsage * 100 <= nAllocated * 115,
+                        strprintf("estimated %d bytes, allocated %d", nUsage, nAllocated));
+}
+#endif
+
+BOOST_AUTO_TEST_CASE(MempoolTrimBatchTest)
+{
+    CTxMemPool pool(CFeeRate(1000));
+    TestMemPoolEntryHelper entry;
+
+    // Unrelated transactions of one size, paying more in the order they are made,
+    // each but the first with a child paying the same.
+    std::vector<CMutableTransaction> vParents, vChildren;
+    for (int i = 0; i < 10; i++) {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].scriptSig = CScript() << i;
+        tx.vout.resize(1);
+        tx.vout[0].scriptPubKey = CScript() << OP_1 << OP_EQUAL;
+        tx.vout[0].nValue = 10 * COIN;
+        pool.addUnchecked(tx.GetHash(), entry.Fee(1000LL * (i + 1)).Time(i).FromTx(tx, &pool));
+        vParents.push_back(tx);
+        if (i == 0)
+            continue;
+
+        CMutableTransaction child;
+        child.vin.resize(1);
+        child.vin[0].prevout = COutPoint(tx.GetHash(), 0);
+        child.vout.resize(1);
+        child.vout[0].scriptPubKey = CScript() << OP_2 << OP_EQUAL;
+        child.vout[0].nValue = 10 * COIN;
+        pool.addUnchecked(child.GetHash(), entry.Fee(1000LL * (i + 1)).Time(100).FromTx(child, &pool));
+        vChildren.push_back(child);
+    }
+
+    // Whole packages go, the cheapest first, and no more than needed.
+    const size_t nLimit = pool.DynamicMemoryUsage() / 2;
+    pool.TrimToSize(nLimit);
+    BOOST_CHECK(pool.DynamicMemoryUsage() <= nLimit);
+    BOOST_CHECK(!pool.exists(vParents[0].GetHash()));
+    BOOST_CHECK(pool.exists(vParents.back().GetHash()));
+    int nLowest = 0;
+    while (!pool.exists(vParents[nLowest].GetHash()))
+        nLowest++;
+    for (int i = nLowest; i < 10; i++)
+        BOOST_CHECK(pool.exists(vParents[i].GetHash()));
+    for (int i = 1; i < 10; i++)
+        BOOST_CHECK_EQUAL(pool.exists(vChildren[i - 1].GetHash()), i >= nLowest);
+    BOOST_CHECK_EQUAL(pool.size(), 2U * (10 - nLowest));
+    CFeeRate maxFeeRateRemoved(1000, GetVirtualTransactionSize(vParents[0]));
+    if (nLowest > 1)
+        maxFeeRateRemoved = CFeeRate(2000LL * nLowest, GetVirtualTransactionSize(vParents[nLowest - 1]) + GetVirtualTransactionSize(vChildren[nLowest - 2]));
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1).GetFeePerK(), maxFeeRateRemoved.GetFeePerK() + 1000);
+
+    // Expiry takes the descendants of old transactions along, whatever their time.
+    BOOST_CHECK_EQUAL(pool.Expire(nLowest + 1), 2);
+    BOOST_CHECK(!pool.exists(vParents[nLowest].GetHash()));
+    BOOST_CHECK(!pool.exists(vChildren[nLowest - 1].GetHash()));
+    BOOST_CHECK_EQUAL(pool.size(), 2U * (9 - nLowest));
+}
+
 BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
 {
     CTxMemPool pool(CFeeRate(1000));
@@ -527,8 +811,8 @@ BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
     pool.addUnchecked(tx5.GetHash(), entry.Fee(1000LL).FromTx(tx5, &pool));
     pool.addUnchecked(tx7.GetHash(), entry.Fee(9000LL).FromTx(tx7, &pool));
 
-    std::vector<CTransaction> vtx;
-    std::list<CTransaction> conflicts;
+    std::vector<CTransactionRef> vtx;
+    std::list<CTransactionRef> conflicts;
     SetMockTime(42);
     SetMockTime(42 + CTxMemPool::ROLLING_FEE_HALFLIFE);
     BOOST_CHECK_EQUAL(pool.GetMinFee(1).GetFeePerK(), maxFeeRateRemoved.GetFeePerK() + 1000);
@@ -4,12 +4,17 @@
 
 #include "policy/policy.h"
 #include "policy/fees.h"
+#include "random.h"
+#include "clientversion.h"
+#include "streams.h"
 #include "txmempool.h"
 #include "uint256.h"
 #include "util.h"
 
 #include "test/test_bitcoin.h"
+#include "test/testutil.h"
 
+#include <boost/filesystem.hpp>
 #include <boost/test/unit_test.hpp>
 
 BOOST_FIXTURE_TEST_SUITE(policyestimator_tests, BasicTestingSetup)
@@ -40,14 +45,14 @@ BOOST_AUTO_TEST_CASE(BlockPolicyEstimates)
     for (unsigned int i = 0; i < 128; i++)
         garbage.push_back('X');
     CMutableTransaction tx;
-    std::list<CTransaction> dummyConflicted;
+    std::list<CTransactionRef> dummyConflicted;
     tx.vin.resize(1);
     tx.vin[0].scriptSig = garbage;
     tx.vout.resize(1);
     tx.vout[0].nValue = 0LL;
     CFeeRate baseRate(basefee, GetVirtualTransactionSize(tx));
 
-    std::vector<CTransaction> block;
+    std::vector<CTransactionRef> block;
     int blocknum = 0;
 
     while (blocknum < 200) {
@@ -65,7 +70,7 @@ BOOST_AUTO_TEST_CASE(BlockPolicyEstimates)
             while (txHashes[9 - h].size()) {
                 std::shared_ptr<const CTransaction> ptx = mpool.get(txHashes[9 - h].back());
                 if (ptx)
-                    block.push_back(*ptx);
+                    block.push_back(ptx);
                 txHashes[9 - h].pop_back();
             }
         }
@@ -137,7 +142,7 @@ BOOST_AUTO_TEST_CASE(BlockPolicyEstimates)
         while (txHashes[j].size()) {
             std::shared_ptr<const CTransaction> ptx = mpool.get(txHashes[j].back());
             if (ptx)
-                block.push_back(*ptx);
+                block.push_back(ptx);
             txHashes[j].pop_back();
         }
     }
@@ -156,7 +161,7 @@ BOOST_AUTO_TEST_CASE(BlockPolicyEstimates)
                 mpool.addUnchecked(hash, entry.Fee(feeV[k / 4][j]).Time(GetTime()).Priority(priV[k / 4][j]).Height(blocknum).FromTx(tx, &mpool));
                 std::shared_ptr<const CTransaction> ptx = mpool.get(hash);
                 if (ptx)
-                    block.push_back(*ptx);
+                    block.push_back(ptx);
             }
         }
         mpool.removeForBlock(block, ++blocknum, dummyConflicted);
@@ -178,4 +183,51 @@ BOOST_AUTO_TEST_CASE(BlockPolicyEstimates)
     }
 }
 
+BOOST_AUTO_TEST_CASE(BlockPolicyEstimatesPersist)
+{
+    CTxMemPool mpool(CFeeRate(1000));
+    TestMemPoolEntryHelper entry;
+    CAmount basefee(2000);
+    CMutableTransaction tx;
+    std::list<CTransactionRef> dummyConflicted;
+    tx.vin.resize(1);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 0LL;
+
+    // Every block confirms the transactions of the block before, higher fees first.
+    std::vector<CTransactionRef> block;
+    for (int blocknum = 0; blocknum < 100; blocknum++) {
+        for (int j = 0; j < 10; j++) {
+            tx.vin[0].prevout.n = 100 * blocknum + j;
+            mpool.addUnchecked(tx.GetHash(), entry.Fee(basefee * (j + 1)).Time(GetTime()).Priority(0).Height(blocknum).FromTx(tx, &mpool));
+            if (j >= 5)
+                block.push_back(mpool.get(tx.GetHash()));
+        }
+        mpool.removeForBlock(block, blocknum + 1, dummyConflicted);
+        block.clear();
+    }
+    BOOST_CHECK(mpool.estimateFee(1).GetFeePerK() > 0);
+
+    const boost::filesystem::path pathEstimates = GetTempPath() / strprintf("fee_estimates_test_%lu_%i.dat", (unsigned long)GetTime(), (int)GetRand(100000));
+    {
+        CAutoFile fileout(fopen(pathEstimates.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+        BOOST_REQUIRE(!fileout.IsNull());
+        BOOST_CHECK(mpool.WriteFeeEstimates(fileout));
+    }
+
+    CTxMemPool mpoolRead(CFeeRate(1000));
+    {
+        CAutoFile filein(fopen(pathEstimates.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+        BOOST_REQUIRE(!filein.IsNull());
+        BOOST_CHECK(mpoolRead.ReadFeeEstimates(filein));
+    }
+    boost::filesystem::remove(pathEstimates);
+
+    // The file holds the averages rescaled, which may only move an estimate by rounding.
+    for (int i = 1; i < 10; i++) {
+        BOOST_CHECK(std::abs(mpoolRead.estimateFee(i).GetFeePerK() - mpool.estimateFee(i).GetFeePerK()) <= 1);
+        BOOST_CHECK_EQUAL(mpoolRead.estimatePriority(i), mpool.estimatePriority(i));
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -3,6 +3,7 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "chain.h"
+#include "chainparams.h"
 #include "random.h"
 #include "util.h"
 #include "test/test_bitcoin.h"
@@ -94,4 +95,34 @@ BOOST_AUTO_TEST_CASE(getlocator_test)
     }
 }
 
+BOOST_AUTO_TEST_CASE(contextual_fields_test)
+{
+    const Consensus::Params& params = Params().GetConsensus();
+    const int nLength = params.nMajorityWindow * 3;
+    std::vector<CBlockIndex> vIndex(nLength);
+    std::vector<CBlockIndex> vPlain(nLength);
+
+    for (int i = 0; i < nLength; i++) {
+        vIndex[i].nHeight = i;
+        vIndex[i].nVersion = 1 + insecure_rand() % 4;
+        vIndex[i].nTime = 1400000000 + i * 150 + insecure_rand() % 600;
+        vIndex[i].pprev = (i == 0) ? NULL : &vIndex[i - 1];
+        vIndex[i].BuildSkip();
+        vIndex[i].BuildContextualFields(params);
+        BOOST_CHECK(vIndex[i].HasContextualFields());
+
+        vPlain[i] = vIndex[i];
+        vPlain[i].pprev = (i == 0) ? NULL : &vPlain[i - 1];
+        vPlain[i].nTimeMedianPast = 0;
+    }
+
+    // The cached values match the ones computed by walking the chain.
+    for (int i = 0; i < nLength; i++) {
+        BOOST_CHECK(!vPlain[i].HasContextualFields());
+        BOOST_CHECK_EQUAL(vIndex[i].GetMedianTimePast(i), vPlain[i].GetMedianTimePast(i));
+        for (int version = 1; version <= 5; version++)
+            BOOST_CHECK_EQUAL(vIndex[i].CountVersionAtLeast(version, params), vPlain[i].CountVersionAtLeast(version, params));
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
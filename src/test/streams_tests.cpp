@@ -2,12 +2,15 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "mappedfile.h"
 #include "streams.h"
 #include "support/allocators/zeroafterfree.h"
 #include "test/test_bitcoin.h"
 
 #include <boost/assign/std/vector.hpp> // for 'operator+=()'
 #include <boost/assert.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/filesystem/fstream.hpp>
 #include <boost/test/unit_test.hpp>
 
 using namespace std;
@@ -58,4 +61,48 @@ BOOST_AUTO_TEST_CASE(streams_serializedata_xor)
         std::string(ds.begin(), ds.end()));
 }
 
+BOOST_AUTO_TEST_CASE(streams_span_reader)
+{
+    CDataStream ss(SER_DISK, 0);
+    std::vector<unsigned char> vch(300, 0x5a);
+    ss << (uint32_t)0x01020304 << vch << std::string("span");
+    const std::string data = ss.str();
+
+    CSpanReader reader(data.data(), data.data() + data.size(), SER_DISK, 0);
+    uint32_t n;
+    std::vector<unsigned char> vchOut;
+    std::string str;
+    reader >> n >> vchOut;
+    BOOST_CHECK_EQUAL(n, 0x01020304U);
+    BOOST_CHECK(vchOut == vch);
+    BOOST_CHECK_EQUAL(reader.size(), 5U);
+    reader >> str;
+    BOOST_CHECK_EQUAL(str, "span");
+    BOOST_CHECK(reader.empty());
+    BOOST_CHECK_THROW(reader >> n, std::ios_base::failure);
+
+    // A truncated span fails instead of reading past its end.
+    CSpanReader truncated(data.data(), data.data() + 100, SER_DISK, 0);
+    BOOST_CHECK_THROW(truncated >> n >> vchOut, std::ios_base::failure);
+}
+
+BOOST_AUTO_TEST_CASE(streams_mapped_file)
+{
+    boost::filesystem::path path = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path();
+    const std::string data(10000, 'x');
+    {
+        boost::filesystem::ofstream out(path, std::ios::binary);
+        out << data;
+    }
+
+    std::shared_ptr<const CMappedFile> mapping = CMappedFile::Open(path);
+#ifndef WIN32
+    BOOST_REQUIRE(mapping);
+    BOOST_CHECK_EQUAL(mapping->size(), data.size());
+    BOOST_CHECK(std::string(mapping->data(), mapping->size()) == data);
+#endif
+    boost::filesystem::remove(path);
+    BOOST_CHECK(!CMappedFile::Open(path));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -26,6 +26,9 @@
 #include "ui_interface.h"
 #include "rpc/server.h"
 #include "rpc/register.h"
+#include "script/interpreter.h"
+#include "script/sigcache.h"
+#include "startupconfig.h"
 
 #include "test/testutil.h"
 
@@ -44,6 +47,8 @@ BasicTestingSetup::BasicTestingSetup(const std::string& chainName)
     fPrintToDebugLog = false; // don't want to write to debug.log file
     fCheckBlockIndex = true;
     SelectParams(chainName);
+    InitStartupConfig(Params());
+    InitSignatureCache();
     noui_connect();
 }
 
@@ -75,6 +80,8 @@ TestingSetup::TestingSetup(const std::string& chainName)
     nScriptCheckThreads = 3;
     for (int i = 0; i < nScriptCheckThreads - 1; i++)
         threadGroup.create_thread(&ThreadScriptCheck);
+    for (int i = 0; i < nScriptCheckThreads - 1; i++)
+        threadGroup.create_thread(&ThreadMempoolScriptCheck);
     RegisterNodeSignals(GetNodeSignals());
 }
 
@@ -99,7 +106,7 @@ TestChain100Setup::TestChain100Setup()
     for (int i = 0; i < COINBASE_MATURITY; i++) {
         std::vector<CMutableTransaction> noTxns;
         CBlock b = CreateAndProcessBlock(noTxns, scriptPubKey);
-        coinbaseTxns.push_back(b.vtx[0]);
+        coinbaseTxns.push_back(*b.vtx[0]);
     }
 }
 
@@ -112,7 +119,7 @@ TestChain100Setup::CreateAndProcessBlock(const std::vector<CMutableTransaction>&
 
     block.vtx.resize(1);
     BOOST_FOREACH (const CMutableTransaction& tx, txns)
-        block.vtx.push_back(tx);
+        block.vtx.push_back(MakeTransactionRef(tx));
 
     unsigned int extraNonce = 0;
     IncrementExtraNonce(&block, chainActive.Tip(), extraNonce);
@@ -128,6 +135,36 @@ TestChain100Setup::CreateAndProcessBlock(const std::vector<CMutableTransaction>&
     return result;
 }
 
+CMutableTransaction
+TestChain100Setup::SpendOutput(const CTransaction& txFrom, uint32_t n, CAmount nValue, const CScript& scriptPubKey)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(txFrom.GetHash(), n);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = nValue;
+    tx.vout[0].scriptPubKey = scriptPubKey;
+
+    std::vector<unsigned char> vchSig;
+    uint256 hash = SignatureHash(txFrom.vout[n].scriptPubKey, tx, 0, SIGHASH_ALL, 0, SIGVERSION_BASE);
+    BOOST_CHECK(coinbaseKey.Sign(hash, vchSig));
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    tx.vin[0].scriptSig << vchSig;
+    return tx;
+}
+
+bool TestChain100Setup::AddToMempool(const CMutableTransaction& tx, int64_t nAcceptTime)
+{
+    LOCK(cs_main);
+    CValidationState state;
+    return AcceptToMemoryPoolWithTime(mempool, state, tx, false, NULL, nAcceptTime, true);
+}
+
+bool TestChain100Setup::AddToMempool(const CMutableTransaction& tx)
+{
+    return AddToMempool(tx, GetTime());
+}
+
 TestChain100Setup::~TestChain100Setup()
 {
 }
@@ -138,7 +175,7 @@ CTxMemPoolEntry TestMemPoolEntryHelper::FromTx(CMutableTransaction& tx, CTxMemPo
     return FromTx(txn, pool);
 }
 
-CTxMemPoolEntry TestMemPoolEntryHelper::FromTx(CTransaction& txn, CTxMemPool* pool)
+CTxMemPoolEntry TestMemPoolEntryHelper::FromTx(const CTransaction& txn, CTxMemPool* pool)
 {
     bool hasNoDependencies = pool ? pool->HasNoInputsOf(txn) : hadNoDependencies;
 
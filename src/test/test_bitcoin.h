@@ -46,6 +46,12 @@ struct TestChain100Setup : public TestingSetup {
     CBlock CreateAndProcessBlock(const std::vector<CMutableTransaction>& txns,
                                  const CScript& scriptPubKey);
 
+    // Spend output n of txFrom, which must pay to coinbaseKey, to scriptPubKey
+    CMutableTransaction SpendOutput(const CTransaction& txFrom, uint32_t n, CAmount nValue, const CScript& scriptPubKey);
+    // Submit tx to the global mempool as if it arrived at nAcceptTime
+    bool AddToMempool(const CMutableTransaction& tx, int64_t nAcceptTime);
+    bool AddToMempool(const CMutableTransaction& tx);
+
     ~TestChain100Setup();
 
     std::vector<CTransaction> coinbaseTxns; // For convenience, coinbase transactions
@@ -78,7 +84,7 @@ struct TestMemPoolEntryHelper {
     }
 
     CTxMemPoolEntry FromTx(CMutableTransaction& tx, CTxMemPool* pool = NULL);
-    CTxMemPoolEntry FromTx(CTransaction& tx, CTxMemPool* pool = NULL);
+    CTxMemPoolEntry FromTx(const CTransaction& tx, CTxMemPool* pool = NULL);
 
     TestMemPoolEntryHelper& Fee(CAmount _fee)
     {
@@ -0,0 +1,61 @@
+// Copyright (c) 2016 The Gulden developers
+// Distributed under the GULDEN software license, see the accompanying
+// file COPYING
+
+#include "chainparams.h"
+#include "consensus/validation.h"
+#include "main.h"
+#include "random.h"
+#include "script/standard.h"
+#include "txindex.h"
+#include "utiltime.h"
+
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(txindex_tests)
+
+BOOST_FIXTURE_TEST_CASE(txindex_initial_sync, TestChain100Setup)
+{
+    CTxIndex txindex(1 << 20, true);
+
+    CTransaction txOut;
+    uint256 hashBlock;
+    BOOST_CHECK(!txindex.FindTx(coinbaseTxns[0].GetHash(), txOut, hashBlock));
+
+    // Build the index from the existing chain in the background.
+    txindex.Start();
+    int64_t nTimeout = GetTimeMillis() + 10000;
+    while (!txindex.IsSynced() && GetTimeMillis() < nTimeout)
+        MilliSleep(50);
+    BOOST_REQUIRE(txindex.IsSynced());
+    BOOST_CHECK_EQUAL(txindex.GetBestHeight(), chainActive.Height());
+
+    for (const CTransaction& tx : coinbaseTxns) {
+        BOOST_CHECK(txindex.FindTx(tx.GetHash(), txOut, hashBlock));
+        BOOST_CHECK(txOut.GetHash() == tx.GetHash());
+        BOOST_CHECK(mapBlockIndex.count(hashBlock));
+    }
+    BOOST_CHECK(!txindex.FindTx(GetRandHash(), txOut, hashBlock));
+
+    // Once synced, new blocks are indexed from the connect notification.
+    CScript scriptPubKey = CScript() << ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+    CBlock block = CreateAndProcessBlock(std::vector<CMutableTransaction>(), scriptPubKey);
+    BOOST_CHECK(txindex.FindTx(block.vtx[0]->GetHash(), txOut, hashBlock));
+    BOOST_CHECK(hashBlock == block.GetHash());
+    BOOST_CHECK_EQUAL(txindex.GetBestHeight(), chainActive.Height());
+
+    // Disconnecting the tip removes its transactions again.
+    {
+        LOCK(cs_main);
+        CValidationState state;
+        BOOST_CHECK(InvalidateBlock(state, Params(), chainActive.Tip()));
+    }
+    BOOST_CHECK(!txindex.FindTx(block.vtx[0]->GetHash(), txOut, hashBlock));
+    BOOST_CHECK_EQUAL(txindex.GetBestHeight(), chainActive.Height());
+
+    txindex.Stop();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,54 @@
+// Copyright (c) 2016 The Gulden developers
+// Distributed under the GULDEN software license, see the accompanying
+// file COPYING
+
+#include "chainparams.h"
+#include "coins.h"
+#include "consensus/validation.h"
+#include "key.h"
+#include "main.h"
+#include "script/standard.h"
+
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(undo_tests, TestChain100Setup)
+
+BOOST_AUTO_TEST_CASE(disconnect_restores_spent_outputs)
+{
+    CScript scriptCoinbase = CScript() << ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+
+    // One chain of spends inside the block and one spend of an output from outside it.
+    std::vector<CMutableTransaction> spends;
+    spends.push_back(SpendOutput(coinbaseTxns[0], 0, 11 * CENT, scriptCoinbase));
+    spends.push_back(SpendOutput(spends[0], 0, 10 * CENT, scriptCoinbase));
+    spends.push_back(SpendOutput(coinbaseTxns[1], 0, 12 * CENT, scriptCoinbase));
+    CBlock block = CreateAndProcessBlock(spends, scriptCoinbase);
+    BOOST_REQUIRE(chainActive.Tip()->GetBlockHash() == block.GetHash());
+
+    {
+        LOCK(cs_main);
+        BOOST_CHECK(!pcoinsTip->HaveCoins(coinbaseTxns[0].GetHash()));
+        BOOST_CHECK(!pcoinsTip->HaveCoins(spends[0].GetHash()));
+        BOOST_CHECK(pcoinsTip->HaveCoins(spends[1].GetHash()));
+
+        CValidationState state;
+        BOOST_CHECK(InvalidateBlock(state, Params(), chainActive.Tip()));
+        BOOST_CHECK(chainActive.Tip()->GetBlockHash() == block.hashPrevBlock);
+
+        // The outputs from outside the block are back with their metadata, and nothing the block created is left.
+        for (int i = 0; i < 2; i++) {
+            const CCoins* coins = pcoinsTip->AccessCoins(coinbaseTxns[i].GetHash());
+            BOOST_REQUIRE(coins);
+            BOOST_CHECK(coins->IsAvailable(0));
+            BOOST_CHECK(coins->fCoinBase);
+            BOOST_CHECK_EQUAL(coins->nHeight, i + 1);
+            BOOST_CHECK(coins->vout[0] == coinbaseTxns[i].vout[0]);
+        }
+        for (const CMutableTransaction& tx : spends)
+            BOOST_CHECK(!pcoinsTip->HaveCoins(tx.GetHash()));
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -15,7 +15,9 @@
 #include "chainparams.h"
 #include "hash.h"
 #include "pow.h"
+#include "ui_interface.h"
 #include "uint256.h"
+#include "util.h"
 
 #include <stdint.h>
 
@@ -23,29 +25,151 @@
 
 using namespace std;
 
+static const char DB_COIN = 'C';
 static const char DB_COINS = 'c';
 static const char DB_BLOCK_FILES = 'f';
 static const char DB_TXINDEX = 't';
+static const char DB_ADDRESSINDEX = 'a';
+static const char DB_ADDRESSUNSPENT = 'u';
 static const char DB_BLOCK_INDEX = 'b';
 
 static const char DB_BEST_BLOCK = 'B';
 static const char DB_FLAG = 'F';
 static const char DB_REINDEX_FLAG = 'R';
 static const char DB_LAST_BLOCK = 'l';
+static const char DB_COINS_VERSION = 'V';
+
+/** Layout of the coin database: 1 is one record per unspent output. Databases without it hold per transaction records. */
+static const int COINS_DB_VERSION = 1;
+
+/** Number of legacy records converted per batch by CCoinsViewDB::Upgrade */
+static const unsigned int UPGRADE_BATCH_SIZE = 10000;
+
+namespace {
+/** Database key of an unspent output. */
+struct CCoinKey {
+    uint256 txid;
+    uint32_t n;
+
+    CCoinKey() : n(0) {}
+    CCoinKey(const uint256& txidIn, uint32_t nIn) : txid(txidIn), n(nIn) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        char prefix = DB_COIN;
+        READWRITE(prefix);
+        if (prefix != DB_COIN)
+            throw std::ios_base::failure("not a coin key");
+        READWRITE(txid);
+        READWRITE(VARINT(n));
+    }
+};
+
+/** Database value of an unspent output: the output and the metadata of its transaction. */
+struct CCoinRecord {
+    CTxOut txout;
+    int nHeight;
+    bool fCoinBase;
+    int nVersion;
+
+    CCoinRecord() : nHeight(0), fCoinBase(false), nVersion(0) {}
+    CCoinRecord(const CCoins& coins, uint32_t n) : txout(coins.vout[n]), nHeight(coins.nHeight), fCoinBase(coins.fCoinBase), nVersion(coins.nVersion) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        unsigned int nCode = nHeight * 2 + (fCoinBase ? 1 : 0);
+        READWRITE(VARINT(nCode));
+        nHeight = nCode / 2;
+        fCoinBase = nCode & 1;
+        READWRITE(VARINT(this->nVersion));
+        READWRITE(REF(CTxOutCompressor(txout)));
+    }
+};
+
+/**
+ * Read the records of txid into coins, starting from a cursor positioned at or
+ * before its first record. Leaves the cursor after the last one. If pnSize is
+ * given, it receives the total size of the records.
+ */
+bool ReadCoinRecords(CDBIterator* pcursor, const uint256& txid, CCoins& coins, unsigned int* pnSize)
+{
+    coins.Clear();
+    bool fFound = false;
+    for (; pcursor->Valid(); pcursor->Next()) {
+        CCoinKey key;
+        if (!pcursor->GetKey(key) || key.txid != txid)
+            break;
+        CCoinRecord record;
+        if (!pcursor->GetValue(record))
+            throw std::runtime_error("Database read failure: corrupt coin record");
+        if (coins.vout.size() <= key.n)
+            coins.vout.resize(key.n + 1);
+        coins.vout[key.n] = record.txout;
+        coins.nHeight = record.nHeight;
+        coins.fCoinBase = record.fCoinBase;
+        coins.nVersion = record.nVersion;
+        if (pnSize)
+            *pnSize += ::GetSerializeSize(key, SER_DISK, CLIENT_VERSION) + pcursor->GetValueSize();
+        fFound = true;
+    }
+    return fFound;
+}
+
+/** Add the records of all unspent outputs of coins to a batch. */
+size_t WriteCoinRecords(CDBBatch& batch, const uint256& txid, const CCoins& coins)
+{
+    size_t nWritten = 0;
+    for (uint32_t n = 0; n < coins.vout.size(); n++) {
+        if (coins.IsAvailable(n)) {
+            batch.Write(CCoinKey(txid, n), CCoinRecord(coins, n));
+            nWritten++;
+        }
+    }
+    return nWritten;
+}
+}
 
 CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe)
-    : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe, true)
+    : db(GetDataDir() / "chainstate", GetDBOptions("chainstate", nCacheSize), fMemory, fWipe, true)
+    , nLastWritten(0)
+    , nLastErased(0)
+{
+}
+
+CDBIterator* CCoinsViewDB::SeekCoins(const uint256& txid) const
 {
+    AssertLockHeld(cs_cursorRead);
+    // Making an iterator costs more than the seek itself, so one is kept between lookups.
+    if (!pcursorRead)
+        pcursorRead.reset(const_cast<CDBWrapper&>(db).NewIterator());
+    pcursorRead->Seek(CCoinKey(txid, 0));
+    return pcursorRead.get();
+}
+
+void CCoinsViewDB::ResetReadCursor()
+{
+    LOCK(cs_cursorRead);
+    pcursorRead.reset();
 }
 
 bool CCoinsViewDB::GetCoins(const uint256& txid, CCoins& coins) const
 {
-    return db.Read(make_pair(DB_COINS, txid), coins);
+    LOCK(cs_cursorRead);
+    return ReadCoinRecords(SeekCoins(txid), txid, coins, NULL);
 }
 
 bool CCoinsViewDB::HaveCoins(const uint256& txid) const
 {
-    return db.Exists(make_pair(DB_COINS, txid));
+    LOCK(cs_cursorRead);
+    CDBIterator* pcursor = SeekCoins(txid);
+    CCoinKey key;
+    return pcursor->Valid() && pcursor->GetKey(key) && key.txid == txid;
 }
 
 uint256 CCoinsViewDB::GetBestBlock() const
@@ -59,14 +183,48 @@ uint256 CCoinsViewDB::GetBestBlock() const
 bool CCoinsViewDB::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock)
 {
     CDBBatch batch(db);
+    boost::scoped_ptr<CDBIterator> pcursor(db.NewIterator());
     size_t count = 0;
     size_t changed = 0;
+    size_t nWritten = 0;
+    size_t nErased = 0;
+    std::vector<std::pair<bool, CCoinRecord> > vOnDisk;
     for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
         if (it->second.flags & CCoinsCacheEntry::DIRTY) {
-            if (it->second.coins.IsPruned())
-                batch.Erase(make_pair(DB_COINS, it->first));
-            else
-                batch.Write(make_pair(DB_COINS, it->first), it->second.coins);
+            const uint256& txid = it->first;
+            const CCoins& coins = it->second.coins;
+            // A fresh entry has no records yet. Any other is compared with its stored records:
+            // an output is written only if it is missing or differs, e.g. because the transaction
+            // was disconnected and mined at another height before a flush, and the stored
+            // outputs that are spent are erased.
+            vOnDisk.clear();
+            if (!(it->second.flags & CCoinsCacheEntry::FRESH)) {
+                CCoinKey key;
+                for (pcursor->Seek(CCoinKey(txid, 0)); pcursor->Valid() && pcursor->GetKey(key) && key.txid == txid; pcursor->Next()) {
+                    if (vOnDisk.size() <= key.n)
+                        vOnDisk.resize(key.n + 1);
+                    // An unreadable record is treated as absent so it gets overwritten.
+                    if (pcursor->GetValue(vOnDisk[key.n].second))
+                        vOnDisk[key.n].first = true;
+                }
+            }
+            const uint32_t nOutputs = std::max<size_t>(coins.vout.size(), vOnDisk.size());
+            for (uint32_t n = 0; n < nOutputs; n++) {
+                const bool fAvailable = coins.IsAvailable(n);
+                const bool fStored = n < vOnDisk.size() && vOnDisk[n].first;
+                if (fAvailable) {
+                    if (fStored) {
+                        const CCoinRecord& stored = vOnDisk[n].second;
+                        if (stored.nHeight == coins.nHeight && stored.fCoinBase == coins.fCoinBase && stored.nVersion == coins.nVersion && stored.txout == coins.vout[n])
+                            continue;
+                    }
+                    batch.Write(CCoinKey(txid, n), CCoinRecord(coins, n));
+                    nWritten++;
+                } else if (fStored) {
+                    batch.Erase(CCoinKey(txid, n));
+                    nErased++;
+                }
+            }
             changed++;
         }
         count++;
@@ -76,12 +234,65 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock)
     if (!hashBlock.IsNull())
         batch.Write(DB_BEST_BLOCK, hashBlock);
 
-    LogPrint("coindb", "Committing %u changed transactions (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
-    return db.WriteBatch(batch);
+    LogPrint("coindb", "Committing %u changed transactions (out of %u), %u outputs written and %u erased, to coin database...\n",
+             (unsigned int)changed, (unsigned int)count, (unsigned int)nWritten, (unsigned int)nErased);
+    nLastWritten = nWritten;
+    nLastErased = nErased;
+    bool fOk = db.WriteBatch(batch);
+    ResetReadCursor();
+    return fOk;
+}
+
+bool CCoinsViewDB::Upgrade()
+{
+    int nVersion = 0;
+    if (db.Read(DB_COINS_VERSION, nVersion)) {
+        if (nVersion != COINS_DB_VERSION)
+            return error("%s: the chainstate database has unknown layout version %d", __func__, nVersion);
+        return true;
+    }
+
+    boost::scoped_ptr<CDBIterator> pcursor(db.NewIterator());
+    pcursor->Seek(std::make_pair(DB_COINS, uint256()));
+    std::pair<char, uint256> key;
+    if (!pcursor->Valid() || !pcursor->GetKey(key) || key.first != DB_COINS) {
+        // Nothing to convert: a new database, or one converted before the layout was recorded.
+        return db.Write(DB_COINS_VERSION, COINS_DB_VERSION, true);
+    }
+
+    uiInterface.InitMessage(_("Upgrading the chainstate database..."));
+    LogPrintf("Upgrading the chainstate database to per output records...\n");
+    int64_t nStart = GetTimeMillis();
+    CDBBatch batch(db);
+    size_t nTransactions = 0, nOutputs = 0;
+    unsigned int nBatch = 0;
+    // Each batch removes the old records it converted, so an interrupted upgrade resumes where it stopped.
+    for (; pcursor->Valid(); pcursor->Next()) {
+        if (!pcursor->GetKey(key) || key.first != DB_COINS)
+            break;
+        CCoins coins;
+        if (!pcursor->GetValue(coins))
+            return error("%s: unable to read coins of %s", __func__, key.second.ToString());
+        nOutputs += WriteCoinRecords(batch, key.second, coins);
+        batch.Erase(key);
+        nTransactions++;
+        if (++nBatch == UPGRADE_BATCH_SIZE) {
+            if (!db.WriteBatch(batch))
+                return error("%s: failed to write converted records", __func__);
+            batch.Clear();
+            nBatch = 0;
+        }
+    }
+    batch.Write(DB_COINS_VERSION, COINS_DB_VERSION);
+    if (!db.WriteBatch(batch, true))
+        return error("%s: failed to write converted records", __func__);
+    ResetReadCursor();
+    LogPrintf("Converted %u transactions into %u output records in %dms\n", nTransactions, nOutputs, GetTimeMillis() - nStart);
+    return true;
 }
 
 CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe)
-    : CDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe)
+    : CDBWrapper(GetDataDir() / "blocks" / "index", GetDBOptions("blockindex", nCacheSize), fMemory, fWipe)
 {
 }
 
@@ -115,42 +326,48 @@ CCoinsViewCursor* CCoinsViewDB::Cursor() const
     /* It seems that there are no "const iterators" for LevelDB.  Since we
        only need read operations on it, use a const-cast to get around
        that restriction.  */
-    i->pcursor->Seek(DB_COINS);
-
-    i->pcursor->GetKey(i->keyTmp);
+    i->pcursor->Seek(CCoinKey());
+    i->Next();
     return i;
 }
 
 bool CCoinsViewDBCursor::GetKey(uint256& key) const
 {
-
-    if (keyTmp.first == DB_COINS) {
-        key = keyTmp.second;
+    if (fValid) {
+        key = txid;
         return true;
     }
     return false;
 }
 
-bool CCoinsViewDBCursor::GetValue(CCoins& coins) const
+bool CCoinsViewDBCursor::GetValue(CCoins& coinsOut) const
 {
-    return pcursor->GetValue(coins);
+    if (!fValid)
+        return false;
+    coinsOut = coins;
+    return true;
 }
 
 unsigned int CCoinsViewDBCursor::GetValueSize() const
 {
-    return pcursor->GetValueSize();
+    return nSize - 32;
 }
 
 bool CCoinsViewDBCursor::Valid() const
 {
-    return keyTmp.first == DB_COINS;
+    return fValid;
 }
 
 void CCoinsViewDBCursor::Next()
 {
-    pcursor->Next();
-    if (!pcursor->Valid() || !pcursor->GetKey(keyTmp))
-        keyTmp.first = 0; // Invalidate cached key after last record so that Valid() and GetKey() return false
+    // The underlying iterator is at the first record of the next transaction, if any.
+    CCoinKey key;
+    fValid = pcursor->Valid() && pcursor->GetKey(key);
+    if (!fValid)
+        return;
+    txid = key.txid;
+    nSize = 0;
+    fValid = ReadCoinRecords(pcursor.get(), txid, coins, &nSize);
 }
 
 bool CBlockTreeDB::WriteBatchSync(const std::vector<std::pair<int, const CBlockFileInfo*> >& fileInfo, int nLastFile, const std::vector<const CBlockIndex*>& blockinfo)
@@ -166,19 +383,85 @@ bool CBlockTreeDB::WriteBatchSync(const std::vector<std::pair<int, const CBlockF
     return WriteBatch(batch, true);
 }
 
-bool CBlockTreeDB::ReadTxIndex(const uint256& txid, CDiskTxPos& pos)
+/** Remove the transaction index entries older versions kept in this database; the index now has its own. */
+bool CBlockTreeDB::EraseTxIndex()
 {
-    return Read(make_pair(DB_TXINDEX, txid), pos);
+    boost::scoped_ptr<CDBIterator> pcursor(NewIterator());
+    CDBBatch batch(*this);
+    unsigned int nBatch = 0;
+    for (pcursor->Seek(make_pair(DB_TXINDEX, uint256())); pcursor->Valid(); pcursor->Next()) {
+        boost::this_thread::interruption_point();
+        std::pair<char, uint256> key;
+        if (!pcursor->GetKey(key) || key.first != DB_TXINDEX)
+            break;
+        batch.Erase(key);
+        if (++nBatch == 10000) {
+            if (!WriteBatch(batch))
+                return false;
+            batch.Clear();
+            nBatch = 0;
+        }
+    }
+    batch.Write(std::make_pair(DB_FLAG, std::string("txindex")), '0');
+    return WriteBatch(batch, true);
 }
 
-bool CBlockTreeDB::WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> >& vect)
+bool CBlockTreeDB::UpdateAddressIndex(const CAddressIndexUpdate& update, bool fDisconnect)
 {
     CDBBatch batch(*this);
-    for (std::vector<std::pair<uint256, CDiskTxPos> >::const_iterator it = vect.begin(); it != vect.end(); it++)
-        batch.Write(make_pair(DB_TXINDEX, it->first), it->second);
+    for (std::vector<std::pair<CAddressHistoryKey, CAmount> >::const_iterator it = update.vHistory.begin(); it != update.vHistory.end(); it++) {
+        if (fDisconnect)
+            batch.Erase(make_pair(DB_ADDRESSINDEX, it->first));
+        else
+            batch.Write(make_pair(DB_ADDRESSINDEX, it->first), it->second);
+    }
+    for (std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >::const_iterator it = update.vUnspent.begin(); it != update.vUnspent.end(); it++) {
+        if (it->second.IsNull())
+            batch.Erase(make_pair(DB_ADDRESSUNSPENT, it->first));
+        else
+            batch.Write(make_pair(DB_ADDRESSUNSPENT, it->first), it->second);
+    }
     return WriteBatch(batch);
 }
 
+bool CBlockTreeDB::ReadAddressHistory(const uint160& hashScript, int nStartHeight, int nEndHeight, std::vector<std::pair<CAddressHistoryKey, CAmount> >& vHistory)
+{
+    boost::scoped_ptr<CDBIterator> pcursor(NewIterator());
+
+    pcursor->Seek(make_pair(DB_ADDRESSINDEX, CAddressHistoryKey(hashScript, std::max(0, nStartHeight))));
+    for (; pcursor->Valid(); pcursor->Next()) {
+        boost::this_thread::interruption_point();
+        std::pair<char, CAddressHistoryKey> key;
+        if (!pcursor->GetKey(key) || key.first != DB_ADDRESSINDEX || key.second.hashScript != hashScript)
+            break;
+        if (nEndHeight >= 0 && key.second.nHeight > nEndHeight)
+            break;
+        CAmount nValue;
+        if (!pcursor->GetValue(nValue))
+            return error("%s: failed to read address index value", __func__);
+        vHistory.push_back(std::make_pair(key.second, nValue));
+    }
+    return true;
+}
+
+bool CBlockTreeDB::ReadAddressUnspent(const uint160& hashScript, std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >& vUnspent)
+{
+    boost::scoped_ptr<CDBIterator> pcursor(NewIterator());
+
+    pcursor->Seek(make_pair(DB_ADDRESSUNSPENT, CAddressUnspentKey(hashScript)));
+    for (; pcursor->Valid(); pcursor->Next()) {
+        boost::this_thread::interruption_point();
+        std::pair<char, CAddressUnspentKey> key;
+        if (!pcursor->GetKey(key) || key.first != DB_ADDRESSUNSPENT || key.second.hashScript != hashScript)
+            break;
+        CAddressUnspentValue value;
+        if (!pcursor->GetValue(value))
+            return error("%s: failed to read address unspent value", __func__);
+        vUnspent.push_back(std::make_pair(key.second, value));
+    }
+    return true;
+}
+
 bool CBlockTreeDB::WriteFlag(const std::string& name, bool fValue)
 {
     return Write(std::make_pair(DB_FLAG, name), fValue ? '1' : '0');
@@ -13,9 +13,11 @@
 #ifndef BITCOIN_TXDB_H
 #define BITCOIN_TXDB_H
 
+#include "addressindex.h"
 #include "coins.h"
 #include "dbwrapper.h"
 #include "chain.h"
+#include "sync.h"
 
 #include <map>
 #include <string>
@@ -23,6 +25,7 @@
 #include <vector>
 
 #include <boost/function.hpp>
+#include <boost/scoped_ptr.hpp>
 
 class CBlockIndex;
 class CCoinsViewDBCursor;
@@ -36,7 +39,9 @@ static const int64_t nMinDbCache = 4;
 
 static const int64_t nMaxBlockDBCache = 2;
 
-static const int64_t nMaxBlockDBAndTxIndexCache = 1024;
+static const int64_t nMaxTxIndexCache = 1024;
+
+static const int64_t nMaxBlockDBAndAddressIndexCache = 1024;
 
 static const int64_t nMaxCoinsDBCache = 8;
 
@@ -70,10 +75,29 @@ struct CDiskTxPos : public CDiskBlockPos {
     }
 };
 
-/** CCoinsView backed by the coin database (chainstate/) */
+/**
+ * CCoinsView backed by the coin database (chainstate/).
+ *
+ * Every unspent output is a record of its own, keyed by txid and output
+ * index, so spending one output of a transaction with many outputs erases
+ * one record instead of rewriting all the others. GetCoins assembles the
+ * CCoins of a transaction from its records with a single range scan.
+ */
 class CCoinsViewDB : public CCoinsView {
 protected:
     CDBWrapper db;
+    //! Output records written and erased by the last BatchWrite
+    size_t nLastWritten;
+    size_t nLastErased;
+
+private:
+    //! Iterator GetCoins and HaveCoins seek with, dropped after every write so reads see it
+    mutable boost::scoped_ptr<CDBIterator> pcursorRead;
+    mutable CCriticalSection cs_cursorRead;
+
+    /** Seek the read iterator to the first record of txid; cs_cursorRead must be held. */
+    CDBIterator* SeekCoins(const uint256& txid) const;
+    void ResetReadCursor();
 
 public:
     CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
@@ -83,6 +107,13 @@ public:
     uint256 GetBestBlock() const;
     bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock);
     CCoinsViewCursor* Cursor() const;
+
+    /**
+     * Convert per transaction records written by older versions to per output
+     * records and record the layout version. Fails if the database has a
+     * layout this version does not know.
+     */
+    bool Upgrade();
 };
 
 /** Specialization of CCoinsViewCursor to iterate over a CCoinsViewDB */
@@ -92,6 +123,7 @@ public:
 
     bool GetKey(uint256& key) const;
     bool GetValue(CCoins& coins) const;
+    /** Size of the records of the current transaction, keys included, apart from one txid. */
     unsigned int GetValueSize() const;
 
     bool Valid() const;
@@ -101,10 +133,16 @@ private:
     CCoinsViewDBCursor(CDBIterator* pcursorIn, const uint256& hashBlockIn)
         : CCoinsViewCursor(hashBlockIn)
         , pcursor(pcursorIn)
+        , fValid(false)
+        , nSize(0)
     {
     }
     boost::scoped_ptr<CDBIterator> pcursor;
-    std::pair<char, uint256> keyTmp;
+    //! The transaction the cursor is at, assembled from its records
+    bool fValid;
+    uint256 txid;
+    CCoins coins;
+    unsigned int nSize;
 
     friend class CCoinsViewDB;
 };
@@ -124,8 +162,10 @@ public:
     bool ReadLastBlockFile(int& nFile);
     bool WriteReindexing(bool fReindex);
     bool ReadReindexing(bool& fReindex);
-    bool ReadTxIndex(const uint256& txid, CDiskTxPos& pos);
-    bool WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> >& list);
+    bool EraseTxIndex();
+    bool UpdateAddressIndex(const CAddressIndexUpdate& update, bool fDisconnect);
+    bool ReadAddressHistory(const uint160& hashScript, int nStartHeight, int nEndHeight, std::vector<std::pair<CAddressHistoryKey, CAmount> >& vHistory);
+    bool ReadAddressUnspent(const uint160& hashScript, std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >& vUnspent);
     bool WriteFlag(const std::string& name, bool fValue);
     bool ReadFlag(const std::string& name, bool& fValue);
     bool LoadBlockIndexGuts(boost::function<CBlockIndex*(const uint256&)> insertBlockIndex);
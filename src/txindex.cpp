@@ -0,0 +1,306 @@
+// Copyright (c) 2016 The Gulden developers
+// Distributed under the GULDEN software license, see the accompanying
+// file COPYING
+
+#include "txindex.h"
+
+#include "chainparams.h"
+#include "main.h"
+#include "primitives/block.h"
+#include "primitives/transaction.h"
+#include "txdb.h"
+#include "util.h"
+#include "utiltime.h"
+
+#include <boost/scoped_ptr.hpp>
+
+static const char DB_TXPOS = 't';
+static const char DB_BEST_BLOCK = 'B';
+
+/** Number of keys erased per batch when dropping entries */
+static const unsigned int WIPE_BATCH_SIZE = 10000;
+/** Seconds between progress messages while building the index */
+static const int64_t SYNC_LOG_INTERVAL = 30;
+
+CTxIndex* ptxindex = NULL;
+
+namespace {
+/** Database key of an index entry: truncated txid followed by the transaction position. */
+struct CTxIndexKey {
+    uint64_t nTxHash;
+    CDiskTxPos pos;
+
+    CTxIndexKey() : nTxHash(0) {}
+    CTxIndexKey(uint64_t nTxHashIn, const CDiskTxPos& posIn) : nTxHash(nTxHashIn), pos(posIn) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        char prefix = DB_TXPOS;
+        READWRITE(prefix);
+        if (prefix != DB_TXPOS)
+            throw std::ios_base::failure("not a transaction index key");
+        READWRITE(nTxHash);
+        READWRITE(pos);
+    }
+};
+
+/** Call fn(key) for the key of every transaction in a block stored at pindex. */
+template <typename Fn>
+void ForEachTxKey(const CBlock& block, const CBlockIndex* pindex, Fn fn)
+{
+    CDiskTxPos pos(pindex->GetBlockPos(), GetSizeOfCompactSize(block.vtx.size()));
+    for (const auto& ptx : block.vtx) {
+        fn(CTxIndexKey(ptx->GetHash().GetCheapHash(), pos));
+        pos.nTxOffset += ::GetSerializeSize(*ptx, SER_DISK, CLIENT_VERSION);
+    }
+}
+
+bool ReadTxFromDisk(const CDiskTxPos& pos, CBlockHeader& header, CTransaction& txOut)
+{
+    CAutoFile file(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
+    if (file.IsNull())
+        return error("%s: OpenBlockFile failed for %s", __func__, pos.ToString());
+    try {
+        file >> header;
+        fseek(file.Get(), pos.nTxOffset, SEEK_CUR);
+        file >> txOut;
+    }
+    catch (const std::exception& e) {
+        return error("%s: Deserialize or I/O error - %s", __func__, e.what());
+    }
+    return true;
+}
+}
+
+CTxIndex::CTxIndex(size_t nCacheSize, bool fMemory, bool fWipeIn)
+    : db(GetDataDir() / "indexes" / "txindex", GetDBOptions("txindex", nCacheSize), fMemory, fWipeIn)
+    , pindexBest(NULL)
+    , fSynced(false)
+    , fFailed(false)
+    , fWipe(false)
+{
+}
+
+CTxIndex::~CTxIndex()
+{
+    Stop();
+}
+
+void CTxIndex::Start()
+{
+    uint256 hashBest;
+    if (db.Read(DB_BEST_BLOCK, hashBest)) {
+        LOCK(cs_main);
+        BlockMap::iterator mi = mapBlockIndex.find(hashBest);
+        if (mi != mapBlockIndex.end()) {
+            pindexBest = mi->second;
+        } else {
+            LogPrintf("%s: best block %s of the transaction index is unknown, rebuilding it\n", __func__, hashBest.ToString());
+            fWipe = true;
+        }
+    }
+    RegisterValidationInterface(this);
+    threadSync = boost::thread(boost::bind(&CTxIndex::ThreadSync, this));
+}
+
+void CTxIndex::Stop()
+{
+    UnregisterValidationInterface(this);
+    if (threadSync.joinable()) {
+        threadSync.interrupt();
+        threadSync.join();
+    }
+}
+
+int CTxIndex::GetBestHeight() const
+{
+    LOCK(cs_main);
+    return pindexBest ? pindexBest->nHeight : -1;
+}
+
+bool CTxIndex::WriteBlock(const CBlock& block, const CBlockIndex* pindex)
+{
+    CDBBatch batch(db);
+    // The genesis coinbase is not part of the UTXO set and was never indexed.
+    if (pindex->pprev)
+        ForEachTxKey(block, pindex, [&batch](const CTxIndexKey& key) { batch.Write(key, '\0'); });
+    batch.Write(DB_BEST_BLOCK, pindex->GetBlockHash());
+    return db.WriteBatch(batch);
+}
+
+bool CTxIndex::EraseBlock(const CBlock& block, const CBlockIndex* pindex)
+{
+    CDBBatch batch(db);
+    ForEachTxKey(block, pindex, [&batch](const CTxIndexKey& key) { batch.Erase(key); });
+    batch.Write(DB_BEST_BLOCK, pindex->pprev ? pindex->pprev->GetBlockHash() : uint256());
+    return db.WriteBatch(batch);
+}
+
+bool CTxIndex::WipeEntries()
+{
+    boost::scoped_ptr<CDBIterator> pcursor(db.NewIterator());
+    CDBBatch batch(db);
+    unsigned int nBatch = 0;
+    for (pcursor->Seek(DB_TXPOS); pcursor->Valid(); pcursor->Next()) {
+        boost::this_thread::interruption_point();
+        CTxIndexKey key;
+        if (!pcursor->GetKey(key))
+            break;
+        batch.Erase(key);
+        if (++nBatch == WIPE_BATCH_SIZE) {
+            if (!db.WriteBatch(batch))
+                return false;
+            batch.Clear();
+            nBatch = 0;
+        }
+    }
+    batch.Erase(DB_BEST_BLOCK);
+    return db.WriteBatch(batch, true);
+}
+
+void CTxIndex::Fail(const std::string& strError)
+{
+    LogPrintf("*** %s; the transaction index is no longer updated\n", strError);
+    strMiscWarning = _("Warning: The transaction index could not be updated and is incomplete, see debug.log for details. Restart to rebuild it.");
+    fFailed = true;
+}
+
+void CTxIndex::ThreadSync()
+{
+    RenameThread("Gulden-txindex");
+    try {
+        bool fLegacyIndex = false;
+        if (pblocktree->ReadFlag("txindex", fLegacyIndex) && fLegacyIndex) {
+            LogPrintf("%s: removing transaction index entries from the block index database\n", __func__);
+            if (!pblocktree->EraseTxIndex())
+                LogPrintf("%s: failed to remove old transaction index entries\n", __func__);
+        }
+        if (fWipe) {
+            if (!WipeEntries()) {
+                Fail(strprintf("%s: failed to clear the transaction index", __func__));
+                return;
+            }
+            fWipe = false;
+        }
+
+        const CBlockIndex* pindex;
+        {
+            LOCK(cs_main);
+            pindex = pindexBest;
+        }
+        const Consensus::Params& consensusParams = Params().GetConsensus();
+        int64_t nLastLog = GetTime();
+        while (true) {
+            boost::this_thread::interruption_point();
+
+            const CBlockIndex* pindexNext = NULL;
+            const CBlockIndex* pindexFork = NULL;
+            {
+                LOCK(cs_main);
+                if (!pindex)
+                    pindexNext = chainActive.Genesis();
+                else if (chainActive.Contains(pindex))
+                    pindexNext = chainActive.Next(pindex);
+                else
+                    pindexFork = chainActive.FindFork(pindex);
+                if (!pindexNext && !pindexFork) {
+                    // Notifications are sent with cs_main held, so none can be missed between here and the
+                    // next connected block.
+                    pindexBest = pindex;
+                    fSynced = true;
+                    break;
+                }
+            }
+
+            if (pindexFork) {
+                // The active chain moved away from blocks indexed earlier; drop their entries first.
+                while (pindex != pindexFork) {
+                    CBlock block;
+                    if (!ReadBlockFromDisk(block, pindex, consensusParams) || !EraseBlock(block, pindex)) {
+                        Fail(strprintf("%s: failed to rewind the transaction index at %s", __func__, pindex->GetBlockHash().ToString()));
+                        return;
+                    }
+                    pindex = pindex->pprev;
+                }
+                continue;
+            }
+
+            CBlock block;
+            if (!ReadBlockFromDisk(block, pindexNext, consensusParams) || !WriteBlock(block, pindexNext)) {
+                Fail(strprintf("%s: failed to index block %s", __func__, pindexNext->GetBlockHash().ToString()));
+                return;
+            }
+            pindex = pindexNext;
+            {
+                LOCK(cs_main);
+                pindexBest = pindex;
+            }
+
+            if (GetTime() - nLastLog >= SYNC_LOG_INTERVAL) {
+                LogPrintf("Building transaction index, at height %d\n", pindex->nHeight);
+                nLastLog = GetTime();
+            }
+        }
+        LogPrintf("Transaction index synced at height %d\n", pindex ? pindex->nHeight : -1);
+    }
+    catch (const boost::thread_interrupted&) {
+        LogPrintf("%s: interrupted\n", __func__);
+    }
+    catch (const std::exception& e) {
+        PrintExceptionContinue(&e, "ThreadTxIndexSync()");
+        Fail(strprintf("%s: %s", __func__, e.what()));
+    }
+}
+
+void CTxIndex::BlockConnected(const CBlock& block, const CBlockIndex* pindex)
+{
+    if (!fSynced || fFailed)
+        return;
+    AssertLockHeld(cs_main);
+    if (pindex->pprev != pindexBest) {
+        Fail(strprintf("%s: block %s does not extend the indexed chain", __func__, pindex->GetBlockHash().ToString()));
+        return;
+    }
+    if (!WriteBlock(block, pindex)) {
+        Fail(strprintf("%s: failed to index block %s", __func__, pindex->GetBlockHash().ToString()));
+        return;
+    }
+    pindexBest = pindex;
+}
+
+void CTxIndex::BlockDisconnected(const CBlock& block, const CBlockIndex* pindex)
+{
+    if (!fSynced || fFailed)
+        return;
+    AssertLockHeld(cs_main);
+    if (pindex != pindexBest) {
+        Fail(strprintf("%s: block %s is not the last indexed block", __func__, pindex->GetBlockHash().ToString()));
+        return;
+    }
+    if (!EraseBlock(block, pindex)) {
+        Fail(strprintf("%s: failed to remove block %s from the index", __func__, pindex->GetBlockHash().ToString()));
+        return;
+    }
+    pindexBest = pindex->pprev;
+}
+
+bool CTxIndex::FindTx(const uint256& txid, CTransaction& txOut, uint256& hashBlock)
+{
+    const uint64_t nTxHash = txid.GetCheapHash();
+    boost::scoped_ptr<CDBIterator> pcursor(db.NewIterator());
+    for (pcursor->Seek(std::make_pair(DB_TXPOS, nTxHash)); pcursor->Valid(); pcursor->Next()) {
+        CTxIndexKey key;
+        if (!pcursor->GetKey(key) || key.nTxHash != nTxHash)
+            break;
+        // Transactions sharing the truncated hash are told apart by reading them.
+        CBlockHeader header;
+        if (!ReadTxFromDisk(key.pos, header, txOut) || txOut.GetHash() != txid)
+            continue;
+        hashBlock = header.GetHash();
+        return true;
+    }
+    return false;
+}
@@ -0,0 +1,89 @@
+// Copyright (c) 2016 The Gulden developers
+// Distributed under the GULDEN software license, see the accompanying
+// file COPYING
+
+#ifndef GULDEN_TXINDEX_H
+#define GULDEN_TXINDEX_H
+
+#include "dbwrapper.h"
+#include "validationinterface.h"
+
+#include <atomic>
+#include <string>
+
+#include <boost/thread.hpp>
+
+class CBlock;
+class CBlockIndex;
+class CTransaction;
+class uint256;
+struct CDiskTxPos;
+
+/**
+ * Transaction index, kept in its own database (indexes/txindex/).
+ *
+ * Entries are keyed by the first 64 bits of the txid followed by the position
+ * of the transaction on disk, with an empty value; that is less than half the
+ * size of a full txid key plus position record. Several transactions may
+ * share a truncated txid, so a lookup reads every candidate from disk and
+ * compares the full hash.
+ *
+ * The index can be enabled at any time. A background thread builds it from
+ * the block files, catching up to the active chain, after which it is kept up
+ * to date from the BlockConnected/BlockDisconnected notifications.
+ *
+ * If building or updating the index fails it stops being updated until the
+ * node is restarted; the failure is logged and raised as a warning.
+ */
+class CTxIndex : public CValidationInterface
+{
+private:
+    CDBWrapper db;
+
+    //! Last block whose transactions are in the index (protected by cs_main)
+    const CBlockIndex* pindexBest;
+    //! Set once the background sync has reached the tip; from then on notifications keep the index current
+    std::atomic<bool> fSynced;
+    //! Set once writing to the index failed; it is no longer kept up to date
+    std::atomic<bool> fFailed;
+    //! The stored best block is unknown (e.g. the block files were replaced), so existing entries must be dropped
+    bool fWipe;
+    boost::thread threadSync;
+
+    CTxIndex(const CTxIndex&);
+    CTxIndex& operator=(const CTxIndex&);
+
+    void ThreadSync();
+    bool WriteBlock(const CBlock& block, const CBlockIndex* pindex);
+    bool EraseBlock(const CBlock& block, const CBlockIndex* pindex);
+    bool WipeEntries();
+    void Fail(const std::string& strError);
+
+protected:
+    void BlockConnected(const CBlock& block, const CBlockIndex* pindex);
+    void BlockDisconnected(const CBlock& block, const CBlockIndex* pindex);
+
+public:
+    CTxIndex(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    virtual ~CTxIndex();
+
+    /** Register for notifications and start building the index in the background. */
+    void Start();
+    /** Stop the background thread and unregister. */
+    void Stop();
+
+    /** Whether the index has caught up with the active chain. */
+    bool IsSynced() const { return fSynced; }
+    /** Whether the index stopped being updated after an error. */
+    bool IsFailed() const { return fFailed; }
+    /** Height of the last indexed block, -1 if none. */
+    int GetBestHeight() const;
+
+    /** Look up a transaction in a block of the active chain. Entries for blocks not yet indexed are simply not found. */
+    bool FindTx(const uint256& txid, CTransaction& txOut, uint256& hashBlock);
+};
+
+/** The transaction index, NULL unless -txindex is set */
+extern CTxIndex* ptxindex;
+
+#endif // GULDEN_TXINDEX_H
@@ -18,31 +18,40 @@
 #include "utiltime.h"
 #include "version.h"
 
+#include <algorithm>
+
 using namespace std;
 
-CTxMemPoolEntry::CTxMemPoolEntry(const CTransaction& _tx, const CAmount& _nFee,
+/** Heap usage of one entry of mapTx: the entry, the nodes of its five indexes (two
+ *  pointers for the txid index, three for each ordered one) and its bucket of the txid index */
+static size_t MapTxEntryUsage()
+{
+    return memusage::MallocUsage(sizeof(CTxMemPoolEntry) + 15 * sizeof(void*));
+}
+
+CTxMemPoolEntry::CTxMemPoolEntry(const CTransactionRef& _tx, const CAmount& _nFee,
                                  int64_t _nTime, double _entryPriority, unsigned int _entryHeight,
                                  bool poolHasNoInputsOf, CAmount _inChainInputValue,
                                  bool _spendsCoinbase, int64_t _sigOpsCost, LockPoints lp)
-    : tx(std::make_shared<CTransaction>(_tx))
+    : tx(_tx)
     , nFee(_nFee)
     , nTime(_nTime)
     , entryPriority(_entryPriority)
+    , inChainInputValue(_inChainInputValue)
+    , lockPoints(lp)
     , entryHeight(_entryHeight)
+    , sigOpCost(_sigOpsCost)
     , hadNoDependencies(poolHasNoInputsOf)
-    , inChainInputValue(_inChainInputValue)
     , spendsCoinbase(_spendsCoinbase)
-    , sigOpCost(_sigOpsCost)
-    , lockPoints(lp)
 {
-    nTxWeight = GetTransactionWeight(_tx);
-    nModSize = _tx.CalculateModifiedSize(GetTxSize());
+    nTxWeight = GetTransactionWeight(*tx);
+    nModSize = tx->CalculateModifiedSize(GetTxSize());
     nUsageSize = RecursiveDynamicUsage(*tx) + memusage::DynamicUsage(tx);
 
     nCountWithDescendants = 1;
     nSizeWithDescendants = GetTxSize();
     nModFeesWithDescendants = nFee;
-    CAmount nValueIn = _tx.GetValueOut() + nFee;
+    CAmount nValueIn = tx->GetValueOut() + nFee;
     assert(inChainInputValue <= nValueIn);
 
     feeDelta = 0;
@@ -51,6 +60,17 @@ CTxMemPoolEntry::CTxMemPoolEntry(const CTransaction& _tx, const CAmount& _nFee,
     nSizeWithAncestors = GetTxSize();
     nModFeesWithAncestors = nFee;
     nSigOpCostWithAncestors = sigOpCost;
+
+    nEpoch = 0;
+}
+
+CTxMemPoolEntry::CTxMemPoolEntry(const CTransaction& _tx, const CAmount& _nFee,
+                                 int64_t _nTime, double _entryPriority, unsigned int _entryHeight,
+                                 bool poolHasNoInputsOf, CAmount _inChainInputValue,
+                                 bool _spendsCoinbase, int64_t _sigOpsCost, LockPoints lp)
+    : CTxMemPoolEntry(MakeTransactionRef(_tx), _nFee, _nTime, _entryPriority, _entryHeight,
+                      poolHasNoInputsOf, _inChainInputValue, _spendsCoinbase, _sigOpsCost, lp)
+{
 }
 
 CTxMemPoolEntry::CTxMemPoolEntry(const CTxMemPoolEntry& other)
@@ -87,24 +107,28 @@ size_t CTxMemPoolEntry::GetTxSize() const
 
 void CTxMemPool::UpdateForDescendants(txiter updateIt, cacheMap& cachedDescendants, const std::set<uint256>& setExclude)
 {
-    setEntries stageEntries, setAllDescendants;
-    stageEntries = GetMemPoolChildren(updateIt);
+    const uint64_t epoch = NewEpoch();
+    std::vector<txiter> vStage, vAllDescendants;
+    BOOST_FOREACH (const txiter childEntry, GetMemPoolChildren(updateIt)) {
+        if (!Visited(childEntry, epoch))
+            vStage.push_back(childEntry);
+    }
 
-    while (!stageEntries.empty()) {
-        const txiter cit = *stageEntries.begin();
-        setAllDescendants.insert(cit);
-        stageEntries.erase(cit);
-        const setEntries& setChildren = GetMemPoolChildren(cit);
-        BOOST_FOREACH (const txiter childEntry, setChildren) {
+    while (!vStage.empty()) {
+        const txiter cit = vStage.back();
+        vStage.pop_back();
+        vAllDescendants.push_back(cit);
+        const vecEntries& vChildren = GetMemPoolChildren(cit);
+        BOOST_FOREACH (const txiter childEntry, vChildren) {
             cacheMap::iterator cacheIt = cachedDescendants.find(childEntry);
             if (cacheIt != cachedDescendants.end()) {
-
+                // Descendants of an entry updated before are not walked again.
                 BOOST_FOREACH (const txiter cacheEntry, cacheIt->second) {
-                    setAllDescendants.insert(cacheEntry);
+                    if (!Visited(cacheEntry, epoch))
+                        vAllDescendants.push_back(cacheEntry);
                 }
-            } else if (!setAllDescendants.count(childEntry)) {
-
-                stageEntries.insert(childEntry);
+            } else if (!Visited(childEntry, epoch)) {
+                vStage.push_back(childEntry);
             }
         }
     }
@@ -112,7 +136,7 @@ void CTxMemPool::UpdateForDescendants(txiter updateIt, cacheMap& cachedDescendan
     int64_t modifySize = 0;
     CAmount modifyFee = 0;
     int64_t modifyCount = 0;
-    BOOST_FOREACH (txiter cit, setAllDescendants) {
+    BOOST_FOREACH (txiter cit, vAllDescendants) {
         if (!setExclude.count(cit->GetTx().GetHash())) {
             modifySize += cit->GetTxSize();
             modifyFee += cit->GetModifiedFee();
@@ -160,16 +184,18 @@ void CTxMemPool::UpdateTransactionsFromBlock(const std::vector<uint256>& vHashes
 
 bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry& entry, setEntries& setAncestors, uint64_t limitAncestorCount, uint64_t limitAncestorSize, uint64_t limitDescendantCount, uint64_t limitDescendantSize, std::string& errString, bool fSearchForParents /* = true */) const
 {
-    setEntries parentHashes;
+    LOCK(cs);
+    const uint64_t epoch = NewEpoch();
+    std::vector<txiter> vStage;
     const CTransaction& tx = entry.GetTx();
 
     if (fSearchForParents) {
 
         for (unsigned int i = 0; i < tx.vin.size(); i++) {
             txiter piter = mapTx.find(tx.vin[i].prevout.hash);
-            if (piter != mapTx.end()) {
-                parentHashes.insert(piter);
-                if (parentHashes.size() + 1 > limitAncestorCount) {
+            if (piter != mapTx.end() && !Visited(piter, epoch)) {
+                vStage.push_back(piter);
+                if (vStage.size() + 1 > limitAncestorCount) {
                     errString = strprintf("too many unconfirmed parents [limit: %u]", limitAncestorCount);
                     return false;
                 }
@@ -178,16 +204,31 @@ bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry& entry, setEntr
     } else {
 
         txiter it = mapTx.iterator_to(entry);
-        parentHashes = GetMemPoolParents(it);
+        BOOST_FOREACH (const txiter& piter, GetMemPoolParents(it)) {
+            Visited(piter, epoch);
+            vStage.push_back(piter);
+        }
+    }
+
+    // The ancestor state kept for every parent bounds the walk from below, so a
+    // transaction at the end of a long chain is refused without walking it.
+    BOOST_FOREACH (const txiter& piter, vStage) {
+        if (piter->GetCountWithAncestors() + 1 > limitAncestorCount) {
+            errString = strprintf("too many unconfirmed ancestors [limit: %u]", limitAncestorCount);
+            return false;
+        } else if (piter->GetSizeWithAncestors() + entry.GetTxSize() > limitAncestorSize) {
+            errString = strprintf("exceeds ancestor size limit [limit: %u]", limitAncestorSize);
+            return false;
+        }
     }
 
     size_t totalSizeWithAncestors = entry.GetTxSize();
 
-    while (!parentHashes.empty()) {
-        txiter stageit = *parentHashes.begin();
+    while (!vStage.empty()) {
+        txiter stageit = vStage.back();
+        vStage.pop_back();
 
         setAncestors.insert(stageit);
-        parentHashes.erase(stageit);
         totalSizeWithAncestors += stageit->GetTxSize();
 
         if (stageit->GetSizeWithDescendants() + entry.GetTxSize() > limitDescendantSize) {
@@ -201,13 +242,13 @@ bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry& entry, setEntr
             return false;
         }
 
-        const setEntries& setMemPoolParents = GetMemPoolParents(stageit);
-        BOOST_FOREACH (const txiter& phash, setMemPoolParents) {
+        const vecEntries& vMemPoolParents = GetMemPoolParents(stageit);
+        BOOST_FOREACH (const txiter& phash, vMemPoolParents) {
 
-            if (setAncestors.count(phash) == 0) {
-                parentHashes.insert(phash);
+            if (!Visited(phash, epoch)) {
+                vStage.push_back(phash);
             }
-            if (parentHashes.size() + setAncestors.size() + 1 > limitAncestorCount) {
+            if (vStage.size() + setAncestors.size() + 1 > limitAncestorCount) {
                 errString = strprintf("too many unconfirmed ancestors [limit: %u]", limitAncestorCount);
                 return false;
             }
@@ -219,7 +260,7 @@ bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry& entry, setEntr
 
 void CTxMemPool::UpdateAncestorsOf(bool add, txiter it, setEntries& setAncestors)
 {
-    setEntries parentIters = GetMemPoolParents(it);
+    const vecEntries& parentIters = GetMemPoolParents(it);
 
     BOOST_FOREACH (txiter piter, parentIters) {
         UpdateChild(piter, it, add);
@@ -248,8 +289,8 @@ void CTxMemPool::UpdateEntryForAncestors(txiter it, const setEntries& setAncesto
 
 void CTxMemPool::UpdateChildrenForRemoval(txiter it)
 {
-    const setEntries& setMemPoolChildren = GetMemPoolChildren(it);
-    BOOST_FOREACH (txiter updateIt, setMemPoolChildren) {
+    const vecEntries& vMemPoolChildren = GetMemPoolChildren(it);
+    BOOST_FOREACH (txiter updateIt, vMemPoolChildren) {
         UpdateParent(updateIt, it, false);
     }
 }
@@ -278,6 +319,13 @@ void CTxMemPool::UpdateForRemoveFromMempool(const setEntries& entriesToRemove, b
         std::string dummy;
 
         CalculateMemPoolAncestors(entry, setAncestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
+        // Ancestors that go along need no update, which spares re-sorting them in mapTx.
+        for (setEntries::iterator ait = setAncestors.begin(); ait != setAncestors.end();) {
+            if (entriesToRemove.count(*ait))
+                setAncestors.erase(ait++);
+            else
+                ++ait;
+        }
 
         UpdateAncestorsOf(false, removeIt, setAncestors);
     }
@@ -293,7 +341,7 @@ void CTxMemPoolEntry::UpdateDescendantState(int64_t modifySize, CAmount modifyFe
     assert(int64_t(nSizeWithDescendants) > 0);
     nModFeesWithDescendants += modifyFee;
     nCountWithDescendants += modifyCount;
-    assert(int64_t(nCountWithDescendants) > 0);
+    assert(int32_t(nCountWithDescendants) > 0);
 }
 
 void CTxMemPoolEntry::UpdateAncestorState(int64_t modifySize, CAmount modifyFee, int64_t modifyCount, int modifySigOps)
@@ -302,13 +350,14 @@ void CTxMemPoolEntry::UpdateAncestorState(int64_t modifySize, CAmount modifyFee,
     assert(int64_t(nSizeWithAncestors) > 0);
     nModFeesWithAncestors += modifyFee;
     nCountWithAncestors += modifyCount;
-    assert(int64_t(nCountWithAncestors) > 0);
+    assert(int32_t(nCountWithAncestors) > 0);
     nSigOpCostWithAncestors += modifySigOps;
     assert(int(nSigOpCostWithAncestors) >= 0);
 }
 
 CTxMemPool::CTxMemPool(const CFeeRate& _minReasonableRelayFee)
     : nTransactionsUpdated(0)
+    , nEpoch(0)
 {
     _clear(); //lock free clear
 
@@ -352,6 +401,7 @@ bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry& entry,
 
     LOCK(cs);
     indexed_transaction_set::iterator newit = mapTx.insert(entry).first;
+    newit->nEpoch = 0;
     mapLinks.insert(make_pair(newit, TxLinks()));
 
     std::map<uint256, std::pair<double, CAmount> >::const_iterator pos = mapDeltas.find(hash);
@@ -387,11 +437,15 @@ bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry& entry,
     vTxHashes.emplace_back(hash, newit);
     newit->vTxHashesIdx = vTxHashes.size() - 1;
 
+    NotifyEntryAdded(tx);
     return true;
 }
 
 void CTxMemPool::removeUnchecked(txiter it)
 {
+    nTransactionsUpdated++;
+    NotifyEntryRemoved(it->GetTx());
+
     const uint256 hash = it->GetTx().GetHash();
     BOOST_FOREACH (const CTxIn& txin, it->GetTx().vin)
         mapNextTx.erase(txin.prevout);
@@ -410,32 +464,53 @@ void CTxMemPool::removeUnchecked(txiter it)
     cachedInnerUsage -= memusage::DynamicUsage(mapLinks[it].parents) + memusage::DynamicUsage(mapLinks[it].children);
     mapLinks.erase(it);
     mapTx.erase(it);
-    nTransactionsUpdated++;
     minerPolicyEstimator->removeTx(hash);
 }
 
 void CTxMemPool::CalculateDescendants(txiter entryit, setEntries& setDescendants)
 {
-    setEntries stage;
-    if (setDescendants.count(entryit) == 0) {
-        stage.insert(entryit);
-    }
+    LOCK(cs);
+    const uint64_t epoch = NewEpoch();
+    std::vector<txiter> vStage(1, entryit);
+    Visited(entryit, epoch);
+
+    while (!vStage.empty()) {
+        txiter it = vStage.back();
+        vStage.pop_back();
+        // The descendants of an entry that was in setDescendants already are in it as well.
+        if (!setDescendants.insert(it).second)
+            continue;
 
-    while (!stage.empty()) {
-        txiter it = *stage.begin();
-        setDescendants.insert(it);
-        stage.erase(it);
+        const vecEntries& vChildren = GetMemPoolChildren(it);
+        BOOST_FOREACH (const txiter& childiter, vChildren) {
+            if (!Visited(childiter, epoch)) {
+                vStage.push_back(childiter);
+            }
+        }
+    }
+}
 
-        const setEntries& setChildren = GetMemPoolChildren(it);
-        BOOST_FOREACH (const txiter& childiter, setChildren) {
-            if (!setDescendants.count(childiter)) {
-                stage.insert(childiter);
+void CTxMemPool::CalculateAncestorsUntil(txiter entryit, setEntries& setAncestors, const setEntries& setStop) const
+{
+    LOCK(cs);
+    const uint64_t epoch = NewEpoch();
+    std::vector<txiter> vStage(1, entryit);
+    Visited(entryit, epoch);
+
+    while (!vStage.empty()) {
+        txiter it = vStage.back();
+        vStage.pop_back();
+
+        BOOST_FOREACH (const txiter& parentiter, GetMemPoolParents(it)) {
+            if (!Visited(parentiter, epoch) && !setStop.count(parentiter)) {
+                setAncestors.insert(parentiter);
+                vStage.push_back(parentiter);
             }
         }
     }
 }
 
-void CTxMemPool::removeRecursive(const CTransaction& origTx, std::list<CTransaction>& removed)
+void CTxMemPool::removeRecursive(const CTransaction& origTx, std::list<CTransactionRef>& removed)
 {
 
     {
@@ -460,7 +535,7 @@ void CTxMemPool::removeRecursive(const CTransaction& origTx, std::list<CTransact
             CalculateDescendants(it, setAllRemoves);
         }
         BOOST_FOREACH (txiter it, setAllRemoves) {
-            removed.push_back(it->GetTx());
+            removed.push_back(it->GetSharedTx());
         }
         RemoveStaged(setAllRemoves, false);
     }
@@ -470,14 +545,14 @@ void CTxMemPool::removeForReorg(const CCoinsViewCache* pcoins, unsigned int nMem
 {
 
     LOCK(cs);
-    list<CTransaction> transactionsToRemove;
+    list<CTransactionRef> transactionsToRemove;
     for (indexed_transaction_set::const_iterator it = mapTx.begin(); it != mapTx.end(); it++) {
         const CTransaction& tx = it->GetTx();
         LockPoints lp = it->GetLockPoints();
         bool validLP = TestLockPointValidity(&lp);
         if (!CheckFinalTx(tx, flags) || !CheckSequenceLocks(tx, flags, &lp, validLP)) {
 
-            transactionsToRemove.push_back(tx);
+            transactionsToRemove.push_back(it->GetSharedTx());
         } else if (it->GetSpendsCoinbase()) {
             BOOST_FOREACH (const CTxIn& txin, tx.vin) {
                 indexed_transaction_set::const_iterator it2 = mapTx.find(txin.prevout.hash);
@@ -487,7 +562,7 @@ void CTxMemPool::removeForReorg(const CCoinsViewCache* pcoins, unsigned int nMem
                 if (nCheckFrequency != 0)
                     assert(coins);
                 if (!coins || (coins->IsCoinBase() && ((signed long)nMemPoolHeight) - coins->nHeight < COINBASE_MATURITY)) {
-                    transactionsToRemove.push_back(tx);
+                    transactionsToRemove.push_back(it->GetSharedTx());
                     break;
                 }
             }
@@ -496,16 +571,15 @@ void CTxMemPool::removeForReorg(const CCoinsViewCache* pcoins, unsigned int nMem
             mapTx.modify(it, update_lock_points(lp));
         }
     }
-    BOOST_FOREACH (const CTransaction& tx, transactionsToRemove) {
-        list<CTransaction> removed;
-        removeRecursive(tx, removed);
+    BOOST_FOREACH (const CTransactionRef& ptx, transactionsToRemove) {
+        list<CTransactionRef> removed;
+        removeRecursive(*ptx, removed);
     }
 }
 
-void CTxMemPool::removeConflicts(const CTransaction& tx, std::list<CTransaction>& removed)
+void CTxMemPool::removeConflicts(const CTransaction& tx, std::list<CTransactionRef>& removed)
 {
 
-    list<CTransaction> result;
     LOCK(cs);
     BOOST_FOREACH (const CTxIn& txin, tx.vin) {
         auto it = mapNextTx.find(txin.prevout);
@@ -522,27 +596,27 @@ void CTxMemPool::removeConflicts(const CTransaction& tx, std::list<CTransaction>
 /**
  * Called when a block is connected. Removes from mempool and updates the miner fee estimator.
  */
-void CTxMemPool::removeForBlock(const std::vector<CTransaction>& vtx, unsigned int nBlockHeight,
-                                std::list<CTransaction>& conflicts, bool fCurrentEstimate)
+void CTxMemPool::removeForBlock(const std::vector<CTransactionRef>& vtx, unsigned int nBlockHeight,
+                                std::list<CTransactionRef>& conflicts, bool fCurrentEstimate)
 {
     LOCK(cs);
     std::vector<CTxMemPoolEntry> entries;
-    BOOST_FOREACH (const CTransaction& tx, vtx) {
-        uint256 hash = tx.GetHash();
+    for (const auto& tx : vtx) {
+        uint256 hash = tx->GetHash();
 
         indexed_transaction_set::iterator i = mapTx.find(hash);
         if (i != mapTx.end())
             entries.push_back(*i);
     }
-    BOOST_FOREACH (const CTransaction& tx, vtx) {
-        txiter it = mapTx.find(tx.GetHash());
+    for (const auto& tx : vtx) {
+        txiter it = mapTx.find(tx->GetHash());
         if (it != mapTx.end()) {
             setEntries stage;
             stage.insert(it);
             RemoveStaged(stage, true);
         }
-        removeConflicts(tx, conflicts);
-        ClearPrioritisation(tx.GetHash());
+        removeConflicts(*tx, conflicts);
+        ClearPrioritisation(tx->GetHash());
     }
 
     minerPolicyEstimator->processBlock(nBlockHeight, entries, fCurrentEstimate);
@@ -621,7 +695,9 @@ void CTxMemPool::check(const CCoinsViewCache* pcoins) const
             assert(it3->second == &tx);
             i++;
         }
-        assert(setParentCheck == GetMemPoolParents(it));
+        const vecEntries& vParents = GetMemPoolParents(it);
+        assert(setParentCheck == setEntries(vParents.begin(), vParents.end()));
+        assert(setParentCheck.size() == vParents.size());
 
         setEntries setAncestors;
         uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
@@ -653,7 +729,9 @@ void CTxMemPool::check(const CCoinsViewCache* pcoins) const
                 childSizes += childit->GetTxSize();
             }
         }
-        assert(setChildrenCheck == GetMemPoolChildren(it));
+        const vecEntries& vChildren = GetMemPoolChildren(it);
+        assert(setChildrenCheck == setEntries(vChildren.begin(), vChildren.end()));
+        assert(setChildrenCheck.size() == vChildren.size());
 
         assert(it->GetSizeWithDescendants() >= childSizes + it->GetTxSize());
 
@@ -859,6 +937,7 @@ void CTxMemPool::PrioritiseTransaction(const uint256 hash, const string strHash,
             BOOST_FOREACH (txiter ancestorIt, setAncestors) {
                 mapTx.modify(ancestorIt, update_descendant_state(0, nFeeDelta, 0));
             }
+            ++nTransactionsUpdated;
         }
     }
     LogPrintf("PrioritiseTransaction: %s priority += %f, fee += %d\n", strHash, dPriorityDelta, FormatMoney(nFeeDelta));
@@ -915,7 +994,24 @@ size_t CTxMemPool::DynamicMemoryUsage() const
 {
     LOCK(cs);
 
-    return memusage::MallocUsage(sizeof(CTxMemPoolEntry) + 15 * sizeof(void*)) * mapTx.size() + memusage::DynamicUsage(mapNextTx) + memusage::DynamicUsage(mapDeltas) + memusage::DynamicUsage(mapLinks) + memusage::DynamicUsage(vTxHashes) + cachedInnerUsage;
+    return MapTxEntryUsage() * mapTx.size() + memusage::DynamicUsage(mapNextTx) + memusage::DynamicUsage(mapDeltas) + memusage::DynamicUsage(mapLinks) + memusage::DynamicUsage(vTxHashes) + cachedInnerUsage;
+}
+
+CTxMemPool::MemoryUsage CTxMemPool::GetMemoryUsage() const
+{
+    LOCK(cs);
+    MemoryUsage usage;
+    usage.nTransactions = 0;
+    for (indexed_transaction_set::const_iterator it = mapTx.begin(); it != mapTx.end(); it++)
+        usage.nTransactions += it->DynamicMemoryUsage();
+    usage.nEntries = MapTxEntryUsage() * mapTx.size();
+    usage.nLinks = memusage::DynamicUsage(mapLinks);
+    for (txlinksMap::const_iterator it = mapLinks.begin(); it != mapLinks.end(); it++)
+        usage.nLinks += memusage::DynamicUsage(it->second.parents) + memusage::DynamicUsage(it->second.children);
+    usage.nNextTx = memusage::DynamicUsage(mapNextTx);
+    usage.nDeltas = memusage::DynamicUsage(mapDeltas);
+    usage.nTxHashes = memusage::DynamicUsage(vTxHashes);
+    return usage;
 }
 
 void CTxMemPool::RemoveStaged(setEntries& stage, bool updateDescendants)
@@ -931,15 +1027,12 @@ int CTxMemPool::Expire(int64_t time)
 {
     LOCK(cs);
     indexed_transaction_set::index<entry_time>::type::iterator it = mapTx.get<entry_time>().begin();
-    setEntries toremove;
+    setEntries stage;
+    // The walk returns at once for a descendant of an earlier expired transaction.
     while (it != mapTx.get<entry_time>().end() && it->GetTime() < time) {
-        toremove.insert(mapTx.project<0>(it));
+        CalculateDescendants(mapTx.project<0>(it), stage);
         it++;
     }
-    setEntries stage;
-    BOOST_FOREACH (txiter removeit, toremove) {
-        CalculateDescendants(removeit, stage);
-    }
     RemoveStaged(stage, false);
     return stage.size();
 }
@@ -954,27 +1047,32 @@ bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry& entry,
     return addUnchecked(hash, entry, setAncestors, fCurrentEstimate);
 }
 
-void CTxMemPool::UpdateChild(txiter entry, txiter child, bool add)
+void CTxMemPool::UpdateLink(vecEntries& links, txiter link, bool add)
 {
-    setEntries s;
-    if (add && mapLinks[entry].children.insert(child).second) {
-        cachedInnerUsage += memusage::IncrementalDynamicUsage(s);
-    } else if (!add && mapLinks[entry].children.erase(child)) {
-        cachedInnerUsage -= memusage::IncrementalDynamicUsage(s);
+    const size_t nUsageBefore = memusage::DynamicUsage(links);
+    vecEntries::iterator it = std::find(links.begin(), links.end(), link);
+    if (add && it == links.end()) {
+        links.push_back(link);
+    } else if (!add && it != links.end()) {
+        links.erase(it);
+        if (links.empty())
+            vecEntries().swap(links);
     }
+    cachedInnerUsage += memusage::DynamicUsage(links);
+    cachedInnerUsage -= nUsageBefore;
+}
+
+void CTxMemPool::UpdateChild(txiter entry, txiter child, bool add)
+{
+    UpdateLink(mapLinks[entry].children, child, add);
 }
 
 void CTxMemPool::UpdateParent(txiter entry, txiter parent, bool add)
 {
-    setEntries s;
-    if (add && mapLinks[entry].parents.insert(parent).second) {
-        cachedInnerUsage += memusage::IncrementalDynamicUsage(s);
-    } else if (!add && mapLinks[entry].parents.erase(parent)) {
-        cachedInnerUsage -= memusage::IncrementalDynamicUsage(s);
-    }
+    UpdateLink(mapLinks[entry].parents, parent, add);
 }
 
-const CTxMemPool::setEntries& CTxMemPool::GetMemPoolParents(txiter entry) const
+const CTxMemPool::vecEntries& CTxMemPool::GetMemPoolParents(txiter entry) const
 {
     assert(entry != mapTx.end());
     txlinksMap::const_iterator it = mapLinks.find(entry);
@@ -982,7 +1080,7 @@ const CTxMemPool::setEntries& CTxMemPool::GetMemPoolParents(txiter entry) const
     return it->second.parents;
 }
 
-const CTxMemPool::setEntries& CTxMemPool::GetMemPoolChildren(txiter entry) const
+const CTxMemPool::vecEntries& CTxMemPool::GetMemPoolChildren(txiter entry) const
 {
     assert(entry != mapTx.end());
     txlinksMap::const_iterator it = mapLinks.find(entry);
@@ -1024,34 +1122,72 @@ void CTxMemPool::trackPackageRemoved(const CFeeRate& rate)
     }
 }
 
+size_t CTxMemPool::RemovalUsageBound(txiter it, size_t nLinkNodeUsage, size_t nNextTxNodeUsage) const
+{
+    const TxLinks& links = mapLinks.find(it)->second;
+    size_t nUsage = MapTxEntryUsage() + it->DynamicMemoryUsage() + nLinkNodeUsage;
+    nUsage += memusage::DynamicUsage(links.parents) + memusage::DynamicUsage(links.children);
+    // A parent left without children frees its list.
+    BOOST_FOREACH (txiter parent, links.parents)
+        nUsage += memusage::DynamicUsage(GetMemPoolChildren(parent));
+    return nUsage + it->GetTx().vin.size() * nNextTxNodeUsage;
+}
+
 void CTxMemPool::TrimToSize(size_t sizelimit, std::vector<uint256>* pvNoSpendsRemaining)
 {
     LOCK(cs);
 
     unsigned nTxnRemoved = 0;
     CFeeRate maxFeeRateRemoved(0);
-    while (!mapTx.empty() && DynamicMemoryUsage() > sizelimit) {
-        indexed_transaction_set::index<descendant_score>::type::iterator it = mapTx.get<descendant_score>().begin();
-
-        CFeeRate removed(it->GetModFeesWithDescendants(), it->GetSizeWithDescendants());
-        removed += minReasonableRelayFee;
-        trackPackageRemoved(removed);
-        maxFeeRateRemoved = std::max(maxFeeRateRemoved, removed);
-
+    size_t nUsage;
+    while (!mapTx.empty() && (nUsage = DynamicMemoryUsage()) > sizelimit) {
+        // Stage packages from the bottom of the descendant score index until their
+        // removal could bring the pool within the limit, and remove them at once.
+        // What a package frees is overestimated, so no more is staged than removing
+        // the packages one by one would take; should the estimate fall short, the
+        // next round stages the rest.
+        const size_t nExcess = nUsage - sizelimit;
+        const size_t nLinkNodeUsage = memusage::DynamicUsage(mapLinks) / mapLinks.size();
+        const size_t nNextTxNodeUsage = mapNextTx.empty() ? 0 : memusage::DynamicUsage(mapNextTx) / mapNextTx.size();
+        const size_t nTxHashesUsage = memusage::DynamicUsage(vTxHashes);
         setEntries stage;
-        CalculateDescendants(mapTx.project<0>(it), stage);
+        size_t nFreed = 0, nFreedHashes = 0;
+        CFeeRate maxFeeRateStaged(0);
+        indexed_transaction_set::index<descendant_score>::type::iterator it = mapTx.get<descendant_score>().begin();
+        for (; it != mapTx.get<descendant_score>().end() && nFreed + nFreedHashes < nExcess; ++it) {
+            txiter root = mapTx.project<0>(it);
+            if (stage.count(root))
+                continue;
+
+            CFeeRate removed(it->GetModFeesWithDescendants(), it->GetSizeWithDescendants());
+            removed += minReasonableRelayFee;
+            maxFeeRateStaged = std::max(maxFeeRateStaged, removed);
+
+            setEntries setPackage;
+            CalculateDescendants(root, setPackage);
+            BOOST_FOREACH (txiter pit, setPackage) {
+                if (stage.insert(pit).second)
+                    nFreed += RemovalUsageBound(pit, nLinkNodeUsage, nNextTxNodeUsage);
+            }
+            // vTxHashes gives its spare capacity back once less than half of it is used.
+            const size_t nHashesLeft = vTxHashes.size() - stage.size();
+            if (nHashesLeft * 2 < vTxHashes.capacity())
+                nFreedHashes = nTxHashesUsage - memusage::MallocUsage(nHashesLeft * sizeof(vTxHashes[0]));
+        }
+        trackPackageRemoved(maxFeeRateStaged);
+        maxFeeRateRemoved = std::max(maxFeeRateRemoved, maxFeeRateStaged);
         nTxnRemoved += stage.size();
 
-        std::vector<CTransaction> txn;
+        std::vector<CTransactionRef> txn;
         if (pvNoSpendsRemaining) {
             txn.reserve(stage.size());
             BOOST_FOREACH (txiter it, stage)
-                txn.push_back(it->GetTx());
+                txn.push_back(it->GetSharedTx());
         }
         RemoveStaged(stage, false);
         if (pvNoSpendsRemaining) {
-            BOOST_FOREACH (const CTransaction& tx, txn) {
-                BOOST_FOREACH (const CTxIn& txin, tx.vin) {
+            BOOST_FOREACH (const CTransactionRef& ptx, txn) {
+                BOOST_FOREACH (const CTxIn& txin, ptx->vin) {
                     if (exists(txin.prevout.hash))
                         continue;
                     auto it = mapNextTx.lower_bound(COutPoint(txin.prevout.hash, 0));
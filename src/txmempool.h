@@ -27,6 +27,7 @@
 #include "boost/multi_index_container.hpp"
 #include "boost/multi_index/ordered_index.hpp"
 #include "boost/multi_index/hashed_index.hpp"
+#include <boost/signals2/signal.hpp>
 
 class CAutoFile;
 class CBlockIndex;
@@ -81,31 +82,40 @@ class CTxMemPool;
 
 class CTxMemPoolEntry {
 private:
+    // There is one entry per transaction in the pool, so the fields are ordered widest
+    // first to avoid padding, and those bounded by the size of a transaction or of the
+    // pool are 32 bits wide.
     std::shared_ptr<const CTransaction> tx;
     CAmount nFee; //!< Cached to avoid expensive parent-transaction lookups
-    size_t nTxWeight; //!< ... and avoid recomputing tx weight (also used for GetTxSize())
-    size_t nModSize; //!< ... and modified size for priority
-    size_t nUsageSize; //!< ... and total memory usage
     int64_t nTime; //!< Local time when entering the mempool
     double entryPriority; //!< Priority when entering the mempool
-    unsigned int entryHeight; //!< Chain height when entering the mempool
-    bool hadNoDependencies; //!< Not dependent on any other txs when it entered the mempool
     CAmount inChainInputValue; //!< Sum of all txin values that are already in blockchain
-    bool spendsCoinbase; //!< keep track of transactions that spend a coinbase
-    int64_t sigOpCost; //!< Total sigop cost
     int64_t feeDelta; //!< Used for determining the priority of the transaction for mining in a block
     LockPoints lockPoints; //!< Track the height and time at which tx was final
 
-    uint64_t nCountWithDescendants; //!< number of descendant transactions
-    uint64_t nSizeWithDescendants; //!< ... and size
+    uint64_t nSizeWithDescendants; //!< size of the transaction and its descendants
     CAmount nModFeesWithDescendants; //!< ... and total fees (all including us)
 
-    uint64_t nCountWithAncestors;
     uint64_t nSizeWithAncestors;
     CAmount nModFeesWithAncestors;
     int64_t nSigOpCostWithAncestors;
 
+    uint32_t nTxWeight; //!< ... and avoid recomputing tx weight (also used for GetTxSize())
+    uint32_t nModSize; //!< ... and modified size for priority
+    uint32_t nUsageSize; //!< ... and total memory usage
+    uint32_t entryHeight; //!< Chain height when entering the mempool
+    int32_t sigOpCost; //!< Total sigop cost
+    uint32_t nCountWithDescendants; //!< number of descendant transactions
+    uint32_t nCountWithAncestors;
+    bool hadNoDependencies; //!< Not dependent on any other txs when it entered the mempool
+    bool spendsCoinbase; //!< keep track of transactions that spend a coinbase
+
 public:
+    /** The entry shares _tx, so the relay map, orphans and notifications can hold the same object. */
+    CTxMemPoolEntry(const CTransactionRef& _tx, const CAmount& _nFee,
+                    int64_t _nTime, double _entryPriority, unsigned int _entryHeight,
+                    bool poolHasNoInputsOf, CAmount _inChainInputValue, bool spendsCoinbase,
+                    int64_t nSigOpsCost, LockPoints lp);
     CTxMemPoolEntry(const CTransaction& _tx, const CAmount& _nFee,
                     int64_t _nTime, double _entryPriority, unsigned int _entryHeight,
                     bool poolHasNoInputsOf, CAmount _inChainInputValue, bool spendsCoinbase,
@@ -149,7 +159,8 @@ public:
     CAmount GetModFeesWithAncestors() const { return nModFeesWithAncestors; }
     int64_t GetSigOpCostWithAncestors() const { return nSigOpCostWithAncestors; }
 
-    mutable size_t vTxHashesIdx; //!< Index in mempool's vTxHashes
+    mutable uint64_t nEpoch; //!< Last walk over the mempool's links that reached this entry
+    mutable uint32_t vTxHashesIdx; //!< Index in mempool's vTxHashes
 };
 
 struct update_descendant_state {
@@ -460,30 +471,54 @@ public:
         }
     };
     typedef std::set<txiter, CompareIteratorByHash> setEntries;
+    /** Direct in-mempool parents or children of an entry, in the order they were linked.
+     *  Most entries have only a few, which a vector holds in one small allocation where
+     *  a set would need a node for each. */
+    typedef std::vector<txiter> vecEntries;
 
-    const setEntries& GetMemPoolParents(txiter entry) const;
-    const setEntries& GetMemPoolChildren(txiter entry) const;
+    const vecEntries& GetMemPoolParents(txiter entry) const;
+    const vecEntries& GetMemPoolChildren(txiter entry) const;
 
 private:
     typedef std::map<txiter, setEntries, CompareIteratorByHash> cacheMap;
 
     struct TxLinks {
-        setEntries parents;
-        setEntries children;
+        vecEntries parents;
+        vecEntries children;
     };
 
     typedef std::map<txiter, TxLinks, CompareIteratorByHash> txlinksMap;
     txlinksMap mapLinks;
 
+    void UpdateLink(vecEntries& links, txiter link, bool add);
     void UpdateParent(txiter entry, txiter parent, bool add);
     void UpdateChild(txiter entry, txiter child, bool add);
 
+    mutable uint64_t nEpoch; //!< Walks over mapLinks so far
+
+    /** Start a walk over mapLinks. Walks do not nest, so an entry is seen in
+     *  the current one exactly when it is marked with the returned epoch. */
+    uint64_t NewEpoch() const { return ++nEpoch; }
+    /** Mark an entry as seen in the walk of epoch; returns whether it was already. */
+    static bool Visited(txiter it, uint64_t epoch)
+    {
+        if (it->nEpoch == epoch)
+            return true;
+        it->nEpoch = epoch;
+        return false;
+    }
+
     std::vector<indexed_transaction_set::const_iterator> GetSortedDepthAndScore() const;
 
 public:
     indirectmap<COutPoint, const CTransaction*> mapNextTx;
     std::map<uint256, std::pair<double, CAmount> > mapDeltas;
 
+    /** Sent with cs held after a transaction entered the pool */
+    boost::signals2::signal<void(const CTransaction&)> NotifyEntryAdded;
+    /** Sent with cs held when a transaction leaves the pool, before its entry is erased */
+    boost::signals2::signal<void(const CTransaction&)> NotifyEntryRemoved;
+
     /** Create a new CTxMemPool.
      *  minReasonableRelayFee should be a feerate which is, roughly, somewhere
      *  around what it "costs" to relay a transaction around the network and
@@ -504,11 +539,12 @@ public:
     bool addUnchecked(const uint256& hash, const CTxMemPoolEntry& entry, bool fCurrentEstimate = true);
     bool addUnchecked(const uint256& hash, const CTxMemPoolEntry& entry, setEntries& setAncestors, bool fCurrentEstimate = true);
 
-    void removeRecursive(const CTransaction& tx, std::list<CTransaction>& removed);
+    /** The removed transactions are returned as the objects the pool held, not copies. */
+    void removeRecursive(const CTransaction& tx, std::list<CTransactionRef>& removed);
     void removeForReorg(const CCoinsViewCache* pcoins, unsigned int nMemPoolHeight, int flags);
-    void removeConflicts(const CTransaction& tx, std::list<CTransaction>& removed);
-    void removeForBlock(const std::vector<CTransaction>& vtx, unsigned int nBlockHeight,
-                        std::list<CTransaction>& conflicts, bool fCurrentEstimate = true);
+    void removeConflicts(const CTransaction& tx, std::list<CTransactionRef>& removed);
+    void removeForBlock(const std::vector<CTransactionRef>& vtx, unsigned int nBlockHeight,
+                        std::list<CTransactionRef>& conflicts, bool fCurrentEstimate = true);
     void clear();
     void _clear(); //lock free
     bool CompareDepthAndScore(const uint256& hasha, const uint256& hashb);
@@ -565,6 +601,11 @@ public:
      *  already in it.  */
     void CalculateDescendants(txiter it, setEntries& setDescendants);
 
+    /** Populate setAncestors with the in-mempool ancestors of it, without walking
+     *  past entries in setStop. The ancestors of everything in setStop must be in
+     *  it as well, as they are for the transactions already in a block. */
+    void CalculateAncestorsUntil(txiter it, setEntries& setAncestors, const setEntries& setStop) const;
+
     /** The minimum fee to get into the mempool, which may itself not be enough
       *  for larger-sized transactions.
       *  The minReasonableRelayFee constructor arg is used to bound the time it
@@ -574,6 +615,8 @@ public:
     CFeeRate GetMinFee(size_t sizelimit) const;
 
     /** Remove transactions from the mempool until its dynamic size is <= sizelimit.
+      *  The packages with the lowest descendant score are removed in batches, each
+      *  staged in one pass over the index.
       *  pvNoSpendsRemaining, if set, will be populated with the list of transactions
       *  which are not in mempool which no longer have any spends in this mempool.
       */
@@ -628,6 +671,21 @@ public:
 
     size_t DynamicMemoryUsage() const;
 
+    /**
+     * Memory used by the pool by what it is used for, counted from the structures
+     * themselves. The parts add up to DynamicMemoryUsage(), which keeps a running
+     * count of the transactions and link lists instead.
+     */
+    struct MemoryUsage {
+        size_t nTransactions; //!< The transactions, which the relay map and orphans may share
+        size_t nEntries; //!< mapTx: the entries with the nodes of all its indexes
+        size_t nLinks; //!< mapLinks, with the parent and child lists
+        size_t nNextTx; //!< mapNextTx
+        size_t nDeltas; //!< mapDeltas
+        size_t nTxHashes; //!< vTxHashes
+    };
+    MemoryUsage GetMemoryUsage() const;
+
 private:
     /** UpdateForDescendants is used by UpdateTransactionsFromBlock to update
      *  the descendants for a single transaction that has been added to the
@@ -655,6 +713,9 @@ private:
     void UpdateForRemoveFromMempool(const setEntries& entriesToRemove, bool updateDescendants);
     /** Sever link between specified transaction and direct children. */
     void UpdateChildrenForRemoval(txiter entry);
+    /** An upper bound on the memory removing entry frees, not counting vTxHashes,
+     *  given the usage of one element of mapLinks and of mapNextTx. */
+    size_t RemovalUsageBound(txiter entry, size_t nLinkNodeUsage, size_t nNextTxNodeUsage) const;
 
     /** Before calling removeUnchecked for a given transaction,
      *  UpdateForRemoveFromMempool must be called on the entire (dependent) set
@@ -34,6 +34,8 @@ class CValidationInterface {
 protected:
     virtual void UpdatedBlockTip(const CBlockIndex* pindex) {}
     virtual void SyncTransaction(const CTransaction& tx, const CBlockIndex* pindex, const CBlock* pblock) {}
+    virtual void BlockConnected(const CBlock& block, const CBlockIndex* pindex) {}
+    virtual void BlockDisconnected(const CBlock& block, const CBlockIndex* pindex) {}
     virtual void SetBestChain(const CBlockLocator& locator) {}
     virtual void UpdatedTransaction(const uint256& hash) {}
     virtual void Inventory(const uint256& hash) {}
@@ -51,6 +53,10 @@ struct CMainSignals {
     boost::signals2::signal<void(const CBlockIndex*)> UpdatedBlockTip;
     /** Notifies listeners of updated transaction data (transaction, and optionally the block it is found in. */
     boost::signals2::signal<void(const CTransaction&, const CBlockIndex* pindex, const CBlock*)> SyncTransaction;
+    /** Notifies listeners of a block connected to the active chain (called with cs_main held). */
+    boost::signals2::signal<void(const CBlock&, const CBlockIndex*)> BlockConnected;
+    /** Notifies listeners of a block disconnected from the tip of the active chain (called with cs_main held). */
+    boost::signals2::signal<void(const CBlock&, const CBlockIndex*)> BlockDisconnected;
     /** Notifies listeners of an updated transaction without new data (for now: a coinbase potentially becoming visible). */
     boost::signals2::signal<void(const uint256&)> UpdatedTransaction;
     /** Notifies listeners of a new active block chain. */
@@ -1418,7 +1418,7 @@ void ListTransactions(const CWalletTx& wtx, const string& strAccount, int nMinDe
 
     bool securedTransaction = (Checkpoints::IsSecuredBySyncCheckpoint(wtx.hashBlock));
 
-    if (!ignorerpconlylistsecuredtransactions && GetBoolArg("-rpconlylistsecuredtransactions", true) && (!securedTransaction && !GetBoolArg("-testnet", false)))
+    if (!ignorerpconlylistsecuredtransactions && GetBoolArg("-rpconlylistsecuredtransactions", true) && (!securedTransaction && !StartupConfig().fTestnet))
         return;
 
     std::vector<CAccount*> doForAccounts;
@@ -28,6 +28,7 @@
 #include "primitives/transaction.h"
 #include "script/script.h"
 #include "script/sign.h"
+#include "startupconfig.h"
 #include "timedata.h"
 #include "txmempool.h"
 #include "util.h"
@@ -94,12 +95,12 @@ void ThreadShadowPoolManager()
                             }
                         }
                     }
-                    if (numShadow < GetArg("-accountpool", 10)) {
+                    if (numShadow < StartupConfig().nAccountPool) {
                         dolock = false;
                         if (!pwalletMain->IsLocked()) {
                             pwalletMain->delayLock = true;
                             CWalletDB db(pwalletMain->strWalletFile);
-                            while (numShadow < GetArg("-accountpool", 10)) {
+                            while (numShadow < StartupConfig().nAccountPool) {
                                 ++numShadow;
                                 ++numNew;
                                 depth = 1;
@@ -129,7 +130,7 @@ void ThreadShadowPoolManager()
             }
 
             if (numNew == 0) {
-                int targetPoolDepth = GetArg("-keypool", 40);
+                int targetPoolDepth = StartupConfig().nKeyPool >= 0 ? StartupConfig().nKeyPool : 40;
                 int numToAllocatePerRound = 5;
                 if (targetPoolDepth > 40)
                     numToAllocatePerRound = 20;
@@ -1697,8 +1698,8 @@ int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
 
             CBlock block;
             ReadBlockFromDisk(block, pindex, Params().GetConsensus());
-            BOOST_FOREACH (CTransaction& tx, block.vtx) {
-                if (AddToWalletIfInvolvingMe(tx, &block, fUpdate))
+            for (const auto& tx : block.vtx) {
+                if (AddToWalletIfInvolvingMe(*tx, &block, fUpdate))
                     ret++;
             }
             pindex = chainActive.Next(pindex);
@@ -2838,7 +2839,7 @@ int CWallet::TopUpKeyPool(unsigned int kpSize, unsigned int maxNew)
         if (kpSize > 0)
             nTargetSize = kpSize;
         else
-            nTargetSize = GetArg("-keypool", 5);
+            nTargetSize = StartupConfig().nKeyPool >= 0 ? StartupConfig().nKeyPool : 5;
 
         int64_t nIndex = 1;
         for (auto accountPair : mapAccounts) {
@@ -3438,7 +3439,7 @@ std::string CWallet::GetWalletHelpString(bool showDebug)
     std::string strUsage = HelpMessageGroup(_("Wallet options:"));
     strUsage += HelpMessageOpt("-disablewallet", _("Do not load the wallet and disable wallet RPC calls"));
     strUsage += HelpMessageOpt("-keypool=<n>", strprintf(_("Set key pool size to <n> (default: %u)"), DEFAULT_KEYPOOL_SIZE));
-    strUsage += HelpMessageOpt("-accountpool=<n>", strprintf(_("Set account pool size to <n> (default: %u)"), 10));
+    strUsage += HelpMessageOpt("-accountpool=<n>", strprintf(_("Set account pool size to <n> (default: %u)"), DEFAULT_ACCOUNTPOOL_SIZE));
     strUsage += HelpMessageOpt("-fallbackfee=<amt>", strprintf(_("A fee rate (in %s/kB) that will be used when fee estimation has insufficient data (default: %s)"),
                                                                CURRENCY_UNIT, FormatMoney(DEFAULT_FALLBACK_FEE)));
     strUsage += HelpMessageOpt("-mintxfee=<amt>", strprintf(_("Fees (in %s/kB) smaller than this are considered zero fee for transaction creation (default: %s)"),
@@ -4068,7 +4069,7 @@ int CMerkleTx::SetMerkleBranch(const CBlock& block)
     hashBlock = block.GetHash();
 
     for (nIndex = 0; nIndex < (int)block.vtx.size(); nIndex++)
-        if (block.vtx[nIndex] == *(CTransaction*)this)
+        if (*block.vtx[nIndex] == *(CTransaction*)this)
             break;
     if (nIndex == (int)block.vtx.size()) {
         nIndex = -1;